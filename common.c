@@ -156,3 +156,179 @@ const char *timestring(void)
 	strftime(TimeBuf,sizeof(TimeBuf)-1,"%Y/%m/%d %T",tm);
 	return TimeBuf;
 }
+
+/*
+  a monotonic time in microseconds, for measuring intervals
+ */
+uint64_t hsm_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+  the current time in microseconds since the epoch, for comparing
+  with store object times
+ */
+uint64_t hsm_wall_usec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+  size of the attribute as stored on the file
+ */
+static size_t hsm_attr_size(const struct hsm_attr *h)
+{
+	return offsetof(struct hsm_attr, resident) + (hsm_num_chunks(h)+7)/8;
+}
+
+/*
+  fetch and validate the hacksm attribute on a file. Attributes from
+  before partial recall was added are converted, and come back with
+  no chunk map. Attributes from before the store time was recorded
+  come back with HSM_STORE_TIME_UNKNOWN. Returns -1 with errno set on
+  failure, with errno == ENOENT if the file has no attribute
+ */
+int hsm_attr_get(dm_sessid_t sid, void *hanp, size_t hlen, dm_token_t token,
+		 struct hsm_attr *h)
+{
+	dm_attrname_t attrname;
+	size_t rlen;
+	int ret;
+
+	memset(attrname.an_chars, 0, DM_ATTR_NAME_SIZE);
+	strncpy((char*)attrname.an_chars, HSM_ATTRNAME, DM_ATTR_NAME_SIZE);
+
+	memset(h, 0, sizeof(*h));
+
+	ret = dm_get_dmattr(sid, hanp, hlen, token, &attrname, 
+			    sizeof(*h), h, &rlen);
+	if (ret != 0) {
+		return -1;
+	}
+
+	if (strncmp(h->magic, HSM_MAGIC_V1, sizeof(h->magic)) == 0 ||
+	    strncmp(h->magic, HSM_MAGIC_V2, sizeof(h->magic)) == 0) {
+		/* older attributes had the state straight after the
+		   inode, with no store time */
+		if (rlen < offsetof(struct hsm_attr, store_time) + 1 ||
+		    rlen > sizeof(*h) - sizeof(h->store_time)) {
+			printf("Bad attribute size %d\n", (int)rlen);
+			errno = EINVAL;
+			return -1;
+		}
+		memmove(&h->state, &h->store_time,
+			rlen - offsetof(struct hsm_attr, store_time));
+		h->store_time = HSM_STORE_TIME_UNKNOWN;
+		rlen += sizeof(h->store_time);
+	}
+
+	if (strncmp(h->magic, HSM_MAGIC_V1, sizeof(h->magic)) == 0) {
+		/* the first attribute had no chunk map, but may have
+		   padding after the state */
+		h->chunk_shift = 0;
+		memset(h->resident, 0, sizeof(h->resident));
+		memcpy(h->magic, HSM_MAGIC, sizeof(h->magic));
+		return 0;
+	}
+
+	if (strncmp(h->magic, HSM_MAGIC_V2, sizeof(h->magic)) == 0) {
+		memcpy(h->magic, HSM_MAGIC, sizeof(h->magic));
+	}
+
+	if (strncmp(h->magic, HSM_MAGIC, sizeof(h->magic)) != 0) {
+		printf("Bad magic '%*.*s'\n", (int)sizeof(h->magic), (int)sizeof(h->magic),
+		       h->magic);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (h->chunk_shift > 63 || rlen != hsm_attr_size(h)) {
+		printf("Bad attribute size %d\n", (int)rlen);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+  store the hacksm attribute on a file
+ */
+int hsm_attr_set(dm_sessid_t sid, void *hanp, size_t hlen, dm_token_t token,
+		 struct hsm_attr *h)
+{
+	dm_attrname_t attrname;
+
+	memset(attrname.an_chars, 0, DM_ATTR_NAME_SIZE);
+	strncpy((char*)attrname.an_chars, HSM_ATTRNAME, DM_ATTR_NAME_SIZE);
+
+	memcpy(h->magic, HSM_MAGIC, sizeof(h->magic));
+
+	return dm_set_dmattr(sid, hanp, hlen, token, &attrname, 0, 
+			     hsm_attr_size(h), (void*)h);
+}
+
+/*
+  choose the chunk size for partially recalling a file of the given
+  size. The chunk size is at least chunk_size, rounded up to a power
+  of 2, and is grown until the file fits in HSM_MAX_CHUNKS chunks
+ */
+unsigned hsm_chunk_shift(uint64_t size, uint64_t chunk_size)
+{
+	unsigned shift = HSM_MIN_CHUNK_SHIFT;
+
+	while (shift < 63 && (1ULL<<shift) < chunk_size) {
+		shift++;
+	}
+	while (shift < 63 && ((size + (1ULL<<shift) - 1) >> shift) > HSM_MAX_CHUNKS) {
+		shift++;
+	}
+	return shift;
+}
+
+/*
+  number of chunks in the chunk map of a file, which is 0 for a file
+  that has no chunk map
+ */
+unsigned hsm_num_chunks(const struct hsm_attr *h)
+{
+	if (h->chunk_shift == 0) {
+		return 0;
+	}
+	return (h->size + (1ULL<<h->chunk_shift) - 1) >> h->chunk_shift;
+}
+
+bool hsm_chunk_resident(const struct hsm_attr *h, unsigned chunk)
+{
+	return (h->resident[chunk/8] & (1<<(chunk%8))) != 0;
+}
+
+void hsm_chunk_set_resident(struct hsm_attr *h, unsigned chunk)
+{
+	h->resident[chunk/8] |= (1<<(chunk%8));
+}
+
+/*
+  true if every chunk of a chunked file has been recalled
+ */
+bool hsm_all_resident(const struct hsm_attr *h)
+{
+	unsigned i, n = hsm_num_chunks(h);
+
+	if (n == 0) {
+		return false;
+	}
+	for (i=0;i<n;i++) {
+		if (!hsm_chunk_resident(h, i)) {
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,151 @@
+/*
+  CRC32C (Castagnoli), for checking store data. The CRC instructions
+  of SSE4.2 and ARMv8 are used when the CPU has them, which keeps up
+  with any store link. Otherwise a slice-by-8 table is used, or a
+  byte at a time on big endian hosts
+ */
+
+#include "hacksm.h"
+#include "store_backend.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_CRC32C_SSE42 1
+#endif
+
+/* the 8 byte steps load words little endian, as the CRC takes the
+   bytes, so big endian hosts go a byte at a time */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HAVE_CRC32C_SLICE8 1
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__) && defined(HAVE_CRC32C_SLICE8)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_CRC32C_ARMV8 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc_table[8][256];
+static uint32_t (*crc_fn)(uint32_t crc, const uint8_t *p, size_t n);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t n)
+{
+#ifdef HAVE_CRC32C_SLICE8
+	while (n > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		n--;
+	}
+	while (n >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = crc_table[7][v & 0xff] ^
+			crc_table[6][(v >> 8) & 0xff] ^
+			crc_table[5][(v >> 16) & 0xff] ^
+			crc_table[4][(v >> 24) & 0xff] ^
+			crc_table[3][(v >> 32) & 0xff] ^
+			crc_table[2][(v >> 40) & 0xff] ^
+			crc_table[1][(v >> 48) & 0xff] ^
+			crc_table[0][v >> 56];
+		p += 8;
+		n -= 8;
+	}
+#endif
+	while (n > 0) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		n--;
+	}
+	return crc;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t n)
+{
+	uint64_t c = crc;
+
+	while (n > 0 && ((uintptr_t)p & 7) != 0) {
+		c = __builtin_ia32_crc32qi(c, *p++);
+		n--;
+	}
+	while (n >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c = __builtin_ia32_crc32di(c, v);
+		p += 8;
+		n -= 8;
+	}
+	while (n > 0) {
+		c = __builtin_ia32_crc32qi(c, *p++);
+		n--;
+	}
+	return c;
+}
+#endif
+
+#ifdef HAVE_CRC32C_ARMV8
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const uint8_t *p, size_t n)
+{
+	while (n > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = __builtin_aarch64_crc32cb(crc, *p++);
+		n--;
+	}
+	while (n >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = __builtin_aarch64_crc32cx(crc, v);
+		p += 8;
+		n -= 8;
+	}
+	while (n > 0) {
+		crc = __builtin_aarch64_crc32cb(crc, *p++);
+		n--;
+	}
+	return crc;
+}
+#endif
+
+static void crc32c_init(void)
+{
+	unsigned i, j;
+
+	for (i=0;i<256;i++) {
+		uint32_t crc = i;
+		for (j=0;j<8;j++) {
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		}
+		crc_table[0][i] = crc;
+	}
+	for (i=0;i<256;i++) {
+		for (j=1;j<8;j++) {
+			crc_table[j][i] = crc_table[0][crc_table[j-1][i] & 0xff] ^
+				(crc_table[j-1][i] >> 8);
+		}
+	}
+
+	crc_fn = crc32c_sw;
+#ifdef HAVE_CRC32C_SSE42
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc_fn = crc32c_sse42;
+	}
+#endif
+#ifdef HAVE_CRC32C_ARMV8
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		crc_fn = crc32c_armv8;
+	}
+#endif
+}
+
+/*
+  return the CRC32C of a buffer, continuing from 'crc', which should
+  be 0 to start
+ */
+uint32_t hsm_crc32c(uint32_t crc, const void *buf, size_t n)
+{
+	pthread_once(&crc_once, crc32c_init);
+	return ~crc_fn(~crc, buf, n);
+}
@@ -19,6 +19,8 @@
 #include <aio.h>
 #include <dmapi.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #define discard_const(ptr) ((void *)((intptr_t)(ptr)))
 
@@ -27,12 +29,23 @@ void hsm_recover_session(const char *name, dm_sessid_t *sid);
 void msleep(int t);
 void hsm_cleanup_tokens(dm_sessid_t sid, dm_response_t response, int retcode);
 const char *timestring(void);
+uint64_t hsm_now_usec(void);
+uint64_t hsm_wall_usec(void);
 
 
 enum hsm_migrate_state {
 	HSM_STATE_START     = 0,
 	HSM_STATE_MIGRATED  = 1,
-	HSM_STATE_RECALL    = 2};
+	HSM_STATE_RECALL    = 2,
+	/* recalled, but the store copy is kept until the file changes */
+	HSM_STATE_PREMIGRATED = 3};
+
+/* the most chunks a file can be split into for partial recall. This
+   keeps the resident bitmap small enough to live in the attribute */
+#define HSM_MAX_CHUNKS 8192
+
+/* smallest chunk size used for partial recall */
+#define HSM_MIN_CHUNK_SHIFT 12
 
 struct hsm_attr {
 	char magic[4];
@@ -40,10 +53,44 @@ struct hsm_attr {
 	uint64_t size;
 	uint64_t device;
 	uint64_t inode;
+	/* the store's time for the object when it was migrated, which
+	   guards its removal against a later migrate of the same
+	   inode. HSM_STORE_TIME_UNKNOWN for files migrated before it was
+	   recorded */
+	uint64_t store_time;
 	uint8_t  state;
+	/* log2 of the chunk size, or zero if the file has never been
+	   partially recalled */
+	uint8_t  chunk_shift;
+	/* bitmap of chunks which have been recalled. Only the bytes
+	   needed for the number of chunks are stored */
+	uint8_t  resident[HSM_MAX_CHUNKS/8];
 };
 
-#define HSM_MAGIC "HSM1"
+#define HSM_MAGIC "HSM3"
+/* attributes from before partial recall, with no chunk map */
+#define HSM_MAGIC_V1 "HSM1"
+/* attributes from before the store time was recorded */
+#define HSM_MAGIC_V2 "HSM2"
+#define HSM_STORE_TIME_UNKNOWN UINT64_MAX
 #define HSM_ATTRNAME "hacksm"
 
+/* attribute holding the handle of the directory a file was in when
+   it was migrated. Used for prefetching siblings on recall */
+#define HSM_DIR_ATTRNAME "hsmdir"
+#define HSM_MAX_HANDLE_SIZE 256
+
+/* the most -O store options a tool takes */
+#define HSM_MAX_STORE_OPTIONS 16
+
+int hsm_attr_get(dm_sessid_t sid, void *hanp, size_t hlen, dm_token_t token,
+		 struct hsm_attr *h);
+int hsm_attr_set(dm_sessid_t sid, void *hanp, size_t hlen, dm_token_t token,
+		 struct hsm_attr *h);
+unsigned hsm_chunk_shift(uint64_t size, uint64_t chunk_size);
+unsigned hsm_num_chunks(const struct hsm_attr *h);
+bool hsm_chunk_resident(const struct hsm_attr *h, unsigned chunk);
+void hsm_chunk_set_resident(struct hsm_attr *h, unsigned chunk);
+bool hsm_all_resident(const struct hsm_attr *h);
+
 #include "store.h"
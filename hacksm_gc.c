@@ -0,0 +1,668 @@
+/*
+  a garbage collector and consistency checker for the HSM store
+
+  The store is listed by several threads at once while the
+  filesystems are scanned for hacksm attributes with
+  dm_get_bulkall(), then both lists are sorted and compared. Store
+  objects that no file refers to are orphans, left behind by failed
+  migrates and lost destroy events, and are removed. Migrated files
+  whose store object is missing are reported.
+ */
+
+#include "hacksm.h"
+
+#define SESSION_NAME "hacksm_gc"
+
+/* default threads listing the store */
+#define HSM_GC_THREADS 8
+
+/* default age in seconds a store object must reach before it can be
+   taken for an orphan, so migrates in progress are left alone */
+#define HSM_GC_AGE 3600
+
+/* the most filesystems scanned at once */
+#define HSM_GC_MAX_FS 16
+
+static struct {
+	dm_sessid_t sid;
+} dmapi = {
+	.sid = DM_NO_SESSION
+};
+
+static struct hsm_store_context *store_ctx;
+
+static struct {
+	const char *store_options[HSM_MAX_STORE_OPTIONS];
+	unsigned num_store_options;
+	unsigned threads;
+	unsigned age;
+	bool dry_run;
+	bool check_size;
+} options = {
+	.threads = HSM_GC_THREADS,
+	.age = HSM_GC_AGE,
+};
+
+/* an object in the store */
+struct gc_object {
+	uint64_t device;
+	uint64_t inode;
+	/* when it was written, in microseconds */
+	uint64_t time;
+};
+
+/* a file with a hacksm attribute */
+struct gc_file {
+	/* the store object it refers to */
+	uint64_t device;
+	uint64_t inode;
+	uint64_t size;
+	/* the file itself */
+	uint64_t fs_inode;
+	uint8_t state;
+};
+
+/* what each store listing thread found */
+struct gc_list {
+	struct gc_object *objects;
+	size_t count, alloc;
+	unsigned part;
+	int ret;
+};
+
+static struct {
+	struct gc_object *objects;
+	size_t num_objects;
+	struct gc_file *files;
+	size_t num_files, alloc_files;
+	uint64_t devices[HSM_GC_MAX_FS];
+	unsigned num_devices;
+	/* for the work shared by threads */
+	void **work;
+	size_t num_work;
+	size_t next_work;
+} gc;
+
+static struct {
+	uint64_t orphans;
+	uint64_t removed;
+	uint64_t recent;
+	uint64_t other_fs;
+	uint64_t missing;
+	uint64_t wrong_size;
+	uint64_t duplicates;
+} stats;
+
+/*
+  connect to DMAPI and the store
+ */
+static void hsm_init(void)
+{
+	char *dmapi_version = NULL;
+	int ret;
+	unsigned i;
+
+	ret = dm_init_service(&dmapi_version);
+	if (ret != 0) {
+		printf("Failed to init dmapi\n");
+		exit(1);
+	}
+
+	printf("Initialised DMAPI version '%s'\n", dmapi_version);
+
+	hsm_recover_session(SESSION_NAME, &dmapi.sid);
+
+	store_ctx = hsm_store_init();
+	if (store_ctx == NULL) {
+		printf("Unable to open HSM store - %s\n", strerror(errno));
+		exit(1);
+	}
+
+	for (i=0;i<options.num_store_options;i++) {
+		if (hsm_store_set_option(store_ctx, options.store_options[i]) != 0) {
+			printf("Bad store option '%s' - %s\n", options.store_options[i],
+			       hsm_store_errmsg(store_ctx));
+			exit(1);
+		}
+	}
+
+	if (hsm_store_connect(store_ctx, "/gpfs") != 0) {
+		printf("Failed to connect to HSM store - %s\n",
+		       hsm_store_errmsg(store_ctx));
+		exit(1);
+	}
+}
+
+/*
+  note an object found by a store listing thread
+ */
+static void hsm_gc_add_object(void *private, dev_t device, ino_t inode, uint64_t time)
+{
+	struct gc_list *l = private;
+
+	if (l->count == l->alloc) {
+		struct gc_object *o;
+		l->alloc = l->alloc ? l->alloc * 2 : 0x10000;
+		o = realloc(l->objects, l->alloc * sizeof(*o));
+		if (o == NULL) {
+			printf("Out of memory listing the store\n");
+			exit(1);
+		}
+		l->objects = o;
+	}
+	l->objects[l->count].device = device;
+	l->objects[l->count].inode = inode;
+	l->objects[l->count].time = time;
+	l->count++;
+}
+
+static void *hsm_gc_list_thread(void *private)
+{
+	struct gc_list *l = private;
+	l->ret = hsm_store_list(store_ctx, l->part, options.threads, hsm_gc_add_object, l);
+	return NULL;
+}
+
+/*
+  scan a filesystem for files with a hacksm attribute
+ */
+static void hsm_gc_scan_fs(const char *path)
+{
+	dm_attrname_t attrname;
+	dm_attrloc_t loc;
+	void *fshanp = NULL;
+	size_t fshlen = 0, buflen = 0x100000, rlen;
+	struct stat st;
+	char *buf;
+	int ret;
+
+	if (stat(path, &st) != 0) {
+		printf("Unable to stat %s - %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if (gc.num_devices == HSM_GC_MAX_FS) {
+		printf("Too many filesystems\n");
+		exit(1);
+	}
+	gc.devices[gc.num_devices++] = st.st_dev;
+
+	if (dm_path_to_fshandle(discard_const(path), &fshanp, &fshlen) != 0) {
+		printf("dm_path_to_fshandle failed for %s - %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if (dm_init_attrloc(dmapi.sid, fshanp, fshlen, DM_NO_TOKEN, &loc) != 0) {
+		printf("dm_init_attrloc failed for %s - %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	memset(attrname.an_chars, 0, DM_ATTR_NAME_SIZE);
+	strncpy((char*)attrname.an_chars, HSM_ATTRNAME, DM_ATTR_NAME_SIZE);
+
+	buf = malloc(buflen);
+	if (buf == NULL) {
+		printf("Out of memory scanning %s\n", path);
+		exit(1);
+	}
+
+	do {
+		dm_xstat_t *xst;
+
+		ret = dm_get_bulkall(dmapi.sid, fshanp, fshlen, DM_NO_TOKEN, DM_AT_STAT,
+				     &attrname, &loc, buflen, buf, &rlen);
+		if (ret == -1 && errno == E2BIG) {
+			buflen *= 2;
+			buf = realloc(buf, buflen);
+			if (buf == NULL) {
+				printf("Out of memory scanning %s\n", path);
+				exit(1);
+			}
+			ret = 1;
+			continue;
+		}
+		if (ret == -1) {
+			printf("dm_get_bulkall failed for %s - %s\n", path, strerror(errno));
+			exit(1);
+		}
+		if (rlen == 0) {
+			break;
+		}
+		/* the link to the next entry is in its dm_stat_t, which
+		   starts each dm_xstat_t */
+		for (xst=(dm_xstat_t *)buf; xst;
+		     xst=DM_STEP_TO_NEXT(&xst->dx_statinfo, dm_xstat_t *)) {
+			size_t len = DM_GET_LEN(xst, dx_attrdata);
+			struct gc_file *f;
+			struct hsm_attr h;
+
+			/* attributes from before partial recall end at
+			   the state */
+			if (len < offsetof(struct hsm_attr, state) + 1) {
+				continue;
+			}
+			memset(&h, 0, sizeof(h));
+			memcpy(&h, DM_GET_VALUE(xst, dx_attrdata, void *),
+			       len < sizeof(h) ? len : sizeof(h));
+			if (strncmp(h.magic, HSM_MAGIC, sizeof(h.magic)) != 0 &&
+			    strncmp(h.magic, HSM_MAGIC_V1, sizeof(h.magic)) != 0) {
+				continue;
+			}
+
+			if (gc.num_files == gc.alloc_files) {
+				gc.alloc_files = gc.alloc_files ? gc.alloc_files * 2 : 0x10000;
+				gc.files = realloc(gc.files, gc.alloc_files * sizeof(*gc.files));
+				if (gc.files == NULL) {
+					printf("Out of memory scanning %s\n", path);
+					exit(1);
+				}
+			}
+			f = &gc.files[gc.num_files++];
+			f->device = h.device;
+			f->inode = h.inode;
+			f->size = h.size;
+			f->fs_inode = xst->dx_statinfo.dt_ino;
+			f->state = h.state;
+		}
+	} while (ret == 1);
+
+	free(buf);
+	dm_handle_free(fshanp, fshlen);
+}
+
+static int hsm_gc_object_cmp(const void *a, const void *b)
+{
+	const struct gc_object *o1 = a, *o2 = b;
+	if (o1->device != o2->device) {
+		return o1->device < o2->device ? -1 : 1;
+	}
+	if (o1->inode != o2->inode) {
+		return o1->inode < o2->inode ? -1 : 1;
+	}
+	return 0;
+}
+
+static int hsm_gc_file_cmp(const void *a, const void *b)
+{
+	const struct gc_file *f1 = a, *f2 = b;
+	if (f1->device != f2->device) {
+		return f1->device < f2->device ? -1 : 1;
+	}
+	if (f1->inode != f2->inode) {
+		return f1->inode < f2->inode ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+  true if the filesystem an object came from was scanned
+ */
+static bool hsm_gc_scanned(uint64_t device)
+{
+	unsigned i;
+	for (i=0;i<gc.num_devices;i++) {
+		if (gc.devices[i] == device) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+  true if a file in this state needs its store object
+ */
+static bool hsm_gc_needs_object(const struct gc_file *f)
+{
+	return f->state == HSM_STATE_MIGRATED ||
+		f->state == HSM_STATE_RECALL ||
+		f->state == HSM_STATE_PREMIGRATED;
+}
+
+/*
+  run fn on each item of work from several threads, as removing and
+  opening store objects is mostly waiting for the store
+ */
+static void *hsm_gc_work_thread(void *private)
+{
+	void (*fn)(void *) = (void (*)(void *))private;
+
+	while (1) {
+		size_t i = __sync_fetch_and_add(&gc.next_work, 1);
+		if (i >= gc.num_work) {
+			break;
+		}
+		fn(gc.work[i]);
+	}
+	return NULL;
+}
+
+static void hsm_gc_parallel(void **work, size_t count, void (*fn)(void *))
+{
+	pthread_t *threads;
+	unsigned i;
+
+	gc.work = work;
+	gc.num_work = count;
+	gc.next_work = 0;
+
+	threads = calloc(options.threads, sizeof(pthread_t));
+	if (threads == NULL) {
+		printf("Out of memory starting threads\n");
+		exit(1);
+	}
+	for (i=0;i<options.threads;i++) {
+		if (pthread_create(&threads[i], NULL, hsm_gc_work_thread, (void *)fn) != 0) {
+			printf("Unable to start thread - %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	for (i=0;i<options.threads;i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+}
+
+/*
+  remove an orphan, unless it has been written again since it was
+  listed
+ */
+static void hsm_gc_remove(void *private)
+{
+	struct gc_object *o = private;
+
+	if (hsm_store_remove_stale(store_ctx, o->device, o->inode, o->time) == 0) {
+		__sync_fetch_and_add(&stats.removed, 1);
+	} else if (errno != ENOENT && errno != EEXIST) {
+		printf("Failed to remove orphan 0x%llx:0x%llx - %s\n",
+		       (unsigned long long)o->device, (unsigned long long)o->inode,
+		       hsm_store_errmsg(store_ctx));
+	}
+}
+
+/*
+  check a migrated file whose store object wasn't listed. It may have
+  been written after the listing, so it is looked for again
+ */
+static void hsm_gc_check_missing(void *private)
+{
+	struct gc_file *f = private;
+	struct hsm_store_handle *handle;
+
+	handle = hsm_store_open(store_ctx, f->device, f->inode, true);
+	if (handle != NULL) {
+		hsm_store_close(handle);
+		return;
+	}
+	__sync_fetch_and_add(&stats.missing, 1);
+	printf("Missing store object 0x%llx:0x%llx for inode %llu (state %u, size %llu)\n",
+	       (unsigned long long)f->device, (unsigned long long)f->inode,
+	       (unsigned long long)f->fs_inode, f->state, (unsigned long long)f->size);
+}
+
+/*
+  check the size of the store object of a migrated file
+ */
+static void hsm_gc_check_size(void *private)
+{
+	struct gc_file *f = private;
+	struct hsm_store_handle *handle;
+	uint64_t size;
+
+	handle = hsm_store_open(store_ctx, f->device, f->inode, true);
+	if (handle == NULL) {
+		return;
+	}
+	size = hsm_store_size(handle);
+	hsm_store_close(handle);
+	if (size != f->size) {
+		__sync_fetch_and_add(&stats.wrong_size, 1);
+		printf("Store object 0x%llx:0x%llx for inode %llu is the wrong size - %llu should be %llu\n",
+		       (unsigned long long)f->device, (unsigned long long)f->inode,
+		       (unsigned long long)f->fs_inode, (unsigned long long)size,
+		       (unsigned long long)f->size);
+	}
+}
+
+/*
+  compare the store with the files referring to it. Objects written
+  after cutoff, in microseconds since the epoch, are left alone
+ */
+static void hsm_gc_compare(uint64_t cutoff)
+{
+	void **orphans = NULL, **missing = NULL, **sized = NULL;
+	size_t num_orphans = 0, num_missing = 0, num_sized = 0;
+	size_t i = 0, j = 0;
+
+	orphans = malloc(gc.num_objects * sizeof(void *) + 1);
+	missing = malloc(gc.num_files * sizeof(void *) + 1);
+	sized = malloc(gc.num_files * sizeof(void *) + 1);
+	if (orphans == NULL || missing == NULL || sized == NULL) {
+		printf("Out of memory comparing the store\n");
+		exit(1);
+	}
+
+	while (i < gc.num_objects || j < gc.num_files) {
+		struct gc_object *o = i < gc.num_objects ? &gc.objects[i] : NULL;
+		struct gc_file *f = j < gc.num_files ? &gc.files[j] : NULL;
+		int cmp;
+
+		if (o == NULL) {
+			cmp = 1;
+		} else if (f == NULL) {
+			cmp = -1;
+		} else {
+			struct gc_object key = { f->device, f->inode, 0 };
+			cmp = hsm_gc_object_cmp(o, &key);
+		}
+
+		if (cmp < 0) {
+			/* an object no file refers to */
+			if (!hsm_gc_scanned(o->device)) {
+				stats.other_fs++;
+			} else if (o->time > cutoff) {
+				stats.recent++;
+			} else {
+				stats.orphans++;
+				printf("Orphan store object 0x%llx:0x%llx\n",
+				       (unsigned long long)o->device,
+				       (unsigned long long)o->inode);
+				orphans[num_orphans++] = o;
+			}
+			i++;
+			continue;
+		}
+
+		if (cmp > 0) {
+			/* a file whose object wasn't listed */
+			if (hsm_gc_needs_object(f)) {
+				missing[num_missing++] = f;
+			}
+		} else {
+			if (options.check_size && f->state == HSM_STATE_MIGRATED) {
+				sized[num_sized++] = f;
+			}
+		}
+
+		/* files restored from a backup with their attribute
+		   share a store object with the original */
+		if (j > 0 && hsm_gc_file_cmp(&gc.files[j-1], f) == 0) {
+			stats.duplicates++;
+			printf("Store object 0x%llx:0x%llx is used by inodes %llu and %llu\n",
+			       (unsigned long long)f->device, (unsigned long long)f->inode,
+			       (unsigned long long)gc.files[j-1].fs_inode,
+			       (unsigned long long)f->fs_inode);
+		}
+		j++;
+		/* the object may be used by more than one file */
+		if (cmp == 0 && (j == gc.num_files || hsm_gc_file_cmp(&gc.files[j], f) != 0)) {
+			i++;
+		}
+	}
+
+	hsm_gc_parallel(missing, num_missing, hsm_gc_check_missing);
+	if (options.check_size) {
+		hsm_gc_parallel(sized, num_sized, hsm_gc_check_size);
+	}
+	if (!options.dry_run) {
+		hsm_gc_parallel(orphans, num_orphans, hsm_gc_remove);
+	}
+
+	free(orphans);
+	free(missing);
+	free(sized);
+}
+
+/*
+  remove duplicate listings of an object, which a conversion running
+  during the listing can cause. The objects must be sorted
+ */
+static void hsm_gc_unique(void)
+{
+	size_t i, n = 0;
+
+	for (i=0;i<gc.num_objects;i++) {
+		if (n > 0 && hsm_gc_object_cmp(&gc.objects[n-1], &gc.objects[i]) == 0) {
+			continue;
+		}
+		gc.objects[n++] = gc.objects[i];
+	}
+	gc.num_objects = n;
+}
+
+static void usage(void)
+{
+	printf("Usage: hacksm_gc <options> PATH..\n");
+	printf("\n\tPATH is the mount point of each filesystem using the store\n");
+	printf("\n\tOptions:\n");
+	printf("\t\t -O name=value      set a store option\n");
+	printf("\t\t -T threads         number of threads listing the store (default %u)\n",
+	       HSM_GC_THREADS);
+	printf("\t\t -a age             leave store objects younger than age seconds (default %u)\n",
+	       HSM_GC_AGE);
+	printf("\t\t -n                 report orphans without removing them\n");
+	printf("\t\t -s                 check the size of each migrated file's store object\n");
+	exit(0);
+}
+
+int main(int argc, char * const argv[])
+{
+	struct gc_list *lists;
+	pthread_t *threads;
+	uint64_t start, now, cutoff;
+	unsigned i;
+	size_t n;
+	int opt;
+
+	/* parse command-line options */
+	while ((opt = getopt(argc, argv, "hO:T:a:ns")) != -1) {
+		switch (opt) {
+		case 'O':
+			if (options.num_store_options == HSM_MAX_STORE_OPTIONS) {
+				printf("Too many store options\n");
+				exit(1);
+			}
+			options.store_options[options.num_store_options++] = optarg;
+			break;
+		case 'T':
+			options.threads = strtoul(optarg, NULL, 0);
+			if (options.threads == 0) {
+				options.threads = 1;
+			}
+			break;
+		case 'a':
+			options.age = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			options.dry_run = true;
+			break;
+		case 's':
+			options.check_size = true;
+			break;
+		case 'h':
+		default:
+			usage();
+			break;
+		}
+	}
+
+	setlinebuf(stdout);
+
+	argv += optind;
+	argc -= optind;
+
+	if (argc == 0) {
+		usage();
+	}
+
+	hsm_init();
+
+	start = hsm_now_usec();
+
+	/* objects are timed by the wall clock. Anything written after
+	   the listing starts is recent too */
+	now = hsm_wall_usec();
+	cutoff = now > (uint64_t)options.age * 1000000 ?
+		now - (uint64_t)options.age * 1000000 : 0;
+
+	/* list the store while the filesystems are scanned */
+	lists = calloc(options.threads, sizeof(*lists));
+	threads = calloc(options.threads, sizeof(*threads));
+	if (lists == NULL || threads == NULL) {
+		printf("Out of memory starting threads\n");
+		exit(1);
+	}
+	for (i=0;i<options.threads;i++) {
+		lists[i].part = i;
+		if (pthread_create(&threads[i], NULL, hsm_gc_list_thread, &lists[i]) != 0) {
+			printf("Unable to start thread - %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+
+	for (i=0;i<argc;i++) {
+		hsm_gc_scan_fs(argv[i]);
+	}
+
+	gc.num_objects = 0;
+	for (i=0;i<options.threads;i++) {
+		pthread_join(threads[i], NULL);
+		if (lists[i].ret != 0) {
+			printf("Failed to list the store - %s\n", hsm_store_errmsg(store_ctx));
+			exit(1);
+		}
+		gc.num_objects += lists[i].count;
+	}
+
+	gc.objects = malloc(gc.num_objects * sizeof(struct gc_object) + 1);
+	if (gc.objects == NULL) {
+		printf("Out of memory listing the store\n");
+		exit(1);
+	}
+	for (n=0, i=0;i<options.threads;i++) {
+		memcpy(&gc.objects[n], lists[i].objects, lists[i].count * sizeof(struct gc_object));
+		n += lists[i].count;
+		free(lists[i].objects);
+	}
+	free(lists);
+	free(threads);
+
+	printf("Listed %llu store objects and %llu files in %.1f seconds\n",
+	       (unsigned long long)gc.num_objects, (unsigned long long)gc.num_files,
+	       (hsm_now_usec() - start) * 1.0e-6);
+
+	qsort(gc.objects, gc.num_objects, sizeof(struct gc_object), hsm_gc_object_cmp);
+	qsort(gc.files, gc.num_files, sizeof(struct gc_file), hsm_gc_file_cmp);
+	hsm_gc_unique();
+
+	hsm_gc_compare(cutoff);
+
+	printf("%llu orphans, %llu removed, %llu too recent, %llu from other filesystems\n",
+	       (unsigned long long)stats.orphans, (unsigned long long)stats.removed,
+	       (unsigned long long)stats.recent, (unsigned long long)stats.other_fs);
+	printf("%llu missing, %llu wrong size, %llu shared\n",
+	       (unsigned long long)stats.missing, (unsigned long long)stats.wrong_size,
+	       (unsigned long long)stats.duplicates);
+	printf("Finished in %.1f seconds\n", (hsm_now_usec() - start) * 1.0e-6);
+
+	hsm_store_shutdown(store_ctx);
+
+	return (stats.missing || stats.wrong_size) ? 1 : 0;
+}
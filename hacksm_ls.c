@@ -12,6 +12,9 @@
 
 static struct {
 	bool dmapi_info;
+	bool scrub;
+	const char *store_options[HSM_MAX_STORE_OPTIONS];
+	unsigned num_store_options;
 } options;
 
 static struct {
@@ -44,6 +47,7 @@ static void hsm_init(void)
 {
 	char *dmapi_version = NULL;
 	int ret;
+	unsigned i;
 
 	ret = dm_init_service(&dmapi_version);
 	if (ret != 0) {
@@ -61,8 +65,17 @@ static void hsm_init(void)
 		exit(1);
 	}
 
+	for (i=0;i<options.num_store_options;i++) {
+		if (hsm_store_set_option(store_ctx, options.store_options[i]) != 0) {
+			printf("Bad store option '%s' - %s\n", options.store_options[i],
+			       hsm_store_errmsg(store_ctx));
+			exit(1);
+		}
+	}
+
 	if (hsm_store_connect(store_ctx, "/gpfs") != 0) {
-		printf("Failed to connect to HSM store\n");
+		printf("Failed to connect to HSM store - %s\n",
+		       hsm_store_errmsg(store_ctx));
 		exit(1);
 	}
 }
@@ -122,6 +135,31 @@ static void hsm_show_dmapi_info(const char *path, void *hanp, size_t hlen)
 }
 
 
+/*
+  read a whole store object, which checks it against its checksums,
+  and check it holds the whole file
+ */
+static void hsm_scrub(const char *path, struct hsm_store_handle *handle,
+		      struct hsm_attr *h)
+{
+	static uint8_t buf[0x100000];
+	uint64_t total = 0;
+	ssize_t n;
+
+	while ((n = hsm_store_read(handle, buf, sizeof(buf))) > 0) {
+		total += n;
+	}
+	if (n == -1) {
+		printf("Store file for %s is corrupt - %s (0x%llx:0x%llx)\n",
+		       path, hsm_store_errmsg(store_ctx),
+		       (unsigned long long)h->device, (unsigned long long)h->inode);
+	} else if (total != h->size) {
+		printf("Store file for %s is the wrong size - %llu should be %llu (0x%llx:0x%llx)\n",
+		       path, (unsigned long long)total, (unsigned long long)h->size,
+		       (unsigned long long)h->device, (unsigned long long)h->inode);
+	}
+}
+
 /*
   list one file
  */
@@ -130,8 +168,6 @@ static void hsm_ls(const char *path)
 	int ret;
 	void *hanp = NULL;
 	size_t hlen = 0;
-	dm_attrname_t attrname;
-	size_t rlen;
 	struct hsm_attr h;
 
 	dmapi.token = DM_NO_TOKEN;
@@ -162,12 +198,11 @@ static void hsm_ls(const char *path)
 		hsm_show_dmapi_info(path, hanp, hlen);
 	}
 
-        memset(attrname.an_chars, 0, DM_ATTR_NAME_SIZE);
-        strncpy((char*)attrname.an_chars, HSM_ATTRNAME, DM_ATTR_NAME_SIZE);
-
 	/* get the attribute on the file */
-	ret = dm_get_dmattr(dmapi.sid, hanp, hlen, dmapi.token, &attrname, 
-			    sizeof(h), &h, &rlen);
+	ret = hsm_attr_get(dmapi.sid, hanp, hlen, dmapi.token, &h);
+	if (ret != 0 && errno == EINVAL) {
+		goto done;
+	}
 	if (ret != 0 && errno != ENOENT) {
 		printf("dm_get_dmattr failed for %s - %s\n", path, strerror(errno));
 		goto done;
@@ -177,21 +212,30 @@ static void hsm_ls(const char *path)
 		printf("p            %s\n", path);
 		goto done;
 	}
-	if (strncmp(h.magic, HSM_MAGIC, sizeof(h.magic)) != 0) {
-		printf("Bad magic '%*.*s'\n", (int)sizeof(h.magic), (int)sizeof(h.magic), h.magic);
-		goto done;
+
+	if (options.dmapi_info && h.chunk_shift != 0) {
+		unsigned i, n = hsm_num_chunks(&h), resident = 0;
+		for (i=0;i<n;i++) {
+			if (hsm_chunk_resident(&h, i)) resident++;
+		}
+		printf("Partially recalled: %u of %u chunks of size 0x%llx resident\n",
+		       resident, n, 1ULL << h.chunk_shift);
 	}
 
 	/* if it is migrated then also check the store file is OK */
-	if (h.state == HSM_STATE_MIGRATED) {
+	if (h.state == HSM_STATE_MIGRATED || h.state == HSM_STATE_PREMIGRATED) {
 		struct hsm_store_handle *handle;
 		handle = hsm_store_open(store_ctx, h.device, h.inode, true);
 		if (handle == NULL) {
 			printf("Failed to open store file for %s - %s (0x%llx:0x%llx)\n", 
 			       path, strerror(errno), 
 			       (unsigned long long)h.device, (unsigned long long)h.inode);
+		} else {
+			if (options.scrub) {
+				hsm_scrub(path, handle, &h);
+			}
+			hsm_store_close(handle);
 		}
-		hsm_store_close(handle);
 	}
 
 	printf("m %7u %d  %s\n", (unsigned)h.size, (int)h.state, path);
@@ -239,6 +283,8 @@ static void usage(void)
 	printf("Usage: hacksm_ls <options> PATH..\n");
 	printf("\n\tOptions:\n");
 	printf("\t\t -D                 show detailed DMAPI info for each file\n");
+	printf("\t\t -O name=value      set a store option\n");
+	printf("\t\t -S                 read back migrated files from the store, checking them\n");
 	exit(0);
 }
 
@@ -247,11 +293,21 @@ int main(int argc, char * const argv[])
 	int opt, i;
 
 	/* parse command-line options */
-	while ((opt = getopt(argc, argv, "hD")) != -1) {
+	while ((opt = getopt(argc, argv, "hDO:S")) != -1) {
 		switch (opt) {
 		case 'D':
 			options.dmapi_info = true;
 			break;
+		case 'O':
+			if (options.num_store_options == HSM_MAX_STORE_OPTIONS) {
+				printf("Too many store options\n");
+				exit(1);
+			}
+			options.store_options[options.num_store_options++] = optarg;
+			break;
+		case 'S':
+			options.scrub = true;
+			break;
 		case 'h':
 		default:
 			usage();
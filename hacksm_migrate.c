@@ -6,9 +6,20 @@
  */
 
 #include "hacksm.h"
+#include <libgen.h>
 
 #define SESSION_NAME "hacksm_migrate"
 
+/* extents asked for at a time when looking for holes */
+#define HSM_MIGRATE_EXTENTS 64
+
+/* size of each read from a file being migrated, before the store
+   has its say */
+#define HSM_MIGRATE_BUFSIZE 0x10000
+
+/* reads from a file that can be waiting to be written to the store */
+#define HSM_MIGRATE_DEPTH 4
+
 static struct {
 	dm_sessid_t sid;
 	dm_token_t token;
@@ -19,6 +30,30 @@ static struct {
 
 static struct hsm_store_context *store_ctx;
 
+static struct {
+	const char *store_options[HSM_MAX_STORE_OPTIONS];
+	unsigned num_store_options;
+	bool convert;
+	unsigned batch_count;
+	unsigned batch_time;
+} options;
+
+/* a file whose data is in the store, waiting for the store to be
+   synced before it is migrated */
+struct hsm_pending {
+	char *path;
+	struct stat st;
+	/* the store's time for the copy we wrote, so that only that
+	   copy is ever removed */
+	uint64_t store_time;
+};
+
+static struct {
+	struct hsm_pending *files;
+	unsigned count;
+	time_t start;
+} pending;
+
 /*
   if we exit unexpectedly then we need to cleanup any rights we held
   by reponding to our userevent
@@ -41,6 +76,7 @@ static void hsm_init(void)
 {
 	char *dmapi_version = NULL;
 	int ret;
+	unsigned i;
 
 	ret = dm_init_service(&dmapi_version);
 	if (ret != 0) {
@@ -58,12 +94,462 @@ static void hsm_init(void)
 		exit(1);
 	}
 
+	for (i=0;i<options.num_store_options;i++) {
+		if (hsm_store_set_option(store_ctx, options.store_options[i]) != 0) {
+			printf("Bad store option '%s' - %s\n", options.store_options[i],
+			       hsm_store_errmsg(store_ctx));
+			exit(1);
+		}
+	}
+
 	if (hsm_store_connect(store_ctx, "/gpfs") != 0) {
-		printf("Failed to connect to HSM store\n");
+		printf("Failed to connect to HSM store - %s\n",
+		       hsm_store_errmsg(store_ctx));
 		exit(1);
 	}
 }
 
+/*
+  record the handle of the directory holding a migrated file, so
+  hacksmd can find its siblings when it is recalled
+ */
+static void hsm_set_dir_attr(const char *path, void *hanp, size_t hlen)
+{
+	char *dpath;
+	void *dhanp = NULL;
+	size_t dhlen = 0;
+	dm_attrname_t attrname;
+
+	dpath = strdup(path);
+	if (dpath == NULL) {
+		return;
+	}
+
+	if (dm_path_to_handle(dirname(dpath), &dhanp, &dhlen) != 0) {
+		free(dpath);
+		return;
+	}
+
+	memset(attrname.an_chars, 0, DM_ATTR_NAME_SIZE);
+	strncpy((char*)attrname.an_chars, HSM_DIR_ATTRNAME, DM_ATTR_NAME_SIZE);
+
+	if (dhlen <= HSM_MAX_HANDLE_SIZE &&
+	    dm_set_dmattr(dmapi.sid, hanp, hlen, dmapi.token, &attrname, 0, 
+			  dhlen, dhanp) != 0) {
+		printf("WARNING: failed to set directory attribute on %s - %s\n",
+		       path, strerror(errno));
+	}
+
+	dm_handle_free(dhanp, dhlen);
+	free(dpath);
+}
+
+/*
+  migrate a premigrated file. hacksmd drops the store copy of a
+  premigrated file when it is written or truncated, so the copy still
+  matches the file and only the data needs to be punched out. The
+  file is marked migrated before the punch, so if we die part way a
+  recall just rewrites the same data
+ */
+static int hsm_migrate_premigrated(const char *path, void *hanp, size_t hlen,
+				   struct hsm_attr *h)
+{
+	struct stat st;
+	dm_region_t region;
+	dm_boolean_t exactFlag;
+	int ret;
+
+	if (lstat(path, &st) != 0) {
+		printf("failed to stat %s - %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	if (st.st_size != h->size || st.st_dev != h->device || st.st_ino != h->inode) {
+		printf("Premigrated file %s does not match its store copy - not migrating\n", path);
+		return 1;
+	}
+
+	ret = dm_upgrade_right(dmapi.sid, hanp, hlen, dmapi.token);
+	if (ret != 0) {
+		printf("dm_upgrade_right failed for %s - %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	/* mark the whole file as offline, including parts beyond EOF */
+	region.rg_offset = 0;
+	region.rg_size   = 0; /* zero means the whole file */
+	region.rg_flags  = DM_REGION_WRITE | DM_REGION_READ;
+
+	ret = dm_set_region(dmapi.sid, hanp, hlen, dmapi.token, 1, &region, &exactFlag);
+	if (ret == -1) {
+		printf("failed dm_set_region on %s - %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	h->state = HSM_STATE_MIGRATED;
+	h->migrate_time = time(NULL);
+	ret = hsm_attr_set(dmapi.sid, hanp, hlen, dmapi.token, h);
+	if (ret == -1) {
+		printf("failed dm_set_dmattr on %s - %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	hsm_set_dir_attr(path, hanp, hlen);
+
+	ret = dm_punch_hole(dmapi.sid, hanp, hlen, dmapi.token, 0, st.st_size);
+	if (ret == -1) {
+		printf("failed dm_punch_hole on %s - %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	printf("Migrated premigrated file '%s' of size %d\n", path, (int)st.st_size);
+
+	return 0;
+}
+
+/*
+  copy the data in one allocated extent of a file to the store. The
+  store writes go through a queue, so the next block is read from
+  the file while the last is being written. Writes to one handle are
+  done in order, so the buffers are reused round robin
+ */
+static int hsm_store_extent(const char *path, void *hanp, size_t hlen,
+			    struct hsm_store_handle *handle, uint64_t ofs, uint64_t end)
+{
+	static uint8_t *buf;
+	static size_t bufsize;
+	static struct hsm_store_queue *queue;
+	unsigned next = 0, inflight = 0;
+	int ret, err = 0;
+
+	/* aligned and sized for the store, so that with io=direct
+	   whole buffers go to the store */
+	if (buf == NULL) {
+		void *p;
+		bufsize = hsm_store_io_size(store_ctx, HSM_MIGRATE_BUFSIZE);
+		if (posix_memalign(&p, HSM_STORE_IO_ALIGN, bufsize * HSM_MIGRATE_DEPTH) != 0) {
+			printf("No memory for migrate buffer\n");
+			return -1;
+		}
+		buf = p;
+		queue = hsm_store_queue_init(store_ctx, HSM_MIGRATE_DEPTH);
+		if (queue == NULL) {
+			printf("Unable to set up store queue - %s\n",
+			       hsm_store_errmsg(store_ctx));
+			free(buf);
+			buf = NULL;
+			return -1;
+		}
+	}
+
+	while (inflight > 0 || (err == 0 && ofs < end)) {
+		struct hsm_store_completion c;
+
+		if (err == 0 && ofs < end && inflight < HSM_MIGRATE_DEPTH) {
+			uint8_t *b = buf + next * bufsize;
+			size_t len = end - ofs < bufsize ? end - ofs : bufsize;
+			ret = dm_read_invis(dmapi.sid, hanp, hlen, dmapi.token, ofs, len, b);
+			if (ret == -1) {
+				printf("failed dm_read_invis on %s - %s\n", path, strerror(errno));
+				err = -1;
+				continue;
+			}
+			if (ret == 0) {
+				printf("File %s is shorter than expected\n", path);
+				err = -1;
+				continue;
+			}
+			if (hsm_store_submit_write(queue, handle, b, ret, NULL) != 0) {
+				printf("Failed to write to store for %s - %s\n", path,
+				       strerror(errno));
+				err = -1;
+				continue;
+			}
+			next = (next + 1) % HSM_MIGRATE_DEPTH;
+			inflight++;
+			ofs += ret;
+			continue;
+		}
+
+		/* the queue is full, or we are draining it */
+		hsm_store_reap(queue, &c, 1, 1);
+		inflight--;
+		if (c.result == -1 && err == 0) {
+			errno = c.err;
+			printf("Failed to write to store for %s - %s\n", path,
+			       hsm_store_errmsg(store_ctx));
+			err = -1;
+		}
+	}
+	return err;
+}
+
+/*
+  copy a file's data to the store. Only the extents the filesystem
+  has allocated are read, and the holes between them are given to
+  the store as zeros, which it can keep as holes
+ */
+static int hsm_store_file_data(const char *path, void *hanp, size_t hlen,
+			       struct hsm_store_handle *handle, uint64_t size)
+{
+	dm_extent_t extents[HSM_MIGRATE_EXTENTS];
+	dm_off_t next = 0;
+	uint64_t ofs = 0;
+	unsigned i, n;
+	int more;
+
+	do {
+		more = dm_get_allocinfo(dmapi.sid, hanp, hlen, dmapi.token, &next,
+					HSM_MIGRATE_EXTENTS, extents, &n);
+		if (more == -1) {
+			/* without an allocation map, copy the lot */
+			return hsm_store_extent(path, hanp, hlen, handle, ofs, size);
+		}
+		for (i=0;i<n && ofs < size;i++) {
+			uint64_t start = extents[i].ex_offset;
+			uint64_t end = start + extents[i].ex_length;
+
+			if (extents[i].ex_type != DM_EXTENT_RES || end <= ofs) {
+				continue;
+			}
+			if (end > size) {
+				end = size;
+			}
+			if (start > ofs) {
+				if (hsm_store_write_zeros(handle, start - ofs) != 0) {
+					printf("Failed to write to store for %s - %s\n", path,
+					       hsm_store_errmsg(store_ctx));
+					return -1;
+				}
+				ofs = start;
+			}
+			if (hsm_store_extent(path, hanp, hlen, handle, ofs, end) != 0) {
+				return -1;
+			}
+			ofs = end;
+		}
+	} while (more == 1 && ofs < size);
+
+	if (ofs < size && hsm_store_write_zeros(handle, size - ofs) != 0) {
+		printf("Failed to write to store for %s - %s\n", path,
+		       hsm_store_errmsg(store_ctx));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  finish migrating a file whose data is durable in the store, with
+  store_time the store's time for its object. The caller holds an
+  exclusive right on the file
+ */
+static int hsm_migrate_finish(const char *path, void *hanp, size_t hlen,
+			      struct stat *st, uint64_t store_time)
+{
+	struct hsm_attr h;
+	dm_region_t region;
+	dm_boolean_t exactFlag;
+	int ret;
+
+	memset(&h, 0, sizeof(h));
+	h.size = st->st_size;
+	h.migrate_time = time(NULL);
+	h.device = st->st_dev;
+	h.inode = st->st_ino;
+	h.store_time = store_time;
+	h.state = HSM_STATE_START;
+
+	/* mark the file as starting to migrate */
+	ret = hsm_attr_set(dmapi.sid, hanp, hlen, dmapi.token, &h);
+	if (ret == -1) {
+		printf("failed dm_set_dmattr on %s - %s\n", path, strerror(errno));
+		hsm_store_remove(store_ctx, st->st_dev, st->st_ino);
+		return 1;
+	}
+
+	hsm_set_dir_attr(path, hanp, hlen);
+
+	/* mark the whole file as offline, including parts beyond EOF */
+	region.rg_offset = 0;
+	region.rg_size   = 0; /* zero means the whole file */
+	region.rg_flags  = DM_REGION_WRITE | DM_REGION_READ;
+
+	ret = dm_set_region(dmapi.sid, hanp, hlen, dmapi.token, 1, &region, &exactFlag);
+	if (ret == -1) {
+		printf("failed dm_set_region on %s - %s\n", path, strerror(errno));
+		hsm_store_remove(store_ctx, st->st_dev, st->st_ino);
+		return 1;
+	}
+
+	/* this dm_get_dmattr() is not strictly necessary - it is just
+	   paranoia */
+	ret = hsm_attr_get(dmapi.sid, hanp, hlen, dmapi.token, &h);
+	if (ret != 0) {
+		printf("ERROR: Abandoning partial migrate - attribute gone!?\n");
+		return 1;
+	}
+
+	if (h.state != HSM_STATE_START) {
+		printf("ERROR: Abandoning partial migrate - state=%d\n", h.state);
+		return 1;
+	}
+
+	ret = dm_punch_hole(dmapi.sid, hanp, hlen, dmapi.token, 0, st->st_size);
+	if (ret == -1) {
+		printf("failed dm_punch_hole on %s - %s\n", path, strerror(errno));
+		hsm_store_remove(store_ctx, st->st_dev, st->st_ino);
+		return 1;
+	}
+
+	h.state = HSM_STATE_MIGRATED;
+
+	/* mark the file as fully migrated */
+	ret = hsm_attr_set(dmapi.sid, hanp, hlen, dmapi.token, &h);
+	if (ret == -1) {
+		printf("failed dm_set_dmattr on %s - %s\n", path, strerror(errno));
+		hsm_store_remove(store_ctx, st->st_dev, st->st_ino);
+		return 1;
+	}
+
+	printf("Migrated file '%s' of size %d\n", path, (int)st->st_size);
+
+	return 0;
+}
+
+/*
+  add a file to the batch waiting for the store to be synced
+ */
+static int hsm_pending_add(const char *path, struct stat *st, uint64_t store_time)
+{
+	struct hsm_pending *p;
+
+	p = realloc(pending.files, (pending.count + 1) * sizeof(*p));
+	if (p == NULL) {
+		return -1;
+	}
+	pending.files = p;
+	p = &pending.files[pending.count];
+	p->path = strdup(path);
+	if (p->path == NULL) {
+		return -1;
+	}
+	p->st = *st;
+	p->store_time = store_time;
+	if (pending.count == 0) {
+		pending.start = time(NULL);
+	}
+	pending.count++;
+	return 0;
+}
+
+/*
+  drop the store copy of a pending file, unless another migrate of
+  the same file has written it since
+ */
+static void hsm_pending_remove(struct hsm_pending *p)
+{
+	hsm_store_remove_stale(store_ctx, p->st.st_dev, p->st.st_ino, p->store_time);
+}
+
+/*
+  migrate a file from a synced batch. Its right was given up while
+  the batch built up, so the file has to be checked again, and is
+  left alone if it has changed since its data was copied
+ */
+static int hsm_migrate_pending(struct hsm_pending *p)
+{
+	void *hanp = NULL;
+	size_t hlen = 0;
+	struct hsm_attr h;
+	struct stat st;
+	int ret, retval = 1;
+
+	ret = dm_path_to_handle(p->path, &hanp, &hlen);
+	if (ret != 0) {
+		printf("dm_path_to_handle failed for %s - %s\n", p->path, strerror(errno));
+		hsm_pending_remove(p);
+		return 1;
+	}
+
+	ret = dm_create_userevent(dmapi.sid, 0, NULL, &dmapi.token);
+	if (ret != 0) {
+		printf("dm_create_userevent failed for %s - %s\n", p->path, strerror(errno));
+		exit(1);
+	}
+
+	ret = dm_request_right(dmapi.sid, hanp, hlen, dmapi.token, DM_RR_WAIT, DM_RIGHT_EXCL);
+	if (ret != 0) {
+		printf("dm_request_right failed for %s - %s\n", p->path, strerror(errno));
+		hsm_pending_remove(p);
+		goto respond;
+	}
+
+	/* a file that has been migrated since, perhaps by another
+	   migrate, has its store copy in use */
+	ret = hsm_attr_get(dmapi.sid, hanp, hlen, dmapi.token, &h);
+	if (ret == 0 || errno != ENOENT) {
+		printf("File %s changed during migrate - not migrating\n", p->path);
+		goto respond;
+	}
+
+	if (lstat(p->path, &st) != 0 ||
+	    st.st_dev != p->st.st_dev || st.st_ino != p->st.st_ino ||
+	    st.st_size != p->st.st_size ||
+	    st.st_mtim.tv_sec != p->st.st_mtim.tv_sec ||
+	    st.st_mtim.tv_nsec != p->st.st_mtim.tv_nsec ||
+	    st.st_ctim.tv_sec != p->st.st_ctim.tv_sec ||
+	    st.st_ctim.tv_nsec != p->st.st_ctim.tv_nsec) {
+		printf("File %s changed during migrate - not migrating\n", p->path);
+		hsm_pending_remove(p);
+		goto respond;
+	}
+
+	retval = hsm_migrate_finish(p->path, hanp, hlen, &st, p->store_time);
+
+respond:
+	ret = dm_respond_event(dmapi.sid, dmapi.token, DM_RESP_CONTINUE, 0, 0, NULL);
+	if (ret == -1) {
+		printf("failed dm_respond_event on %s - %s\n", p->path, strerror(errno));
+		exit(1);
+	}
+	dmapi.token = DM_NO_TOKEN;
+
+	dm_handle_free(hanp, hlen);
+	return retval;
+}
+
+/*
+  sync the store and migrate the batch of files written to it. If the
+  sync fails none of them can be migrated
+ */
+static int hsm_pending_flush(void)
+{
+	unsigned i;
+	int ret = 0;
+
+	if (pending.count == 0) {
+		return 0;
+	}
+
+	if (hsm_store_sync(store_ctx) != 0) {
+		printf("Failed to sync store - %s\n", hsm_store_errmsg(store_ctx));
+		for (i=0;i<pending.count;i++) {
+			hsm_pending_remove(&pending.files[i]);
+		}
+		ret = 1;
+	} else {
+		for (i=0;i<pending.count;i++) {
+			ret |= hsm_migrate_pending(&pending.files[i]);
+		}
+	}
+
+	for (i=0;i<pending.count;i++) {
+		free(pending.files[i].path);
+	}
+	pending.count = 0;
+	return ret;
+}
+
 /*
   migrate one file
  */
@@ -72,14 +558,9 @@ static int hsm_migrate(const char *path)
 	int ret;
 	void *hanp = NULL;
 	size_t hlen = 0;
-	dm_attrname_t attrname;
-	uint8_t buf[0x1000];
-	size_t rlen;
 	struct stat st;
 	struct hsm_attr h;
-	dm_region_t region;
-	dm_boolean_t exactFlag;
-	off_t ofs;
+	uint64_t store_time;
 	int retval = 1;
 	struct hsm_store_handle *handle;
 
@@ -120,27 +601,26 @@ static int hsm_migrate(const char *path)
 		goto respond;
 	}
 
-        memset(attrname.an_chars, 0, DM_ATTR_NAME_SIZE);
-        strncpy((char*)attrname.an_chars, HSM_ATTRNAME, DM_ATTR_NAME_SIZE);
-
-	/* get any existing attribute on the file */
-	ret = dm_get_dmattr(dmapi.sid, hanp, hlen, dmapi.token, &attrname, 
-			    sizeof(h), &h, &rlen);
+	/* get any existing attribute on the file, checking it is
+	   valid */
+	ret = hsm_attr_get(dmapi.sid, hanp, hlen, dmapi.token, &h);
+	if (ret != 0 && errno == EINVAL) {
+		exit(1);
+	}
 	if (ret != 0 && errno != ENOENT) {
 		printf("dm_get_dmattr failed for %s - %s\n", path, strerror(errno));
 		goto respond;
 	}
 
-	/* check it is valid */
 	if (ret == 0) {
-		if (strncmp(h.magic, HSM_MAGIC, sizeof(h.magic)) != 0) {
-			printf("Bad magic '%*.*s'\n", (int)sizeof(h.magic), (int)sizeof(h.magic), h.magic);
-			exit(1);
-		}
 		if (h.state == HSM_STATE_START) {
 			/* a migration has died on this file */
 			printf("Continuing migration of partly migrated file\n");
 			hsm_store_remove(store_ctx, h.device, h.inode);
+		} else if (h.state == HSM_STATE_PREMIGRATED) {
+			/* the store already has the data */
+			retval = hsm_migrate_premigrated(path, hanp, hlen, &h);
+			goto respond;
 		} else {
 			/* it is either fully migrated, or waiting recall */
 			printf("Not migrating already migrated file %s\n", path);
@@ -171,95 +651,45 @@ static int hsm_migrate(const char *path)
 	}
 
 	/* read the file data and store it away */
-	ofs = 0;
-	while ((ret = dm_read_invis(dmapi.sid, hanp, hlen, dmapi.token, ofs, sizeof(buf), buf)) > 0) {
-		if (hsm_store_write(handle, buf, ret) != 0) {
-			printf("Failed to write to store for %s - %s\n", path, strerror(errno));
-			hsm_store_close(handle);
-			hsm_store_remove(store_ctx, st.st_dev, st.st_ino);
-			goto respond;
-		}
-		ofs += ret;
-	}
-	if (ret == -1) {
-		printf("failed dm_read_invis on %s - %s\n", path, strerror(errno));
+	if (hsm_store_file_data(path, hanp, hlen, handle, st.st_size) != 0) {
 		hsm_store_close(handle);
 		hsm_store_remove(store_ctx, st.st_dev, st.st_ino);
 		goto respond;
 	}
-	hsm_store_close(handle);
-
-	/* now upgrade to a exclusive right on the file before we
-	   change the dmattr and punch holes in the file. */
-	ret = dm_upgrade_right(dmapi.sid, hanp, hlen, dmapi.token);
-	if (ret != 0) {
-		printf("dm_upgrade_right failed for %s - %s\n", path, strerror(errno));
-		goto respond;
-	}
-
-	strncpy(h.magic, HSM_MAGIC, sizeof(h.magic));
-	h.size = st.st_size;
-	h.migrate_time = time(NULL);
-	h.device = st.st_dev;
-	h.inode = st.st_ino;
-	h.state = HSM_STATE_START;
-
-	/* mark the file as starting to migrate */
-	ret = dm_set_dmattr(dmapi.sid, hanp, hlen, dmapi.token, &attrname, 0, 
-			    sizeof(h), (void*)&h);
-	if (ret == -1) {
-		printf("failed dm_set_dmattr on %s - %s\n", path, strerror(errno));
+	if (hsm_store_close(handle) != 0) {
+		printf("Failed to close store file for %s - %s\n", path,
+		       hsm_store_errmsg(store_ctx));
 		hsm_store_remove(store_ctx, st.st_dev, st.st_ino);
 		goto respond;
 	}
 
-	/* mark the whole file as offline, including parts beyond EOF */
-	region.rg_offset = 0;
-	region.rg_size   = 0; /* zero means the whole file */
-	region.rg_flags  = DM_REGION_WRITE | DM_REGION_READ;
-
-	ret = dm_set_region(dmapi.sid, hanp, hlen, dmapi.token, 1, &region, &exactFlag);
-	if (ret == -1) {
-		printf("failed dm_set_region on %s - %s\n", path, strerror(errno));
+	if (hsm_store_object_time(store_ctx, st.st_dev, st.st_ino, &store_time) != 0) {
+		printf("Failed to find store file for %s - %s\n", path,
+		       hsm_store_errmsg(store_ctx));
 		hsm_store_remove(store_ctx, st.st_dev, st.st_ino);
 		goto respond;
 	}
 
-	/* this dm_get_dmattr() is not strictly necessary - it is just
-	   paranoia */
-	ret = dm_get_dmattr(dmapi.sid, hanp, hlen, dmapi.token, &attrname, 
-			    sizeof(h), &h, &rlen);
-	if (ret != 0) {
-		printf("ERROR: Abandoning partial migrate - attribute gone!?\n");
-		goto respond;
-	}
-
-	if (h.state != HSM_STATE_START) {
-		printf("ERROR: Abandoning partial migrate - state=%d\n", h.state);
-		goto respond;
-	}
-
-	ret = dm_punch_hole(dmapi.sid, hanp, hlen, dmapi.token, 0, st.st_size);
-	if (ret == -1) {
-		printf("failed dm_punch_hole on %s - %s\n", path, strerror(errno));
-		hsm_store_remove(store_ctx, st.st_dev, st.st_ino);
+	if (options.batch_count > 1) {
+		/* the rest is done once the store is synced */
+		if (hsm_pending_add(path, &st, store_time) != 0) {
+			printf("Out of memory for %s\n", path);
+			hsm_store_remove(store_ctx, st.st_dev, st.st_ino);
+			goto respond;
+		}
+		retval = 0;
 		goto respond;
 	}
 
-	h.state = HSM_STATE_MIGRATED;
-
-	/* mark the file as fully migrated */
-	ret = dm_set_dmattr(dmapi.sid, hanp, hlen, dmapi.token, &attrname, 
-			    0, sizeof(h), (void*)&h);
-	if (ret == -1) {
-		printf("failed dm_set_dmattr on %s - %s\n", path, strerror(errno));
-		hsm_store_remove(store_ctx, st.st_dev, st.st_ino);
+	/* now upgrade to a exclusive right on the file before we
+	   change the dmattr and punch holes in the file. */
+	ret = dm_upgrade_right(dmapi.sid, hanp, hlen, dmapi.token);
+	if (ret != 0) {
+		printf("dm_upgrade_right failed for %s - %s\n", path, strerror(errno));
 		goto respond;
 	}
 
-	printf("Migrated file '%s' of size %d\n", path, (int)st.st_size);
-
-	retval = 0;
+	retval = hsm_migrate_finish(path, hanp, hlen, &st, store_time);
 
 respond:
 	/* destroy our userevent */
@@ -280,6 +710,9 @@ static void usage(void)
 	printf("Usage: hacksm_migrate <options> PATH..\n");
 	printf("\n\tOptions:\n");
 	printf("\t\t -c                 cleanup lost tokens\n");
+	printf("\t\t -O name=value      set a store option\n");
+	printf("\t\t -L                 convert the store to the layout or roots given by the store options\n");
+	printf("\t\t -B count[,secs]    sync the store once per batch of files, or every secs seconds\n");
 	exit(0);
 }
 
@@ -289,11 +722,29 @@ int main(int argc, char * const argv[])
 	bool cleanup = false;
 
 	/* parse command-line options */
-	while ((opt = getopt(argc, argv, "hc")) != -1) {
+	while ((opt = getopt(argc, argv, "hcO:LB:")) != -1) {
 		switch (opt) {
 		case 'c':
 			cleanup = true;
 			break;
+		case 'O':
+			if (options.num_store_options == HSM_MAX_STORE_OPTIONS) {
+				printf("Too many store options\n");
+				exit(1);
+			}
+			options.store_options[options.num_store_options++] = optarg;
+			break;
+		case 'L':
+			options.convert = true;
+			break;
+		case 'B': {
+			char *p;
+			options.batch_count = strtoul(optarg, &p, 0);
+			if (*p == ',') {
+				options.batch_time = strtoul(p+1, NULL, 0);
+			}
+			break;
+		}
 		case 'h':
 		default:
 			usage();
@@ -318,13 +769,36 @@ int main(int argc, char * const argv[])
 	signal(SIGTERM, hsm_term_handler);
 	signal(SIGINT, hsm_term_handler);
 
+	if (options.convert) {
+		ret = hsm_store_convert(store_ctx);
+		if (ret == -1) {
+			printf("Failed to convert store - %s\n", hsm_store_errmsg(store_ctx));
+			exit(1);
+		}
+		printf("Converted store layout, moving %d files\n", ret);
+		ret = 0;
+		if (argc == 0) {
+			return 0;
+		}
+	}
+
 	if (argc == 0) {
 		usage();
 	}
 
+	if (options.batch_count > 1) {
+		hsm_store_defer_sync(store_ctx);
+	}
+
 	for (i=0;i<argc;i++) {
 		ret |= hsm_migrate(argv[i]);
+		if (pending.count >= options.batch_count ||
+		    (options.batch_time != 0 &&
+		     time(NULL) - pending.start >= options.batch_time)) {
+			ret |= hsm_pending_flush();
+		}
 	}
+	ret |= hsm_pending_flush();
 
 	return ret;
 }
@@ -6,17 +6,60 @@
  */
 
 #include "hacksm.h"
+#include <pthread.h>
+#include <sched.h>
+
+/* default size of each transfer from the store during a recall */
+#define HSM_RECALL_BUFSIZE 0x100000
+
+/* the most store reads a worker can have in flight */
+#define HSM_MAX_RECALL_DEPTH 64
+
+/* starting and largest size of the buffer for dm_get_events() */
+#define HSM_EVENT_BUFSIZE 0x10000
+#define HSM_EVENT_BUFSIZE_MAX 0x1000000
+
+/* polling with -N: how many empty polls just yield, and the range of
+   sleeps between polls after that */
+#define HSM_POLL_SPINS 16
+#define HSM_POLL_MIN_USEC 50
+#define HSM_POLL_MAX_USEC 10000
+
+/* default journal of store removals that haven't been done yet. It
+   should be on a local disk, as it is appended to on every recall */
+#define HSM_REAP_JOURNAL "/var/lib/hacksmd.reap"
 
 static struct {
 	bool blocking_wait;
 	unsigned debug;
 	bool use_fork;
 	unsigned recall_delay;
+	unsigned num_threads;
+	uint64_t chunk_size;
+	bool early_response;
+	size_t xfer_size;
+	unsigned recall_depth;
+	unsigned max_wait_ms;
+	unsigned prefetch_count;
+	uint64_t prefetch_bytes;
+	unsigned prefetch_age;
+	const char *stats_file;
+	unsigned stats_interval;
+	const char *reap_journal;
+	bool premigrate;
+	const char *store_options[HSM_MAX_STORE_OPTIONS];
+	unsigned num_store_options;
 } options = {
 	.blocking_wait = true,
 	.debug = 2,
 	.use_fork = false,
 	.recall_delay = 0,
+	.num_threads = 4,
+	.xfer_size = HSM_RECALL_BUFSIZE,
+	.recall_depth = 2,
+	.prefetch_bytes = 1ULL<<30,
+	.stats_interval = 10,
+	.reap_journal = HSM_REAP_JOURNAL,
 };
 
 static struct {
@@ -29,6 +72,749 @@ static struct hsm_store_context *store_ctx;
 
 #define SESSION_NAME "hacksmd"
 
+/* initial size of a pooled event message. Larger messages grow the
+   pooled buffer, which is then kept for later events */
+#define HSM_JOB_MSGSIZE 0x400
+
+/* chunk size used for early response when -C isn't given */
+#define HSM_DEFAULT_CHUNK_SIZE 0x100000
+
+/* how much a background recall copies each time it takes the right
+   on a file. The right is dropped in between so events can get in */
+#define HSM_BG_BATCH_SIZE 0x400000
+
+/* the most background recalls that can be queued */
+#define HSM_MAX_BG_JOBS 1024
+
+/* the most directory entries looked at for one prefetch */
+#define HSM_PREFETCH_SCAN_MAX 10000
+
+/* number of directories we remember the last recall in, for
+   spotting sequential access by name */
+#define HSM_DIR_HISTORY_SIZE 64
+
+/* number of pooled messages per worker thread. When all of them are
+   in use the event loop stops pulling events from the kernel until a
+   worker frees one up */
+#define HSM_JOBS_PER_WORKER 16
+
+/*
+  per-thread state for handling events. Each worker has its own
+  preallocated recall buffers, one for each store read it can have
+  in flight, and a store queue to read into them with
+ */
+struct hsm_worker {
+	pthread_t thread;
+	unsigned id;
+	uint8_t *buf;
+	size_t bufsize;
+	unsigned depth;
+	struct hsm_store_queue *queue;
+};
+
+/*
+  an event copied out of the dm_get_events() buffer, so the buffer
+  can be reused while a worker handles the event
+ */
+struct hsm_job {
+	struct hsm_job *next;
+	size_t alloc;
+	dm_eventmsg_t *msg;
+	/* recalls are ordered by store position when -W is used */
+	bool is_recall;
+	uint64_t position;
+	uint64_t queue_time;
+};
+
+/*
+  the worker pool. Jobs live either on the free list or on the
+  pending queue, so the number of jobs bounds the queue length
+ */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t free_cond;
+	struct hsm_job *free_list;
+	struct hsm_job *head, *tail;
+	unsigned num_queued;
+	unsigned max_queued;
+	unsigned num_busy;
+	unsigned num_workers;
+	struct hsm_worker *workers;
+	uint64_t sweep_position;
+} pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.free_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* the worker used when handling events in the main thread */
+static struct hsm_worker main_worker;
+
+#define HSM_RECALL_HASH_SIZE 1024
+
+/*
+  a recall in progress. Data events on a file that is already being
+  recalled are added to the waiters list and answered along with the
+  event that started the recall
+ */
+struct hsm_waiter {
+	dm_token_t token;
+	uint64_t ofs, len;
+};
+
+struct hsm_recall {
+	struct hsm_recall *next;
+	void *hanp;
+	size_t hlen;
+	bool in_table;
+	unsigned num_waiters;
+	unsigned num_seen;
+	unsigned alloc_waiters;
+	struct hsm_waiter *waiters;
+};
+
+/*
+  table of in-progress recalls, keyed by file handle
+ */
+static struct {
+	pthread_mutex_t mutex;
+	struct hsm_recall *hash[HSM_RECALL_HASH_SIZE];
+} recalls = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+  kinds of background job. Completing the recall of a file someone is
+  reading comes before prefetching
+ */
+enum hsm_bg_type {
+	HSM_BG_COMPLETE,	/* recall the rest of a partially recalled file */
+	HSM_BG_SCAN_DIR,	/* choose siblings of a recalled file to prefetch */
+	HSM_BG_PREFETCH		/* recall a file nobody has asked for yet */
+};
+
+/*
+  a queued background job. The handles are copied, as the event they
+  came from is gone by the time the job runs
+ */
+struct hsm_bg_job {
+	struct hsm_bg_job *next;
+	enum hsm_bg_type type;
+	unsigned start_chunk;
+	size_t hlen;
+	size_t dirhlen;
+	uint8_t *dirhanp;
+	uint8_t hanp[];
+};
+
+/*
+  the last file recalled in a directory, for spotting readers going
+  through a directory in name order
+ */
+struct hsm_dir_history {
+	unsigned hash;
+	unsigned run;
+	char *last_name;
+};
+
+/*
+  background recalls have their own workers, so they never occupy a
+  worker needed for events
+ */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t idle_cond;
+	struct hsm_bg_job *head, *tail;
+	unsigned num_queued;
+	unsigned num_busy;
+	bool stopping;
+	struct hsm_worker worker;
+	struct hsm_dir_history dirs[HSM_DIR_HISTORY_SIZE];
+} bg = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.idle_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* the most store removals done in one pass of the reaper, and how
+   long it waits for a batch to build up */
+#define HSM_REAP_BATCH 256
+#define HSM_REAP_DELAY_USEC 100000
+
+/* rewrite the reaper journal once it grows past this size */
+#define HSM_REAP_JOURNAL_MAX 0x100000
+
+/*
+  a store file waiting to be removed. The store's time for the file
+  when the removal was queued guards against removing the store file
+  of a later migrate of the same inode
+ */
+struct hsm_reap_entry {
+	struct hsm_reap_entry *next;
+	uint64_t device;
+	uint64_t inode;
+	uint64_t store_time;
+	uint64_t queue_time;
+};
+
+/*
+  store files are removed by a reaper thread, so recalls and destroys
+  don't wait for the store. Each removal is appended to a journal
+  and is on disk before its event is answered, and the journal is
+  replayed on startup, so a restarted hacksmd finishes the
+  removals. Removals queued at the same time share one sync of the
+  journal. With no journal the removals are done synchronously
+ */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t idle_cond;
+	pthread_cond_t sync_cond;
+	struct hsm_reap_entry *head, *tail;
+	unsigned num_queued;
+	bool busy;
+	bool stopping;
+	int fd;
+	off_t journal_size;
+	/* journal entries written, and how many of those are known to
+	   be on disk */
+	uint64_t written, synced;
+	bool syncing;
+} reap = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.idle_cond = PTHREAD_COND_INITIALIZER,
+	.sync_cond = PTHREAD_COND_INITIALIZER,
+	.fd = -1,
+};
+
+/*
+  the phases of event handling that are timed. The last few cover the
+  whole handling of each kind of event
+ */
+enum hsm_phase {
+	HSM_PHASE_QUEUE,	/* waiting in the pool for a worker */
+	HSM_PHASE_RIGHT,	/* getting the exclusive right */
+	HSM_PHASE_ATTR_GET,
+	HSM_PHASE_ATTR_SET,	/* setting or removing the attribute */
+	HSM_PHASE_STORE_OPEN,
+	HSM_PHASE_COPY,		/* copying data back from the store */
+	HSM_PHASE_STORE_REMOVE,
+	HSM_PHASE_REGION,	/* setting or clearing managed regions */
+	HSM_PHASE_RESPOND,
+	HSM_PHASE_RECALL,
+	HSM_PHASE_DESTROY,
+	HSM_PHASE_MOUNT,
+	HSM_PHASE_REAP,		/* a removal by the reaper, from queue to unlink */
+	HSM_NUM_PHASES
+};
+
+static const char *hsm_phase_names[HSM_NUM_PHASES] = {
+	"queue", "right", "attr_get", "attr_set", "store_open", "copy",
+	"store_remove", "region", "respond", "recall", "destroy", "mount",
+	"reap"
+};
+
+/* latencies are kept in power of 2 buckets of microseconds. The last
+   bucket holds everything from about 18 minutes up */
+#define HSM_HIST_BUCKETS 32
+
+struct hsm_hist {
+	uint64_t count;
+	uint64_t total_usec;
+	uint64_t max_usec;
+	uint64_t buckets[HSM_HIST_BUCKETS];
+};
+
+/*
+  counters and latency histograms. These are updated with relaxed
+  atomics by all threads, and written out with -S
+ */
+static struct {
+	uint64_t start_time;
+	uint64_t events;
+	uint64_t recall_bytes;
+	struct hsm_hist phases[HSM_NUM_PHASES];
+} stats;
+
+/*
+  add one latency to the histogram for a phase
+ */
+static void hsm_stats_add(enum hsm_phase phase, uint64_t usec)
+{
+	struct hsm_hist *hist = &stats.phases[phase];
+	unsigned b = usec ? 64 - __builtin_clzll(usec) : 0;
+	uint64_t max;
+
+	if (b >= HSM_HIST_BUCKETS) {
+		b = HSM_HIST_BUCKETS - 1;
+	}
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->total_usec, usec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->buckets[b], 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&hist->max_usec, __ATOMIC_RELAXED);
+	while (usec > max &&
+	       !__atomic_compare_exchange_n(&hist->max_usec, &max, usec, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+/*
+  record the time since 'start' against a phase, returning the
+  current time so that consecutive phases can be chained
+ */
+static uint64_t hsm_stats_phase(enum hsm_phase phase, uint64_t start)
+{
+	uint64_t now = hsm_now_usec();
+	hsm_stats_add(phase, now - start);
+	return now;
+}
+
+/*
+  estimate a percentile from a histogram, as the top of the bucket it
+  falls in
+ */
+static uint64_t hsm_hist_percentile(const struct hsm_hist *hist, uint64_t count,
+				    unsigned pct)
+{
+	uint64_t target = (count * pct + 99) / 100, sum = 0;
+	unsigned b;
+
+	for (b=0;b<HSM_HIST_BUCKETS;b++) {
+		sum += hist->buckets[b];
+		if (sum >= target) {
+			break;
+		}
+	}
+	if (b == 0) {
+		return 0;
+	}
+	if (b == HSM_HIST_BUCKETS || (1ULL << b) - 1 > hist->max_usec) {
+		return hist->max_usec;
+	}
+	return (1ULL << b) - 1;
+}
+
+/*
+  write the stats out to the -S file. The file is written under a
+  temporary name and renamed, so readers always see a whole file
+ */
+static void hsm_stats_write(uint64_t *last_bytes, uint64_t *last_time)
+{
+	char *tmpname;
+	FILE *f;
+	uint64_t now = hsm_now_usec();
+	uint64_t bytes = __atomic_load_n(&stats.recall_bytes, __ATOMIC_RELAXED);
+	unsigned i, b;
+
+	if (asprintf(&tmpname, "%s.tmp", options.stats_file) == -1) {
+		return;
+	}
+	f = fopen(tmpname, "w");
+	if (f == NULL) {
+		printf("Failed to open stats file %s - %s\n", tmpname, strerror(errno));
+		free(tmpname);
+		return;
+	}
+
+	fprintf(f, "uptime_sec %llu\n",
+		(unsigned long long)((now - stats.start_time) / 1000000));
+	fprintf(f, "events %llu\n",
+		(unsigned long long)__atomic_load_n(&stats.events, __ATOMIC_RELAXED));
+	pthread_mutex_lock(&pool.mutex);
+	fprintf(f, "queue_depth %u\n", pool.num_queued);
+	fprintf(f, "queue_depth_max %u\n", pool.max_queued);
+	fprintf(f, "workers_busy %u\n", pool.num_busy);
+	pthread_mutex_unlock(&pool.mutex);
+	pthread_mutex_lock(&bg.mutex);
+	fprintf(f, "bg_queued %u\n", bg.num_queued);
+	pthread_mutex_unlock(&bg.mutex);
+	pthread_mutex_lock(&reap.mutex);
+	fprintf(f, "reap_queued %u\n", reap.num_queued);
+	pthread_mutex_unlock(&reap.mutex);
+	fprintf(f, "recall_bytes %llu\n", (unsigned long long)bytes);
+	fprintf(f, "recall_bytes_per_sec %llu\n",
+		(unsigned long long)(now > *last_time ?
+				     (bytes - *last_bytes) * 1000000 / (now - *last_time) : 0));
+
+	for (i=0;i<HSM_NUM_PHASES;i++) {
+		struct hsm_hist hist;
+
+		hist.count = __atomic_load_n(&stats.phases[i].count, __ATOMIC_RELAXED);
+		hist.total_usec = __atomic_load_n(&stats.phases[i].total_usec, __ATOMIC_RELAXED);
+		hist.max_usec = __atomic_load_n(&stats.phases[i].max_usec, __ATOMIC_RELAXED);
+		for (b=0;b<HSM_HIST_BUCKETS;b++) {
+			hist.buckets[b] = __atomic_load_n(&stats.phases[i].buckets[b],
+							  __ATOMIC_RELAXED);
+		}
+		if (hist.count == 0) {
+			continue;
+		}
+
+		fprintf(f, "phase %s count %llu avg_usec %llu p50_usec %llu p99_usec %llu max_usec %llu\n",
+			hsm_phase_names[i],
+			(unsigned long long)hist.count,
+			(unsigned long long)(hist.total_usec / hist.count),
+			(unsigned long long)hsm_hist_percentile(&hist, hist.count, 50),
+			(unsigned long long)hsm_hist_percentile(&hist, hist.count, 99),
+			(unsigned long long)hist.max_usec);
+		fprintf(f, "hist %s", hsm_phase_names[i]);
+		for (b=0;b<HSM_HIST_BUCKETS;b++) {
+			fprintf(f, " %llu", (unsigned long long)hist.buckets[b]);
+		}
+		fprintf(f, "\n");
+	}
+
+	if (fclose(f) != 0 || rename(tmpname, options.stats_file) != 0) {
+		printf("Failed to write stats file %s - %s\n",
+		       options.stats_file, strerror(errno));
+		unlink(tmpname);
+	}
+	free(tmpname);
+
+	*last_bytes = bytes;
+	*last_time = now;
+}
+
+/*
+  thread that rewrites the stats file every -S interval
+ */
+static void *hsm_stats_main(void *private)
+{
+	uint64_t last_bytes = 0, last_time = stats.start_time;
+
+	while (1) {
+		sleep(options.stats_interval);
+		hsm_stats_write(&last_bytes, &last_time);
+	}
+	return NULL;
+}
+
+/*
+  start the thread writing the stats file
+ */
+static void hsm_stats_start(void)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, hsm_stats_main, NULL) != 0) {
+		printf("Failed to start stats thread\n");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+/*
+  write a removal to a journal, returning the length written
+ */
+static int hsm_reap_journal_write(int fd, struct hsm_reap_entry *e)
+{
+	char line[100];
+	int len;
+
+	len = snprintf(line, sizeof(line), "0x%llx 0x%llx %llu %llu\n",
+		       (unsigned long long)e->device, (unsigned long long)e->inode,
+		       (unsigned long long)e->store_time,
+		       (unsigned long long)e->queue_time);
+	if (write(fd, line, len) != len) {
+		return -1;
+	}
+	return len;
+}
+
+/*
+  append a removal to the journal. Returns the sequence number to
+  pass to hsm_reap_journal_sync(), or 0 if it could not be written.
+  Must be called with reap locked
+ */
+static uint64_t hsm_reap_journal_add(struct hsm_reap_entry *e)
+{
+	int len;
+
+	len = hsm_reap_journal_write(reap.fd, e);
+	if (len == -1) {
+		/* the store file will be left behind if we restart
+		   before removing it */
+		printf("WARNING: failed to write reaper journal - %s\n", strerror(errno));
+		return 0;
+	}
+	reap.journal_size += len;
+	return ++reap.written;
+}
+
+/*
+  wait until the journal entry with the given sequence number is on
+  disk. Whoever finds no sync running syncs everything written so
+  far, so a burst of removals shares one fdatasync(). Must be called
+  with reap locked
+ */
+static void hsm_reap_journal_sync(uint64_t seq)
+{
+	while (reap.synced < seq) {
+		uint64_t upto;
+		int fd, ret;
+
+		if (reap.syncing) {
+			pthread_cond_wait(&reap.sync_cond, &reap.mutex);
+			continue;
+		}
+		reap.syncing = true;
+		upto = reap.written;
+		fd = reap.fd;
+		pthread_mutex_unlock(&reap.mutex);
+		ret = fdatasync(fd);
+		if (ret != 0) {
+			printf("WARNING: failed to sync reaper journal - %s\n", strerror(errno));
+		}
+		pthread_mutex_lock(&reap.mutex);
+		reap.syncing = false;
+		if (reap.synced < upto) {
+			reap.synced = upto;
+		}
+		pthread_cond_broadcast(&reap.sync_cond);
+	}
+}
+
+/*
+  put a removal on the queue. Must be called with reap locked
+ */
+static void hsm_reap_add(struct hsm_reap_entry *e)
+{
+	e->next = NULL;
+	if (reap.tail) {
+		reap.tail->next = e;
+	} else {
+		reap.head = e;
+	}
+	reap.tail = e;
+	reap.num_queued++;
+	pthread_cond_signal(&reap.work_cond);
+}
+
+/*
+  remove a store file, either by queueing it for the reaper or
+  directly if there is no reaper. store_time is the store's time for
+  the object from the file's attribute, and is only looked up in the
+  store for files migrated before it was recorded
+ */
+static int hsm_reap_queue(uint64_t device, uint64_t inode, uint64_t store_time)
+{
+	struct hsm_reap_entry *e;
+	uint64_t seq;
+
+	if (reap.fd == -1) {
+		return hsm_store_remove(store_ctx, device, inode);
+	}
+	if (store_time == HSM_STORE_TIME_UNKNOWN &&
+	    hsm_store_object_time(store_ctx, device, inode, &store_time) != 0) {
+		if (errno == ENOENT) {
+			/* nothing to remove */
+			return 0;
+		}
+		return hsm_store_remove(store_ctx, device, inode);
+	}
+	e = malloc(sizeof(*e));
+	if (e == NULL) {
+		return hsm_store_remove(store_ctx, device, inode);
+	}
+	e->device = device;
+	e->inode = inode;
+	e->store_time = store_time;
+	e->queue_time = hsm_wall_usec();
+
+	/* the entry is queued before the journal is synced, so a
+	   journal rewrite in the meantime still carries it. Removing
+	   it before the sync does no harm */
+	pthread_mutex_lock(&reap.mutex);
+	seq = hsm_reap_journal_add(e);
+	hsm_reap_add(e);
+	hsm_reap_journal_sync(seq);
+	pthread_mutex_unlock(&reap.mutex);
+	return 0;
+}
+
+/*
+  rewrite the journal to hold just the removals still queued. The new
+  journal is written and synced under a temporary name and renamed
+  into place, so a crash leaves either the old or the new one. Must
+  be called with reap locked
+ */
+static void hsm_reap_journal_rewrite(void)
+{
+	struct hsm_reap_entry *e;
+	off_t size = 0;
+	char *tmpname;
+	int fd, len = 0;
+
+	/* a sync in progress is using the old journal */
+	while (reap.syncing) {
+		pthread_cond_wait(&reap.sync_cond, &reap.mutex);
+	}
+
+	if (asprintf(&tmpname, "%s.tmp", options.reap_journal) == -1) {
+		return;
+	}
+	fd = open(tmpname, O_RDWR|O_CREAT|O_TRUNC|O_APPEND, 0600);
+	if (fd == -1) {
+		printf("WARNING: failed to rewrite reaper journal - %s\n", strerror(errno));
+		free(tmpname);
+		return;
+	}
+	for (e=reap.head; e; e=e->next) {
+		len = hsm_reap_journal_write(fd, e);
+		if (len == -1) {
+			break;
+		}
+		size += len;
+	}
+	if (len == -1 || fsync(fd) != 0 || rename(tmpname, options.reap_journal) != 0) {
+		printf("WARNING: failed to rewrite reaper journal - %s\n", strerror(errno));
+		close(fd);
+		unlink(tmpname);
+		free(tmpname);
+		return;
+	}
+	free(tmpname);
+	close(reap.fd);
+	reap.fd = fd;
+	reap.journal_size = size;
+	/* everything written so far is either done or in the new
+	   journal, which is on disk */
+	reap.synced = reap.written;
+	pthread_cond_broadcast(&reap.sync_cond);
+}
+
+/*
+  main loop for the reaper thread. Removals are taken in batches, and
+  the journal is cut back once the queue is empty
+ */
+static void *hsm_reap_main(void *private)
+{
+	pthread_mutex_lock(&reap.mutex);
+	while (1) {
+		struct hsm_reap_entry *batch, *e;
+		unsigned n;
+		bool idle;
+
+		while (reap.head == NULL || reap.stopping) {
+			pthread_cond_wait(&reap.work_cond, &reap.mutex);
+		}
+
+		/* give a burst of deletes a chance to arrive */
+		if (reap.num_queued < HSM_REAP_BATCH) {
+			uint64_t until = hsm_wall_usec() + HSM_REAP_DELAY_USEC;
+			struct timespec ts = {
+				.tv_sec = until / 1000000,
+				.tv_nsec = (until % 1000000) * 1000
+			};
+			pthread_cond_timedwait(&reap.work_cond, &reap.mutex, &ts);
+			if (reap.stopping) {
+				continue;
+			}
+		}
+
+		batch = reap.head;
+		for (n=1, e=batch; n<HSM_REAP_BATCH && e->next; n++, e=e->next) ;
+		reap.head = e->next;
+		if (reap.head == NULL) {
+			reap.tail = NULL;
+		}
+		e->next = NULL;
+		reap.num_queued -= n;
+		reap.busy = true;
+		pthread_mutex_unlock(&reap.mutex);
+
+		while ((e = batch) != NULL) {
+			batch = e->next;
+			if (hsm_store_remove_stale(store_ctx, e->device, e->inode,
+						   e->store_time) != 0 &&
+			    errno != ENOENT) {
+				if (errno != EEXIST) {
+					printf("WARNING: Failed to unlink store file for file 0x%llx:0x%llx - %s\n",
+					       (unsigned long long)e->device,
+					       (unsigned long long)e->inode, strerror(errno));
+				} else if (options.debug > 1) {
+					printf("Store file for 0x%llx:0x%llx was migrated again - not removing\n",
+					       (unsigned long long)e->device,
+					       (unsigned long long)e->inode);
+				}
+			}
+			hsm_stats_add(HSM_PHASE_REAP, hsm_wall_usec() - e->queue_time);
+			free(e);
+		}
+
+		/* once the removals are done, reclaim the space they
+		   freed in the store */
+		pthread_mutex_lock(&reap.mutex);
+		idle = (reap.head == NULL);
+		pthread_mutex_unlock(&reap.mutex);
+		if (idle && hsm_store_compact(store_ctx) == -1) {
+			printf("WARNING: Failed to compact store - %s\n",
+			       hsm_store_errmsg(store_ctx));
+		}
+
+		pthread_mutex_lock(&reap.mutex);
+		reap.busy = false;
+		if (reap.head == NULL || reap.journal_size > HSM_REAP_JOURNAL_MAX) {
+			hsm_reap_journal_rewrite();
+		}
+		pthread_cond_broadcast(&reap.idle_cond);
+	}
+	return NULL;
+}
+
+/*
+  open the reaper journal, queue any removals left from a previous
+  run, and start the reaper thread. If the journal can't be opened
+  then store files are removed synchronously
+ */
+static void hsm_reap_start(void)
+{
+	unsigned long long device, inode, store_time, queue_time;
+	pthread_t thread;
+	FILE *f;
+
+	reap.fd = open(options.reap_journal, O_RDWR|O_CREAT|O_APPEND, 0600);
+	if (reap.fd == -1) {
+		printf("WARNING: unable to open reaper journal %s (%s) - removing store files synchronously\n",
+		       options.reap_journal, strerror(errno));
+		return;
+	}
+
+	f = fopen(options.reap_journal, "r");
+	if (f != NULL) {
+		pthread_mutex_lock(&reap.mutex);
+		while (fscanf(f, "%llx %llx %llu %llu\n", &device, &inode,
+			      &store_time, &queue_time) == 4) {
+			struct hsm_reap_entry *e = malloc(sizeof(*e));
+			if (e == NULL) {
+				break;
+			}
+			e->device = device;
+			e->inode = inode;
+			e->store_time = store_time;
+			e->queue_time = queue_time;
+			hsm_reap_add(e);
+		}
+		reap.journal_size = ftell(f);
+		pthread_mutex_unlock(&reap.mutex);
+		fclose(f);
+	}
+
+	if (reap.num_queued != 0) {
+		printf("Finishing %u store file removals from the reaper journal\n",
+		       reap.num_queued);
+	}
+
+	if (pthread_create(&thread, NULL, hsm_reap_main, NULL) != 0) {
+		printf("Failed to start reaper thread\n");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
 /* no special handling on terminate in hacksmd, as we want existing
    events to stay around so we can continue them on restart */
 static void hsm_term_handler(int signal)
@@ -49,6 +835,7 @@ static void hsm_init(void)
 	dm_eventset_t eventSet;
 	int ret;
 	int errcode = 0;
+	unsigned i;
 
 	if (store_ctx) {
 		hsm_store_shutdown(store_ctx);
@@ -60,8 +847,17 @@ static void hsm_init(void)
 		exit(1);
 	}
 
+	for (i=0;i<options.num_store_options;i++) {
+		if (hsm_store_set_option(store_ctx, options.store_options[i]) != 0) {
+			printf("Bad store option '%s' - %s\n", options.store_options[i],
+			       hsm_store_errmsg(store_ctx));
+			exit(1);
+		}
+	}
+
 	if (hsm_store_connect(store_ctx, "/gpfs") != 0) {
-		printf("Failed to connect to HSM store\n");
+		printf("Failed to connect to HSM store - %s\n",
+		       hsm_store_errmsg(store_ctx));
 		exit(1);
 	}
 
@@ -103,6 +899,7 @@ static void hsm_handle_mount(dm_eventmsg_t *msg)
 	size_t hand1len;
 	dm_eventset_t eventSet;
 	int ret;
+	uint64_t start = hsm_now_usec(), t;
 	
 	mount = DM_GET_VALUE(msg, ev_data, dm_mount_event_t*);
 	hand1 = DM_GET_VALUE(mount , me_handle1, void *);
@@ -127,41 +924,578 @@ static void hsm_handle_mount(dm_eventmsg_t *msg)
 		exit(1);
 	}
 	
+	t = hsm_now_usec();
 	ret = dm_respond_event(dmapi.sid, msg->ev_token, 
 			       DM_RESP_CONTINUE, 0, 0, NULL);
 	if (ret != 0) {
 		printf("Failed to respond to mount event\n");
 		exit(1);
 	}
+	hsm_stats_phase(HSM_PHASE_RESPOND, t);
+	hsm_stats_phase(HSM_PHASE_MOUNT, start);
 }
 
 /*
-  called on a data event from DMAPI. Check the files attribute, and if
-  it is migrated then do a recall
+  hash a file handle for the recall table
  */
-static void hsm_handle_recall(dm_eventmsg_t *msg)
+static unsigned hsm_handle_hash(const void *hanp, size_t hlen)
 {
-	dm_data_event_t *ev;
-	void *hanp;
-	size_t hlen, rlen;
-	int ret;
-	dm_attrname_t attrname;
-	dm_token_t token = msg->ev_token;
-	struct hsm_attr h;
-	dm_boolean_t exactFlag;
-	uint8_t buf[0x10000];
-	off_t ofs;
-	dm_right_t right;
-	dm_response_t response = DM_RESP_CONTINUE;
-	int retcode = 0;
-	struct hsm_store_handle *handle;
+	const uint8_t *p = (const uint8_t *)hanp;
+	uint32_t v = 0x811c9dc5;
+	size_t i;
 
-        ev = DM_GET_VALUE(msg, ev_data, dm_data_event_t *);
-        hanp = DM_GET_VALUE(ev, de_handle, void *);
-        hlen = DM_GET_LEN(ev, de_handle);
+	for (i=0;i<hlen;i++) {
+		v = (v ^ p[i]) * 0x01000193;
+	}
+	return v % HSM_RECALL_HASH_SIZE;
+}
 
-        memset(attrname.an_chars, 0, DM_ATTR_NAME_SIZE);
-        strncpy((char*)attrname.an_chars, HSM_ATTRNAME, DM_ATTR_NAME_SIZE);
+/*
+  start a recall on a file. If a recall is already in progress on the
+  file then the token and the range it wants are added to its waiters
+  and NULL is returned, otherwise the caller owns the returned recall
+  and must finish it with hsm_recall_end()
+ */
+static struct hsm_recall *hsm_recall_start(void *hanp, size_t hlen, dm_token_t token,
+					   uint64_t ofs, uint64_t len)
+{
+	unsigned idx = hsm_handle_hash(hanp, hlen);
+	struct hsm_recall *r;
+
+	pthread_mutex_lock(&recalls.mutex);
+	for (r=recalls.hash[idx]; r; r=r->next) {
+		if (r->hlen == hlen && memcmp(r->hanp, hanp, hlen) == 0) {
+			break;
+		}
+	}
+	if (r != NULL) {
+		if (r->num_waiters == r->alloc_waiters) {
+			unsigned n = r->alloc_waiters ? r->alloc_waiters * 2 : 8;
+			struct hsm_waiter *w = realloc(r->waiters, n * sizeof(struct hsm_waiter));
+			if (w == NULL) {
+				printf("No memory for recall waiters\n");
+				exit(1);
+			}
+			r->waiters = w;
+			r->alloc_waiters = n;
+		}
+		r->waiters[r->num_waiters].token = token;
+		r->waiters[r->num_waiters].ofs = ofs;
+		r->waiters[r->num_waiters].len = len;
+		r->num_waiters++;
+		pthread_mutex_unlock(&recalls.mutex);
+		if (options.debug > 2) {
+			printf("Joined recall already in progress\n");
+		}
+		return NULL;
+	}
+
+	r = calloc(1, sizeof(struct hsm_recall));
+	if (r == NULL) {
+		printf("No memory for recall\n");
+		exit(1);
+	}
+	/* the handle lives in the owners event message, which outlives
+	   the recall */
+	r->hanp = hanp;
+	r->hlen = hlen;
+	r->in_table = true;
+	r->next = recalls.hash[idx];
+	recalls.hash[idx] = r;
+	pthread_mutex_unlock(&recalls.mutex);
+
+	return r;
+}
+
+/*
+  remove a recall from the table. Must be called with the table locked
+ */
+static void hsm_recall_remove(struct hsm_recall *r)
+{
+	unsigned idx = hsm_handle_hash(r->hanp, r->hlen);
+	struct hsm_recall **rp;
+
+	for (rp=&recalls.hash[idx]; *rp != r; rp=&(*rp)->next) ;
+	*rp = r->next;
+	r->in_table = false;
+}
+
+/*
+  get the range wanted by the next waiter that joined the recall since
+  the last call. When there are no more, the recall is removed from
+  the table so no more waiters can join, and false is returned. This
+  lets a partial recall cover the ranges of every event it answers
+ */
+static bool hsm_recall_next(struct hsm_recall *r, uint64_t *ofs, uint64_t *len)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&recalls.mutex);
+	if (r->num_seen < r->num_waiters) {
+		*ofs = r->waiters[r->num_seen].ofs;
+		*len = r->waiters[r->num_seen].len;
+		r->num_seen++;
+		ret = true;
+	} else if (r->in_table) {
+		hsm_recall_remove(r);
+	}
+	pthread_mutex_unlock(&recalls.mutex);
+
+	return ret;
+}
+
+/*
+  finish a recall, answering any events that were waiting on it with
+  the same response as the event that did the recall
+ */
+static void hsm_recall_end(struct hsm_recall *r, dm_response_t response, int retcode)
+{
+	unsigned i;
+	int ret;
+
+	pthread_mutex_lock(&recalls.mutex);
+	if (r->in_table) {
+		hsm_recall_remove(r);
+	}
+	pthread_mutex_unlock(&recalls.mutex);
+
+	if (r->num_waiters != 0 && options.debug > 1) {
+		printf("Answering %u coalesced events\n", r->num_waiters);
+	}
+
+	for (i=0;i<r->num_waiters;i++) {
+		ret = dm_respond_event(dmapi.sid, r->waiters[i].token, 
+				       response, retcode, 0, NULL);
+		if (ret != 0) {
+			printf("Failed to respond to coalesced event\n");
+			exit(1);
+		}
+	}
+
+	free(r->waiters);
+	free(r);
+}
+
+/*
+  copy a range of a file holding data back from the store using
+  invisible writes. Store data is written from a mapping where it can
+  be, and otherwise read into our buffers. Up to w->depth reads from
+  the store are kept in flight in the worker's store queue, so the
+  store is reading the next blocks while we write the ones that have
+  arrived, in whatever order they finish. The writes are not
+  synchronous - the caller must use hsm_recall_sync() before relying
+  on the data
+ */
+static int hsm_recall_extent(struct hsm_worker *w, struct hsm_store_handle *handle,
+			     void *hanp, size_t hlen, dm_token_t token,
+			     uint64_t ofs, uint64_t len)
+{
+	uint64_t aofs[HSM_MAX_RECALL_DEPTH];
+	size_t alen[HSM_MAX_RECALL_DEPTH];
+	unsigned free_slots[HSM_MAX_RECALL_DEPTH];
+	uint64_t end = ofs + len;
+	unsigned i, num_free, inflight = 0;
+	int ret = 0;
+
+	/* where the store object can be mapped, write straight from
+	   the mapping rather than copying through our buffers. Whatever
+	   can't be mapped is read below, which also reports any error */
+	while (ofs < end) {
+		const uint8_t *data;
+		size_t n;
+
+		data = hsm_store_map(handle, end - ofs, ofs, &n);
+		if (data == NULL) {
+			break;
+		}
+		if (n == 0) {
+			/* the store object ends early */
+			end = ofs;
+			break;
+		}
+		if (dm_write_invis(dmapi.sid, hanp, hlen, token, 0, ofs, n,
+				   discard_const(data)) != n) {
+			printf("dm_write_invis failed - %s\n", strerror(errno));
+			hsm_store_unmap(handle);
+			return -1;
+		}
+		__atomic_fetch_add(&stats.recall_bytes, n, __ATOMIC_RELAXED);
+		ofs += n;
+	}
+	hsm_store_unmap(handle);
+
+	for (i=0;i<w->depth;i++) {
+		free_slots[i] = i;
+	}
+	num_free = w->depth;
+
+	while (inflight > 0 || (ret == 0 && ofs < end)) {
+		struct hsm_store_completion c;
+		unsigned slot;
+		ssize_t n;
+
+		/* keep the pipeline full */
+		while (ret == 0 && num_free > 0 && ofs < end) {
+			slot = free_slots[--num_free];
+			alen[slot] = end - ofs < w->bufsize ? end - ofs : w->bufsize;
+			aofs[slot] = ofs;
+			if (hsm_store_submit_read(w->queue, handle, w->buf + slot * w->bufsize,
+						  alen[slot], ofs, &aofs[slot]) != 0) {
+				printf("Failed to read from store - %s\n", strerror(errno));
+				free_slots[num_free++] = slot;
+				ret = -1;
+				break;
+			}
+			ofs += alen[slot];
+			inflight++;
+		}
+		if (inflight == 0) {
+			break;
+		}
+
+		hsm_store_reap(w->queue, &c, 1, 1);
+		slot = (uint64_t *)c.private - aofs;
+		free_slots[num_free++] = slot;
+		inflight--;
+
+		n = c.result;
+		if (ret != 0) {
+			/* just draining the pipeline after an error */
+			continue;
+		}
+		if (n == -1) {
+			errno = c.err;
+			printf("Failed to read from store - %s\n", hsm_store_errmsg(store_ctx));
+			ret = -1;
+			continue;
+		}
+		if (n > 0 &&
+		    dm_write_invis(dmapi.sid, hanp, hlen, token, 0, aofs[slot], n,
+				   w->buf + slot * w->bufsize) != n) {
+			printf("dm_write_invis failed - %s\n", strerror(errno));
+			ret = -1;
+			continue;
+		}
+		__atomic_fetch_add(&stats.recall_bytes, n, __ATOMIC_RELAXED);
+		if (n < alen[slot]) {
+			/* the store object ends early, so stop reading */
+			end = ofs;
+		}
+	}
+	return ret;
+}
+
+/*
+  copy a range of a file back from the store. Holes the store knows
+  about are skipped, and as the file's data was punched out when it
+  was migrated they stay holes. The writes are not synchronous - the
+  caller must use hsm_recall_sync() before relying on the data
+ */
+static int hsm_recall_data(struct hsm_worker *w, struct hsm_store_handle *handle,
+			   void *hanp, size_t hlen, dm_token_t token,
+			   uint64_t ofs, uint64_t len)
+{
+	uint64_t end = ofs + len;
+
+	while (ofs < end) {
+		uint64_t data, hole;
+
+		data = hsm_store_seek_data(handle, ofs);
+		if (data >= end) {
+			break;
+		}
+		hole = hsm_store_seek_hole(handle, data);
+		if (hole > end) {
+			hole = end;
+		}
+		if (hsm_recall_extent(w, handle, hanp, hlen, token, data, hole - data) != 0) {
+			return -1;
+		}
+		ofs = hole;
+	}
+	return 0;
+}
+
+/*
+  make the data written by hsm_recall_data() durable. This must be
+  done before the chunk map or attribute say the data is there
+ */
+static int hsm_recall_sync(void *hanp, size_t hlen, dm_token_t token)
+{
+	if (dm_sync_by_handle(dmapi.sid, hanp, hlen, token) != 0) {
+		printf("dm_sync_by_handle failed - %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  recall the chunks of a file covering a byte range that are not
+  already resident. A zero length means up to the end of the file
+ */
+static int hsm_recall_chunks(struct hsm_worker *w, struct hsm_store_handle *handle,
+			     void *hanp, size_t hlen, dm_token_t token,
+			     struct hsm_attr *h, uint64_t ofs, uint64_t len)
+{
+	unsigned i, first, last, nchunks = hsm_num_chunks(h);
+	uint64_t chunk_size = 1ULL << h->chunk_shift;
+
+	if (ofs >= h->size) {
+		return 0;
+	}
+	if (len == 0 || len > h->size - ofs) {
+		len = h->size - ofs;
+	}
+	first = ofs >> h->chunk_shift;
+	last = (ofs + len - 1) >> h->chunk_shift;
+	if (last >= nchunks) {
+		last = nchunks - 1;
+	}
+
+	for (i=first;i<=last;i++) {
+		uint64_t start = (uint64_t)i << h->chunk_shift;
+		uint64_t n = chunk_size;
+		if (hsm_chunk_resident(h, i)) {
+			continue;
+		}
+		if (n > h->size - start) {
+			n = h->size - start;
+		}
+		if (hsm_recall_data(w, handle, hanp, hlen, token, start, n) != 0) {
+			return -1;
+		}
+		hsm_chunk_set_resident(h, i);
+	}
+	return 0;
+}
+
+/*
+  set the managed regions of a partially recalled file so that only
+  the chunks still in the store generate events. The last region is
+  left open ended if the last chunk is not resident, so that the area
+  beyond EOF stays managed as it was after the migrate
+ */
+static int hsm_set_chunk_regions(void *hanp, size_t hlen, dm_token_t token,
+				 struct hsm_attr *h)
+{
+	unsigned i, nchunks = hsm_num_chunks(h), nregions = 0;
+	dm_region_t *regions;
+	dm_boolean_t exactFlag;
+	int ret;
+
+	regions = calloc((nchunks+1)/2, sizeof(dm_region_t));
+	if (regions == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i=0;i<nchunks;i++) {
+		unsigned j;
+		if (hsm_chunk_resident(h, i)) {
+			continue;
+		}
+		for (j=i+1;j<nchunks && !hsm_chunk_resident(h, j);j++) ;
+		regions[nregions].rg_offset = (uint64_t)i << h->chunk_shift;
+		if (j == nchunks) {
+			regions[nregions].rg_size = 0;
+		} else {
+			regions[nregions].rg_size = (uint64_t)(j - i) << h->chunk_shift;
+		}
+		regions[nregions].rg_flags = DM_REGION_WRITE | DM_REGION_READ;
+		nregions++;
+		i = j;
+	}
+
+	ret = dm_set_region(dmapi.sid, hanp, hlen, token, nregions, regions, &exactFlag);
+	free(regions);
+	return ret == -1 ? -1 : 0;
+}
+
+/*
+  keep the store copy of a fully recalled file, marking the file as
+  premigrated. A write or truncate region stays on the file, so that
+  we hear about any change that makes the store copy stale
+ */
+static int hsm_premigrate(void *hanp, size_t hlen, dm_token_t token, struct hsm_attr *h)
+{
+	dm_region_t region;
+	dm_boolean_t exactFlag;
+	uint64_t t = hsm_now_usec();
+
+	h->state = HSM_STATE_PREMIGRATED;
+	h->chunk_shift = 0;
+	memset(h->resident, 0, sizeof(h->resident));
+	if (hsm_attr_set(dmapi.sid, hanp, hlen, token, h) != 0) {
+		printf("dm_set_dmattr failed - %s\n", strerror(errno));
+		return -1;
+	}
+	t = hsm_stats_phase(HSM_PHASE_ATTR_SET, t);
+
+	region.rg_offset = 0;
+	region.rg_size   = 0; /* zero means the whole file */
+	region.rg_flags  = DM_REGION_WRITE | DM_REGION_TRUNCATE;
+	if (dm_set_region(dmapi.sid, hanp, hlen, token, 1, &region, &exactFlag) == -1) {
+		printf("failed dm_set_region - %s\n", strerror(errno));
+		return -1;
+	}
+	hsm_stats_phase(HSM_PHASE_REGION, t);
+
+	return 0;
+}
+
+/*
+  a file has been fully recalled, or a premigrated file has changed,
+  so remove the attribute, the store file and the managed regions. If
+  keep_copy is set and -P was given then the file is left premigrated
+  instead
+ */
+static int hsm_recall_finish(void *hanp, size_t hlen, dm_token_t token, struct hsm_attr *h,
+			     bool keep_copy)
+{
+	dm_attrname_t attrname;
+	dm_boolean_t exactFlag;
+	int ret;
+	uint64_t t = hsm_now_usec();
+
+	if (keep_copy && options.premigrate) {
+		return hsm_premigrate(hanp, hlen, token, h);
+	}
+
+        memset(attrname.an_chars, 0, DM_ATTR_NAME_SIZE);
+        strncpy((char*)attrname.an_chars, HSM_ATTRNAME, DM_ATTR_NAME_SIZE);
+
+	/* remove the attribute from the file - it is now fully recalled */
+	ret = dm_remove_dmattr(dmapi.sid, hanp, hlen, token, 0, &attrname);
+	if (ret != 0) {
+		printf("dm_remove_dmattr failed - %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* the directory attribute is only there for prefetching,
+	   and may not exist */
+	memset(attrname.an_chars, 0, DM_ATTR_NAME_SIZE);
+	strncpy((char*)attrname.an_chars, HSM_DIR_ATTRNAME, DM_ATTR_NAME_SIZE);
+	dm_remove_dmattr(dmapi.sid, hanp, hlen, token, 0, &attrname);
+	t = hsm_stats_phase(HSM_PHASE_ATTR_SET, t);
+
+	/* remove the store file */
+	ret = hsm_reap_queue(h->device, h->inode, h->store_time);
+	if (ret != 0) {
+		printf("WARNING: Failed to unlink store file\n");
+	}
+	t = hsm_stats_phase(HSM_PHASE_STORE_REMOVE, t);
+
+	/* remove the managed region from the file */
+	ret = dm_set_region(dmapi.sid, hanp, hlen, token, 0, NULL, &exactFlag);
+	if (ret == -1) {
+		printf("failed dm_set_region - %s\n", strerror(errno));
+		return -1;
+	}
+	hsm_stats_phase(HSM_PHASE_REGION, t);
+
+	return 0;
+}
+
+/*
+  queue a background job. For HSM_BG_COMPLETE the recall starts at
+  start_chunk, and for HSM_BG_SCAN_DIR the directory handle is the
+  directory to scan. Jobs are dropped if the queue is full, as the
+  files will still be recalled on demand
+ */
+static void hsm_bg_queue(enum hsm_bg_type type, void *hanp, size_t hlen,
+			 void *dirhanp, size_t dirhlen, unsigned start_chunk)
+{
+	struct hsm_bg_job *job;
+
+	pthread_mutex_lock(&bg.mutex);
+	if (bg.num_queued >= HSM_MAX_BG_JOBS) {
+		pthread_mutex_unlock(&bg.mutex);
+		return;
+	}
+	for (job=bg.head; job; job=job->next) {
+		if (job->type == type &&
+		    job->hlen == hlen && memcmp(job->hanp, hanp, hlen) == 0) {
+			pthread_mutex_unlock(&bg.mutex);
+			return;
+		}
+	}
+
+	job = malloc(sizeof(struct hsm_bg_job) + hlen + dirhlen);
+	if (job == NULL) {
+		pthread_mutex_unlock(&bg.mutex);
+		return;
+	}
+	job->next = NULL;
+	job->type = type;
+	job->start_chunk = start_chunk;
+	job->hlen = hlen;
+	memcpy(job->hanp, hanp, hlen);
+	job->dirhlen = dirhlen;
+	job->dirhanp = job->hanp + hlen;
+	if (dirhlen != 0) {
+		memcpy(job->dirhanp, dirhanp, dirhlen);
+	}
+
+	if (bg.tail) {
+		bg.tail->next = job;
+	} else {
+		bg.head = job;
+	}
+	bg.tail = job;
+	bg.num_queued++;
+	pthread_cond_signal(&bg.work_cond);
+	pthread_mutex_unlock(&bg.mutex);
+}
+
+/*
+  get the handle of the directory a file was migrated from, if known
+ */
+static bool hsm_get_dir_handle(void *hanp, size_t hlen, dm_token_t token,
+			       uint8_t *dirhanp, size_t *dirhlen)
+{
+	dm_attrname_t attrname;
+
+	memset(attrname.an_chars, 0, DM_ATTR_NAME_SIZE);
+	strncpy((char*)attrname.an_chars, HSM_DIR_ATTRNAME, DM_ATTR_NAME_SIZE);
+
+	return dm_get_dmattr(dmapi.sid, hanp, hlen, token, &attrname,
+			     HSM_MAX_HANDLE_SIZE, dirhanp, dirhlen) == 0;
+}
+
+/*
+  called on a data event from DMAPI. Check the files attribute, and if
+  it is migrated then do a recall. If partial recall is enabled then
+  only the chunks covering the range of the event are recalled, and
+  the rest of the file is left managed
+ */
+static void hsm_handle_recall(dm_eventmsg_t *msg, struct hsm_worker *w)
+{
+	dm_data_event_t *ev;
+	void *hanp;
+	size_t hlen;
+	int ret;
+	dm_token_t token = msg->ev_token;
+	struct hsm_attr h;
+	dm_right_t right;
+	dm_response_t response = DM_RESP_CONTINUE;
+	int retcode = 0;
+	struct hsm_store_handle *handle;
+	struct hsm_recall *recall;
+	uint64_t ofs, len;
+	uint8_t dirhanp[HSM_MAX_HANDLE_SIZE];
+	size_t dirhlen = 0;
+	uint64_t start = hsm_now_usec(), t = start;
+
+        ev = DM_GET_VALUE(msg, ev_data, dm_data_event_t *);
+        hanp = DM_GET_VALUE(ev, de_handle, void *);
+        hlen = DM_GET_LEN(ev, de_handle);
+
+	/* if another worker is already recalling this file then
+	   wait for that recall rather than starting another one */
+	recall = hsm_recall_start(hanp, hlen, token, ev->de_offset, ev->de_length);
+	if (recall == NULL) {
+		return;
+	}
 
 	/* make sure we have an exclusive right on the file */
 	ret = dm_query_right(dmapi.sid, hanp, hlen, token, &right);
@@ -181,11 +1515,12 @@ static void hsm_handle_recall(dm_eventmsg_t *msg)
 			goto done;
 		}
 	}
+	t = hsm_stats_phase(HSM_PHASE_RIGHT, t);
 
 	/* get the attribute from the file, and make sure it is
 	   valid */
-	ret = dm_get_dmattr(dmapi.sid, hanp, hlen, token, &attrname, 
-			    sizeof(h), &h, &rlen);
+	ret = hsm_attr_get(dmapi.sid, hanp, hlen, token, &h);
+	t = hsm_stats_phase(HSM_PHASE_ATTR_GET, t);
 	if (ret != 0) {
 		if (errno == ENOENT) {
 			if (options.debug > 2) {
@@ -193,24 +1528,26 @@ static void hsm_handle_recall(dm_eventmsg_t *msg)
 			}
 			goto done;
 		}
-		printf("dm_get_dmattr failed - %s\n", strerror(errno));
+		printf("hsm_attr_get failed - %s\n", strerror(errno));
 		retcode = EIO;
 		response = DM_RESP_ABORT;
 		goto done;
 	}
 
-	if (rlen != sizeof(h)) {
-		printf("hsm_handle_read - bad attribute size %d\n", (int)rlen);
-		retcode = EIO;
-		response = DM_RESP_ABORT;
-		goto done;
-	}
-
-	if (strncmp(h.magic, HSM_MAGIC, sizeof(h.magic)) != 0) {
-		printf("Bad magic '%*.*s'\n", (int)sizeof(h.magic), (int)sizeof(h.magic),
-		       h.magic);
-		retcode = EIO;
-		response = DM_RESP_ABORT;
+	/* a premigrated file has all its data, but a change to it
+	   means the store copy is out of date. A read can only come
+	   from a migrate that died part way, so is handled as a
+	   recall, as the store copy is still good */
+	if (h.state == HSM_STATE_PREMIGRATED && msg->ev_type != DM_EVENT_READ) {
+		if (options.debug > 1) {
+			printf("%s %s: Dropping store copy of premigrated file %llx:%llx\n",
+			       timestring(), dmapi_event_string(msg->ev_type),
+			       (unsigned long long)h.device, (unsigned long long)h.inode);
+		}
+		if (hsm_recall_finish(hanp, hlen, token, &h, false) != 0) {
+			retcode = EIO;
+			response = DM_RESP_ABORT;
+		}
 		goto done;
 	}
 
@@ -219,17 +1556,19 @@ static void hsm_handle_recall(dm_eventmsg_t *msg)
 	   migrate won't happen until the recall is completed by a
 	   restarted hacksmd */
 	h.state = HSM_STATE_RECALL;
-	ret = dm_set_dmattr(dmapi.sid, hanp, hlen, token, &attrname, 0, sizeof(h), (void*)&h);
+	ret = hsm_attr_set(dmapi.sid, hanp, hlen, token, &h);
 	if (ret != 0) {
 		printf("dm_set_dmattr failed - %s\n", strerror(errno));
 		retcode = EIO;
 		response = DM_RESP_ABORT;
 		goto done;
 	}
+	t = hsm_stats_phase(HSM_PHASE_ATTR_SET, t);
 
 	/* get the migrated data from the store, and put it in the
 	   file with invisible writes */
 	handle = hsm_store_open(store_ctx, h.device, h.inode, true);
+	t = hsm_stats_phase(HSM_PHASE_STORE_OPEN, t);
 	if (handle == NULL) {
 		printf("Failed to open store file for file 0x%llx:0x%llx - %s\n",
 		       (unsigned long long)h.device, (unsigned long long)h.inode,
@@ -239,259 +1578,1060 @@ static void hsm_handle_recall(dm_eventmsg_t *msg)
 		goto done;
 	}
 
-	if (options.debug > 1) {
-		printf("%s %s: Recalling file %llx:%llx of size %d\n", 
-		       timestring(),
-		       dmapi_event_string(msg->ev_type),
-		       (unsigned long long)h.device, (unsigned long long)h.inode,
-		       (int)h.size);
+	if (options.debug > 1) {
+		printf("%s %s: Recalling file %llx:%llx of size %d\n", 
+		       timestring(),
+		       dmapi_event_string(msg->ev_type),
+		       (unsigned long long)h.device, (unsigned long long)h.inode,
+		       (int)h.size);
+	}
+
+	if (options.recall_delay) {
+		sleep(random() % options.recall_delay);
+	}
+
+	/* a reader of one file in a directory is likely to want
+	   its siblings next */
+	if (options.prefetch_count != 0 && msg->ev_type == DM_EVENT_READ &&
+	    !hsm_get_dir_handle(hanp, hlen, token, dirhanp, &dirhlen)) {
+		dirhlen = 0;
+	}
+
+	if (options.chunk_size != 0 && h.chunk_shift == 0 && h.size != 0) {
+		h.chunk_shift = hsm_chunk_shift(h.size, options.chunk_size);
+	}
+
+	t = hsm_now_usec();
+	if (h.chunk_shift == 0) {
+		ret = hsm_recall_data(w, handle, hanp, hlen, token, 0, h.size);
+	} else if (options.chunk_size == 0) {
+		/* a previously partially recalled file, but partial
+		   recall is now disabled */
+		ret = hsm_recall_chunks(w, handle, hanp, hlen, token, &h, 0, 0);
+	} else {
+		ofs = ev->de_offset;
+		len = ev->de_length;
+		do {
+			ret = hsm_recall_chunks(w, handle, hanp, hlen, token, &h, ofs, len);
+		} while (ret == 0 && hsm_recall_next(recall, &ofs, &len));
+	}
+	if (ret == 0) {
+		ret = hsm_recall_sync(hanp, hlen, token);
+	}
+	t = hsm_stats_phase(HSM_PHASE_COPY, t);
+
+	if (ret == 0 && h.chunk_shift != 0 && !hsm_all_resident(&h)) {
+		/* record which chunks are now resident before we stop
+		   getting events for them */
+		h.state = HSM_STATE_MIGRATED;
+		ret = hsm_attr_set(dmapi.sid, hanp, hlen, token, &h);
+		t = hsm_stats_phase(HSM_PHASE_ATTR_SET, t);
+		if (ret != 0) {
+			printf("dm_set_dmattr failed - %s\n", strerror(errno));
+			hsm_store_close(handle);
+			retcode = EIO;
+			response = DM_RESP_ABORT;
+			goto done;
+		}
+		ret = hsm_set_chunk_regions(hanp, hlen, token, &h);
+		t = hsm_stats_phase(HSM_PHASE_REGION, t);
+		if (ret == 0) {
+			hsm_store_close(handle);
+			if (options.early_response) {
+				/* the reader can go ahead now, and the
+				   rest of the file follows in the
+				   background */
+				hsm_bg_queue(HSM_BG_COMPLETE, hanp, hlen, NULL, 0,
+					     (ev->de_offset + ev->de_length) >> h.chunk_shift);
+			}
+			goto done;
+		}
+		/* some filesystems can't manage more than one region */
+		printf("Failed to set chunk regions (%s) - recalling whole file\n",
+		       strerror(errno));
+		ret = hsm_recall_chunks(w, handle, hanp, hlen, token, &h, 0, 0);
+		if (ret == 0) {
+			ret = hsm_recall_sync(hanp, hlen, token);
+		}
+		hsm_stats_phase(HSM_PHASE_COPY, t);
+	}
+	hsm_store_close(handle);
+
+	if (ret != 0) {
+		retcode = EIO;
+		response = DM_RESP_ABORT;
+		goto done;
+	}
+
+	if (hsm_recall_finish(hanp, hlen, token, &h, true) != 0) {
+		retcode = EIO;
+		response = DM_RESP_ABORT;
+		goto done;
+	}
+
+done:
+	/* tell the kernel that the event has been handled */
+	t = hsm_now_usec();
+	ret = dm_respond_event(dmapi.sid, msg->ev_token, 
+			       response, retcode, 0, NULL);
+	if (ret != 0) {
+		printf("Failed to respond to read event\n");
+		exit(1);
+	}
+	hsm_stats_phase(HSM_PHASE_RESPOND, t);
+	hsm_stats_phase(HSM_PHASE_RECALL, start);
+
+	/* and answer any events that arrived while we were recalling */
+	hsm_recall_end(recall, response, retcode);
+
+	if (dirhlen != 0 && response == DM_RESP_CONTINUE) {
+		hsm_bg_queue(HSM_BG_SCAN_DIR, hanp, hlen, dirhanp, dirhlen, 0);
+	}
+}
+
+
+/*
+  called on a DM_EVENT_DESTROY event, when a file is being deleted
+ */
+static void hsm_handle_destroy(dm_eventmsg_t *msg)
+{
+	dm_destroy_event_t *ev;
+	void *hanp;
+	size_t hlen;
+	int ret;
+	dm_attrname_t attrname;
+	dm_token_t token = msg->ev_token;
+	struct hsm_attr h;
+	dm_right_t right;
+	dm_response_t response = DM_RESP_CONTINUE;
+	int retcode = 0;
+	dm_boolean_t exactFlag;
+	uint64_t start = hsm_now_usec(), t = start;
+
+        ev = DM_GET_VALUE(msg, ev_data, dm_destroy_event_t *);
+        hanp = DM_GET_VALUE(ev, ds_handle, void *);
+        hlen = DM_GET_LEN(ev, ds_handle);
+
+	if (DM_TOKEN_EQ(token, DM_INVALID_TOKEN)) {
+		goto done;
+	}
+
+	/* make sure we have an exclusive lock on the file */
+	ret = dm_query_right(dmapi.sid, hanp, hlen, token, &right);
+	if (ret != 0 && errno != ENOENT) {
+		printf("dm_query_right failed - %s\n", strerror(errno));
+		retcode = EIO;
+		response = DM_RESP_ABORT;
+		goto done;
+	}
+
+	if (right != DM_RIGHT_EXCL || errno == ENOENT) {
+		ret = dm_request_right(dmapi.sid, hanp, hlen, token, DM_RR_WAIT, DM_RIGHT_EXCL);
+		if (ret != 0) {
+			printf("dm_request_right failed - %s\n", strerror(errno));
+			retcode = EIO;
+			response = DM_RESP_ABORT;
+			goto done;
+		}
+	}
+
+	t = hsm_stats_phase(HSM_PHASE_RIGHT, t);
+
+        memset(attrname.an_chars, 0, DM_ATTR_NAME_SIZE);
+        strncpy((char*)attrname.an_chars, HSM_ATTRNAME, DM_ATTR_NAME_SIZE);
+
+	/* get the attribute and check it is valid. This is just
+	   paranoia really, as the file is going away */
+	ret = hsm_attr_get(dmapi.sid, hanp, hlen, token, &h);
+	t = hsm_stats_phase(HSM_PHASE_ATTR_GET, t);
+	if (ret != 0 && errno == EINVAL) {
+		retcode = EIO;
+		response = DM_RESP_ABORT;
+		goto done;
+	}
+	if (ret != 0) {
+		printf("WARNING: dm_get_dmattr failed - %s\n", strerror(errno));
+		goto done;
+	}
+
+	if (options.debug > 1) {
+		printf("%s: Destroying file %llx:%llx of size %d\n", 
+		       dmapi_event_string(msg->ev_type),
+		       (unsigned long long)h.device, (unsigned long long)h.inode,
+		       (int)h.size);
+	}
+
+	/* remove the store file */
+	t = hsm_now_usec();
+	ret = hsm_reap_queue(h.device, h.inode, h.store_time);
+	if (ret == -1) {
+		printf("WARNING: Failed to unlink store file for file 0x%llx:0x%llx\n",
+		       (unsigned long long)h.device, (unsigned long long)h.inode);
+	}
+	t = hsm_stats_phase(HSM_PHASE_STORE_REMOVE, t);
+
+	/* remove the attribute */
+	ret = dm_remove_dmattr(dmapi.sid, hanp, hlen, token, 0, &attrname);
+	t = hsm_stats_phase(HSM_PHASE_ATTR_SET, t);
+	if (ret != 0) {
+		printf("dm_remove_dmattr failed - %s\n", strerror(errno));
+		retcode = EIO;
+		response = DM_RESP_ABORT;
+		goto done;
+	}
+
+	/* and clear the managed region */
+	ret = dm_set_region(dmapi.sid, hanp, hlen, token, 0, NULL, &exactFlag);
+	if (ret == -1) {
+		printf("WARNING: failed dm_set_region - %s\n", strerror(errno));
+	}
+	hsm_stats_phase(HSM_PHASE_REGION, t);
+
+done:
+	/* only respond if the token is real */
+	if (!DM_TOKEN_EQ(msg->ev_token,DM_NO_TOKEN) &&
+	    !DM_TOKEN_EQ(msg->ev_token, DM_INVALID_TOKEN)) {
+		t = hsm_now_usec();
+		ret = dm_respond_event(dmapi.sid, msg->ev_token, 
+				       response, retcode, 0, NULL);
+		if (ret != 0) {
+			printf("Failed to respond to destroy event\n");
+			exit(1);
+		}
+		hsm_stats_phase(HSM_PHASE_RESPOND, t);
+	}
+	hsm_stats_phase(HSM_PHASE_DESTROY, start);
+}
+
+/*
+  main switch for DMAPI messages
+ */
+static void hsm_handle_message(dm_eventmsg_t *msg, struct hsm_worker *w)
+{
+	__atomic_fetch_add(&stats.events, 1, __ATOMIC_RELAXED);
+
+	switch (msg->ev_type) {
+	case DM_EVENT_MOUNT:
+		hsm_handle_mount(msg);
+		break;
+	case DM_EVENT_READ:
+	case DM_EVENT_WRITE:
+	case DM_EVENT_TRUNCATE:
+		hsm_handle_recall(msg, w);
+		break;
+	case DM_EVENT_DESTROY:
+		hsm_handle_destroy(msg);
+		break;
+	default:
+		if (!DM_TOKEN_EQ(msg->ev_token,DM_NO_TOKEN) &&
+		    !DM_TOKEN_EQ(msg->ev_token, DM_INVALID_TOKEN)) {
+			printf("Giving default response\n");
+			int ret = dm_respond_event(dmapi.sid, msg->ev_token, 
+					       DM_RESP_CONTINUE, 0, 0, NULL);
+			if (ret != 0) {
+				printf("Failed to respond to mount event\n");
+				exit(1);
+			}
+		}
+		break;
+	}
+}
+
+/*
+  setup a worker, allocating its recall buffer
+ */
+static void hsm_worker_init(struct hsm_worker *w, unsigned id)
+{
+	void *p;
+
+	w->id = id;
+	/* aligned and a whole number of direct I/O buffers, so that
+	   with io=direct the store reads straight into it */
+	w->bufsize = hsm_store_io_size(store_ctx, options.xfer_size);
+	w->depth = options.recall_depth;
+	if (posix_memalign(&p, HSM_STORE_IO_ALIGN, w->bufsize * w->depth) != 0) {
+		p = NULL;
+	}
+	w->buf = p;
+	if (w->buf == NULL) {
+		printf("No memory for worker recall buffer\n");
+		exit(1);
+	}
+	w->queue = hsm_store_queue_init(store_ctx, w->depth);
+	if (w->queue == NULL) {
+		printf("Unable to set up store queue - %s\n", hsm_store_errmsg(store_ctx));
+		exit(1);
+	}
+}
+
+/*
+  free a worker's store queue and recall buffer. The worker must be
+  idle
+ */
+static void hsm_worker_free(struct hsm_worker *w)
+{
+	if (w->queue != NULL) {
+		hsm_store_queue_free(w->queue);
+		w->queue = NULL;
+	}
+	free(w->buf);
+	w->buf = NULL;
+}
+
+/*
+  choose the next job for a worker and take it off the queue. Must be
+  called with the pool locked.
+
+  Without -W jobs are taken in the order they arrived. With -W, events
+  other than recalls go first, then recalls are served in a sweep
+  through the store (an elevator), continuing from the position of
+  the last recall and wrapping at the end. A recall that has waited
+  longer than the -W limit is taken first, so a sweep can't starve it
+ */
+static struct hsm_job *hsm_pool_next_job(void)
+{
+	struct hsm_job *job, *prev, *best = NULL, *best_prev = NULL;
+	struct hsm_job *lowest = NULL, *lowest_prev = NULL;
+
+	if (options.max_wait_ms == 0 || !pool.head->is_recall ||
+	    hsm_now_usec() - pool.head->queue_time > options.max_wait_ms * 1000ULL) {
+		best = pool.head;
+	} else {
+		for (prev=NULL, job=pool.head; job; prev=job, job=job->next) {
+			if (!job->is_recall) {
+				best = job;
+				best_prev = prev;
+				break;
+			}
+			if (lowest == NULL || job->position < lowest->position) {
+				lowest = job;
+				lowest_prev = prev;
+			}
+			if (job->position >= pool.sweep_position &&
+			    (best == NULL || job->position < best->position)) {
+				best = job;
+				best_prev = prev;
+			}
+		}
+		if (best == NULL) {
+			/* wrap around to the start of the store */
+			best = lowest;
+			best_prev = lowest_prev;
+		}
+	}
+
+	if (best_prev) {
+		best_prev->next = best->next;
+	} else {
+		pool.head = best->next;
+	}
+	if (pool.tail == best) {
+		pool.tail = best_prev;
+	}
+	pool.num_queued--;
+
+	if (best->is_recall) {
+		pool.sweep_position = best->position;
+	}
+
+	return best;
+}
+
+/*
+  main loop for a worker thread: take jobs off the queue and handle
+  them, returning the job to the free list when done
+ */
+static void *hsm_worker_main(void *private)
+{
+	struct hsm_worker *w = (struct hsm_worker *)private;
+
+	srandom(w->id ^ getpid() ^ time(NULL));
+
+	pthread_mutex_lock(&pool.mutex);
+	while (1) {
+		struct hsm_job *job;
+
+		while (pool.head == NULL) {
+			pthread_cond_wait(&pool.work_cond, &pool.mutex);
+		}
+		job = hsm_pool_next_job();
+		pool.num_busy++;
+		pthread_mutex_unlock(&pool.mutex);
+
+		hsm_stats_phase(HSM_PHASE_QUEUE, job->queue_time);
+		hsm_handle_message(job->msg, w);
+
+		pthread_mutex_lock(&pool.mutex);
+		pool.num_busy--;
+		job->next = pool.free_list;
+		pool.free_list = job;
+		pthread_cond_broadcast(&pool.free_cond);
+	}
+	return NULL;
+}
+
+/*
+  start the worker pool
+ */
+static void hsm_pool_start(unsigned num_workers)
+{
+	unsigned i, num_jobs = num_workers * HSM_JOBS_PER_WORKER;
+
+	for (i=0;i<num_jobs;i++) {
+		struct hsm_job *job = calloc(1, sizeof(struct hsm_job));
+		if (job == NULL || (job->msg = malloc(HSM_JOB_MSGSIZE)) == NULL) {
+			printf("No memory for event pool\n");
+			exit(1);
+		}
+		job->alloc = HSM_JOB_MSGSIZE;
+		job->next = pool.free_list;
+		pool.free_list = job;
+	}
+
+	pool.workers = calloc(num_workers, sizeof(struct hsm_worker));
+	if (pool.workers == NULL) {
+		printf("No memory for %u workers\n", num_workers);
+		exit(1);
+	}
+
+	for (i=0;i<num_workers;i++) {
+		hsm_worker_init(&pool.workers[i], i+1);
+		if (pthread_create(&pool.workers[i].thread, NULL,
+				   hsm_worker_main, &pool.workers[i]) != 0) {
+			printf("Failed to start worker thread %u\n", i);
+			exit(1);
+		}
+		pool.num_workers++;
+	}
+
+	printf("Started %u worker threads\n", pool.num_workers);
+}
+
+/*
+  copy a message into a pooled job and queue it for the workers. If
+  all pooled jobs are in use then wait for one to be freed
+ */
+static void hsm_pool_queue(dm_eventmsg_t *msg, size_t len)
+{
+	struct hsm_job *job;
+
+	pthread_mutex_lock(&pool.mutex);
+	while (pool.free_list == NULL) {
+		pthread_cond_wait(&pool.free_cond, &pool.mutex);
+	}
+	job = pool.free_list;
+	pool.free_list = job->next;
+	pthread_mutex_unlock(&pool.mutex);
+
+	if (len > job->alloc) {
+		dm_eventmsg_t *m = realloc(job->msg, len);
+		if (m == NULL) {
+			printf("No memory for event of size %u\n", (unsigned)len);
+			exit(1);
+		}
+		job->msg = m;
+		job->alloc = len;
+	}
+	memcpy(job->msg, msg, len);
+	/* this is now the only message in its buffer */
+	job->msg->_link = 0;
+
+	job->is_recall = false;
+	job->queue_time = hsm_now_usec();
+	if (options.max_wait_ms != 0 &&
+	    (msg->ev_type == DM_EVENT_READ || msg->ev_type == DM_EVENT_WRITE)) {
+		dm_data_event_t *ev = DM_GET_VALUE(msg, ev_data, dm_data_event_t *);
+		struct hsm_attr h;
+
+		/* find where the data is in the store. No token
+		   is needed just to look at the attribute */
+		if (hsm_attr_get(dmapi.sid, DM_GET_VALUE(ev, de_handle, void *),
+				 DM_GET_LEN(ev, de_handle), DM_NO_TOKEN, &h) == 0) {
+			job->is_recall = true;
+			job->position = hsm_store_position(store_ctx, h.device, h.inode);
+		}
+	}
+
+	pthread_mutex_lock(&pool.mutex);
+	job->next = NULL;
+	if (pool.tail) {
+		pool.tail->next = job;
+	} else {
+		pool.head = job;
+	}
+	pool.tail = job;
+	pool.num_queued++;
+	if (pool.num_queued > pool.max_queued) {
+		pool.max_queued = pool.num_queued;
+	}
+	pthread_cond_signal(&pool.work_cond);
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+/*
+  wait until no events are queued for the workers. Background work
+  only runs when the workers have nothing waiting, so it never holds
+  up events
+ */
+static void hsm_bg_yield(void)
+{
+	pthread_mutex_lock(&pool.mutex);
+	while (pool.head != NULL) {
+		pthread_cond_wait(&pool.free_cond, &pool.mutex);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+/*
+  recall the rest of a partially recalled file in the background. We
+  hold our own token from a user event, and only hold the exclusive
+  right on the file while copying one batch of chunks, so events on
+  the file from readers are not held up for long
+ */
+static void hsm_bg_recall(struct hsm_worker *w, struct hsm_bg_job *job)
+{
+	void *hanp = job->hanp;
+	size_t hlen = job->hlen;
+	dm_token_t token;
+	struct hsm_attr h;
+	unsigned next = job->start_chunk;
+	int ret;
+
+	ret = dm_create_userevent(dmapi.sid, 0, NULL, &token);
+	if (ret != 0) {
+		printf("dm_create_userevent failed - %s\n", strerror(errno));
+		return;
+	}
+
+	while (!bg.stopping) {
+		struct hsm_store_handle *handle;
+		unsigned i, nchunks;
+		uint64_t copied = 0;
+
+		hsm_bg_yield();
+
+		ret = dm_request_right(dmapi.sid, hanp, hlen, token, DM_RR_WAIT, DM_RIGHT_EXCL);
+		if (ret != 0) {
+			printf("dm_request_right failed - %s\n", strerror(errno));
+			break;
+		}
+
+		/* a data event may have recalled the file while we
+		   didn't hold the right */
+		if (hsm_attr_get(dmapi.sid, hanp, hlen, token, &h) != 0 ||
+		    h.state != HSM_STATE_MIGRATED || h.size == 0) {
+			break;
+		}
+
+		/* a prefetched file is recalled in chunks like any
+		   other background recall */
+		if (h.chunk_shift == 0) {
+			h.chunk_shift = hsm_chunk_shift(h.size, options.chunk_size ?
+							options.chunk_size : HSM_DEFAULT_CHUNK_SIZE);
+		}
+
+		handle = hsm_store_open(store_ctx, h.device, h.inode, true);
+		if (handle == NULL) {
+			printf("Failed to open store file for file 0x%llx:0x%llx - %s\n",
+			       (unsigned long long)h.device, (unsigned long long)h.inode,
+			       strerror(errno));
+			break;
+		}
+
+		h.state = HSM_STATE_RECALL;
+		ret = hsm_attr_set(dmapi.sid, hanp, hlen, token, &h);
+
+		/* copy the next batch of chunks, going round from
+		   where the reader was last seen */
+		nchunks = hsm_num_chunks(&h);
+		for (i=0; ret == 0 && i<nchunks && copied < HSM_BG_BATCH_SIZE; i++) {
+			unsigned c = (next + i) % nchunks;
+			if (hsm_chunk_resident(&h, c)) {
+				continue;
+			}
+			ret = hsm_recall_chunks(w, handle, hanp, hlen, token, &h,
+						(uint64_t)c << h.chunk_shift, 1);
+			copied += 1ULL << h.chunk_shift;
+		}
+		next = (next + i) % nchunks;
+		hsm_store_close(handle);
+		if (ret == 0) {
+			ret = hsm_recall_sync(hanp, hlen, token);
+		}
+
+		if (ret != 0) {
+			printf("Background recall failed for file 0x%llx:0x%llx\n",
+			       (unsigned long long)h.device, (unsigned long long)h.inode);
+			break;
+		}
+
+		if (hsm_all_resident(&h)) {
+			hsm_recall_finish(hanp, hlen, token, &h, true);
+			if (options.debug > 1) {
+				printf("%s Background recall of %llx:%llx complete\n",
+				       timestring(),
+				       (unsigned long long)h.device, (unsigned long long)h.inode);
+			}
+			break;
+		}
+
+		h.state = HSM_STATE_MIGRATED;
+		if (hsm_attr_set(dmapi.sid, hanp, hlen, token, &h) != 0) {
+			printf("dm_set_dmattr failed - %s\n", strerror(errno));
+			break;
+		}
+		/* if this fails the regions stay wider than needed,
+		   which only costs extra events */
+		hsm_set_chunk_regions(hanp, hlen, token, &h);
+
+		dm_release_right(dmapi.sid, hanp, hlen, token);
+	}
+
+	/* this also drops any right we still hold */
+	ret = dm_respond_event(dmapi.sid, token, DM_RESP_CONTINUE, 0, 0, NULL);
+	if (ret != 0) {
+		printf("Failed to respond to background user event\n");
+		exit(1);
+	}
+}
+
+/*
+  a directory entry that might be prefetched
+ */
+struct hsm_prefetch_ent {
+	char *name;
+	void *hanp;
+	size_t hlen;
+};
+
+static int hsm_prefetch_ent_cmp(const void *p1, const void *p2)
+{
+	const struct hsm_prefetch_ent *e1 = p1, *e2 = p2;
+	return strcmp(e1->name, e2->name);
+}
+
+/*
+  note a recall of the named file in a directory, returning true if
+  the directory looks like it is being read in name order
+ */
+static bool hsm_dir_sequential(void *dirhanp, size_t dirhlen, const char *name)
+{
+	unsigned hash = hsm_handle_hash(dirhanp, dirhlen);
+	struct hsm_dir_history *d = &bg.dirs[hash % HSM_DIR_HISTORY_SIZE];
+
+	if (d->last_name == NULL || d->hash != hash) {
+		d->run = 0;
+	} else if (strcmp(name, d->last_name) > 0) {
+		d->run++;
+	} else {
+		d->run = 0;
+	}
+	d->hash = hash;
+	free(d->last_name);
+	d->last_name = strdup(name);
+
+	return d->run >= 2;
+}
+
+/*
+  look through the directory of a recalled file and queue background
+  recalls of its migrated siblings, within the -p limits on count,
+  bytes and age. If the directory is being read in name order then
+  the files following the recalled one are chosen, otherwise any
+  siblings are taken in directory order
+ */
+static void hsm_prefetch_scan(struct hsm_bg_job *job)
+{
+	struct hsm_prefetch_ent *ents = NULL;
+	unsigned i, n = 0, alloc = 0, count = 0;
+	uint64_t bytes = 0;
+	char *trigger = NULL;
+	size_t buflen = 0x10000, rlen;
+	dm_attrloc_t loc;
+	char *buf;
+	int ret;
+
+	if (dm_init_attrloc(dmapi.sid, job->dirhanp, job->dirhlen, DM_NO_TOKEN, &loc) != 0) {
+		return;
 	}
 
-	if (options.recall_delay) {
-		sleep(random() % options.recall_delay);
+	buf = malloc(buflen);
+	if (buf == NULL) {
+		return;
 	}
 
-	ofs = 0;
-	while ((ret = hsm_store_read(handle, buf, sizeof(buf))) > 0) {
-		int ret2 = dm_write_invis(dmapi.sid, hanp, hlen, token, DM_WRITE_SYNC, ofs, ret, buf);
-		if (ret2 != ret) {
-			printf("dm_write_invis failed - %s\n", strerror(errno));
-			retcode = EIO;
-			response = DM_RESP_ABORT;
-			hsm_store_close(handle);
-			goto done;
+	do {
+		dm_stat_t *st;
+
+		ret = dm_get_dirattrs(dmapi.sid, job->dirhanp, job->dirhlen, DM_NO_TOKEN,
+				      DM_AT_HANDLE|DM_AT_STAT, &loc, buflen, buf, &rlen);
+		if (ret == -1 || rlen == 0) {
+			break;
 		}
-		ofs += ret;
-	}
-	hsm_store_close(handle);
+		for (st=(dm_stat_t *)buf; st; st=DM_STEP_TO_NEXT(st, dm_stat_t *)) {
+			char *name = DM_GET_VALUE(st, dt_compname, char *);
+			size_t namelen = DM_GET_LEN(st, dt_compname);
+			void *hanp = DM_GET_VALUE(st, dt_handle, void *);
+			size_t hlen = DM_GET_LEN(st, dt_handle);
 
-	/* remove the attribute from the file - it is now fully recalled */
-	ret = dm_remove_dmattr(dmapi.sid, hanp, hlen, token, 0, &attrname);
-	if (ret != 0) {
-		printf("dm_remove_dmattr failed - %s\n", strerror(errno));
-		retcode = EIO;
-		response = DM_RESP_ABORT;
-		goto done;
+			if (!S_ISREG(st->dt_mode)) {
+				continue;
+			}
+			if (dm_handle_cmp(hanp, hlen, job->hanp, job->hlen) == 0) {
+				trigger = strndup(name, namelen);
+				continue;
+			}
+			if (n == HSM_PREFETCH_SCAN_MAX) {
+				continue;
+			}
+			if (n == alloc) {
+				unsigned newalloc = alloc ? alloc * 2 : 64;
+				struct hsm_prefetch_ent *e;
+				e = realloc(ents, newalloc * sizeof(*e));
+				if (e == NULL) {
+					/* give up on prefetching this time */
+					free(buf);
+					goto done;
+				}
+				ents = e;
+				alloc = newalloc;
+			}
+			ents[n].name = strndup(name, namelen);
+			ents[n].hanp = malloc(hlen);
+			ents[n].hlen = hlen;
+			if (ents[n].name == NULL || ents[n].hanp == NULL) {
+				free(ents[n].name);
+				free(ents[n].hanp);
+				continue;
+			}
+			memcpy(ents[n].hanp, hanp, hlen);
+			n++;
+		}
+	} while (ret == 1);
+
+	free(buf);
+
+	i = 0;
+	if (trigger != NULL && hsm_dir_sequential(job->dirhanp, job->dirhlen, trigger)) {
+		/* only look at the names after the one just read */
+		qsort(ents, n, sizeof(ents[0]), hsm_prefetch_ent_cmp);
+		while (i < n && strcmp(ents[i].name, trigger) <= 0) {
+			i++;
+		}
 	}
 
-	/* remove the store file */
-	ret = hsm_store_remove(store_ctx, h.device, h.inode);
-	if (ret != 0) {
-		printf("WARNING: Failed to unlink store file\n");
+	for (; i<n && count < options.prefetch_count; i++) {
+		struct hsm_attr h;
+
+		if (hsm_attr_get(dmapi.sid, ents[i].hanp, ents[i].hlen, DM_NO_TOKEN, &h) != 0 ||
+		    h.state != HSM_STATE_MIGRATED) {
+			continue;
+		}
+		if (options.prefetch_age != 0 &&
+		    time(NULL) - h.migrate_time > options.prefetch_age) {
+			continue;
+		}
+		if (bytes + h.size > options.prefetch_bytes) {
+			continue;
+		}
+		bytes += h.size;
+		count++;
+		hsm_bg_queue(HSM_BG_PREFETCH, ents[i].hanp, ents[i].hlen, NULL, 0, 0);
 	}
 
-	/* remove the managed region from the file */
-	ret = dm_set_region(dmapi.sid, hanp, hlen, token, 0, NULL, &exactFlag);
-	if (ret == -1) {
-		printf("failed dm_set_region - %s\n", strerror(errno));
-		retcode = EIO;
-		response = DM_RESP_ABORT;
-		goto done;
+	if (count != 0 && options.debug > 1) {
+		printf("%s Prefetching %u files of %llu bytes after recall of '%s'\n",
+		       timestring(), count, (unsigned long long)bytes,
+		       trigger ? trigger : "");
 	}
 
 done:
-	/* tell the kernel that the event has been handled */
-	ret = dm_respond_event(dmapi.sid, msg->ev_token, 
-			       response, retcode, 0, NULL);
-	if (ret != 0) {
-		printf("Failed to respond to read event\n");
-		exit(1);
+	for (i=0;i<n;i++) {
+		free(ents[i].name);
+		free(ents[i].hanp);
 	}
+	free(ents);
+	free(trigger);
 }
 
-
 /*
-  called on a DM_EVENT_DESTROY event, when a file is being deleted
+  take the next background job off the queue, preferring to complete
+  recalls that have a reader. Must be called with bg locked
  */
-static void hsm_handle_destroy(dm_eventmsg_t *msg)
+static struct hsm_bg_job *hsm_bg_next_job(void)
 {
-	dm_destroy_event_t *ev;
-	void *hanp;
-	size_t hlen, rlen;
-	int ret;
-	dm_attrname_t attrname;
-	dm_token_t token = msg->ev_token;
-	struct hsm_attr h;
-	dm_right_t right;
-	dm_response_t response = DM_RESP_CONTINUE;
-	int retcode = 0;
-	dm_boolean_t exactFlag;
+	struct hsm_bg_job *job, *prev = NULL;
 
-        ev = DM_GET_VALUE(msg, ev_data, dm_destroy_event_t *);
-        hanp = DM_GET_VALUE(ev, ds_handle, void *);
-        hlen = DM_GET_LEN(ev, ds_handle);
-
-	if (DM_TOKEN_EQ(token, DM_INVALID_TOKEN)) {
-		goto done;
+	for (job=bg.head; job; prev=job, job=job->next) {
+		if (job->type == HSM_BG_COMPLETE) {
+			break;
+		}
+	}
+	if (job == NULL) {
+		job = bg.head;
+		prev = NULL;
 	}
 
-	/* make sure we have an exclusive lock on the file */
-	ret = dm_query_right(dmapi.sid, hanp, hlen, token, &right);
-	if (ret != 0 && errno != ENOENT) {
-		printf("dm_query_right failed - %s\n", strerror(errno));
-		retcode = EIO;
-		response = DM_RESP_ABORT;
-		goto done;
+	if (prev) {
+		prev->next = job->next;
+	} else {
+		bg.head = job->next;
 	}
+	if (bg.tail == job) {
+		bg.tail = prev;
+	}
+	bg.num_queued--;
+	return job;
+}
 
-	if (right != DM_RIGHT_EXCL || errno == ENOENT) {
-		ret = dm_request_right(dmapi.sid, hanp, hlen, token, DM_RR_WAIT, DM_RIGHT_EXCL);
-		if (ret != 0) {
-			printf("dm_request_right failed - %s\n", strerror(errno));
-			retcode = EIO;
-			response = DM_RESP_ABORT;
-			goto done;
+/*
+  main loop for the background recall thread
+ */
+static void *hsm_bg_main(void *private)
+{
+	struct hsm_worker *w = (struct hsm_worker *)private;
+
+	pthread_mutex_lock(&bg.mutex);
+	while (1) {
+		struct hsm_bg_job *job;
+
+		while (bg.head == NULL || bg.stopping) {
+			pthread_cond_wait(&bg.work_cond, &bg.mutex);
 		}
-	}
+		job = hsm_bg_next_job();
+		bg.num_busy++;
+		pthread_mutex_unlock(&bg.mutex);
 
-        memset(attrname.an_chars, 0, DM_ATTR_NAME_SIZE);
-        strncpy((char*)attrname.an_chars, HSM_ATTRNAME, DM_ATTR_NAME_SIZE);
+		if (job->type == HSM_BG_SCAN_DIR) {
+			hsm_prefetch_scan(job);
+		} else {
+			hsm_bg_recall(w, job);
+		}
+		free(job);
 
-	/* get the attribute and check it is valid. This is just
-	   paranoia really, as the file is going away */
-	ret = dm_get_dmattr(dmapi.sid, hanp, hlen, token, &attrname, 
-			    sizeof(h), &h, &rlen);
-	if (ret != 0) {
-		printf("WARNING: dm_get_dmattr failed - %s\n", strerror(errno));
-		goto done;
+		pthread_mutex_lock(&bg.mutex);
+		bg.num_busy--;
+		pthread_cond_broadcast(&bg.idle_cond);
 	}
+	return NULL;
+}
 
-	if (rlen != sizeof(h)) {
-		printf("hsm_handle_read - bad attribute size %d\n", (int)rlen);
-		retcode = EIO;
-		response = DM_RESP_ABORT;
-		goto done;
+/*
+  start the background recall thread
+ */
+static void hsm_bg_start(void)
+{
+	hsm_worker_init(&bg.worker, 0);
+	if (pthread_create(&bg.worker.thread, NULL, hsm_bg_main, &bg.worker) != 0) {
+		printf("Failed to start background thread\n");
+		exit(1);
 	}
+}
 
-	if (strncmp(h.magic, HSM_MAGIC, sizeof(h.magic)) != 0) {
-		printf("Bad magic '%*.*s'\n", (int)sizeof(h.magic), (int)sizeof(h.magic), h.magic);
-		retcode = EIO;
-		response = DM_RESP_ABORT;
-		goto done;
+/*
+  wait for all queued events to be handled. Used before restarting
+  the DMAPI session, as the workers use the session and store. A
+  background recall in progress is stopped at the end of its current
+  batch, and queued ones are kept until hsm_pool_resume()
+ */
+static void hsm_pool_wait_idle(void)
+{
+	pthread_mutex_lock(&pool.mutex);
+	while (pool.head != NULL || pool.num_busy != 0) {
+		pthread_cond_wait(&pool.free_cond, &pool.mutex);
 	}
+	pthread_mutex_unlock(&pool.mutex);
 
-	if (options.debug > 1) {
-		printf("%s: Destroying file %llx:%llx of size %d\n", 
-		       dmapi_event_string(msg->ev_type),
-		       (unsigned long long)h.device, (unsigned long long)h.inode,
-		       (int)h.size);
+	pthread_mutex_lock(&bg.mutex);
+	bg.stopping = true;
+	while (bg.num_busy != 0) {
+		pthread_cond_wait(&bg.idle_cond, &bg.mutex);
 	}
+	pthread_mutex_unlock(&bg.mutex);
 
-	/* remove the store file */
-	ret = hsm_store_remove(store_ctx, h.device, h.inode);
-	if (ret == -1) {
-		printf("WARNING: Failed to unlink store file for file 0x%llx:0x%llx\n",
-		       (unsigned long long)h.device, (unsigned long long)h.inode);
+	pthread_mutex_lock(&reap.mutex);
+	reap.stopping = true;
+	while (reap.busy) {
+		pthread_cond_wait(&reap.idle_cond, &reap.mutex);
 	}
+	pthread_mutex_unlock(&reap.mutex);
+}
 
-	/* remove the attribute */
-	ret = dm_remove_dmattr(dmapi.sid, hanp, hlen, token, 0, &attrname);
-	if (ret != 0) {
-		printf("dm_remove_dmattr failed - %s\n", strerror(errno));
-		retcode = EIO;
-		response = DM_RESP_ABORT;
-		goto done;
-	}
+/*
+  set up the store again, after hsm_pool_wait_idle(). The store
+  queues of the workers belong to the old store, and the size of
+  their buffers depends on its options, so they are set up again
+  along with it
+ */
+static void hsm_restart(void)
+{
+	bool have_bg = (bg.worker.buf != NULL);
+	unsigned i;
 
-	/* and clear the managed region */
-	ret = dm_set_region(dmapi.sid, hanp, hlen, token, 0, NULL, &exactFlag);
-	if (ret == -1) {
-		printf("WARNING: failed dm_set_region - %s\n", strerror(errno));
+	for (i=0;i<pool.num_workers;i++) {
+		hsm_worker_free(&pool.workers[i]);
+	}
+	if (have_bg) {
+		hsm_worker_free(&bg.worker);
 	}
+	hsm_worker_free(&main_worker);
 
-done:
-	/* only respond if the token is real */
-	if (!DM_TOKEN_EQ(msg->ev_token,DM_NO_TOKEN) &&
-	    !DM_TOKEN_EQ(msg->ev_token, DM_INVALID_TOKEN)) {
-		ret = dm_respond_event(dmapi.sid, msg->ev_token, 
-				       response, retcode, 0, NULL);
-		if (ret != 0) {
-			printf("Failed to respond to destroy event\n");
-			exit(1);
-		}
+	hsm_init();
+
+	for (i=0;i<pool.num_workers;i++) {
+		hsm_worker_init(&pool.workers[i], pool.workers[i].id);
 	}
+	if (have_bg) {
+		hsm_worker_init(&bg.worker, 0);
+	}
+	hsm_worker_init(&main_worker, 0);
 }
 
 /*
-  main switch for DMAPI messages
+  let background recalls run again after hsm_pool_wait_idle()
  */
-static void hsm_handle_message(dm_eventmsg_t *msg)
+static void hsm_pool_resume(void)
 {
-	switch (msg->ev_type) {
-	case DM_EVENT_MOUNT:
-		hsm_handle_mount(msg);
-		break;
-	case DM_EVENT_READ:
-	case DM_EVENT_WRITE:
-		hsm_handle_recall(msg);
-		break;
-	case DM_EVENT_DESTROY:
-		hsm_handle_destroy(msg);
-		break;
-	default:
-		if (!DM_TOKEN_EQ(msg->ev_token,DM_NO_TOKEN) &&
-		    !DM_TOKEN_EQ(msg->ev_token, DM_INVALID_TOKEN)) {
-			printf("Giving default response\n");
-			int ret = dm_respond_event(dmapi.sid, msg->ev_token, 
-					       DM_RESP_CONTINUE, 0, 0, NULL);
-			if (ret != 0) {
-				printf("Failed to respond to mount event\n");
-				exit(1);
+	pthread_mutex_lock(&bg.mutex);
+	bg.stopping = false;
+	pthread_cond_broadcast(&bg.work_cond);
+	pthread_mutex_unlock(&bg.mutex);
+
+	pthread_mutex_lock(&reap.mutex);
+	reap.stopping = false;
+	pthread_cond_broadcast(&reap.work_cond);
+	pthread_mutex_unlock(&reap.mutex);
+}
+
+/*
+  hand out the messages from one dm_get_events() call
+ */
+static void hsm_dispatch_events(char *buf, size_t rlen)
+{
+	dm_eventmsg_t *msg;
+
+	/* loop over all the messages we received */
+	for (msg=(dm_eventmsg_t *)buf; 
+	     msg; 
+	     msg = DM_STEP_TO_NEXT(msg, dm_eventmsg_t *)) {
+		/* optionally fork on each message, thus
+		   giving parallelism and allowing us to delay
+		   recalls, simulating slow tape speeds */
+		if (options.use_fork) {
+			if (fork() != 0) continue;
+			srandom(getpid() ^ time(NULL));
+			/* the threads of the store queue stay in the
+			   parent */
+			main_worker.queue = hsm_store_queue_init(store_ctx, main_worker.depth);
+			if (main_worker.queue == NULL) {
+				printf("Unable to set up store queue - %s\n",
+				       hsm_store_errmsg(store_ctx));
+				_exit(1);
 			}
+			hsm_handle_message(msg, &main_worker);
+			_exit(0);
+		} else if (pool.num_workers != 0) {
+			size_t len = msg->_link ? msg->_link : (buf + rlen) - (char *)msg;
+			hsm_pool_queue(msg, len);
+		} else {
+			hsm_handle_message(msg, &main_worker);
 		}
-		break;
 	}
 }
 
 /*
-  wait for DMAPI events to come in and dispatch them
+  wait for DMAPI events to come in and dispatch them. 
+
+  Once we have some events we keep pulling more without waiting until
+  the kernel has no more queued, and only then go back to waiting. The
+  event buffer grows when the kernel tells us a message doesn't fit,
+  and when a backlog fills most of it.
+
+  With -N we poll instead of waiting. We poll again straight away
+  while events keep coming, then yield for a few polls, then back off
+  exponentially up to HSM_POLL_MAX_USEC between polls
  */
 static void hsm_wait_events(void)
 {
 	int ret;
-	char buf[0x10000];
+	char *buf;
+	size_t bufsize = HSM_EVENT_BUFSIZE;
 	size_t rlen;
+	unsigned idle_polls = 0;
+	unsigned backoff = HSM_POLL_MIN_USEC;
+	bool draining = false;
+
+	buf = malloc(bufsize);
+	if (buf == NULL) {
+		printf("No memory for event buffer\n");
+		exit(1);
+	}
 
 	printf("Waiting for events\n");
 	
 	while (1) {
-		dm_eventmsg_t *msg;
-		if (options.blocking_wait) {
-			ret = dm_get_events(dmapi.sid, 0, DM_EV_WAIT, sizeof(buf), buf, &rlen);
+		if (options.blocking_wait && !draining) {
+			ret = dm_get_events(dmapi.sid, 0, DM_EV_WAIT, bufsize, buf, &rlen);
 		} else {
 			/* optionally don't use DM_RR_WAIT to ensure
 			   that the daemon can be killed. This is only
 			   needed because GPFS uses an uninterruptible
 			   sleep for dm_get_events with DM_EV_WAIT. It
 			   should be an interruptible sleep */
-			msleep(10);
-			ret = dm_get_events(dmapi.sid, 0, 0, sizeof(buf), buf, &rlen);
+			ret = dm_get_events(dmapi.sid, 0, 0, bufsize, buf, &rlen);
 		}
 		if (ret < 0) {
-			if (errno == EAGAIN) continue;
+			if (errno == EAGAIN) {
+				draining = false;
+				if (options.blocking_wait) {
+					continue;
+				}
+				if (idle_polls++ < HSM_POLL_SPINS) {
+					sched_yield();
+					continue;
+				}
+				usleep(backoff);
+				backoff *= 2;
+				if (backoff > HSM_POLL_MAX_USEC) {
+					backoff = HSM_POLL_MAX_USEC;
+				}
+				continue;
+			}
+			if (errno == E2BIG && rlen > bufsize && rlen <= HSM_EVENT_BUFSIZE_MAX) {
+				char *buf2 = realloc(buf, rlen);
+				if (buf2 == NULL) {
+					printf("No memory for event buffer of size %u\n", (unsigned)rlen);
+					exit(1);
+				}
+				buf = buf2;
+				bufsize = rlen;
+				continue;
+			}
 			if (errno == ESTALE) {
 				printf("DMAPI service has shutdown - restarting\n");
-				hsm_init();
+				hsm_pool_wait_idle();
+				hsm_restart();
+				hsm_pool_resume();
+				draining = false;
 				continue;
 			}
 			printf("Failed to get event (%s)\n", strerror(errno));
 			exit(1);
 		}
 
-		/* loop over all the messages we received */
-		for (msg=(dm_eventmsg_t *)buf; 
-		     msg; 
-		     msg = DM_STEP_TO_NEXT(msg, dm_eventmsg_t *)) {
-			/* optionally fork on each message, thus
-			   giving parallelism and allowing us to delay
-			   recalls, simulating slow tape speeds */
-			if (options.use_fork) {
-				if (fork() != 0) continue;
-				srandom(getpid() ^ time(NULL));
-				hsm_handle_message(msg);
-				_exit(0);
-			} else {
-				hsm_handle_message(msg);
+		idle_polls = 0;
+		backoff = HSM_POLL_MIN_USEC;
+		draining = true;
+
+		hsm_dispatch_events(buf, rlen);
+
+		/* a backlog that nearly fills the buffer means we
+		   should take bigger bites */
+		if (rlen > bufsize - bufsize/4 && bufsize < HSM_EVENT_BUFSIZE_MAX) {
+			char *buf2 = realloc(buf, bufsize * 2);
+			if (buf2 != NULL) {
+				buf = buf2;
+				bufsize *= 2;
 			}
 		}
 	}
@@ -544,7 +2684,7 @@ static void hsm_cleanup_events(void)
 			} else {
 				unsigned saved_delay = options.recall_delay;
 				options.recall_delay = 0;
-				hsm_handle_message(msg);
+				hsm_handle_message(msg, &main_worker);
 				options.recall_delay = saved_delay;
 			}
 		}
@@ -564,6 +2704,18 @@ static void usage(void)
 	printf("\t\t -d level           choose debug level\n");
 	printf("\t\t -F                 fork to handle each event\n");
 	printf("\t\t -R delay           set a random delay on recall up to 'delay' seconds\n");
+	printf("\t\t -T threads         number of worker threads (0 to handle events inline)\n");
+	printf("\t\t -C size            recall files in chunks of at least this size\n");
+	printf("\t\t -E                 answer events early, recalling the rest in the background\n");
+	printf("\t\t -b size            size of each read from the store during recall\n");
+	printf("\t\t -q depth           number of store reads to keep in flight during recall\n");
+	printf("\t\t -W maxwait         order recalls by store position, delaying none more than maxwait ms\n");
+	printf("\t\t -p count[,bytes[,age]]  prefetch up to count siblings of a file recalled by a read\n");
+	printf("\t\t -S file[,secs]     write stats to file every secs seconds (default 10)\n");
+	printf("\t\t -J file            journal of pending store removals (default %s)\n",
+	       HSM_REAP_JOURNAL);
+	printf("\t\t -P                 keep the store copy of recalled files until they change\n");
+	printf("\t\t -O name=value      set a store option\n");
 	exit(0);
 }
 
@@ -574,7 +2726,7 @@ int main(int argc, char * const argv[])
 	bool cleanup = false;
 
 	/* parse command-line options */
-	while ((opt = getopt(argc, argv, "chNd:FR:")) != -1) {
+	while ((opt = getopt(argc, argv, "chNd:FR:T:C:Eb:q:W:p:S:J:PO:")) != -1) {
 		switch (opt) {
 		case 'c':
 			cleanup = true;
@@ -591,6 +2743,57 @@ int main(int argc, char * const argv[])
 		case 'F':
 			options.use_fork = true;
 			break;
+		case 'T':
+			options.num_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			options.chunk_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'E':
+			options.early_response = true;
+			break;
+		case 'b':
+			options.xfer_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			options.recall_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'W':
+			options.max_wait_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'p': {
+			char *p;
+			options.prefetch_count = strtoul(optarg, &p, 0);
+			if (*p == ',') {
+				options.prefetch_bytes = strtoull(p+1, &p, 0);
+			}
+			if (*p == ',') {
+				options.prefetch_age = strtoul(p+1, &p, 0);
+			}
+			break;
+		}
+		case 'S': {
+			char *p = strchr(optarg, ',');
+			if (p != NULL) {
+				*p = 0;
+				options.stats_interval = strtoul(p+1, NULL, 0);
+			}
+			options.stats_file = optarg;
+			break;
+		}
+		case 'J':
+			options.reap_journal = optarg;
+			break;
+		case 'P':
+			options.premigrate = true;
+			break;
+		case 'O':
+			if (options.num_store_options == HSM_MAX_STORE_OPTIONS) {
+				printf("Too many store options\n");
+				exit(1);
+			}
+			options.store_options[options.num_store_options++] = optarg;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -603,6 +2806,24 @@ int main(int argc, char * const argv[])
 	argv += optind;
 	argc -= optind;
 
+	if (options.xfer_size == 0) {
+		options.xfer_size = HSM_RECALL_BUFSIZE;
+	}
+	if (options.recall_depth == 0) {
+		options.recall_depth = 1;
+	}
+	if (options.recall_depth > HSM_MAX_RECALL_DEPTH) {
+		options.recall_depth = HSM_MAX_RECALL_DEPTH;
+	}
+	if (options.stats_interval == 0) {
+		options.stats_interval = 1;
+	}
+
+	/* early response works by partial recall */
+	if (options.early_response && options.chunk_size == 0) {
+		options.chunk_size = HSM_DEFAULT_CHUNK_SIZE;
+	}
+
 	signal(SIGCHLD, SIG_IGN);
 
 	signal(SIGTERM, hsm_term_handler);
@@ -615,8 +2836,29 @@ int main(int argc, char * const argv[])
 		return 0;
 	}
 
+	hsm_worker_init(&main_worker, 0);
+
+	/* a forked child can't hand removals to a thread in the
+	   parent, so they stay synchronous with -F */
+	if (!options.use_fork) {
+		hsm_reap_start();
+	}
+
+	stats.start_time = hsm_now_usec();
+	if (options.stats_file != NULL) {
+		hsm_stats_start();
+	}
+
+	if (options.early_response || options.prefetch_count != 0) {
+		hsm_bg_start();
+	}
+
 	hsm_cleanup_events();
 
+	if (!options.use_fork && options.num_threads != 0) {
+		hsm_pool_start(options.num_threads);
+	}
+
 	hsm_wait_events();
 
 	return 0;
@@ -0,0 +1,116 @@
+/*
+  SHA-256 (FIPS 180-4), used to name deduplicated store chunks
+ */
+
+#include "hacksm.h"
+#include "store_backend.h"
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *state, const uint8_t *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h;
+	unsigned i;
+
+	for (i=0;i<16;i++) {
+		w[i] = (uint32_t)p[i*4] << 24 | (uint32_t)p[i*4+1] << 16 |
+			(uint32_t)p[i*4+2] << 8 | p[i*4+3];
+	}
+	for (i=16;i<64;i++) {
+		uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+		uint32_t s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i=0;i<64;i++) {
+		uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+			((e & f) ^ (~e & g)) + K[i] + w[i];
+		uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+			((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void hsm_sha256_init(struct hsm_sha256 *c)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(c->state, init, sizeof(init));
+	c->length = 0;
+	c->buf_len = 0;
+}
+
+void hsm_sha256_update(struct hsm_sha256 *c, const uint8_t *data, size_t n)
+{
+	c->length += n;
+
+	if (c->buf_len > 0) {
+		size_t len = 64 - c->buf_len;
+		if (len > n) {
+			len = n;
+		}
+		memcpy(c->buf + c->buf_len, data, len);
+		c->buf_len += len;
+		data += len;
+		n -= len;
+		if (c->buf_len < 64) {
+			return;
+		}
+		sha256_block(c->state, c->buf);
+		c->buf_len = 0;
+	}
+
+	while (n >= 64) {
+		sha256_block(c->state, data);
+		data += 64;
+		n -= 64;
+	}
+
+	memcpy(c->buf, data, n);
+	c->buf_len = n;
+}
+
+void hsm_sha256_final(struct hsm_sha256 *c, uint8_t digest[32])
+{
+	uint64_t bits = c->length * 8;
+	unsigned i;
+
+	c->buf[c->buf_len++] = 0x80;
+	if (c->buf_len > 56) {
+		memset(c->buf + c->buf_len, 0, 64 - c->buf_len);
+		sha256_block(c->state, c->buf);
+		c->buf_len = 0;
+	}
+	memset(c->buf + c->buf_len, 0, 56 - c->buf_len);
+	for (i=0;i<8;i++) {
+		c->buf[56+i] = bits >> (56 - i*8);
+	}
+	sha256_block(c->state, c->buf);
+
+	for (i=0;i<8;i++) {
+		digest[i*4]   = c->state[i] >> 24;
+		digest[i*4+1] = c->state[i] >> 16;
+		digest[i*4+2] = c->state[i] >> 8;
+		digest[i*4+3] = c->state[i];
+	}
+}
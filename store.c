@@ -0,0 +1,1067 @@
+/*
+  generic HSM store layer. This picks a backend for the store and
+  does the data transfer for it
+
+  Andrew Tridgell August 2008
+
+ */
+
+#include "hacksm.h"
+#include "store_backend.h"
+#include <dirent.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+/* the most hsm_store_map() maps at once */
+#define HSM_STORE_MAP_WINDOW 0x800000
+
+/* the most closed handles kept for reuse */
+#define HSM_STORE_HANDLE_POOL 64
+
+static const struct hsm_store_ops *backends[] = {
+	&hsm_store_file_ops,
+	&hsm_store_pack_ops,
+	&hsm_store_dedup_ops,
+	&hsm_store_stripe_ops,
+	NULL
+};
+
+struct hsm_store_aio {
+	struct hsm_store_handle *h;
+	struct aiocb cb;
+	/* set if the read had to be done synchronously */
+	bool done;
+	ssize_t result;
+	/* for a framed object, the clen bytes of compressed data are
+	   read into cbuf, which is in the aligned buffer cbuf_alloc,
+	   and decompressed into buf when the read is waited for */
+	uint8_t *cbuf_alloc;
+	uint8_t *cbuf;
+	size_t clen;
+	uint8_t *buf;
+	size_t n;
+	off_t ofs;
+};
+
+/*
+  find a backend by name
+ */
+static const struct hsm_store_ops *store_backend(const char *name)
+{
+	unsigned i;
+	for (i=0;backends[i];i++) {
+		if (strcmp(backends[i]->name, name) == 0) {
+			return backends[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+  initialise the link to the store
+ */
+struct hsm_store_context *hsm_store_init(void)
+{
+	struct hsm_store_context *ctx;
+
+	ctx = calloc(1, sizeof(struct hsm_store_context));
+	if (ctx == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ctx->errmsg = "";
+	ctx->basepath = HSM_STORE_PATH;
+	ctx->checksum = true;
+	pthread_mutex_init(&ctx->pool_mutex, NULL);
+
+	return ctx;
+}
+
+/*
+  set a store option. The backend option picks the backend for a new
+  store and the compression, checksum, cache and io options apply to
+  all backends. The rest are passed to the backend when we connect
+ */
+int hsm_store_set_option(struct hsm_store_context *ctx, const char *option)
+{
+	if (strchr(option, '=') == NULL) {
+		ctx->errmsg = "Store options must be name=value";
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (strncmp(option, "compress=", 9) == 0) {
+		return hsm_frame_set_option(ctx, "compress", option+9);
+	}
+	if (strncmp(option, "compress_chunk=", 15) == 0) {
+		return hsm_frame_set_option(ctx, "compress_chunk", option+15);
+	}
+	if (strncmp(option, "checksum=", 9) == 0) {
+		return hsm_frame_set_option(ctx, "checksum", option+9);
+	}
+	if (strncmp(option, "cache=", 6) == 0) {
+		return hsm_cache_set_option(ctx, "cache", option+6);
+	}
+	if (strncmp(option, "cache_size=", 11) == 0) {
+		return hsm_cache_set_option(ctx, "cache_size", option+11);
+	}
+	if (strncmp(option, "io=", 3) == 0) {
+		return hsm_direct_set_option(ctx, "io", option+3);
+	}
+
+	if (strncmp(option, "backend=", 8) == 0) {
+		if (store_backend(option+8) == NULL) {
+			ctx->errmsg = "Unknown store backend";
+			errno = EINVAL;
+			return -1;
+		}
+		ctx->backend = option+8;
+		return 0;
+	}
+
+	if (ctx->num_options == HSM_STORE_MAX_OPTIONS) {
+		ctx->errmsg = "Too many store options";
+		errno = EINVAL;
+		return -1;
+	}
+	ctx->options[ctx->num_options] = strdup(option);
+	if (ctx->options[ctx->num_options] == NULL) {
+		ctx->errmsg = "Unable to allocate store option";
+		errno = ENOMEM;
+		return -1;
+	}
+	ctx->num_options++;
+	return 0;
+}
+
+/*
+  return an error message for the last failed operation
+ */
+const char *hsm_store_errmsg(struct hsm_store_context *ctx)
+{
+	return ctx->errmsg;
+}
+
+/*
+  true if a store directory has no objects in it
+ */
+bool hsm_store_dir_empty(const char *path)
+{
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(path);
+	if (d == NULL) {
+		return false;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] != '.') {
+			closedir(d);
+			return false;
+		}
+	}
+	closedir(d);
+	return true;
+}
+
+/*
+  work out which backend a store uses. The backend is recorded when a
+  store is created, so that every tool agrees on it. A store with no
+  record predates backends, and uses the file backend
+ */
+static const struct hsm_store_ops *store_find_backend(struct hsm_store_context *ctx)
+{
+	char name[64] = "";
+	char *fname = NULL;
+	const struct hsm_store_ops *ops;
+	FILE *f;
+
+	if (asprintf(&fname, "%s/%s", ctx->basepath, HSM_BACKEND_FILE) == -1) {
+		ctx->errmsg = "Unable to allocate store filename";
+		return NULL;
+	}
+
+	f = fopen(fname, "r");
+	if (f != NULL) {
+		if (fscanf(f, "%63s", name) != 1) {
+			name[0] = 0;
+		}
+		fclose(f);
+		free(fname);
+		ops = store_backend(name);
+		if (ops == NULL) {
+			ctx->errmsg = "Store has an unknown backend";
+			return NULL;
+		}
+		if (ctx->backend && strcmp(ctx->backend, name) != 0) {
+			ctx->errmsg = "Store was created with a different backend";
+			return NULL;
+		}
+		return ops;
+	}
+
+	if (ctx->backend == NULL || !hsm_store_dir_empty(ctx->basepath)) {
+		free(fname);
+		if (ctx->backend && strcmp(ctx->backend, "file") != 0) {
+			ctx->errmsg = "Store already has files in it";
+			return NULL;
+		}
+		return &hsm_store_file_ops;
+	}
+
+	/* a new store */
+	f = fopen(fname, "w");
+	free(fname);
+	if (f == NULL) {
+		ctx->errmsg = "Unable to record store backend";
+		return NULL;
+	}
+	fprintf(f, "%s\n", ctx->backend);
+	if (fclose(f) != 0) {
+		ctx->errmsg = "Unable to record store backend";
+		return NULL;
+	}
+	return store_backend(ctx->backend);
+}
+
+/*
+  connect to the store
+ */
+int hsm_store_connect(struct hsm_store_context *ctx, const char *fsname)
+{
+	struct stat st;
+	unsigned i;
+
+	if (stat(ctx->basepath, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		ctx->errmsg = "Invalid store path";
+		return -1;
+	}
+
+	ctx->ops = store_find_backend(ctx);
+	if (ctx->ops == NULL) {
+		return -1;
+	}
+
+	if (ctx->ops->init(ctx) != 0) {
+		ctx->ops = NULL;
+		return -1;
+	}
+
+	for (i=0;i<ctx->num_options;i++) {
+		char *name = ctx->options[i];
+		char *value = strchr(name, '=');
+		int ret;
+
+		*value = 0;
+		ret = ctx->ops->set_option(ctx, name, value+1);
+		*value = '=';
+		if (ret != 0) {
+			return -1;
+		}
+	}
+
+	if (ctx->ops->connect(ctx) != 0) {
+		return -1;
+	}
+	return hsm_cache_connect(ctx);
+}
+
+/*
+  shutdown the link to the store
+ */
+void hsm_store_shutdown(struct hsm_store_context *ctx)
+{
+	unsigned i;
+
+	if (ctx->ops) {
+		ctx->ops->shutdown(ctx);
+	}
+	hsm_cache_shutdown(ctx);
+	for (i=0;i<ctx->num_options;i++) {
+		free(ctx->options[i]);
+	}
+	while (ctx->pool) {
+		struct hsm_store_handle *h = ctx->pool;
+		ctx->pool = h->next;
+		free(h);
+	}
+	hsm_direct_shutdown(ctx);
+	pthread_mutex_destroy(&ctx->pool_mutex);
+	free(ctx);
+}
+
+/*
+  get a handle from the pool, or allocate one
+ */
+static struct hsm_store_handle *store_handle_get(struct hsm_store_context *ctx)
+{
+	struct hsm_store_handle *h;
+
+	pthread_mutex_lock(&ctx->pool_mutex);
+	h = ctx->pool;
+	if (h != NULL) {
+		ctx->pool = h->next;
+		ctx->pool_size--;
+	}
+	pthread_mutex_unlock(&ctx->pool_mutex);
+
+	if (h == NULL) {
+		h = malloc(sizeof(struct hsm_store_handle));
+		if (h == NULL) {
+			return NULL;
+		}
+	}
+	memset(h, 0, sizeof(*h));
+	return h;
+}
+
+/*
+  return a handle to the pool
+ */
+static void store_handle_put(struct hsm_store_context *ctx, struct hsm_store_handle *h)
+{
+	pthread_mutex_lock(&ctx->pool_mutex);
+	if (ctx->pool_size < HSM_STORE_HANDLE_POOL) {
+		h->next = ctx->pool;
+		ctx->pool = h;
+		ctx->pool_size++;
+		h = NULL;
+	}
+	pthread_mutex_unlock(&ctx->pool_mutex);
+	free(h);
+}
+
+/*
+  open a file in the store
+ */
+struct hsm_store_handle *hsm_store_open(struct hsm_store_context *ctx,
+					dev_t device, ino_t inode, bool readonly)
+{
+	struct hsm_store_handle *h;
+
+	h = store_handle_get(ctx);
+	if (h == NULL) {
+		ctx->errmsg = "Unable to allocate store handle";
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	h->ctx = ctx;
+	h->device = device;
+	h->inode = inode;
+	h->fd = -1;
+	h->cache_fd = -1;
+	h->readonly = readonly;
+
+	if (ctx->ops->open(ctx, h, device, inode) != 0) {
+		store_handle_put(ctx, h);
+		return NULL;
+	}
+
+	if (readonly) {
+		hsm_cache_read_start(h);
+	} else {
+		hsm_cache_write_start(h);
+	}
+	hsm_direct_start(h);
+
+	if ((readonly && hsm_frame_read_start(h) != 0) ||
+	    (!readonly && (ctx->codec || ctx->checksum) &&
+	     hsm_frame_write_start(h) != 0)) {
+		hsm_direct_end(h);
+		if (readonly) {
+			hsm_cache_read_end(h);
+		}
+		ctx->ops->close(h);
+		if (!readonly) {
+			hsm_cache_write_end(h, false);
+		}
+		store_handle_put(ctx, h);
+		return NULL;
+	}
+
+	return h;
+}
+
+/*
+  position of an object in the store
+ */
+uint64_t hsm_store_position(struct hsm_store_context *ctx,
+			    dev_t device, ino_t inode)
+{
+	return ctx->ops->position(ctx, device, inode);
+}
+
+/*
+  remove a file from the store
+ */
+int hsm_store_remove(struct hsm_store_context *ctx,
+		     dev_t device, ino_t inode)
+{
+	if (ctx->ops->remove(ctx, device, inode, UINT64_MAX) != 0) {
+		return -1;
+	}
+	hsm_cache_remove(ctx, device, inode);
+	return 0;
+}
+
+/*
+  get the store's time for an object
+ */
+int hsm_store_object_time(struct hsm_store_context *ctx,
+			  dev_t device, ino_t inode, uint64_t *time)
+{
+	return ctx->ops->object_time(ctx, device, inode, time);
+}
+
+/*
+  remove a file from the store if it is still the copy with this time
+ */
+int hsm_store_remove_stale(struct hsm_store_context *ctx,
+			   dev_t device, ino_t inode, uint64_t time)
+{
+	if (ctx->ops->remove(ctx, device, inode, time) != 0) {
+		return -1;
+	}
+	hsm_cache_remove(ctx, device, inode);
+	return 0;
+}
+
+/*
+  list part of the objects in the store
+ */
+int hsm_store_list(struct hsm_store_context *ctx, unsigned part, unsigned num_parts,
+		   hsm_store_list_fn fn, void *private)
+{
+	if (num_parts == 0 || part >= num_parts) {
+		ctx->errmsg = "Invalid store list part";
+		errno = EINVAL;
+		return -1;
+	}
+	return ctx->ops->list(ctx, part, num_parts, fn, private);
+}
+
+/*
+  parse an object name of the form 0xDEV:0xINO
+ */
+bool hsm_store_parse_name(const char *name, dev_t *device, ino_t *inode)
+{
+	unsigned long long d, i;
+	int len = 0;
+
+	if (sscanf(name, "0x%llx:0x%llx%n", &d, &i, &len) != 2 ||
+	    name[len] != 0) {
+		return false;
+	}
+	*device = d;
+	*inode = i;
+	return true;
+}
+
+/*
+  choose the list part a name in a directory belongs to
+ */
+unsigned hsm_store_name_part(const char *name, unsigned num_parts)
+{
+	uint32_t hash = 0x811c9dc5;
+
+	/* FNV-1a */
+	for (;*name;name++) {
+		hash = (hash ^ (uint8_t)*name) * 0x01000193;
+	}
+	return hash % num_parts;
+}
+
+/*
+  modification time of a store file in microseconds
+ */
+uint64_t hsm_store_mtime(const struct stat *st)
+{
+	return (uint64_t)st->st_mtim.tv_sec * 1000000 + st->st_mtim.tv_nsec / 1000;
+}
+
+/*
+  convert the store to the layout given by the store options
+ */
+int hsm_store_convert(struct hsm_store_context *ctx)
+{
+	if (ctx->ops->convert == NULL) {
+		ctx->errmsg = "Store backend has no layouts to convert";
+		errno = ENOSYS;
+		return -1;
+	}
+	return ctx->ops->convert(ctx);
+}
+
+/*
+  reclaim space left by removed objects
+ */
+int hsm_store_compact(struct hsm_store_context *ctx)
+{
+	if (ctx->ops->compact == NULL) {
+		return 0;
+	}
+	return ctx->ops->compact(ctx);
+}
+
+/*
+  clamp a read to the end of the object
+ */
+static size_t store_read_size(struct hsm_store_handle *h, size_t n, off_t ofs)
+{
+	if (ofs >= h->size) {
+		return 0;
+	}
+	if (n > h->size - ofs) {
+		n = h->size - ofs;
+	}
+	return n;
+}
+
+/*
+  size of an object open for reading
+ */
+uint64_t hsm_store_size(struct hsm_store_handle *h)
+{
+	return h->size;
+}
+
+/*
+  read from a stored file
+ */
+size_t hsm_store_read(struct hsm_store_handle *h, uint8_t *buf, size_t n)
+{
+	ssize_t ret = hsm_store_pread(h, buf, n, h->ofs);
+	if (ret > 0) {
+		h->ofs += ret;
+	}
+	return ret;
+}
+
+/*
+  read from an object, below any framing
+ */
+ssize_t hsm_store_raw_pread(struct hsm_store_handle *h, uint8_t *buf, size_t n, off_t ofs)
+{
+	ssize_t ret;
+
+	if (h->ctx->ops->pread && !h->cached) {
+		ret = h->ctx->ops->pread(h, buf, n, ofs);
+	} else if (h->direct) {
+		ret = hsm_direct_pread(h, buf, n, h->base + ofs);
+	} else {
+		ret = pread(h->fd, buf, n, h->base + ofs);
+	}
+	hsm_cache_fill(h, buf, ret, ofs);
+	return ret;
+}
+
+/*
+  true if reads of a handle may be done by several threads at once.
+  Objects read with io=direct or io=dontneed, and objects being
+  copied into the cache, keep state in the handle for each read
+ */
+bool hsm_store_concurrent_reads(struct hsm_store_handle *h)
+{
+	if (!h->readonly || h->direct != NULL || h->cache_fill != NULL) {
+		return false;
+	}
+	if (h->ctx->ops->pread != NULL && !h->cached) {
+		return h->ctx->ops->concurrent_pread;
+	}
+	return true;
+}
+
+/*
+  read from a handle other threads may be reading at the same time.
+  Framed data is decoded with buffers of the read's own
+ */
+ssize_t hsm_store_pread_shared(struct hsm_store_handle *h, uint8_t *buf, size_t n,
+			       off_t ofs)
+{
+	n = store_read_size(h, n, ofs);
+	if (n == 0) {
+		return 0;
+	}
+	if (h->frame) {
+		return hsm_frame_pread_shared(h, buf, n, ofs);
+	}
+	return hsm_store_raw_pread(h, buf, n, ofs);
+}
+
+/*
+  read from a stored file at an offset
+ */
+ssize_t hsm_store_pread(struct hsm_store_handle *h, uint8_t *buf, size_t n, off_t ofs)
+{
+	n = store_read_size(h, n, ofs);
+	if (n == 0) {
+		return 0;
+	}
+	if (h->frame) {
+		return hsm_frame_pread(h, buf, n, ofs);
+	}
+	return hsm_store_raw_pread(h, buf, n, ofs);
+}
+
+/*
+  drop the window given out by hsm_store_map()
+ */
+void hsm_store_unmap(struct hsm_store_handle *h)
+{
+	if (h->map) {
+		munmap(h->map, h->map_len);
+		h->map = NULL;
+		h->map_len = 0;
+	}
+}
+
+/*
+  an I/O error on a mapped page, such as a network store going away,
+  raises SIGBUS when the page is touched. While a thread is checking
+  a mapped window, map_guard is where it goes back to on a fault.
+  Any other SIGBUS is passed to the handler there was before
+ */
+static __thread sigjmp_buf *map_guard;
+static struct sigaction map_old_action;
+static pthread_once_t map_once = PTHREAD_ONCE_INIT;
+
+static void store_map_sigbus(int sig)
+{
+	if (map_guard != NULL) {
+		siglongjmp(*map_guard, 1);
+	}
+	/* not ours */
+	sigaction(SIGBUS, &map_old_action, NULL);
+	raise(sig);
+}
+
+static void store_map_init(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = store_map_sigbus;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, &map_old_action);
+}
+
+/*
+  check the CRCs of a mapped window, failing with EIO rather than
+  dying if the pages can't be read
+ */
+static int store_map_check(struct hsm_store_handle *h, const uint8_t *p,
+			   off_t ofs, size_t clen)
+{
+	sigjmp_buf env;
+	int ret;
+
+	pthread_once(&map_once, store_map_init);
+	if (sigsetjmp(env, 1) != 0) {
+		map_guard = NULL;
+		h->ctx->errmsg = "I/O error reading mapped store object";
+		errno = EIO;
+		return -1;
+	}
+	map_guard = &env;
+	ret = hsm_frame_map_check(h, p, ofs, clen);
+	map_guard = NULL;
+	return ret;
+}
+
+/*
+  map up to n bytes of an object at ofs, returning a pointer to the
+  data and the number of bytes it holds in *len. The data is borrowed
+  from the handle until the next map, unmap or close. *len is 0 at
+  the end of the object. Fails with EOPNOTSUPP if the data at ofs
+  can't be mapped, in which case it has to be read instead
+ */
+const uint8_t *hsm_store_map(struct hsm_store_handle *h, size_t n, off_t ofs,
+			     size_t *len)
+{
+	static long page_size;
+	off_t cofs, start;
+	size_t clen, skip = 0;
+	uint8_t *p;
+
+	hsm_store_unmap(h);
+
+	*len = 0;
+	if (n > HSM_STORE_MAP_WINDOW) {
+		n = HSM_STORE_MAP_WINDOW;
+	}
+	n = store_read_size(h, n, ofs);
+	if (n == 0) {
+		return (const uint8_t *)"";
+	}
+
+	/* only backends that leave data transfer to us, and cached
+	   copies, can be mapped, and of framed objects only chunks
+	   that aren't compressed. Mapping goes through the page cache,
+	   so it isn't done with io=direct or io=dontneed, and while a
+	   cached copy is filled the data has to come through reads */
+	if ((h->ctx->ops->pread != NULL && !h->cached) || h->direct || h->cache_fill) {
+		goto unsupported;
+	}
+	if (h->frame) {
+		n = hsm_frame_map_range(h, n, ofs, &cofs, &clen, &skip);
+		if (n == 0) {
+			goto unsupported;
+		}
+	} else {
+		cofs = ofs;
+		clen = n;
+	}
+
+	if (page_size == 0) {
+		page_size = sysconf(_SC_PAGESIZE);
+	}
+	start = (h->base + cofs) & ~(off_t)(page_size - 1);
+	h->map_len = h->base + cofs + clen - start;
+	h->map = mmap(NULL, h->map_len, PROT_READ, MAP_SHARED, h->fd, start);
+	if (h->map == MAP_FAILED) {
+		h->map = NULL;
+		h->map_len = 0;
+		h->ctx->errmsg = "Unable to map store object";
+		return NULL;
+	}
+	madvise(h->map, h->map_len, MADV_SEQUENTIAL);
+	/* start reading the next window while this one is used */
+	posix_fadvise(h->fd, h->base + cofs + clen, HSM_STORE_MAP_WINDOW,
+		      POSIX_FADV_WILLNEED);
+
+	p = (uint8_t *)h->map + (h->base + cofs - start);
+	if (h->frame && store_map_check(h, p, ofs, clen) != 0) {
+		hsm_store_unmap(h);
+		return NULL;
+	}
+	*len = n;
+	return p + skip;
+
+unsupported:
+	h->ctx->errmsg = "Store object can't be mapped";
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+/*
+  do a read that couldn't be queued, or was refused by O_DIRECT,
+  synchronously
+ */
+static ssize_t store_aio_sync(struct hsm_store_aio *a)
+{
+	free(a->cbuf_alloc);
+	a->cbuf_alloc = NULL;
+	a->cbuf = NULL;
+	return hsm_store_pread(a->h, a->buf, a->n, a->ofs);
+}
+
+/*
+  set up an asynchronous read from a stored file, describing it in
+  the aiocb of the request without starting it. A read that can't be
+  done asynchronously is done now, and the request marked done
+ */
+struct hsm_store_aio *hsm_store_aio_prepare(struct hsm_store_handle *h, uint8_t *buf,
+					    size_t n, off_t ofs)
+{
+	struct hsm_store_aio *a;
+	int fd;
+
+	a = calloc(1, sizeof(struct hsm_store_aio));
+	if (a == NULL) {
+		h->ctx->errmsg = "Unable to allocate store aio";
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	a->h = h;
+	n = store_read_size(h, n, ofs);
+	if (n == 0) {
+		a->done = true;
+		return a;
+	}
+
+	/* backends without a file descriptor are read synchronously */
+	if (h->ctx->ops->pread && !h->cached) {
+		a->result = hsm_store_pread(h, buf, n, ofs);
+		a->done = true;
+		return a;
+	}
+
+	/* with io=direct, reads the caller's buffer can't take as it
+	   is are done synchronously through an aligned buffer */
+	fd = hsm_direct_fd(h);
+	if (fd != -1 && h->frame == NULL && !hsm_direct_aligned(buf, h->base + ofs, n)) {
+		a->result = hsm_store_pread(h, buf, n, ofs);
+		a->done = true;
+		return a;
+	}
+	if (fd == -1) {
+		fd = h->fd;
+	}
+
+	a->buf = buf;
+	a->n = n;
+	a->ofs = ofs;
+	a->cb.aio_fildes = fd;
+	a->cb.aio_buf = buf;
+	a->cb.aio_nbytes = n;
+	a->cb.aio_offset = h->base + ofs;
+	a->cb.aio_sigevent.sigev_notify = SIGEV_NONE;
+
+	if (h->frame) {
+		off_t cofs, start;
+		size_t clen, skip = 0;
+		void *p;
+
+		hsm_frame_range(h, n, ofs, &cofs, &clen);
+		start = h->base + cofs;
+		if (fd != h->fd) {
+			/* read whole blocks for O_DIRECT */
+			start &= ~(off_t)(HSM_STORE_IO_ALIGN - 1);
+			skip = h->base + cofs - start;
+		}
+		a->clen = clen;
+		a->cb.aio_offset = start;
+		a->cb.aio_nbytes = (skip + clen + HSM_STORE_IO_ALIGN - 1) &
+			~(size_t)(HSM_STORE_IO_ALIGN - 1);
+		if (posix_memalign(&p, HSM_STORE_IO_ALIGN, a->cb.aio_nbytes) != 0) {
+			a->result = hsm_frame_pread(h, buf, n, ofs);
+			a->done = true;
+			return a;
+		}
+		a->cbuf_alloc = p;
+		a->cbuf = a->cbuf_alloc + skip;
+		a->cb.aio_buf = a->cbuf_alloc;
+	}
+
+	return a;
+}
+
+/*
+  the read a request set up by hsm_store_aio_prepare() is to do,
+  returning false if it has been done already
+ */
+bool hsm_store_aio_describe(struct hsm_store_aio *a, int *fd, void **buf,
+			    size_t *n, off_t *ofs)
+{
+	if (a->done) {
+		return false;
+	}
+	*fd = a->cb.aio_fildes;
+	*buf = (void *)a->cb.aio_buf;
+	*n = a->cb.aio_nbytes;
+	*ofs = a->cb.aio_offset;
+	return true;
+}
+
+/*
+  finish an asynchronous read that returned ret, or -1 with error
+  err, and free the request
+ */
+ssize_t hsm_store_aio_complete(struct hsm_store_aio *a, ssize_t ret, int err)
+{
+	if (a->done) {
+		ret = a->result;
+		free(a);
+		return ret;
+	}
+
+	if (ret == -1 && a->cb.aio_fildes != a->h->fd && hsm_direct_failed(a->h, err)) {
+		/* the filesystem turned out not to do O_DIRECT */
+		ret = store_aio_sync(a);
+	} else if (ret == -1) {
+		a->h->ctx->errmsg = "aio read failed";
+		errno = err;
+	} else {
+		if (a->cb.aio_fildes == a->h->fd) {
+			hsm_direct_read_done(a->h, a->cb.aio_offset, ret);
+		}
+		hsm_cache_fill(a->h, (const uint8_t *)a->cb.aio_buf, ret,
+			       a->cb.aio_offset - a->h->base);
+		if (a->cbuf && ret < (a->cbuf - a->cbuf_alloc) + a->clen) {
+			a->h->ctx->errmsg = "short read of store object";
+			errno = EIO;
+			ret = -1;
+		} else if (a->cbuf) {
+			ret = hsm_frame_decode(a->h, a->cbuf, a->buf, a->n, a->ofs);
+		}
+	}
+	free(a->cbuf_alloc);
+	free(a);
+	return ret;
+}
+
+/*
+  write to an object, below any framing
+ */
+int hsm_store_raw_write(struct hsm_store_handle *h, const uint8_t *buf, size_t n)
+{
+	uint64_t ofs = h->ofs;
+	size_t len = n;
+
+	if (h->ctx->ops->write) {
+		if (h->ctx->ops->write(h, buf, n) != 0) {
+			return -1;
+		}
+		hsm_cache_write(h, buf, n, ofs);
+		return 0;
+	}
+
+	if (h->direct) {
+		if (hsm_direct_write(h, buf, n) != 0) {
+			return -1;
+		}
+		hsm_cache_write(h, buf, n, ofs);
+		return 0;
+	}
+
+	while (n > 0) {
+		ssize_t nwritten = pwrite(h->fd, buf, n, h->base + h->ofs);
+		if (nwritten <= 0) {
+			h->ctx->errmsg = "write failed";
+			return -1;
+		}
+		buf += nwritten;
+		n -= nwritten;
+		h->ofs += nwritten;
+	}
+	hsm_cache_write(h, buf - len, len, ofs);
+	return 0;
+}
+
+/*
+  write to a stored file
+ */
+int hsm_store_write(struct hsm_store_handle *h, uint8_t *buf, size_t n)
+{
+	if (h->frame == NULL && h->ofs == 0 && n > 0 && hsm_frame_needed(buf, n) &&
+	    hsm_frame_write_start(h) != 0) {
+		return -1;
+	}
+	if (h->frame) {
+		return hsm_frame_write(h, buf, n);
+	}
+	return hsm_store_raw_write(h, buf, n);
+}
+
+/*
+  write n bytes of zeros to a stored file. An object that is framed,
+  or can be as nothing has been written yet, keeps whole chunks of
+  zeros as holes. Otherwise the zeros are written out
+ */
+int hsm_store_write_zeros(struct hsm_store_handle *h, uint64_t n)
+{
+	static const uint8_t zeros[0x10000];
+
+	if (h->frame == NULL && h->ofs == 0 && n > 0 &&
+	    hsm_frame_write_start(h) != 0) {
+		return -1;
+	}
+	if (h->frame) {
+		return hsm_frame_write_zeros(h, n);
+	}
+	while (n > 0) {
+		size_t len = n < sizeof(zeros) ? n : sizeof(zeros);
+		if (hsm_store_raw_write(h, zeros, len) != 0) {
+			return -1;
+		}
+		n -= len;
+	}
+	return 0;
+}
+
+/*
+  the first offset at or after ofs holding data. Objects not stored
+  with a map of their holes are all data
+ */
+uint64_t hsm_store_seek_data(struct hsm_store_handle *h, uint64_t ofs)
+{
+	if (ofs >= h->size) {
+		return h->size;
+	}
+	if (h->frame) {
+		return hsm_frame_seek(h, ofs, true);
+	}
+	return ofs;
+}
+
+/*
+  the first offset at or after ofs in a hole, or the size of the
+  file if there are no more holes
+ */
+uint64_t hsm_store_seek_hole(struct hsm_store_handle *h, uint64_t ofs)
+{
+	if (ofs >= h->size) {
+		return h->size;
+	}
+	if (h->frame) {
+		return hsm_frame_seek(h, ofs, false);
+	}
+	return h->size;
+}
+
+/*
+  leave syncing objects to hsm_store_sync()
+ */
+void hsm_store_defer_sync(struct hsm_store_context *ctx)
+{
+	ctx->defer_sync = true;
+}
+
+/*
+  make the objects closed since the last sync durable. Backends that
+  keep their objects under the store root are covered by one syncfs,
+  however many objects there are
+ */
+int hsm_store_sync(struct hsm_store_context *ctx)
+{
+	int fd, ret;
+
+	if (ctx->ops->sync) {
+		return ctx->ops->sync(ctx);
+	}
+
+	fd = open(ctx->basepath, O_RDONLY|O_DIRECTORY);
+	if (fd == -1) {
+		ctx->errmsg = "Unable to open store directory";
+		return -1;
+	}
+	ret = syncfs(fd);
+	close(fd);
+	if (ret != 0) {
+		ctx->errmsg = "Unable to sync store";
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  close a store file
+ */
+int hsm_store_close(struct hsm_store_handle *h)
+{
+	int ret = 0;
+
+	if (h->frame && !h->readonly) {
+		ret = hsm_frame_write_finish(h);
+	}
+	if (hsm_direct_finish(h) != 0) {
+		ret = -1;
+	}
+	hsm_store_unmap(h);
+	hsm_direct_end(h);
+	if (h->readonly) {
+		hsm_cache_read_end(h);
+	}
+	if (h->ctx->ops->close(h) != 0) {
+		ret = -1;
+	}
+	if (!h->readonly) {
+		hsm_cache_write_end(h, ret == 0);
+	}
+	hsm_frame_free(h->frame);
+	store_handle_put(h->ctx, h);
+	return ret;
+}
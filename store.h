@@ -13,6 +13,12 @@ struct hsm_store_context *hsm_store_init(void);
 struct hsm_store_handle *hsm_store_open(struct hsm_store_context *,
 					dev_t device, ino_t inode, bool readonly);
 
+/*
+  set a backend specific option, given as name=value. Options must be
+  set before connecting to the store
+ */
+int hsm_store_set_option(struct hsm_store_context *ctx, const char *option);
+
 /*
   return an error message for the last failed operation
  */
@@ -24,16 +30,121 @@ const char *hsm_store_errmsg(struct hsm_store_context *ctx);
  */
 int hsm_store_connect(struct hsm_store_context *ctx, const char *fsname);
 
+/* buffers for reads and writes should be aligned to this, so that
+   with io=direct they can be used for direct I/O as they are */
+#define HSM_STORE_IO_ALIGN 4096
+
+/*
+  the size of reads and writes that suits the store, for a caller
+  that would otherwise use n. With io=direct this is a whole number
+  of the buffers direct I/O is done in
+ */
+size_t hsm_store_io_size(struct hsm_store_context *ctx, size_t n);
+
 /*
   read from an open handle
  */
 size_t hsm_store_read(struct hsm_store_handle *, uint8_t *buf, size_t n);
 
+/*
+  read from an open handle at the given offset, without moving the
+  position used by hsm_store_read()
+ */
+ssize_t hsm_store_pread(struct hsm_store_handle *, uint8_t *buf, size_t n, off_t ofs);
+
+/*
+  a queue of store operations done in the background, so that one
+  thread can keep many of them in flight. Each operation is given a
+  pointer of the caller's, which comes back with its result when it
+  is reaped. Reads may finish in any order. Writes to a handle are
+  done in the order they were submitted, and a close once everything
+  submitted on the handle before it has finished. A handle must not
+  be used directly while it has operations in a queue, and a queue
+  must only be used by one thread at a time
+ */
+struct hsm_store_queue;
+
+struct hsm_store_completion {
+	void *private;
+	/* bytes read, 0 for a finished write or close, or -1 with
+	   the error in err */
+	ssize_t result;
+	int err;
+};
+
+/*
+  set up a queue that holds up to depth operations
+ */
+struct hsm_store_queue *hsm_store_queue_init(struct hsm_store_context *ctx,
+					     unsigned depth);
+
+/*
+  submit a read of n bytes at ofs, a write appending n bytes, or a
+  close of a handle. The buffer must stay valid until the operation
+  is reaped. Fails with EAGAIN if the queue is full
+ */
+int hsm_store_submit_read(struct hsm_store_queue *q, struct hsm_store_handle *h,
+			  uint8_t *buf, size_t n, off_t ofs, void *private);
+int hsm_store_submit_write(struct hsm_store_queue *q, struct hsm_store_handle *h,
+			   uint8_t *buf, size_t n, void *private);
+int hsm_store_submit_close(struct hsm_store_queue *q, struct hsm_store_handle *h,
+			   void *private);
+
+/*
+  collect up to max finished operations, waiting until at least min
+  have finished, or as many as are still in the queue if that is
+  fewer. Returns the number collected
+ */
+unsigned hsm_store_reap(struct hsm_store_queue *q, struct hsm_store_completion *c,
+			unsigned max, unsigned min);
+
+/*
+  wait for everything in a queue to finish, dropping the results, and
+  free it
+ */
+void hsm_store_queue_free(struct hsm_store_queue *q);
+
+/*
+  map up to n bytes of an open handle at the given offset, returning
+  the data and how much of it there is in *len, which is 0 at the end
+  of the file. The data belongs to the handle and is only valid until
+  the next map, unmap or close. Fails with EOPNOTSUPP if the data
+  can't be mapped, when it should be read instead
+ */
+const uint8_t *hsm_store_map(struct hsm_store_handle *, size_t n, off_t ofs,
+			     size_t *len);
+
+/*
+  drop the data given out by hsm_store_map()
+ */
+void hsm_store_unmap(struct hsm_store_handle *);
+
 /* 
    write to an open handle
  */
 int hsm_store_write(struct hsm_store_handle *, uint8_t *buf, size_t n);
 
+/*
+  write n bytes of zeros to an open handle. Where the store can, it
+  records them as a hole rather than storing them
+ */
+int hsm_store_write_zeros(struct hsm_store_handle *, uint64_t n);
+
+/*
+  the size of a file open for reading
+ */
+uint64_t hsm_store_size(struct hsm_store_handle *);
+
+/*
+  return the first offset at or after ofs that holds data, or the
+  first that is in a hole, as lseek() does with SEEK_DATA and
+  SEEK_HOLE. Both return the size of the file if there is no such
+  offset. Holes are only known for objects stored with a map of
+  them, and all other data may still be zeros
+ */
+uint64_t hsm_store_seek_data(struct hsm_store_handle *, uint64_t ofs);
+uint64_t hsm_store_seek_hole(struct hsm_store_handle *, uint64_t ofs);
+
 /* 
    close a handle
  */
@@ -44,8 +155,77 @@ int hsm_store_close(struct hsm_store_handle *);
  */
 void hsm_store_shutdown(struct hsm_store_context *);
 
+/*
+  return a hint for where an object lies in the store. Recalls are
+  served in order of this hint, to reduce seeking on stores where
+  order matters
+ */
+uint64_t hsm_store_position(struct hsm_store_context *ctx,
+			    dev_t device, ino_t inode);
+
 /*
   remove a file from the store
  */
 int hsm_store_remove(struct hsm_store_context *ctx,
 		     dev_t device, ino_t inode);
+
+/*
+  convert an existing store to the layout given by the store options,
+  returning the number of objects moved or -1 on error. The store
+  can be used by others while it is converted
+ */
+int hsm_store_convert(struct hsm_store_context *ctx);
+
+/*
+  reclaim space in the store left by removed files, for backends that
+  need it. Returns how much was done, or -1 on error
+ */
+int hsm_store_compact(struct hsm_store_context *ctx);
+
+/*
+  stop hsm_store_close() syncing each object written. Objects closed
+  after this are only durable once hsm_store_sync() has returned,
+  which lets many be made durable at once
+ */
+void hsm_store_defer_sync(struct hsm_store_context *ctx);
+
+/*
+  make every object closed so far durable
+ */
+int hsm_store_sync(struct hsm_store_context *ctx);
+
+/*
+  called by hsm_store_list() for each object, with the store's time
+  for it (see hsm_store_object_time())
+ */
+typedef void (*hsm_store_list_fn)(void *private, dev_t device, ino_t inode,
+				  uint64_t time);
+
+/*
+  list part 'part' of 'num_parts' of the objects in the store. The
+  parts can be listed at the same time from different threads, so a
+  large store can be listed in parallel. Objects added or removed
+  while the store is listed may or may not be seen, and an object
+  being moved by a conversion may be seen twice. fn must not use the
+  store
+ */
+int hsm_store_list(struct hsm_store_context *ctx, unsigned part, unsigned num_parts,
+		   hsm_store_list_fn fn, void *private);
+
+/*
+  get the store's time for an object, in microseconds since the
+  epoch. It is taken from the store server or the node that wrote
+  the object, so it can't be compared with the local clock, but it
+  changes each time the object is written
+ */
+int hsm_store_object_time(struct hsm_store_context *ctx,
+			  dev_t device, ino_t inode, uint64_t *time);
+
+/*
+  remove a file from the store if it is still the copy the store gave
+  'time' for, from hsm_store_object_time() or hsm_store_list(). A copy
+  written since belongs to a later migrate of the same inode, and is
+  kept, failing with EEXIST
+ */
+int hsm_store_remove_stale(struct hsm_store_context *ctx,
+			   dev_t device, ino_t inode, uint64_t time);
@@ -0,0 +1,326 @@
+/*
+  interface between the generic store layer in store.c and the store
+  backends. Not used outside the store code
+
+  The generic layer does all data transfer on the file descriptor a
+  backend gives it at open, so a backend only has to say where an
+  object lives
+ */
+
+/* where the store lives */
+#define HSM_STORE_PATH "/hacksm_store"
+
+/* file in the store root naming the backend that created the store.
+   Stores without one use the file backend */
+#define HSM_BACKEND_FILE ".backend"
+
+/* the most options that can be given with hsm_store_set_option() */
+#define HSM_STORE_MAX_OPTIONS 16
+
+/* how object data is moved, see store_direct.c */
+enum hsm_store_io {
+	HSM_IO_BUFFERED = 0,
+	HSM_IO_DIRECT,
+	HSM_IO_DONTNEED
+};
+
+struct hsm_store_context {
+	const struct hsm_store_ops *ops;
+	/* backend state, set up by the backend init call */
+	void *private;
+	const char *basepath;
+	const char *errmsg;
+	/* options are kept until connect, as the backend isn't known
+	   before then */
+	char *options[HSM_STORE_MAX_OPTIONS];
+	unsigned num_options;
+	const char *backend;
+	/* compression for new objects, or NULL to store them raw */
+	const struct hsm_codec *codec;
+	int level;
+	uint32_t chunk_size;
+	/* keep a CRC32C of each chunk of new objects */
+	bool checksum;
+	/* objects are made durable by hsm_store_sync() rather than
+	   when they are closed */
+	bool defer_sync;
+	/* local cache in front of the store, or NULL */
+	struct hsm_store_cache *cache;
+	enum hsm_store_io io;
+	/* closed handles, kept for reuse */
+	pthread_mutex_t pool_mutex;
+	struct hsm_store_handle *pool;
+	unsigned pool_size;
+	/* free direct I/O buffers, also under pool_mutex */
+	struct direct_buf *direct_pool;
+	unsigned direct_pool_size;
+};
+
+struct hsm_store_handle {
+	struct hsm_store_context *ctx;
+	/* backend state for this handle */
+	void *private;
+	/* the object this handle is open on */
+	dev_t device;
+	ino_t inode;
+	int fd;
+	/* where the object starts in fd */
+	off_t base;
+	/* size of the object when opened for reading. For a framed
+	   object this becomes the size of the file once the frame
+	   header is read */
+	uint64_t size;
+	/* position for hsm_store_read() and hsm_store_write(). For
+	   writes this is always the position in the object, which is
+	   where it ends when it is closed */
+	uint64_t ofs;
+	bool readonly;
+	/* set for a compressed or otherwise framed object */
+	struct hsm_store_frame *frame;
+	/* the window given out by hsm_store_map() */
+	void *map;
+	size_t map_len;
+	/* id of a framed object, from its frame header */
+	uint32_t object_id;
+	/* set when reads come from a cached copy of the object, in
+	   which case the backend's fd and base are kept aside */
+	bool cached;
+	int store_fd;
+	off_t store_base;
+	/* temporary cache file an object is written through to, or
+	   for reads, filled from what is read */
+	int cache_fd;
+	char *cache_tmpname;
+	struct hsm_cache_fill *cache_fill;
+	/* state for io=direct or io=dontneed, or NULL */
+	struct hsm_store_direct *direct;
+	/* operations on the handle in a store queue that haven't
+	   finished, and how many queue threads are working on it. Both
+	   are under the queue's mutex */
+	unsigned queued;
+	unsigned queue_running;
+	/* next free handle in the pool */
+	struct hsm_store_handle *next;
+};
+
+struct hsm_store_ops {
+	const char *name;
+
+	/* set up backend state. No I/O should be done before connect */
+	int (*init)(struct hsm_store_context *ctx);
+
+	/* set a backend option, returning -1 with errno EINVAL if it
+	   isn't known */
+	int (*set_option)(struct hsm_store_context *ctx, const char *name,
+			  const char *value);
+
+	int (*connect)(struct hsm_store_context *ctx);
+	void (*shutdown)(struct hsm_store_context *ctx);
+
+	/* open an object, filling in fd, base and size (for reads) of
+	   the handle */
+	int (*open)(struct hsm_store_context *ctx, struct hsm_store_handle *h,
+		    dev_t device, ino_t inode);
+
+	/* finish with an object. For a written object this makes the
+	   object durable and visible. The generic layer closes nothing
+	   itself */
+	int (*close)(struct hsm_store_handle *h);
+
+	/* remove an object if its time is still 'time', or whatever
+	   its time if that is UINT64_MAX */
+	int (*remove)(struct hsm_store_context *ctx, dev_t device, ino_t inode,
+		      uint64_t time);
+
+	/* the store's time for an object, see hsm_store_object_time() */
+	int (*object_time)(struct hsm_store_context *ctx, dev_t device, ino_t inode,
+			   uint64_t *time);
+
+	uint64_t (*position)(struct hsm_store_context *ctx, dev_t device, ino_t inode);
+
+	/* list part of the objects, see hsm_store_list() */
+	int (*list)(struct hsm_store_context *ctx, unsigned part, unsigned num_parts,
+		    hsm_store_list_fn fn, void *private);
+
+	/* optional calls */
+	int (*convert)(struct hsm_store_context *ctx);
+	int (*compact)(struct hsm_store_context *ctx);
+	/* make objects closed with syncs deferred durable, for
+	   backends that keep objects outside the store root */
+	int (*sync)(struct hsm_store_context *ctx);
+
+	/* for backends that don't keep an object in a file descriptor.
+	   write appends to an object open for writing, advancing ofs,
+	   and pread reads from an object open for reading. The
+	   generic layer doesn't use fd when these are set */
+	int (*write)(struct hsm_store_handle *h, const uint8_t *buf, size_t n);
+	ssize_t (*pread)(struct hsm_store_handle *h, uint8_t *buf, size_t n, off_t ofs);
+	/* set if pread may be called by several threads at once on one
+	   handle */
+	bool concurrent_pread;
+};
+
+extern const struct hsm_store_ops hsm_store_file_ops;
+extern const struct hsm_store_ops hsm_store_pack_ops;
+extern const struct hsm_store_ops hsm_store_dedup_ops;
+extern const struct hsm_store_ops hsm_store_stripe_ops;
+
+/*
+  true if a store directory has no objects in it. Dot files, which
+  hold store metadata, don't count
+ */
+bool hsm_store_dir_empty(const char *path);
+
+/*
+  parse the name of an object, as device and inode in the form
+  0xDEV:0xINO, returning false if it isn't one
+ */
+bool hsm_store_parse_name(const char *name, dev_t *device, ino_t *inode);
+
+/*
+  hash of a name, for splitting a directory between list parts
+ */
+unsigned hsm_store_name_part(const char *name, unsigned num_parts);
+
+/*
+  the modification time of a store file in microseconds, for backends
+  that use it as the time of an object
+ */
+uint64_t hsm_store_mtime(const struct stat *st);
+
+/*
+  true if reads of a handle may be done by several threads at once,
+  with hsm_store_pread_shared()
+ */
+bool hsm_store_concurrent_reads(struct hsm_store_handle *h);
+ssize_t hsm_store_pread_shared(struct hsm_store_handle *h, uint8_t *buf, size_t n,
+			       off_t ofs);
+
+/*
+  compressed framing of objects, done by the generic layer for every
+  backend. See store_frame.c
+ */
+int hsm_frame_set_option(struct hsm_store_context *ctx, const char *name,
+			 const char *value);
+bool hsm_frame_needed(const uint8_t *buf, size_t n);
+int hsm_frame_write_start(struct hsm_store_handle *h);
+int hsm_frame_write(struct hsm_store_handle *h, const uint8_t *buf, size_t n);
+int hsm_frame_write_zeros(struct hsm_store_handle *h, uint64_t n);
+int hsm_frame_write_finish(struct hsm_store_handle *h);
+int hsm_frame_object_id(struct hsm_store_handle *h, uint32_t *id);
+int hsm_frame_read_start(struct hsm_store_handle *h);
+void hsm_frame_range(struct hsm_store_handle *h, size_t n, off_t ofs,
+		     off_t *cofs, size_t *clen);
+ssize_t hsm_frame_decode(struct hsm_store_handle *h, const uint8_t *cbuf,
+			 uint8_t *buf, size_t n, off_t ofs);
+ssize_t hsm_frame_pread(struct hsm_store_handle *h, uint8_t *buf, size_t n, off_t ofs);
+ssize_t hsm_frame_pread_shared(struct hsm_store_handle *h, uint8_t *buf, size_t n,
+			       off_t ofs);
+uint64_t hsm_frame_seek(struct hsm_store_handle *h, uint64_t ofs, bool data);
+size_t hsm_frame_map_range(struct hsm_store_handle *h, size_t n, off_t ofs,
+			   off_t *cofs, size_t *clen, size_t *skip);
+int hsm_frame_map_check(struct hsm_store_handle *h, const uint8_t *cbuf,
+			off_t ofs, size_t clen);
+void hsm_frame_free(struct hsm_store_frame *f);
+
+/*
+  local cache of store objects, see store_cache.c
+ */
+int hsm_cache_set_option(struct hsm_store_context *ctx, const char *name,
+			 const char *value);
+int hsm_cache_connect(struct hsm_store_context *ctx);
+void hsm_cache_shutdown(struct hsm_store_context *ctx);
+void hsm_cache_read_start(struct hsm_store_handle *h);
+void hsm_cache_read_end(struct hsm_store_handle *h);
+void hsm_cache_fill(struct hsm_store_handle *h, const uint8_t *buf, ssize_t n,
+		    int64_t ofs);
+void hsm_cache_write_start(struct hsm_store_handle *h);
+void hsm_cache_write(struct hsm_store_handle *h, const uint8_t *buf, size_t n,
+		     uint64_t ofs);
+void hsm_cache_write_end(struct hsm_store_handle *h, bool ok);
+void hsm_cache_remove(struct hsm_store_context *ctx, dev_t device, ino_t inode);
+
+/*
+  I/O that bypasses the page cache, see store_direct.c
+ */
+int hsm_direct_set_option(struct hsm_store_context *ctx, const char *name,
+			  const char *value);
+void hsm_direct_shutdown(struct hsm_store_context *ctx);
+bool hsm_direct_aligned(const void *buf, off_t ofs, size_t n);
+void hsm_direct_start(struct hsm_store_handle *h);
+int hsm_direct_fd(struct hsm_store_handle *h);
+bool hsm_direct_failed(struct hsm_store_handle *h, int err);
+void hsm_direct_dontneed(struct hsm_store_context *ctx, int fd, off_t ofs, off_t len);
+void hsm_direct_read_done(struct hsm_store_handle *h, off_t ofs, size_t n);
+ssize_t hsm_direct_pread(struct hsm_store_handle *h, uint8_t *buf, size_t n, off_t ofs);
+int hsm_direct_write(struct hsm_store_handle *h, const uint8_t *buf, size_t n);
+int hsm_direct_finish(struct hsm_store_handle *h);
+void hsm_direct_end(struct hsm_store_handle *h);
+
+/*
+  CRC32C, see crc32c.c
+ */
+uint32_t hsm_crc32c(uint32_t crc, const void *buf, size_t n);
+
+/*
+  asynchronous reads, for the store queue. See store_queue.c
+ */
+struct hsm_store_aio *hsm_store_aio_prepare(struct hsm_store_handle *h, uint8_t *buf,
+					    size_t n, off_t ofs);
+bool hsm_store_aio_describe(struct hsm_store_aio *a, int *fd, void **buf,
+			    size_t *n, off_t *ofs);
+ssize_t hsm_store_aio_complete(struct hsm_store_aio *a, ssize_t ret, int err);
+
+/*
+  raw access to an object, below any framing, for the framing code
+ */
+int hsm_store_raw_write(struct hsm_store_handle *h, const uint8_t *buf, size_t n);
+ssize_t hsm_store_raw_pread(struct hsm_store_handle *h, uint8_t *buf, size_t n, off_t ofs);
+
+/*
+  an append-only log of fixed size records, shared between the
+  processes using a store. See store_log.c
+ */
+struct hsm_store_log {
+	const char *name;
+	size_t rec_size;
+	/* called for each record in log order, and when the log has
+	   been rewritten and is about to be replayed from the start */
+	void (*apply)(void *private, const void *rec);
+	void (*reset)(void *private);
+	void *private;
+	char *fname;
+	int fd;
+	ino_t ino;
+	/* how far we have replayed */
+	off_t ofs;
+};
+
+int hsm_store_lock(int fd, bool wait, short type);
+void hsm_log_init(struct hsm_store_log *log, const char *name, size_t rec_size,
+		  void (*apply)(void *private, const void *rec),
+		  void (*reset)(void *private), void *private);
+void hsm_log_close(struct hsm_store_log *log);
+int hsm_log_update(struct hsm_store_context *ctx, struct hsm_store_log *log);
+int hsm_log_lock(struct hsm_store_context *ctx, struct hsm_store_log *log);
+void hsm_log_unlock(struct hsm_store_log *log);
+int hsm_log_write(struct hsm_store_context *ctx, struct hsm_store_log *log,
+		  const void *recs, unsigned count);
+int hsm_log_append(struct hsm_store_context *ctx, struct hsm_store_log *log,
+		   const void *recs, unsigned count);
+int hsm_log_rewrite(struct hsm_store_context *ctx, struct hsm_store_log *log,
+		    int (*fill)(void *private, int fd));
+
+/*
+  SHA-256, for naming deduplicated chunks. See sha256.c
+ */
+struct hsm_sha256 {
+	uint32_t state[8];
+	uint64_t length;
+	uint8_t buf[64];
+	unsigned buf_len;
+};
+
+void hsm_sha256_init(struct hsm_sha256 *c);
+void hsm_sha256_update(struct hsm_sha256 *c, const uint8_t *data, size_t n);
+void hsm_sha256_final(struct hsm_sha256 *c, uint8_t digest[32]);
@@ -0,0 +1,589 @@
+/*
+  a cache of store objects on local disk, in front of any backend
+
+  Objects written with the cache on are written through to it, and
+  objects read whole from the store are kept in it from the data the
+  reads brought in, so repeat recalls are served from local disk.
+  The shared store stays the authority: each cached copy records the
+  id from the frame header of the object it copies, and is only used
+  while the object in the store still has that id and size. Objects
+  without an id (raw objects) are never cached.
+
+  The cache directory is its own index, with one file per object
+  named by device and inode, so it survives restarts. A cache file's
+  mtime is when it was last used, and when the cache grows past its
+  size the least recently used files are removed. Several processes
+  can share a cache directory.
+ */
+
+#include "hacksm.h"
+#include "store_backend.h"
+#include <dirent.h>
+#include <limits.h>
+
+#define HSM_CACHE_MAGIC "HSMC"
+
+/* the cache is trimmed to this percentage of its size */
+#define HSM_CACHE_LOW_WATER 90
+
+/* default size of the cache */
+#define HSM_CACHE_DEFAULT_SIZE (10ULL * 1024 * 1024 * 1024)
+
+/* the most separate ranges of an object read while filling its
+   cached copy, beyond which it isn't cached */
+#define HSM_CACHE_FILL_RANGES 64
+
+/* at the start of each cache file, before the copy of the object */
+struct cache_header {
+	char magic[4];
+	uint32_t object_id;
+	/* size of the object in the store */
+	uint64_t size;
+};
+
+struct hsm_store_cache {
+	const char *path;
+	int dir_fd;
+	uint64_t max_size;
+	/* how much the cache holds, as of the last scan plus what we
+	   have added since */
+	pthread_mutex_t mutex;
+	uint64_t used;
+};
+
+struct cache_entry {
+	char name[64];
+	time_t mtime;
+	uint64_t size;
+};
+
+/*
+  a cached copy being filled from the reads of an object, with the
+  parts of the object read so far, in order and not touching
+ */
+struct hsm_cache_fill {
+	uint64_t size;
+	unsigned count;
+	struct {
+		uint64_t start, end;
+	} ranges[HSM_CACHE_FILL_RANGES];
+};
+
+static void cache_name(char name[64], dev_t device, ino_t inode)
+{
+	snprintf(name, 64, "0x%llx:0x%llx",
+		 (unsigned long long)device, (unsigned long long)inode);
+}
+
+/*
+  handle the cache=PATH and cache_size=BYTES store options
+ */
+int hsm_cache_set_option(struct hsm_store_context *ctx, const char *name,
+			 const char *value)
+{
+	struct hsm_store_cache *c = ctx->cache;
+
+	if (c == NULL) {
+		c = calloc(1, sizeof(*c));
+		if (c == NULL) {
+			ctx->errmsg = "Unable to allocate store cache";
+			errno = ENOMEM;
+			return -1;
+		}
+		c->dir_fd = -1;
+		c->max_size = HSM_CACHE_DEFAULT_SIZE;
+		pthread_mutex_init(&c->mutex, NULL);
+		ctx->cache = c;
+	}
+
+	if (strcmp(name, "cache") == 0) {
+		c->path = value;
+		return 0;
+	}
+
+	c->max_size = strtoull(value, NULL, 0);
+	if (c->max_size == 0) {
+		ctx->errmsg = "cache_size must be more than 0";
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  list the cache files, returning how many there are, and adding up
+  their size
+ */
+static int cache_scan(struct hsm_store_cache *c, struct cache_entry **entries,
+		      uint64_t *total)
+{
+	struct cache_entry *list = NULL;
+	unsigned count = 0, alloc = 0;
+	struct dirent *de;
+	DIR *d;
+	int fd;
+
+	*total = 0;
+
+	fd = dup(c->dir_fd);
+	if (fd == -1) {
+		return -1;
+	}
+	d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		return -1;
+	}
+	rewinddir(d);
+
+	while ((de = readdir(d)) != NULL) {
+		struct stat st;
+
+		if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(list->name) ||
+		    fstatat(c->dir_fd, de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+		if (entries != NULL) {
+			if (count == alloc) {
+				struct cache_entry *p;
+				alloc = alloc ? alloc * 2 : 256;
+				p = realloc(list, alloc * sizeof(*list));
+				if (p == NULL) {
+					break;
+				}
+				list = p;
+			}
+			strcpy(list[count].name, de->d_name);
+			list[count].mtime = st.st_mtime;
+			list[count].size = st.st_size;
+			count++;
+		}
+		*total += st.st_size;
+	}
+	closedir(d);
+
+	if (entries != NULL) {
+		*entries = list;
+	}
+	return count;
+}
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+	const struct cache_entry *e1 = a, *e2 = b;
+	if (e1->mtime != e2->mtime) {
+		return e1->mtime < e2->mtime ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+  remove the least recently used cache files until the cache is back
+  under its low water mark. The directory is scanned afresh, as other
+  processes may have added or removed files
+ */
+static void cache_evict(struct hsm_store_cache *c)
+{
+	struct cache_entry *list = NULL;
+	uint64_t total, target = c->max_size / 100 * HSM_CACHE_LOW_WATER;
+	int i, count;
+
+	count = cache_scan(c, &list, &total);
+	if (count == -1) {
+		return;
+	}
+
+	qsort(list, count, sizeof(*list), cache_entry_cmp);
+	for (i=0;i<count && total > target;i++) {
+		if (unlinkat(c->dir_fd, list[i].name, 0) == 0) {
+			total -= list[i].size;
+		}
+	}
+	free(list);
+
+	c->used = total;
+}
+
+/*
+  note a new cache file, trimming the cache if it has grown too big
+ */
+static void cache_added(struct hsm_store_cache *c, uint64_t size)
+{
+	pthread_mutex_lock(&c->mutex);
+	c->used += size;
+	if (c->used > c->max_size) {
+		cache_evict(c);
+	}
+	pthread_mutex_unlock(&c->mutex);
+}
+
+/*
+  open the cache directory, creating it if needed
+ */
+int hsm_cache_connect(struct hsm_store_context *ctx)
+{
+	struct hsm_store_cache *c = ctx->cache;
+
+	if (c == NULL) {
+		return 0;
+	}
+	if (c->path == NULL) {
+		ctx->errmsg = "cache_size given without a cache directory";
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (mkdir(c->path, 0700) != 0 && errno != EEXIST) {
+		ctx->errmsg = "Unable to create store cache directory";
+		return -1;
+	}
+	c->dir_fd = open(c->path, O_RDONLY|O_DIRECTORY);
+	if (c->dir_fd == -1) {
+		ctx->errmsg = "Unable to open store cache directory";
+		return -1;
+	}
+
+	if (cache_scan(c, NULL, &c->used) == -1) {
+		ctx->errmsg = "Unable to read store cache directory";
+		return -1;
+	}
+	return 0;
+}
+
+void hsm_cache_shutdown(struct hsm_store_context *ctx)
+{
+	struct hsm_store_cache *c = ctx->cache;
+
+	if (c == NULL) {
+		return;
+	}
+	if (c->dir_fd != -1) {
+		close(c->dir_fd);
+	}
+	pthread_mutex_destroy(&c->mutex);
+	free(c);
+	ctx->cache = NULL;
+}
+
+/*
+  create a temporary cache file, to be renamed into place once it is
+  complete
+ */
+static int cache_tmp(struct hsm_store_cache *c, char tmpname[PATH_MAX])
+{
+	snprintf(tmpname, PATH_MAX, "%s/.tmp.XXXXXX", c->path);
+	return mkstemp(tmpname);
+}
+
+/*
+  put a complete temporary cache file in place for an object
+ */
+static int cache_commit(struct hsm_store_cache *c, struct hsm_store_handle *h,
+			int fd, const char *tmpname, uint64_t size)
+{
+	struct cache_header hdr;
+	char name[64], *final;
+	int ret;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HSM_CACHE_MAGIC, 4);
+	hdr.object_id = h->object_id;
+	hdr.size = size;
+
+	cache_name(name, h->device, h->inode);
+	if (asprintf(&final, "%s/%s", c->path, name) == -1) {
+		unlink(tmpname);
+		return -1;
+	}
+
+	ret = pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) ? 0 : -1;
+	if (ret == 0) {
+		ret = rename(tmpname, final);
+	}
+	if (ret != 0) {
+		unlink(tmpname);
+	}
+	free(final);
+
+	if (ret == 0) {
+		cache_added(c, size + sizeof(hdr));
+	}
+	return ret;
+}
+
+/*
+  note that a range of the object has been copied, returning false
+  if there are too many ranges to keep track of
+ */
+static bool fill_add(struct hsm_cache_fill *f, uint64_t start, uint64_t end)
+{
+	unsigned i, j;
+
+	for (i=0;i<f->count && f->ranges[i].end < start;i++) ;
+	for (j=i;j<f->count && f->ranges[j].start <= end;j++) {
+		if (f->ranges[j].start < start) {
+			start = f->ranges[j].start;
+		}
+		if (f->ranges[j].end > end) {
+			end = f->ranges[j].end;
+		}
+	}
+	if (j == i) {
+		if (f->count == HSM_CACHE_FILL_RANGES) {
+			return false;
+		}
+		memmove(&f->ranges[i+1], &f->ranges[i], (f->count - i) * sizeof(f->ranges[0]));
+		f->count++;
+	} else {
+		memmove(&f->ranges[i+1], &f->ranges[j], (f->count - j) * sizeof(f->ranges[0]));
+		f->count -= j - i - 1;
+	}
+	f->ranges[i].start = start;
+	f->ranges[i].end = end;
+	return true;
+}
+
+/*
+  give up filling the cached copy of an object
+ */
+static void fill_abandon(struct hsm_store_handle *h)
+{
+	unlink(h->cache_tmpname);
+	close(h->cache_fd);
+	h->cache_fd = -1;
+	free(h->cache_tmpname);
+	h->cache_tmpname = NULL;
+	free(h->cache_fill);
+	h->cache_fill = NULL;
+}
+
+/*
+  start filling a cached copy of an object from the reads done on it.
+  Nothing is read from the store just for the cache, so a partial
+  recall doesn't wait for the whole object, and the copy is only
+  kept if the object turns out to be read whole
+ */
+static void fill_start(struct hsm_store_cache *c, struct hsm_store_handle *h)
+{
+	uint32_t id;
+
+	/* an object that would take up much of the cache is left out */
+	if (h->size > c->max_size / 4) {
+		return;
+	}
+
+	h->cache_fill = calloc(1, sizeof(struct hsm_cache_fill));
+	h->cache_tmpname = malloc(PATH_MAX);
+	if (h->cache_fill == NULL || h->cache_tmpname == NULL) {
+		free(h->cache_fill);
+		free(h->cache_tmpname);
+		h->cache_fill = NULL;
+		h->cache_tmpname = NULL;
+		return;
+	}
+	h->cache_fd = cache_tmp(c, h->cache_tmpname);
+	if (h->cache_fd == -1) {
+		free(h->cache_fill);
+		free(h->cache_tmpname);
+		h->cache_fill = NULL;
+		h->cache_tmpname = NULL;
+		return;
+	}
+	h->cache_fill->size = h->size;
+
+	/* the frame header was read before the fill started */
+	if (hsm_frame_object_id(h, &id) != 0) {
+		fill_abandon(h);
+	}
+}
+
+/*
+  copy data just read from the store at ofs into the cached copy
+  being filled. The read may start before or run past the object,
+  when it was made in whole blocks
+ */
+void hsm_cache_fill(struct hsm_store_handle *h, const uint8_t *buf, ssize_t n,
+		    int64_t ofs)
+{
+	struct hsm_cache_fill *f = h->cache_fill;
+
+	if (f == NULL || n <= 0) {
+		return;
+	}
+	if (ofs < 0) {
+		if (n <= -ofs) {
+			return;
+		}
+		buf -= ofs;
+		n += ofs;
+		ofs = 0;
+	}
+	if (ofs >= f->size) {
+		return;
+	}
+	if (ofs + n > f->size) {
+		n = f->size - ofs;
+	}
+	if (pwrite(h->cache_fd, buf, n, sizeof(struct cache_header) + ofs) != n ||
+	    !fill_add(f, ofs, ofs + n)) {
+		fill_abandon(h);
+	}
+}
+
+/*
+  open the cached copy of an object, if it matches the object in the
+  store, which has been opened on h
+ */
+static int cache_lookup(struct hsm_store_cache *c, struct hsm_store_handle *h)
+{
+	struct cache_header hdr;
+	char name[64];
+	int fd;
+
+	cache_name(name, h->device, h->inode);
+	fd = openat(c->dir_fd, name, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, HSM_CACHE_MAGIC, 4) != 0 ||
+	    hdr.object_id != h->object_id || hdr.size != h->size) {
+		/* the object has been written again since */
+		close(fd);
+		unlinkat(c->dir_fd, name, 0);
+		return -1;
+	}
+
+	/* the mtime of a cache file is when it was last used */
+	futimens(fd, NULL);
+	return fd;
+}
+
+/*
+  called when an object has been opened for reading, before its frame
+  is loaded. Reads are switched to the cached copy of the object, or
+  if there isn't one, a copy is filled as the object is read
+ */
+void hsm_cache_read_start(struct hsm_store_handle *h)
+{
+	struct hsm_store_cache *c = h->ctx->cache;
+	int fd;
+
+	if (c == NULL || hsm_frame_object_id(h, &h->object_id) != 0) {
+		return;
+	}
+
+	fd = cache_lookup(c, h);
+	if (fd == -1) {
+		fill_start(c, h);
+		return;
+	}
+
+	h->store_fd = h->fd;
+	h->store_base = h->base;
+	h->fd = fd;
+	h->base = sizeof(struct cache_header);
+	h->cached = true;
+}
+
+/*
+  called before the backend closes an object opened for reading. A
+  cached copy being filled is kept if every byte of the object was
+  read
+ */
+void hsm_cache_read_end(struct hsm_store_handle *h)
+{
+	struct hsm_cache_fill *f = h->cache_fill;
+
+	if (f != NULL) {
+		if (f->count == 1 && f->ranges[0].start == 0 && f->ranges[0].end == f->size) {
+			cache_commit(h->ctx->cache, h, h->cache_fd, h->cache_tmpname, f->size);
+			close(h->cache_fd);
+			h->cache_fd = -1;
+			free(h->cache_tmpname);
+			h->cache_tmpname = NULL;
+			free(f);
+			h->cache_fill = NULL;
+		} else {
+			fill_abandon(h);
+		}
+	}
+	if (h->cached) {
+		close(h->fd);
+		h->fd = h->store_fd;
+		h->base = h->store_base;
+		h->cached = false;
+	}
+}
+
+/*
+  start writing an object through to the cache
+ */
+void hsm_cache_write_start(struct hsm_store_handle *h)
+{
+	struct hsm_store_cache *c = h->ctx->cache;
+
+	h->cache_fd = -1;
+	if (c == NULL) {
+		return;
+	}
+	h->cache_tmpname = malloc(PATH_MAX);
+	if (h->cache_tmpname == NULL) {
+		return;
+	}
+	h->cache_fd = cache_tmp(c, h->cache_tmpname);
+	if (h->cache_fd == -1) {
+		free(h->cache_tmpname);
+		h->cache_tmpname = NULL;
+	}
+}
+
+/*
+  finish writing an object through to the cache, once the store has
+  it. 'ok' is false if the object wasn't stored
+ */
+void hsm_cache_write_end(struct hsm_store_handle *h, bool ok)
+{
+	if (h->cache_fd == -1) {
+		return;
+	}
+	if (ok && h->object_id != 0) {
+		cache_commit(h->ctx->cache, h, h->cache_fd, h->cache_tmpname, h->ofs);
+	} else {
+		unlink(h->cache_tmpname);
+	}
+	close(h->cache_fd);
+	h->cache_fd = -1;
+	free(h->cache_tmpname);
+	h->cache_tmpname = NULL;
+}
+
+/*
+  write data written to the store at ofs through to the cache. If the
+  cache can't take it the object just isn't cached
+ */
+void hsm_cache_write(struct hsm_store_handle *h, const uint8_t *buf, size_t n,
+		     uint64_t ofs)
+{
+	if (h->cache_fd == -1) {
+		return;
+	}
+	if (pwrite(h->cache_fd, buf, n, sizeof(struct cache_header) + ofs) != n) {
+		hsm_cache_write_end(h, false);
+	}
+}
+
+/*
+  drop the cached copy of an object removed from the store
+ */
+void hsm_cache_remove(struct hsm_store_context *ctx, dev_t device, ino_t inode)
+{
+	struct hsm_store_cache *c = ctx->cache;
+	char name[64];
+
+	if (c == NULL || c->dir_fd == -1) {
+		return;
+	}
+	cache_name(name, device, inode);
+	unlinkat(c->dir_fd, name, 0);
+}
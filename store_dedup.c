@@ -0,0 +1,1128 @@
+/*
+  HSM store backend deduplicating objects by content
+
+  Object data is cut into chunks at points chosen by the content
+  (a gear hash of the bytes just before), so an insert or delete in a
+  file only changes the chunks around it. Each chunk is kept once, in
+  a file named by its SHA-256, and each object is a recipe listing
+  its chunks. Migrating a near copy of a stored file costs mostly
+  hashing.
+
+  A log of reference count changes lets a garbage collector find
+  chunks no recipe uses. References are always added before a recipe
+  is written and dropped after one is removed, so a crash can only
+  leak chunks, never lose them.
+ */
+
+#include "hacksm.h"
+#include "store_backend.h"
+#include <pthread.h>
+#include <dirent.h>
+
+#define HSM_DEDUP_REFS "dedup.refs"
+#define HSM_DEDUP_CHUNKS "chunks"
+#define HSM_DEDUP_OBJECTS "objects"
+#define HSM_DEDUP_MAGIC "HSMD"
+
+/* default average chunk size. Chunks are between a quarter and four
+   times this */
+#define HSM_DEDUP_CHUNK 0x10000
+#define HSM_DEDUP_MIN_CHUNK 0x1000
+#define HSM_DEDUP_MAX_CHUNK 0x400000
+
+/* the reference log is rewritten when it is this many times bigger
+   than the live chunks in it, and at least this big */
+#define HSM_DEDUP_REFS_RATIO 4
+#define HSM_DEDUP_REFS_MIN 0x100000
+
+/* a reference count change. A change of zero records that the chunk
+   was deleted by the garbage collector */
+struct dedup_record {
+	uint8_t hash[32];
+	int32_t delta;
+	uint32_t length;
+};
+
+/* the start of a recipe */
+struct dedup_recipe {
+	char magic[4];
+	uint32_t num_chunks;
+	/* size of the object */
+	uint64_t size;
+	/* when the object was written, in microseconds since the
+	   epoch */
+	uint64_t time;
+};
+
+/* each chunk in a recipe */
+struct dedup_chunk {
+	uint8_t hash[32];
+	uint32_t length;
+	uint32_t reserved;
+};
+
+/* reference count of a chunk, only kept by a process that collects
+   garbage */
+struct dedup_ref {
+	struct dedup_ref *next;
+	uint8_t hash[32];
+	int64_t refs;
+	uint32_t length;
+};
+
+struct dedup_store {
+	unsigned chunk_avg;
+	uint64_t mask;
+	pthread_mutex_t mutex;
+	/* the store directory, for syncing it */
+	int dir_fd;
+	struct hsm_store_log refs;
+	/* reference counts, loaded on the first garbage collection */
+	bool loaded;
+	struct dedup_ref **hash;
+	unsigned hash_size;
+	unsigned num_refs;
+};
+
+/* state of a handle open for writing */
+struct dedup_write {
+	dev_t device;
+	ino_t inode;
+	uint64_t fp;
+	uint8_t *buf;
+	uint32_t len;
+	struct dedup_chunk *chunks;
+	unsigned num_chunks, alloc;
+	uint64_t size;
+};
+
+/* state of a handle open for reading */
+struct dedup_read {
+	struct dedup_recipe recipe;
+	struct dedup_chunk *chunks;
+	/* where each chunk starts in the object. There is one more
+	   than there are chunks */
+	uint64_t *offsets;
+	/* the last chunk read */
+	uint8_t *buf;
+	int64_t buf_chunk;
+};
+
+/* random values for the gear hash. These decide where chunks are
+   cut, so must never change for an existing store */
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void gear_init(void)
+{
+	uint64_t x = 0x6861636b736d6421ULL;
+	unsigned i;
+
+	/* splitmix64 */
+	for (i=0;i<256;i++) {
+		uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+static uint64_t dedup_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+  name of a chunk file
+ */
+static char *chunk_fname(struct hsm_store_context *ctx, const uint8_t hash[32])
+{
+	char hex[65], *fname = NULL;
+	unsigned i;
+
+	for (i=0;i<32;i++) {
+		sprintf(hex + i*2, "%02x", hash[i]);
+	}
+	if (asprintf(&fname, "%s/%s/%.2s/%s", ctx->basepath, HSM_DEDUP_CHUNKS,
+		     hex, hex + 2) == -1) {
+		ctx->errmsg = "Unable to allocate store filename";
+		errno = ENOMEM;
+		return NULL;
+	}
+	return fname;
+}
+
+/*
+  name of a recipe, with an optional suffix
+ */
+static char *recipe_fname(struct hsm_store_context *ctx, dev_t device, ino_t inode,
+			  const char *suffix)
+{
+	char *fname = NULL;
+
+	if (asprintf(&fname, "%s/%s/0x%llx:0x%llx%s", ctx->basepath, HSM_DEDUP_OBJECTS,
+		     (unsigned long long)device, (unsigned long long)inode,
+		     suffix ? suffix : "") == -1) {
+		ctx->errmsg = "Unable to allocate store filename";
+		errno = ENOMEM;
+		return NULL;
+	}
+	return fname;
+}
+
+/*
+  load a recipe, returning the chunks in it
+ */
+static struct dedup_chunk *recipe_load(struct hsm_store_context *ctx, const char *fname,
+				       struct dedup_recipe *recipe)
+{
+	struct dedup_chunk *chunks;
+	size_t len;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd == -1) {
+		ctx->errmsg = "Object not in store";
+		return NULL;
+	}
+	if (read(fd, recipe, sizeof(*recipe)) != sizeof(*recipe) ||
+	    memcmp(recipe->magic, HSM_DEDUP_MAGIC, 4) != 0) {
+		close(fd);
+		ctx->errmsg = "Corrupt store recipe";
+		errno = EIO;
+		return NULL;
+	}
+	len = recipe->num_chunks * sizeof(struct dedup_chunk);
+	chunks = malloc(len + 1);
+	if (chunks == NULL || read(fd, chunks, len) != len) {
+		free(chunks);
+		close(fd);
+		ctx->errmsg = "Unable to read store recipe";
+		errno = EIO;
+		return NULL;
+	}
+	close(fd);
+	return chunks;
+}
+
+/*
+  add or drop a reference to each chunk in a list. When adding, the
+  chunks are checked to still be there with the log locked. The
+  garbage collector holds the log lock while it deletes, so once the
+  references are in the log the chunks are safe
+ */
+static int refs_change(struct hsm_store_context *ctx, const struct dedup_chunk *chunks,
+		       unsigned num_chunks, int delta)
+{
+	struct dedup_store *ds = ctx->private;
+	struct dedup_record *recs;
+	unsigned i;
+	int ret = 0;
+
+	if (num_chunks == 0) {
+		return 0;
+	}
+	recs = calloc(num_chunks, sizeof(*recs));
+	if (recs == NULL) {
+		ctx->errmsg = "Unable to allocate reference records";
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i=0;i<num_chunks;i++) {
+		memcpy(recs[i].hash, chunks[i].hash, 32);
+		recs[i].delta = delta;
+		recs[i].length = chunks[i].length;
+	}
+	pthread_mutex_lock(&ds->mutex);
+	if (hsm_log_lock(ctx, &ds->refs) != 0) {
+		pthread_mutex_unlock(&ds->mutex);
+		free(recs);
+		return -1;
+	}
+	for (i=0;i<num_chunks && delta > 0 && ret == 0;i++) {
+		char *cname = chunk_fname(ctx, chunks[i].hash);
+		if (cname == NULL || access(cname, F_OK) != 0) {
+			ctx->errmsg = "Chunk removed by garbage collection during write";
+			errno = EAGAIN;
+			ret = -1;
+		}
+		free(cname);
+	}
+	if (ret == 0) {
+		ret = hsm_log_write(ctx, &ds->refs, recs, num_chunks);
+	}
+	hsm_log_unlock(&ds->refs);
+	pthread_mutex_unlock(&ds->mutex);
+	free(recs);
+	return ret;
+}
+
+/*
+  stop other processes replacing or removing recipes while we look
+  at one. The reference log's lock is used, as recipes are replaced
+  and removed rarely compared with their chunks being referenced
+ */
+static int recipe_lock(struct hsm_store_context *ctx)
+{
+	struct dedup_store *ds = ctx->private;
+
+	pthread_mutex_lock(&ds->mutex);
+	if (hsm_log_lock(ctx, &ds->refs) != 0) {
+		pthread_mutex_unlock(&ds->mutex);
+		return -1;
+	}
+	return 0;
+}
+
+static void recipe_unlock(struct hsm_store_context *ctx)
+{
+	struct dedup_store *ds = ctx->private;
+
+	hsm_log_unlock(&ds->refs);
+	pthread_mutex_unlock(&ds->mutex);
+}
+
+/*
+  remove a recipe, so that exactly one remover or replacer drops its
+  references. Returns the chunks it held, or NULL with errno ENOENT
+  if there was no recipe. Unless 'time' is UINT64_MAX, a recipe that
+  doesn't have that time is left in place, failing with EEXIST. Must
+  be called with recipes locked, so the recipe checked is the one
+  removed
+ */
+static struct dedup_chunk *recipe_claim(struct hsm_store_context *ctx, const char *fname,
+					struct dedup_recipe *recipe, uint64_t time)
+{
+	struct dedup_chunk *chunks;
+	struct stat st;
+
+	chunks = recipe_load(ctx, fname, recipe);
+	if (chunks == NULL) {
+		return NULL;
+	}
+	if (time != UINT64_MAX &&
+	    (stat(fname, &st) != 0 || hsm_store_mtime(&st) != time)) {
+		free(chunks);
+		ctx->errmsg = "Store object was written again since the removal";
+		errno = EEXIST;
+		return NULL;
+	}
+	if (unlink(fname) != 0) {
+		free(chunks);
+		ctx->errmsg = "Unable to remove recipe";
+		return NULL;
+	}
+	return chunks;
+}
+
+static unsigned ref_hash(struct dedup_store *ds, const uint8_t hash[32])
+{
+	uint64_t h;
+	memcpy(&h, hash, sizeof(h));
+	return h % ds->hash_size;
+}
+
+static struct dedup_ref **ref_find(struct dedup_store *ds, const uint8_t hash[32])
+{
+	struct dedup_ref **r;
+
+	for (r=&ds->hash[ref_hash(ds, hash)]; *r; r=&(*r)->next) {
+		if (memcmp((*r)->hash, hash, 32) == 0) {
+			break;
+		}
+	}
+	return r;
+}
+
+static void ref_rehash(struct dedup_store *ds)
+{
+	struct dedup_ref **old = ds->hash;
+	unsigned i, old_size = ds->hash_size;
+
+	ds->hash = calloc(old_size * 2, sizeof(struct dedup_ref *));
+	if (ds->hash == NULL) {
+		ds->hash = old;
+		return;
+	}
+	ds->hash_size = old_size * 2;
+	for (i=0;i<old_size;i++) {
+		struct dedup_ref *r, *next;
+		for (r=old[i]; r; r=next) {
+			unsigned h = ref_hash(ds, r->hash);
+			next = r->next;
+			r->next = ds->hash[h];
+			ds->hash[h] = r;
+		}
+	}
+	free(old);
+}
+
+/*
+  apply a reference log record
+ */
+static void dedup_apply(void *private, const void *p)
+{
+	struct dedup_store *ds = private;
+	const struct dedup_record *rec = p;
+	struct dedup_ref **rp = ref_find(ds, rec->hash), *r = *rp;
+
+	if (rec->delta == 0) {
+		if (r != NULL) {
+			*rp = r->next;
+			free(r);
+			ds->num_refs--;
+		}
+		return;
+	}
+	if (r == NULL) {
+		r = calloc(1, sizeof(*r));
+		if (r == NULL) {
+			return;
+		}
+		memcpy(r->hash, rec->hash, 32);
+		r->length = rec->length;
+		*rp = r;
+		if (++ds->num_refs > ds->hash_size) {
+			ref_rehash(ds);
+		}
+	}
+	r->refs += rec->delta;
+}
+
+static void dedup_reset(void *private)
+{
+	struct dedup_store *ds = private;
+	unsigned i;
+
+	for (i=0;i<ds->hash_size;i++) {
+		while (ds->hash[i]) {
+			struct dedup_ref *r = ds->hash[i];
+			ds->hash[i] = r->next;
+			free(r);
+		}
+	}
+	ds->num_refs = 0;
+}
+
+static int dedup_refs_fill(void *private, int fd)
+{
+	struct dedup_store *ds = private;
+	unsigned i;
+
+	for (i=0;i<ds->hash_size;i++) {
+		struct dedup_ref *r;
+		for (r=ds->hash[i]; r; r=r->next) {
+			struct dedup_record rec;
+			if (r->refs <= 0) {
+				continue;
+			}
+			memcpy(rec.hash, r->hash, 32);
+			rec.delta = r->refs;
+			rec.length = r->length;
+			if (write(fd, &rec, sizeof(rec)) != sizeof(rec)) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+  set up the backend state
+ */
+static int dedup_init(struct hsm_store_context *ctx)
+{
+	struct dedup_store *ds;
+
+	pthread_once(&gear_once, gear_init);
+
+	ds = calloc(1, sizeof(struct dedup_store));
+	if (ds == NULL) {
+		ctx->errmsg = "Unable to allocate dedup store";
+		errno = ENOMEM;
+		return -1;
+	}
+	ds->chunk_avg = HSM_DEDUP_CHUNK;
+	ds->dir_fd = -1;
+	pthread_mutex_init(&ds->mutex, NULL);
+	/* only a process collecting garbage reads the log */
+	hsm_log_init(&ds->refs, HSM_DEDUP_REFS, sizeof(struct dedup_record),
+		     NULL, NULL, ds);
+	ctx->private = ds;
+	return 0;
+}
+
+/*
+  set a dedup store option. The dedup store knows this option:
+
+    chunk_avg=BYTES   average chunk size, a power of 2. Changing it
+                      on an existing store stops new objects sharing
+                      chunks with old ones
+ */
+static int dedup_set_option(struct hsm_store_context *ctx, const char *name,
+			    const char *value)
+{
+	struct dedup_store *ds = ctx->private;
+
+	if (strcmp(name, "chunk_avg") == 0) {
+		ds->chunk_avg = strtoul(value, NULL, 0);
+		if (ds->chunk_avg < HSM_DEDUP_MIN_CHUNK * 4 ||
+		    ds->chunk_avg > HSM_DEDUP_MAX_CHUNK / 4 ||
+		    (ds->chunk_avg & (ds->chunk_avg - 1)) != 0) {
+			ctx->errmsg = "chunk_avg must be a power of 2 from 16k to 1M";
+			errno = EINVAL;
+			return -1;
+		}
+		return 0;
+	}
+
+	ctx->errmsg = "Unknown store option";
+	errno = EINVAL;
+	return -1;
+}
+
+static int dedup_connect(struct hsm_store_context *ctx)
+{
+	struct dedup_store *ds = ctx->private;
+	const char *dirs[] = { HSM_DEDUP_CHUNKS, HSM_DEDUP_OBJECTS };
+	unsigned i, bits;
+
+	for (i=0;i<2;i++) {
+		char *dname = NULL;
+		if (asprintf(&dname, "%s/%s", ctx->basepath, dirs[i]) == -1) {
+			ctx->errmsg = "Unable to allocate store filename";
+			return -1;
+		}
+		if (mkdir(dname, 0700) != 0 && errno != EEXIST) {
+			free(dname);
+			ctx->errmsg = "Unable to create store directory";
+			return -1;
+		}
+		free(dname);
+	}
+
+	ds->dir_fd = open(ctx->basepath, O_RDONLY);
+	if (ds->dir_fd == -1) {
+		ctx->errmsg = "Unable to open store directory";
+		return -1;
+	}
+
+	/* cut where the top log2(avg) bits of the hash are zero */
+	for (bits=0; (1U<<bits) < ds->chunk_avg; bits++) ;
+	ds->mask = ~0ULL << (64 - bits);
+
+	return hsm_log_update(ctx, &ds->refs);
+}
+
+static void dedup_shutdown(struct hsm_store_context *ctx)
+{
+	struct dedup_store *ds = ctx->private;
+
+	if (ds->hash) {
+		dedup_reset(ds);
+		free(ds->hash);
+	}
+	hsm_log_close(&ds->refs);
+	if (ds->dir_fd != -1) {
+		close(ds->dir_fd);
+	}
+	pthread_mutex_destroy(&ds->mutex);
+	free(ds);
+	ctx->private = NULL;
+}
+
+/*
+  store a chunk, unless a chunk with the same content is stored
+  already. Chunks aren't synced here, the whole store is synced when
+  the object is closed
+ */
+static int chunk_store(struct hsm_store_context *ctx, const uint8_t *buf, uint32_t len,
+		       struct dedup_chunk *chunk)
+{
+	struct hsm_sha256 sha;
+	char *fname, *tmpname = NULL;
+	int fd;
+
+	hsm_sha256_init(&sha);
+	hsm_sha256_update(&sha, buf, len);
+	hsm_sha256_final(&sha, chunk->hash);
+	chunk->length = len;
+	chunk->reserved = 0;
+
+	fname = chunk_fname(ctx, chunk->hash);
+	if (fname == NULL) {
+		return -1;
+	}
+	if (access(fname, F_OK) == 0) {
+		free(fname);
+		return 0;
+	}
+
+	if (asprintf(&tmpname, "%s.XXXXXX", fname) == -1) {
+		free(fname);
+		ctx->errmsg = "Unable to allocate store filename";
+		return -1;
+	}
+	fd = mkstemp(tmpname);
+	if (fd == -1 && errno == ENOENT) {
+		/* the first chunk in this directory */
+		char *p = strrchr(fname, '/');
+		*p = 0;
+		mkdir(fname, 0700);
+		*p = '/';
+		strcpy(tmpname + strlen(tmpname) - 6, "XXXXXX");
+		fd = mkstemp(tmpname);
+	}
+	if (fd == -1) {
+		ctx->errmsg = "Unable to create chunk";
+		goto failed;
+	}
+	if (write(fd, buf, len) != len) {
+		close(fd);
+		ctx->errmsg = "Unable to write chunk";
+		goto failed;
+	}
+	close(fd);
+	if (rename(tmpname, fname) != 0) {
+		ctx->errmsg = "Unable to create chunk";
+		goto failed;
+	}
+	free(tmpname);
+	free(fname);
+	return 0;
+
+failed:
+	unlink(tmpname);
+	free(tmpname);
+	free(fname);
+	return -1;
+}
+
+/*
+  finish the chunk being written
+ */
+static int dedup_cut(struct hsm_store_handle *h)
+{
+	struct dedup_write *dw = h->private;
+
+	if (dw->num_chunks == dw->alloc) {
+		unsigned n = dw->alloc ? dw->alloc * 2 : 64;
+		struct dedup_chunk *c = realloc(dw->chunks, n * sizeof(*c));
+		if (c == NULL) {
+			h->ctx->errmsg = "Unable to allocate recipe";
+			errno = ENOMEM;
+			return -1;
+		}
+		dw->chunks = c;
+		dw->alloc = n;
+	}
+	if (chunk_store(h->ctx, dw->buf, dw->len, &dw->chunks[dw->num_chunks]) != 0) {
+		return -1;
+	}
+	dw->num_chunks++;
+	dw->size += dw->len;
+	dw->len = 0;
+	dw->fp = 0;
+	return 0;
+}
+
+/*
+  write to an object, cutting it into chunks
+ */
+static int dedup_write(struct hsm_store_handle *h, const uint8_t *buf, size_t n)
+{
+	struct dedup_store *ds = h->ctx->private;
+	struct dedup_write *dw = h->private;
+	uint32_t min = ds->chunk_avg / 4, max = ds->chunk_avg * 4;
+	size_t i;
+
+	for (i=0;i<n;i++) {
+		dw->buf[dw->len++] = buf[i];
+		dw->fp = (dw->fp << 1) + gear[buf[i]];
+		if ((dw->len >= min && (dw->fp & ds->mask) == 0) || dw->len == max) {
+			if (dedup_cut(h) != 0) {
+				return -1;
+			}
+		}
+	}
+	h->ofs += n;
+	return 0;
+}
+
+/*
+  finish writing an object. References to its chunks are added, then
+  the recipe is put in place, then any recipe it replaced lets go of
+  its chunks
+ */
+static int dedup_write_finish(struct hsm_store_handle *h)
+{
+	struct hsm_store_context *ctx = h->ctx;
+	struct dedup_store *ds = ctx->private;
+	struct dedup_write *dw = h->private;
+	struct dedup_recipe recipe, old_recipe;
+	struct dedup_chunk *old_chunks;
+	char *fname = NULL, *tmpname = NULL;
+	int fd;
+
+	if (dw->len > 0 && dedup_cut(h) != 0) {
+		return -1;
+	}
+
+	/* new chunks have to be on disk before a recipe can use them.
+	   With syncs deferred, nothing uses the recipe until the
+	   whole store is synced */
+	if (!ctx->defer_sync && syncfs(ds->dir_fd) != 0) {
+		ctx->errmsg = "Unable to sync store";
+		return -1;
+	}
+
+	if (refs_change(ctx, dw->chunks, dw->num_chunks, 1) != 0) {
+		return -1;
+	}
+
+	memcpy(recipe.magic, HSM_DEDUP_MAGIC, 4);
+	recipe.num_chunks = dw->num_chunks;
+	recipe.size = dw->size;
+	recipe.time = dedup_now();
+
+	fname = recipe_fname(ctx, dw->device, dw->inode, NULL);
+	tmpname = recipe_fname(ctx, dw->device, dw->inode, ".tmp");
+	if (fname == NULL || tmpname == NULL) {
+		goto failed;
+	}
+	fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1) {
+		ctx->errmsg = "Unable to create recipe";
+		goto failed;
+	}
+	if (write(fd, &recipe, sizeof(recipe)) != sizeof(recipe) ||
+	    write(fd, dw->chunks, dw->num_chunks * sizeof(struct dedup_chunk)) !=
+	    dw->num_chunks * sizeof(struct dedup_chunk) ||
+	    (!ctx->defer_sync && fsync(fd) != 0)) {
+		close(fd);
+		unlink(tmpname);
+		ctx->errmsg = "Unable to write recipe";
+		goto failed;
+	}
+	close(fd);
+
+	/* the old recipe's references are dropped by whoever takes
+	   it out of use, us or a remover */
+	if (recipe_lock(ctx) != 0) {
+		unlink(tmpname);
+		goto failed;
+	}
+	old_chunks = recipe_load(ctx, fname, &old_recipe);
+	if (rename(tmpname, fname) != 0) {
+		recipe_unlock(ctx);
+		unlink(tmpname);
+		free(old_chunks);
+		ctx->errmsg = "Unable to write recipe";
+		goto failed;
+	}
+	recipe_unlock(ctx);
+	if (!ctx->defer_sync) {
+		syncfs(ds->dir_fd);
+	}
+	if (old_chunks != NULL) {
+		refs_change(ctx, old_chunks, old_recipe.num_chunks, -1);
+		free(old_chunks);
+	}
+
+	free(fname);
+	free(tmpname);
+	return 0;
+
+failed:
+	refs_change(ctx, dw->chunks, dw->num_chunks, -1);
+	free(fname);
+	free(tmpname);
+	return -1;
+}
+
+/*
+  open an object in the store
+ */
+static int dedup_open(struct hsm_store_context *ctx, struct hsm_store_handle *h,
+		      dev_t device, ino_t inode)
+{
+	struct dedup_store *ds = ctx->private;
+	struct dedup_read *dr;
+	char *fname;
+	unsigned i;
+
+	if (!h->readonly) {
+		struct dedup_write *dw = calloc(1, sizeof(*dw));
+		if (dw == NULL || (dw->buf = malloc(ds->chunk_avg * 4)) == NULL) {
+			free(dw);
+			ctx->errmsg = "Unable to allocate store handle";
+			errno = ENOMEM;
+			return -1;
+		}
+		dw->device = device;
+		dw->inode = inode;
+		h->private = dw;
+		return 0;
+	}
+
+	dr = calloc(1, sizeof(*dr));
+	fname = recipe_fname(ctx, device, inode, NULL);
+	if (dr == NULL || fname == NULL) {
+		free(dr);
+		free(fname);
+		ctx->errmsg = "Unable to allocate store handle";
+		errno = ENOMEM;
+		return -1;
+	}
+	dr->chunks = recipe_load(ctx, fname, &dr->recipe);
+	free(fname);
+	if (dr->chunks == NULL) {
+		free(dr);
+		return -1;
+	}
+
+	dr->offsets = malloc((dr->recipe.num_chunks + 1) * sizeof(uint64_t));
+	if (dr->offsets == NULL) {
+		free(dr->chunks);
+		free(dr);
+		ctx->errmsg = "Unable to allocate store handle";
+		errno = ENOMEM;
+		return -1;
+	}
+	dr->offsets[0] = 0;
+	for (i=0;i<dr->recipe.num_chunks;i++) {
+		dr->offsets[i+1] = dr->offsets[i] + dr->chunks[i].length;
+	}
+	/* reads find their chunk from the offsets, so a recipe whose
+	   chunks don't add up to its size would send them past the
+	   last chunk */
+	if (dr->offsets[dr->recipe.num_chunks] != dr->recipe.size) {
+		free(dr->offsets);
+		free(dr->chunks);
+		free(dr);
+		ctx->errmsg = "Corrupt store recipe";
+		errno = EIO;
+		return -1;
+	}
+	dr->buf_chunk = -1;
+
+	h->private = dr;
+	h->size = dr->recipe.size;
+	return 0;
+}
+
+/*
+  read a chunk of an object into the handle buffer
+ */
+static int dedup_load_chunk(struct hsm_store_handle *h, unsigned chunk)
+{
+	struct dedup_read *dr = h->private;
+	uint32_t len = dr->chunks[chunk].length;
+	char *fname;
+	int fd;
+
+	if (dr->buf_chunk == chunk) {
+		return 0;
+	}
+	dr->buf_chunk = -1;
+
+	if (dr->buf == NULL) {
+		dr->buf = malloc(HSM_DEDUP_MAX_CHUNK);
+		if (dr->buf == NULL) {
+			h->ctx->errmsg = "Unable to allocate chunk buffer";
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	if (len > HSM_DEDUP_MAX_CHUNK) {
+		h->ctx->errmsg = "Corrupt store recipe";
+		errno = EIO;
+		return -1;
+	}
+
+	fname = chunk_fname(h->ctx, dr->chunks[chunk].hash);
+	if (fname == NULL) {
+		return -1;
+	}
+	fd = open(fname, O_RDONLY);
+	free(fname);
+	if (fd == -1) {
+		h->ctx->errmsg = "Missing store chunk";
+		return -1;
+	}
+	if (pread(fd, dr->buf, len, 0) != len) {
+		close(fd);
+		h->ctx->errmsg = "Short store chunk";
+		errno = EIO;
+		return -1;
+	}
+	close(fd);
+
+	dr->buf_chunk = chunk;
+	return 0;
+}
+
+/*
+  read from an object
+ */
+static ssize_t dedup_pread(struct hsm_store_handle *h, uint8_t *buf, size_t n, off_t ofs)
+{
+	struct dedup_read *dr = h->private;
+	unsigned lo = 0, hi = dr->recipe.num_chunks;
+	size_t done = 0;
+
+	if (ofs >= dr->recipe.size) {
+		return 0;
+	}
+	if (n > dr->recipe.size - ofs) {
+		n = dr->recipe.size - ofs;
+	}
+
+	/* find the chunk holding ofs */
+	while (hi - lo > 1) {
+		unsigned mid = (lo + hi) / 2;
+		if (dr->offsets[mid] <= ofs) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	while (done < n) {
+		uint64_t skip = ofs + done - dr->offsets[lo];
+		size_t len = dr->chunks[lo].length - skip;
+
+		if (len > n - done) {
+			len = n - done;
+		}
+		if (dedup_load_chunk(h, lo) != 0) {
+			return -1;
+		}
+		memcpy(buf + done, dr->buf + skip, len);
+		done += len;
+		lo++;
+	}
+	return n;
+}
+
+/*
+  close an object
+ */
+static int dedup_close(struct hsm_store_handle *h)
+{
+	int ret = 0;
+
+	if (!h->readonly) {
+		struct dedup_write *dw = h->private;
+		ret = dedup_write_finish(h);
+		free(dw->buf);
+		free(dw->chunks);
+		free(dw);
+	} else {
+		struct dedup_read *dr = h->private;
+		free(dr->chunks);
+		free(dr->offsets);
+		free(dr->buf);
+		free(dr);
+	}
+	return ret;
+}
+
+/*
+  the time of an object is the modification time of its recipe
+ */
+static int dedup_object_time(struct hsm_store_context *ctx,
+			     dev_t device, ino_t inode, uint64_t *time)
+{
+	struct stat st;
+	char *fname;
+	int ret;
+
+	fname = recipe_fname(ctx, device, inode, NULL);
+	if (fname == NULL) {
+		return -1;
+	}
+	ret = stat(fname, &st);
+	free(fname);
+	if (ret != 0) {
+		ctx->errmsg = "Object not in store";
+		return -1;
+	}
+	*time = hsm_store_mtime(&st);
+	return 0;
+}
+
+/*
+  remove an object if it still has the given time. Its chunks are
+  only deleted by garbage collection, once no other object uses them
+ */
+static int dedup_remove(struct hsm_store_context *ctx,
+			dev_t device, ino_t inode, uint64_t time)
+{
+	struct dedup_recipe recipe;
+	struct dedup_chunk *chunks;
+	char *fname;
+	int ret;
+
+	fname = recipe_fname(ctx, device, inode, NULL);
+	if (fname == NULL) {
+		return -1;
+	}
+
+	if (recipe_lock(ctx) != 0) {
+		free(fname);
+		return -1;
+	}
+	chunks = recipe_claim(ctx, fname, &recipe, time);
+	recipe_unlock(ctx);
+	free(fname);
+	if (chunks == NULL) {
+		return -1;
+	}
+	ret = refs_change(ctx, chunks, recipe.num_chunks, -1);
+	free(chunks);
+	return ret;
+}
+
+static uint64_t dedup_position(struct hsm_store_context *ctx,
+			       dev_t device, ino_t inode)
+{
+	return ((uint64_t)device << 48) ^ (uint64_t)inode;
+}
+
+/*
+  list part of the objects in the store, from their recipes
+ */
+static int dedup_list(struct hsm_store_context *ctx, unsigned part, unsigned num_parts,
+		      hsm_store_list_fn fn, void *private)
+{
+	struct dedup_store *ds = ctx->private;
+	struct dirent *de;
+	DIR *d;
+	int fd;
+
+	fd = openat(ds->dir_fd, HSM_DEDUP_OBJECTS, O_RDONLY|O_DIRECTORY);
+	d = fd == -1 ? NULL : fdopendir(fd);
+	if (d == NULL) {
+		if (fd != -1) {
+			close(fd);
+		}
+		ctx->errmsg = "Unable to open store directory";
+		return -1;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		dev_t device;
+		ino_t inode;
+		struct stat st;
+
+		/* recipes being written have a suffix */
+		if (hsm_store_name_part(de->d_name, num_parts) != part ||
+		    !hsm_store_parse_name(de->d_name, &device, &inode) ||
+		    fstatat(fd, de->d_name, &st, 0) != 0) {
+			continue;
+		}
+		fn(private, device, inode, hsm_store_mtime(&st));
+	}
+	closedir(d);
+	return 0;
+}
+
+/*
+  delete chunks no object uses any more, and rewrite the reference
+  log once it is mostly dead records. Returns the number of chunks
+  deleted
+ */
+static int dedup_compact(struct hsm_store_context *ctx)
+{
+	struct dedup_store *ds = ctx->private;
+	struct dedup_record *recs = NULL;
+	unsigned i, n = 0, alloc = 0;
+	int ret;
+
+	pthread_mutex_lock(&ds->mutex);
+	if (!ds->loaded) {
+		ds->hash_size = 1024;
+		ds->hash = calloc(ds->hash_size, sizeof(struct dedup_ref *));
+		if (ds->hash == NULL) {
+			pthread_mutex_unlock(&ds->mutex);
+			ctx->errmsg = "Unable to allocate reference counts";
+			errno = ENOMEM;
+			return -1;
+		}
+		ds->refs.apply = dedup_apply;
+		ds->refs.reset = dedup_reset;
+		ds->refs.ofs = 0;
+		ds->loaded = true;
+	}
+
+	if (hsm_log_lock(ctx, &ds->refs) != 0) {
+		pthread_mutex_unlock(&ds->mutex);
+		return -1;
+	}
+
+	for (i=0;i<ds->hash_size;i++) {
+		struct dedup_ref *r;
+		for (r=ds->hash[i]; r; r=r->next) {
+			char *fname;
+			if (r->refs > 0) {
+				continue;
+			}
+			if (n == alloc) {
+				struct dedup_record *p;
+				alloc = alloc ? alloc * 2 : 256;
+				p = realloc(recs, alloc * sizeof(*recs));
+				if (p == NULL) {
+					goto done;
+				}
+				recs = p;
+			}
+			fname = chunk_fname(ctx, r->hash);
+			if (fname == NULL) {
+				goto done;
+			}
+			if (unlink(fname) != 0 && errno != ENOENT) {
+				free(fname);
+				continue;
+			}
+			free(fname);
+			memcpy(recs[n].hash, r->hash, 32);
+			recs[n].delta = 0;
+			recs[n].length = r->length;
+			n++;
+		}
+	}
+
+done:
+	ret = n;
+	if (n > 0 && hsm_log_write(ctx, &ds->refs, recs, n) != 0) {
+		ret = -1;
+	}
+	if (ret != -1 && ds->refs.ofs >= HSM_DEDUP_REFS_MIN &&
+	    ds->refs.ofs >= (off_t)ds->num_refs * sizeof(struct dedup_record) * HSM_DEDUP_REFS_RATIO) {
+		hsm_log_rewrite(ctx, &ds->refs, dedup_refs_fill);
+	}
+	hsm_log_unlock(&ds->refs);
+	pthread_mutex_unlock(&ds->mutex);
+	free(recs);
+	return ret;
+}
+
+const struct hsm_store_ops hsm_store_dedup_ops = {
+	.name		= "dedup",
+	.init		= dedup_init,
+	.set_option	= dedup_set_option,
+	.connect	= dedup_connect,
+	.shutdown	= dedup_shutdown,
+	.open		= dedup_open,
+	.close		= dedup_close,
+	.remove		= dedup_remove,
+	.object_time	= dedup_object_time,
+	.position	= dedup_position,
+	.list		= dedup_list,
+	.compact	= dedup_compact,
+	.write		= dedup_write,
+	.pread		= dedup_pread,
+};
@@ -0,0 +1,495 @@
+/*
+  store I/O that stays out of the page cache, for any backend that
+  leaves data transfer to the generic layer
+
+  A migrate copies data that won't be read again for a long time,
+  and a recall copies data that is read once and written back to the
+  file, so neither gains anything from the page cache, and both push
+  out what the node's applications are using.
+
+  With io=direct objects are read and written through a second file
+  descriptor opened with O_DIRECT on the same file. Writes are
+  gathered into aligned buffers and written a buffer at a time, with
+  only the last partial block of an object going through the page
+  cache. Reads that aren't aligned go through an aligned buffer.
+  Where the filesystem refuses O_DIRECT, or an object doesn't start
+  on a block boundary, the handle falls back to io=dontneed.
+
+  With io=dontneed the normal descriptor is used, and pages are
+  dropped from the cache behind the reads and writes: a write starts
+  writeback of each window as it is finished, and waits for and drops
+  the window before it.
+ */
+
+#include "hacksm.h"
+#include "store_backend.h"
+
+/* size of the aligned buffers writes are gathered in */
+#define HSM_DIRECT_BUFSIZE 0x100000
+
+/* the most free buffers kept for reuse */
+#define HSM_DIRECT_POOL 16
+
+/* how much is written between drops of written data with
+   io=dontneed */
+#define HSM_DIRECT_WINDOW 0x800000
+
+struct hsm_store_direct {
+	/* false once the handle has fallen back to io=dontneed */
+	bool direct;
+	/* O_DIRECT descriptor, opened when first needed, or -1 */
+	int fd;
+	/* aligned buffer, holding 'used' bytes of a write that start
+	   at 'pos' in the file */
+	uint8_t *buf;
+	size_t used;
+	off_t pos;
+	/* with io=dontneed, writeback has been started up to 'started'
+	   and what is before 'dropped' is out of the cache */
+	off_t started;
+	off_t dropped;
+};
+
+/* a free buffer in the pool */
+struct direct_buf {
+	struct direct_buf *next;
+};
+
+/*
+  handle the io=buffered|direct|dontneed store option
+ */
+int hsm_direct_set_option(struct hsm_store_context *ctx, const char *name,
+			  const char *value)
+{
+	if (strcmp(value, "buffered") == 0) {
+		ctx->io = HSM_IO_BUFFERED;
+	} else if (strcmp(value, "direct") == 0) {
+		ctx->io = HSM_IO_DIRECT;
+	} else if (strcmp(value, "dontneed") == 0) {
+		ctx->io = HSM_IO_DONTNEED;
+	} else {
+		ctx->errmsg = "io must be buffered, direct or dontneed";
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  free the buffer pool
+ */
+void hsm_direct_shutdown(struct hsm_store_context *ctx)
+{
+	while (ctx->direct_pool) {
+		struct direct_buf *b = ctx->direct_pool;
+		ctx->direct_pool = b->next;
+		free(b);
+	}
+}
+
+static uint8_t *direct_buf_get(struct hsm_store_context *ctx)
+{
+	struct direct_buf *b;
+	void *p;
+
+	pthread_mutex_lock(&ctx->pool_mutex);
+	b = ctx->direct_pool;
+	if (b != NULL) {
+		ctx->direct_pool = b->next;
+		ctx->direct_pool_size--;
+	}
+	pthread_mutex_unlock(&ctx->pool_mutex);
+
+	if (b != NULL) {
+		return (uint8_t *)b;
+	}
+	if (posix_memalign(&p, HSM_STORE_IO_ALIGN, HSM_DIRECT_BUFSIZE) != 0) {
+		return NULL;
+	}
+	return p;
+}
+
+static void direct_buf_put(struct hsm_store_context *ctx, uint8_t *p)
+{
+	struct direct_buf *b = (struct direct_buf *)p;
+
+	pthread_mutex_lock(&ctx->pool_mutex);
+	if (ctx->direct_pool_size < HSM_DIRECT_POOL) {
+		b->next = ctx->direct_pool;
+		ctx->direct_pool = b;
+		ctx->direct_pool_size++;
+		b = NULL;
+	}
+	pthread_mutex_unlock(&ctx->pool_mutex);
+	free(b);
+}
+
+/*
+  the transfer size that suits the store, for a caller that would
+  otherwise use n
+ */
+size_t hsm_store_io_size(struct hsm_store_context *ctx, size_t n)
+{
+	if (ctx->io != HSM_IO_DIRECT) {
+		return n;
+	}
+	return (n + HSM_DIRECT_BUFSIZE - 1) & ~(size_t)(HSM_DIRECT_BUFSIZE - 1);
+}
+
+/*
+  true if a transfer can be done with O_DIRECT as it is
+ */
+bool hsm_direct_aligned(const void *buf, off_t ofs, size_t n)
+{
+	return ((uintptr_t)buf | (uintptr_t)ofs | n) % HSM_STORE_IO_ALIGN == 0;
+}
+
+/*
+  set up a handle just opened on an object. Backends that do their
+  own data transfer are left to it
+ */
+void hsm_direct_start(struct hsm_store_handle *h)
+{
+	struct hsm_store_context *ctx = h->ctx;
+	struct hsm_store_direct *d;
+
+	if (ctx->io == HSM_IO_BUFFERED || (ctx->ops->pread != NULL && !h->cached)) {
+		return;
+	}
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		/* the data just goes through the cache */
+		return;
+	}
+	d->fd = -1;
+	d->direct = (ctx->io == HSM_IO_DIRECT);
+	d->pos = d->started = d->dropped = h->base;
+	/* writes are only done a block at a time if the object
+	   starts on a block boundary, which in a pack it needn't */
+	if (!h->readonly && h->base % HSM_STORE_IO_ALIGN != 0) {
+		d->direct = false;
+	}
+	if (h->readonly && !d->direct) {
+		posix_fadvise(h->fd, h->base, h->size, POSIX_FADV_SEQUENTIAL);
+	}
+	h->direct = d;
+}
+
+/*
+  give up on O_DIRECT for a handle
+ */
+static void direct_fallback(struct hsm_store_handle *h)
+{
+	struct hsm_store_direct *d = h->direct;
+
+	d->direct = false;
+	if (d->fd != -1) {
+		close(d->fd);
+		d->fd = -1;
+	}
+}
+
+/*
+  the O_DIRECT descriptor of a handle, or -1 if it is not using
+  direct I/O
+ */
+int hsm_direct_fd(struct hsm_store_handle *h)
+{
+	struct hsm_store_direct *d = h->direct;
+	char path[64];
+
+	if (d == NULL || !d->direct) {
+		return -1;
+	}
+	if (d->fd != -1) {
+		return d->fd;
+	}
+	/* a new open file description, so the backend's descriptor,
+	   which may be shared, is left as it is */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", h->fd);
+	d->fd = open(path, (h->readonly ? O_RDONLY : O_WRONLY) | O_DIRECT);
+	if (d->fd == -1) {
+		direct_fallback(h);
+	}
+	return d->fd;
+}
+
+/*
+  note that an O_DIRECT transfer failed, returning true if the
+  handle has fallen back and the transfer should be done again
+  through the page cache
+ */
+bool hsm_direct_failed(struct hsm_store_handle *h, int err)
+{
+	if (err != EINVAL) {
+		return false;
+	}
+	direct_fallback(h);
+	return true;
+}
+
+/*
+  drop a range of a file from the page cache, unless the store does
+  buffered I/O. For backends that keep their own files. Dirty pages
+  can't be dropped, so writeback of them is started for them to go
+  once it is done
+ */
+void hsm_direct_dontneed(struct hsm_store_context *ctx, int fd, off_t ofs, off_t len)
+{
+	if (ctx->io == HSM_IO_BUFFERED) {
+		return;
+	}
+	sync_file_range(fd, ofs, len, SYNC_FILE_RANGE_WRITE);
+	posix_fadvise(fd, ofs, len, POSIX_FADV_DONTNEED);
+}
+
+/*
+  note a read of n bytes at ofs in the file of a handle that didn't
+  use O_DIRECT
+ */
+void hsm_direct_read_done(struct hsm_store_handle *h, off_t ofs, size_t n)
+{
+	if (h->direct != NULL && n > 0) {
+		posix_fadvise(h->fd, ofs, n, POSIX_FADV_DONTNEED);
+	}
+}
+
+/*
+  read from an object at ofs in its file, for hsm_store_raw_pread()
+ */
+ssize_t hsm_direct_pread(struct hsm_store_handle *h, uint8_t *buf, size_t n, off_t ofs)
+{
+	struct hsm_store_direct *d = h->direct;
+	size_t done = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = hsm_direct_fd(h);
+	if (fd != -1 && hsm_direct_aligned(buf, ofs, n)) {
+		ret = pread(fd, buf, n, ofs);
+		if (ret != -1 || !hsm_direct_failed(h, errno)) {
+			return ret;
+		}
+		fd = -1;
+	}
+	if (fd != -1 && d->buf == NULL) {
+		d->buf = direct_buf_get(h->ctx);
+		if (d->buf == NULL) {
+			direct_fallback(h);
+			fd = -1;
+		}
+	}
+	if (fd == -1) {
+		ret = pread(h->fd, buf, n, ofs);
+		if (ret > 0) {
+			hsm_direct_read_done(h, ofs, ret);
+		}
+		return ret;
+	}
+
+	/* read the blocks holding the range into our buffer */
+	while (done < n) {
+		off_t start = (ofs + done) & ~(off_t)(HSM_STORE_IO_ALIGN - 1);
+		size_t skip = ofs + done - start;
+		size_t len = (skip + n - done + HSM_STORE_IO_ALIGN - 1) &
+			~(size_t)(HSM_STORE_IO_ALIGN - 1);
+
+		if (len > HSM_DIRECT_BUFSIZE) {
+			len = HSM_DIRECT_BUFSIZE;
+		}
+		ret = pread(fd, d->buf, len, start);
+		if (ret == -1) {
+			if (done == 0 && hsm_direct_failed(h, errno)) {
+				return hsm_direct_pread(h, buf, n, ofs);
+			}
+			return done > 0 ? done : -1;
+		}
+		if (ret <= skip) {
+			break;
+		}
+		ret -= skip;
+		if (ret > n - done) {
+			ret = n - done;
+		}
+		memcpy(buf + done, d->buf + skip, ret);
+		done += ret;
+		if (skip + ret < len) {
+			break;
+		}
+	}
+	return done;
+}
+
+/*
+  write all of a buffer
+ */
+static int direct_pwrite(int fd, const uint8_t *buf, size_t n, off_t ofs)
+{
+	while (n > 0) {
+		ssize_t nwritten = pwrite(fd, buf, n, ofs);
+		if (nwritten <= 0) {
+			return -1;
+		}
+		buf += nwritten;
+		n -= nwritten;
+		ofs += nwritten;
+	}
+	return 0;
+}
+
+/*
+  write out the whole blocks gathered in the buffer, and with 'all'
+  the partial block after them too, through the page cache
+ */
+static int direct_flush(struct hsm_store_handle *h, bool all)
+{
+	struct hsm_store_direct *d = h->direct;
+	size_t len = d->used & ~(size_t)(HSM_STORE_IO_ALIGN - 1);
+	int fd = hsm_direct_fd(h);
+
+	if (len > 0 && fd != -1 && direct_pwrite(fd, d->buf, len, d->pos) != 0) {
+		if (!hsm_direct_failed(h, errno)) {
+			return -1;
+		}
+		fd = -1;
+	}
+	if (len > 0 && fd == -1 && direct_pwrite(h->fd, d->buf, len, d->pos) != 0) {
+		return -1;
+	}
+	d->pos += len;
+	d->used -= len;
+	if (d->used > 0) {
+		memmove(d->buf, d->buf + len, d->used);
+	}
+	if (all && d->used > 0) {
+		if (direct_pwrite(h->fd, d->buf, d->used, d->pos) != 0) {
+			return -1;
+		}
+		d->pos += d->used;
+		d->used = 0;
+	}
+	return 0;
+}
+
+/*
+  drop what has been written from the cache, a window at a time. The
+  last window was only started, so it is waited for now
+ */
+static void direct_drop_behind(struct hsm_store_handle *h, off_t end)
+{
+	struct hsm_store_direct *d = h->direct;
+
+	if (end - d->started < HSM_DIRECT_WINDOW) {
+		return;
+	}
+	if (d->started > d->dropped) {
+		sync_file_range(h->fd, d->dropped, d->started - d->dropped,
+				SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|
+				SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(h->fd, d->dropped, d->started - d->dropped,
+			      POSIX_FADV_DONTNEED);
+		d->dropped = d->started;
+	}
+	sync_file_range(h->fd, d->started, end - d->started, SYNC_FILE_RANGE_WRITE);
+	d->started = end;
+}
+
+/*
+  append to an object, for hsm_store_raw_write()
+ */
+int hsm_direct_write(struct hsm_store_handle *h, const uint8_t *buf, size_t n)
+{
+	struct hsm_store_direct *d = h->direct;
+
+	if (d->direct && d->buf == NULL) {
+		d->buf = direct_buf_get(h->ctx);
+		if (d->buf == NULL) {
+			d->direct = false;
+		}
+	}
+
+	while (n > 0 && d->direct) {
+		size_t len = HSM_DIRECT_BUFSIZE - d->used;
+		if (len > n) {
+			len = n;
+		}
+		memcpy(d->buf + d->used, buf, len);
+		d->used += len;
+		buf += len;
+		n -= len;
+		h->ofs += len;
+		if (d->used == HSM_DIRECT_BUFSIZE && direct_flush(h, false) != 0) {
+			h->ctx->errmsg = "write failed";
+			return -1;
+		}
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	/* through the page cache, after anything still gathered */
+	if (d->used > 0 && direct_flush(h, true) != 0) {
+		h->ctx->errmsg = "write failed";
+		return -1;
+	}
+	if (direct_pwrite(h->fd, buf, n, h->base + h->ofs) != 0) {
+		h->ctx->errmsg = "write failed";
+		return -1;
+	}
+	h->ofs += n;
+	direct_drop_behind(h, h->base + h->ofs);
+	return 0;
+}
+
+/*
+  finish writing an object, before the backend closes it. What is
+  left in the cache is written back and dropped, unless syncs are
+  deferred, when writeback is only started
+ */
+int hsm_direct_finish(struct hsm_store_handle *h)
+{
+	struct hsm_store_direct *d = h->direct;
+	off_t end = h->base + h->ofs;
+
+	if (d == NULL || h->readonly) {
+		return 0;
+	}
+	if (d->used > 0 && direct_flush(h, true) != 0) {
+		h->ctx->errmsg = "write failed";
+		return -1;
+	}
+	if (end > d->dropped) {
+		int flags = SYNC_FILE_RANGE_WRITE;
+		if (!h->ctx->defer_sync) {
+			flags |= SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WAIT_AFTER;
+		}
+		sync_file_range(h->fd, d->dropped, end - d->dropped, flags);
+		posix_fadvise(h->fd, d->dropped, end - d->dropped, POSIX_FADV_DONTNEED);
+	}
+	return 0;
+}
+
+/*
+  finish with a handle
+ */
+void hsm_direct_end(struct hsm_store_handle *h)
+{
+	struct hsm_store_direct *d = h->direct;
+
+	if (d == NULL) {
+		return;
+	}
+	/* readahead can bring in more than was read */
+	if (h->readonly && !d->direct) {
+		posix_fadvise(h->fd, h->base, 0, POSIX_FADV_DONTNEED);
+	}
+	if (d->fd != -1) {
+		close(d->fd);
+	}
+	if (d->buf != NULL) {
+		direct_buf_put(h->ctx, d->buf);
+	}
+	free(d);
+	h->direct = NULL;
+}
@@ -1,188 +1,837 @@
 /*
-  HSM store backend
+  HSM store backend keeping each object in its own file
 
   Andrew Tridgell August 2008
 
  */
 
 #include "hacksm.h"
+#include "store_backend.h"
+#include <pthread.h>
+#include <dirent.h>
 
-#define HSM_STORE_PATH "/hacksm_store"
+/* file in the store root recording how objects are laid out */
+#define HSM_LAYOUT_FILE ".layout"
 
-struct hsm_store_context {
-	const char *basepath;
-	const char *errmsg;
+/* default fan-out for new stores: two levels of 256 directories */
+#define HSM_DEFAULT_FANOUT_DEPTH 2
+#define HSM_DEFAULT_FANOUT_WIDTH 256
+
+#define HSM_MAX_FANOUT_DEPTH 4
+#define HSM_MAX_FANOUT_WIDTH 4096
+
+/* seconds a conversion waits before its second pass, for anyone that
+   created an object just before they saw the new layout */
+#define HSM_CONVERT_GRACE 5
+
+/* room for the name of an object relative to the store root */
+#define HSM_FILE_NAME_MAX (HSM_MAX_FANOUT_DEPTH * 4 + 40)
+
+/* default number of read-only store files kept open */
+#define HSM_DEFAULT_FD_CACHE 16
+
+/*
+  objects are spread over 'depth' levels of 'width' directories each,
+  chosen by a hash of the object name. A depth of 0 is the original
+  flat layout
+ */
+struct store_layout {
+	unsigned depth;
+	unsigned width;
 };
 
-struct hsm_store_handle {
-	struct hsm_store_context *ctx;
+/*
+  a store file kept open after a read, for the next recall of the
+  same object
+ */
+struct file_cached_fd {
+	dev_t device;
+	ino_t inode;
+	/* inode of the store file, to tell if it has been replaced */
+	ino_t file_ino;
 	int fd;
-	bool readonly;
+	uint64_t last_use;
+};
+
+struct file_store {
+	/* the store root, which object names are relative to */
+	int dir_fd;
+	/* the fan-out asked for with the fanout option */
+	struct store_layout fanout;
+	bool fanout_set;
+	/* the layout from the layout file. While a store is being
+	   converted, objects not yet moved are in the old layout */
+	pthread_mutex_t mutex;
+	struct store_layout layout;
+	struct store_layout old_layout;
+	bool converting;
+	ino_t layout_ino;
+	struct timespec layout_mtime;
+	/* read-only store files kept open, also under the mutex */
+	struct file_cached_fd *fds;
+	unsigned num_fds;
+	unsigned fd_cache;
+	uint64_t fd_tick;
 };
 
 /*
-  initialise the link to the store
+  set up the backend state
  */
-struct hsm_store_context *hsm_store_init(void)
+static int file_init(struct hsm_store_context *ctx)
 {
-	struct hsm_store_context *ctx;
+	struct file_store *fs;
 
-	ctx = calloc(1, sizeof(struct hsm_store_context));
-	if (ctx == NULL) {
+	fs = calloc(1, sizeof(struct file_store));
+	if (fs == NULL) {
+		ctx->errmsg = "Unable to allocate file store";
 		errno = ENOMEM;
-		return NULL;
+		return -1;
 	}
 
-	ctx->errmsg = "";
+	fs->dir_fd = -1;
+	fs->fanout.depth = HSM_DEFAULT_FANOUT_DEPTH;
+	fs->fanout.width = HSM_DEFAULT_FANOUT_WIDTH;
+	fs->fd_cache = HSM_DEFAULT_FD_CACHE;
+	pthread_mutex_init(&fs->mutex, NULL);
+	ctx->private = fs;
 
-	return ctx;
+	return 0;
 }
 
 /*
-  return an error message for the last failed operation
+  set a file store option. The file store knows these options:
+
+    fanout=DEPTHxWIDTH   fan-out used for a new store, or by
+                         hsm_store_convert()
+    fd_cache=COUNT       number of store files kept open after a
+                         read, for repeat recalls (default 16)
  */
-const char *hsm_store_errmsg(struct hsm_store_context *ctx)
+static int file_set_option(struct hsm_store_context *ctx, const char *name,
+			   const char *value)
 {
-	return ctx->errmsg;
+	struct file_store *fs = ctx->private;
+
+	if (strcmp(name, "fanout") == 0) {
+		unsigned depth, width = 0;
+		if (sscanf(value, "%ux%u", &depth, &width) < 1 ||
+		    depth > HSM_MAX_FANOUT_DEPTH ||
+		    (depth != 0 && (width < 2 || width > HSM_MAX_FANOUT_WIDTH))) {
+			ctx->errmsg = "Invalid fanout - must be DEPTHxWIDTH";
+			errno = EINVAL;
+			return -1;
+		}
+		fs->fanout.depth = depth;
+		fs->fanout.width = depth ? width : 0;
+		fs->fanout_set = true;
+		return 0;
+	}
+
+	if (strcmp(name, "fd_cache") == 0) {
+		fs->fd_cache = strtoul(value, NULL, 0);
+		return 0;
+	}
+
+	ctx->errmsg = "Unknown store option";
+	errno = EINVAL;
+	return -1;
 }
 
 /*
-  connect to the store
+  return the name of the layout file
  */
-int hsm_store_connect(struct hsm_store_context *ctx, const char *fsname)
+static char *store_layout_fname(struct hsm_store_context *ctx)
 {
+	char *fname = NULL;
+	if (asprintf(&fname, "%s/%s", ctx->basepath, HSM_LAYOUT_FILE) == -1) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return fname;
+}
+
+/*
+  load the layout file if it has changed since we last looked,
+  returning true if it was (re)loaded. A store with no layout file is
+  flat
+ */
+static bool store_layout_load(struct hsm_store_context *ctx)
+{
+	struct file_store *fs = ctx->private;
+	struct store_layout layout = { 0, 0 }, old_layout = { 0, 0 };
+	bool converting = false;
 	struct stat st;
+	FILE *f = NULL;
+	int fd;
+
+	fd = openat(fs->dir_fd, HSM_LAYOUT_FILE, O_RDONLY);
+	if (fd != -1) {
+		f = fdopen(fd, "r");
+		if (f == NULL) {
+			close(fd);
+			return false;
+		}
+	}
+	if (f == NULL) {
+		memset(&st, 0, sizeof(st));
+	} else if (fstat(fileno(f), &st) != 0) {
+		fclose(f);
+		return false;
+	}
 
-	ctx->basepath = HSM_STORE_PATH;
+	pthread_mutex_lock(&fs->mutex);
+	if (st.st_ino == fs->layout_ino &&
+	    st.st_mtim.tv_sec == fs->layout_mtime.tv_sec &&
+	    st.st_mtim.tv_nsec == fs->layout_mtime.tv_nsec) {
+		pthread_mutex_unlock(&fs->mutex);
+		if (f) fclose(f);
+		return false;
+	}
+
+	if (f != NULL) {
+		char line[100];
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "fanout %u %u", &layout.depth, &layout.width) == 2) {
+				continue;
+			}
+			if (sscanf(line, "old %u %u", &old_layout.depth, &old_layout.width) == 2) {
+				converting = true;
+			}
+		}
+		fclose(f);
+	}
+
+	fs->layout = layout;
+	fs->old_layout = old_layout;
+	fs->converting = converting;
+	fs->layout_ino = st.st_ino;
+	fs->layout_mtime = st.st_mtim;
+	pthread_mutex_unlock(&fs->mutex);
 
-	if (stat(ctx->basepath, &st) != 0 || !S_ISDIR(st.st_mode)) {
-		ctx->errmsg = "Invalid store path";
+	return true;
+}
+
+/*
+  write a new layout file. It is written under a temporary name and
+  renamed, so other users of the store see either the old or the new
+  layout
+ */
+static int store_layout_save(struct hsm_store_context *ctx,
+			     struct store_layout *layout,
+			     struct store_layout *old_layout)
+{
+	char *fname, *tmpname = NULL;
+	FILE *f;
+	int ret = -1;
+
+	fname = store_layout_fname(ctx);
+	if (fname == NULL || asprintf(&tmpname, "%s.tmp", fname) == -1) {
+		free(fname);
+		errno = ENOMEM;
 		return -1;
 	}
 
+	f = fopen(tmpname, "w");
+	if (f != NULL) {
+		fprintf(f, "fanout %u %u\n", layout->depth, layout->width);
+		if (old_layout) {
+			fprintf(f, "old %u %u\n", old_layout->depth, old_layout->width);
+		}
+		if (fflush(f) == 0 && fsync(fileno(f)) == 0 &&
+		    fclose(f) == 0 && rename(tmpname, fname) == 0) {
+			ret = 0;
+		} else {
+			unlink(tmpname);
+		}
+	}
+	if (ret != 0) {
+		ctx->errmsg = "Unable to write store layout file";
+	}
+
+	free(tmpname);
+	free(fname);
+	store_layout_load(ctx);
+	return ret;
+}
+
+/*
+  connect to the store
+ */
+static int file_connect(struct hsm_store_context *ctx)
+{
+	struct file_store *fs = ctx->private;
+
+	fs->dir_fd = open(ctx->basepath, O_RDONLY|O_DIRECTORY);
+	if (fs->dir_fd == -1) {
+		ctx->errmsg = "Unable to open store directory";
+		return -1;
+	}
+
+	/* a new store starts with the fan-out layout. Existing flat
+	   stores stay flat until they are converted */
+	if (hsm_store_dir_empty(ctx->basepath)) {
+		store_layout_save(ctx, &fs->fanout, NULL);
+	}
+
+	store_layout_load(ctx);
+
 	return 0;
 }
 
 /*
   shutdown the link to the store
  */
-void hsm_store_shutdown(struct hsm_store_context *ctx)
+static void file_shutdown(struct hsm_store_context *ctx)
 {
-	ctx->basepath = NULL;
-	free(ctx);
+	struct file_store *fs = ctx->private;
+	unsigned i;
+
+	for (i=0;i<fs->num_fds;i++) {
+		close(fs->fds[i].fd);
+	}
+	free(fs->fds);
+	if (fs->dir_fd != -1) {
+		close(fs->dir_fd);
+	}
+	pthread_mutex_destroy(&fs->mutex);
+	free(fs);
+	ctx->private = NULL;
 }
 
 /*
-  return a filename in the store
+  put the name of an object for the given layout, relative to the
+  store root, in fname
  */
-static char *store_fname(struct hsm_store_context *ctx, dev_t device, ino_t inode)
+static void store_layout_path(struct store_layout *layout, dev_t device, ino_t inode,
+			      char fname[HSM_FILE_NAME_MAX])
 {
-	char *fname = NULL;
-	asprintf(&fname, "%s/0x%llx:0x%llx",
-		 ctx->basepath,
-		 (unsigned long long)device, (unsigned long long)inode);
-	if (fname == NULL) {
-		errno = ENOMEM;
-		return NULL;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint64_t key[2] = { device, inode };
+	const uint8_t *p = (const uint8_t *)key;
+	char *d = fname;
+	unsigned i;
+
+	/* FNV-1a of the device and inode */
+	for (i=0;i<sizeof(key);i++) {
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
 	}
-	return fname;
+
+	for (i=0;i<layout->depth;i++) {
+		d += sprintf(d, "%03x/", (unsigned)(hash % layout->width));
+		hash /= layout->width;
+	}
+
+	sprintf(d, "0x%llx:0x%llx",
+		(unsigned long long)device, (unsigned long long)inode);
 }
 
 /*
-  open a file in the store
+  put the name of an object in the store in fname. If the store is
+  being converted then the name in the old layout is put in
+  old_fname and true is returned
  */
-struct hsm_store_handle *hsm_store_open(struct hsm_store_context *ctx,
-					dev_t device, ino_t inode, bool readonly)
+static bool store_fname(struct hsm_store_context *ctx, dev_t device, ino_t inode,
+			char fname[HSM_FILE_NAME_MAX], char old_fname[HSM_FILE_NAME_MAX])
 {
-	struct hsm_store_handle *h;
-	char *fname = NULL;
+	struct file_store *fs = ctx->private;
+	struct store_layout layout, old_layout;
+	bool converting;
 
-	fname = store_fname(ctx, device, inode);
-	if (fname == NULL) {
-		ctx->errmsg = "Unable to allocate store filename";
-		return NULL;
+	pthread_mutex_lock(&fs->mutex);
+	layout = fs->layout;
+	old_layout = fs->old_layout;
+	converting = fs->converting;
+	pthread_mutex_unlock(&fs->mutex);
+
+	store_layout_path(&layout, device, inode, fname);
+	if (converting) {
+		store_layout_path(&old_layout, device, inode, old_fname);
 	}
+	return converting;
+}
 
-	h = malloc(sizeof(struct hsm_store_handle));
-	if (h == NULL) {
-		ctx->errmsg = "Unable to allocate store handle";
-		errno = ENOMEM;
-		free(fname);
-		return NULL;
+/*
+  create the fan-out directories leading to a store file
+ */
+static int store_mkdirs(int dir_fd, char *fname)
+{
+	char *p;
+	int ret = 0;
+
+	for (p=strchr(fname, '/'); p && ret == 0; p=strchr(p+1, '/')) {
+		*p = 0;
+		if (mkdirat(dir_fd, fname, 0700) != 0 && errno != EEXIST) {
+			ret = -1;
+		}
+		*p = '/';
 	}
+	return ret;
+}
 
-	h->ctx = ctx;
-	h->readonly = readonly;
+/*
+  move an object into its place in the current layout
+ */
+static int store_move(int dir_fd, const char *old_fname, char *fname)
+{
+	if (renameat(dir_fd, old_fname, dir_fd, fname) == 0) {
+		return 0;
+	}
+	if (errno != ENOENT || store_mkdirs(dir_fd, fname) != 0) {
+		return -1;
+	}
+	return renameat(dir_fd, old_fname, dir_fd, fname);
+}
 
-	if (readonly) {
-		h->fd = open(fname, O_RDONLY);
+/*
+  find an existing object, putting its name in fname and its stat in
+  st. An object still in the old layout of a store being converted
+  is moved as it is found. If it can't be found and the layout file
+  has changed then the lookup is tried again with the new layout, so
+  a conversion by another process is picked up. Fails with ENOENT if
+  there is no such object
+ */
+static int store_lookup(struct hsm_store_context *ctx, dev_t device, ino_t inode,
+			char fname[HSM_FILE_NAME_MAX], struct stat *st)
+{
+	struct file_store *fs = ctx->private;
+	char old_fname[HSM_FILE_NAME_MAX];
+	bool converting, retried = false;
+
+again:
+	converting = store_fname(ctx, device, inode, fname, old_fname);
+	if (fstatat(fs->dir_fd, fname, st, 0) == 0) {
+		return 0;
+	}
+	if (errno != ENOENT) {
+		return -1;
+	}
+	if (converting) {
+		/* if the move fails someone else may have moved it */
+		store_move(fs->dir_fd, old_fname, fname);
+		if (fstatat(fs->dir_fd, fname, st, 0) == 0) {
+			return 0;
+		}
+	}
+	if (!retried && store_layout_load(ctx)) {
+		retried = true;
+		goto again;
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+/*
+  take the cached fd of an object, if it is still open on the store
+  file found by a lookup. Returns -1 if there isn't one
+ */
+static int fd_cache_take(struct file_store *fs, dev_t device, ino_t inode,
+			 struct stat *st)
+{
+	int fd = -1;
+	bool current = false;
+	unsigned i;
+
+	pthread_mutex_lock(&fs->mutex);
+	for (i=0;i<fs->num_fds;i++) {
+		if (fs->fds[i].device == device && fs->fds[i].inode == inode) {
+			fd = fs->fds[i].fd;
+			current = (fs->fds[i].file_ino == st->st_ino);
+			fs->fds[i] = fs->fds[--fs->num_fds];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fs->mutex);
+
+	/* the object was removed and written again */
+	if (fd != -1 && !current) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/*
+  keep the fd of an object that has been read, for the next recall of
+  it. The least recently used fd is closed to make room
+ */
+static void fd_cache_put(struct file_store *fs, dev_t device, ino_t inode, int fd)
+{
+	struct file_cached_fd *c = NULL;
+	struct stat st;
+	int old_fd = -1;
+	unsigned i;
+
+	if (fs->fd_cache == 0 || fstat(fd, &st) != 0) {
+		close(fd);
+		return;
+	}
+
+	pthread_mutex_lock(&fs->mutex);
+	if (fs->fds == NULL) {
+		fs->fds = calloc(fs->fd_cache, sizeof(struct file_cached_fd));
+		if (fs->fds == NULL) {
+			pthread_mutex_unlock(&fs->mutex);
+			close(fd);
+			return;
+		}
+	}
+
+	/* replace any fd already kept for the object, else use a free
+	   slot, else the least recently used */
+	for (i=0;i<fs->num_fds;i++) {
+		if (fs->fds[i].device == device && fs->fds[i].inode == inode) {
+			c = &fs->fds[i];
+			break;
+		}
+		if (c == NULL || fs->fds[i].last_use < c->last_use) {
+			c = &fs->fds[i];
+		}
+	}
+	if (i == fs->num_fds && fs->num_fds < fs->fd_cache) {
+		c = &fs->fds[fs->num_fds++];
 	} else {
-		h->fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+		old_fd = c->fd;
 	}
+	c->device = device;
+	c->inode = inode;
+	c->file_ino = st.st_ino;
+	c->fd = fd;
+	c->last_use = ++fs->fd_tick;
+	pthread_mutex_unlock(&fs->mutex);
 
-	free(fname);
+	if (old_fd != -1) {
+		close(old_fd);
+	}
+}
+
+/*
+  close any cached fd of an object, so a removed object doesn't
+  hold on to its space
+ */
+static void fd_cache_drop(struct file_store *fs, dev_t device, ino_t inode)
+{
+	struct stat st;
+	int fd;
+
+	/* no current store file can match this */
+	memset(&st, 0, sizeof(st));
+	fd = fd_cache_take(fs, device, inode, &st);
+	if (fd != -1) {
+		close(fd);
+	}
+}
+
+/*
+  open a file in the store
+ */
+static int file_open(struct hsm_store_context *ctx, struct hsm_store_handle *h,
+		     dev_t device, ino_t inode)
+{
+	struct file_store *fs = ctx->private;
+	char fname[HSM_FILE_NAME_MAX], old_fname[HSM_FILE_NAME_MAX];
+	struct stat st;
+
+	if (h->readonly) {
+		if (store_lookup(ctx, device, inode, fname, &st) != 0) {
+			ctx->errmsg = "Unable to open store file";
+			return -1;
+		}
+		h->fd = fd_cache_take(fs, device, inode, &st);
+		if (h->fd == -1) {
+			h->fd = openat(fs->dir_fd, fname, O_RDONLY);
+		}
+		h->size = st.st_size;
+	} else {
+		bool converting;
+		store_layout_load(ctx);
+		converting = store_fname(ctx, device, inode, fname, old_fname);
+		h->fd = openat(fs->dir_fd, fname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+		if (h->fd == -1 && errno == ENOENT && store_mkdirs(fs->dir_fd, fname) == 0) {
+			h->fd = openat(fs->dir_fd, fname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+		}
+		/* don't leave an out of date copy in the old layout */
+		if (h->fd != -1 && converting) {
+			unlinkat(fs->dir_fd, old_fname, 0);
+		}
+		h->size = UINT64_MAX;
+	}
 
 	if (h->fd == -1) {
 		ctx->errmsg = "Unable to open store file";
-		free(h);
-		return NULL;
+		return -1;
 	}
 
-	return h;
+	return 0;
 }
 
 /*
-  remove a file from the store
+  close a store file. Files that were read are kept open for a while
  */
-int hsm_store_remove(struct hsm_store_context *ctx,
-		     dev_t device, ino_t inode)
+static int file_close(struct hsm_store_handle *h)
 {
-	char *fname;
-	int ret;
+	if (h->readonly) {
+		fd_cache_put(h->ctx->private, h->device, h->inode, h->fd);
+		return 0;
+	}
+	if (!h->ctx->defer_sync) {
+		fsync(h->fd);
+	}
+	return close(h->fd);
+}
 
-	fname = store_fname(ctx, device, inode);
-	if (fname == NULL) {
+/*
+  move the objects under a directory of the old layout of a store
+  into the current layout. 'level' is how many directories down from
+  the store root we are. Objects that are already in place, and
+  directories of the new layout, are left alone
+ */
+static int store_convert_dir(struct hsm_store_context *ctx, const char *path,
+			     unsigned level, struct store_layout *from,
+			     struct store_layout *to, int *count)
+{
+	struct dirent *de;
+	DIR *d;
+	int ret = 0;
+
+	d = opendir(path);
+	if (d == NULL) {
+		ctx->errmsg = "Unable to open store directory";
 		return -1;
 	}
-	ret = unlink(fname);
-	free(fname);
+
+	while (ret == 0 && (de = readdir(d)) != NULL) {
+		unsigned long long device, inode;
+		char *name = NULL;
+
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+		if (asprintf(&name, "%s/%s", path, de->d_name) == -1) {
+			ctx->errmsg = "Unable to allocate store filename";
+			ret = -1;
+			break;
+		}
+
+		if (level < from->depth) {
+			if (strlen(de->d_name) == 3 &&
+			    strspn(de->d_name, "0123456789abcdef") == 3) {
+				ret = store_convert_dir(ctx, name, level+1, from, to, count);
+			}
+		} else if (sscanf(de->d_name, "0x%llx:0x%llx", &device, &inode) == 2) {
+			struct file_store *fs = ctx->private;
+			char old_fname[HSM_FILE_NAME_MAX], fname[HSM_FILE_NAME_MAX];
+			/* the name relative to the store root */
+			const char *rname = name + strlen(ctx->basepath) + 1;
+			store_layout_path(from, device, inode, old_fname);
+			store_layout_path(to, device, inode, fname);
+			if (strcmp(rname, old_fname) == 0 && strcmp(rname, fname) != 0) {
+				/* someone else may have moved it first */
+				if (store_move(fs->dir_fd, old_fname, fname) == 0) {
+					(*count)++;
+				} else if (errno != ENOENT) {
+					ctx->errmsg = "Unable to move store file";
+					ret = -1;
+				}
+			}
+		}
+		free(name);
+	}
+	closedir(d);
+
+	/* old directories are removed once empty */
+	if (ret == 0 && level > 0) {
+		rmdir(path);
+	}
+
 	return ret;
 }
 
+/*
+  convert the store to the layout given by the fanout option, or the
+  default fan-out. This can be done while the store is in use: the
+  new layout is recorded first, and other users look for objects
+  that are not in place yet in the old layout, moving them as they
+  go. An interrupted conversion is finished by running it again.
+  Returns the number of objects moved, or -1 on error
+ */
+static int file_convert(struct hsm_store_context *ctx)
+{
+	struct file_store *fs = ctx->private;
+	struct store_layout from, to = fs->fanout;
+	int count = 0;
+	unsigned pass;
+
+	store_layout_load(ctx);
+
+	pthread_mutex_lock(&fs->mutex);
+	if (fs->converting) {
+		from = fs->old_layout;
+		if (!fs->fanout_set) {
+			to = fs->layout;
+		} else if (to.depth != fs->layout.depth || to.width != fs->layout.width) {
+			pthread_mutex_unlock(&fs->mutex);
+			ctx->errmsg = "A conversion to a different layout is in progress";
+			errno = EBUSY;
+			return -1;
+		}
+	} else {
+		from = fs->layout;
+		if (from.depth == to.depth && from.width == to.width) {
+			pthread_mutex_unlock(&fs->mutex);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&fs->mutex);
+
+	if (store_layout_save(ctx, &to, &from) != 0) {
+		return -1;
+	}
+
+	/* the second pass catches objects created in the old layout
+	   by someone that hadn't yet seen the new one */
+	for (pass=0;pass<2;pass++) {
+		if (pass != 0) {
+			sleep(HSM_CONVERT_GRACE);
+		}
+		if (store_convert_dir(ctx, ctx->basepath, 0, &from, &to, &count) != 0) {
+			return -1;
+		}
+	}
+
+	if (store_layout_save(ctx, &to, NULL) != 0) {
+		return -1;
+	}
+
+	return count;
+}
 
 /*
-  read from a stored file
+  position of an object in the store. Objects are named by device and
+  inode, so that is the order we give
  */
-size_t hsm_store_read(struct hsm_store_handle *h, uint8_t *buf, size_t n)
+static uint64_t file_position(struct hsm_store_context *ctx,
+			      dev_t device, ino_t inode)
 {
-	return read(h->fd, buf, n);
+	return ((uint64_t)device << 48) ^ (uint64_t)inode;
 }
 
 /*
-  write to a stored file
+  the time of an object is the modification time of its store file,
+  from the store's server
  */
-int hsm_store_write(struct hsm_store_handle *h, uint8_t *buf, size_t n)
+static int file_object_time(struct hsm_store_context *ctx,
+			    dev_t device, ino_t inode, uint64_t *time)
 {
-	size_t nwritten = write(h->fd, buf, n);
-	if (nwritten != n) {
-		h->ctx->errmsg = "write failed";
+	char fname[HSM_FILE_NAME_MAX];
+	struct stat st;
+
+	if (store_lookup(ctx, device, inode, fname, &st) != 0) {
 		return -1;
 	}
+	*time = hsm_store_mtime(&st);
 	return 0;
 }
 
 /*
-  close a store file
+  remove a file from the store if it still has the given time
  */
-int hsm_store_close(struct hsm_store_handle *h)
+static int file_remove(struct hsm_store_context *ctx,
+		       dev_t device, ino_t inode, uint64_t time)
 {
-	int ret;
-	
-	if (!h->readonly) {
-		fsync(h->fd);
+	struct file_store *fs = ctx->private;
+	char fname[HSM_FILE_NAME_MAX];
+	struct stat st;
+
+	if (store_lookup(ctx, device, inode, fname, &st) != 0) {
+		return -1;
+	}
+	if (time != UINT64_MAX && hsm_store_mtime(&st) != time) {
+		ctx->errmsg = "Store file was written again since the removal";
+		errno = EEXIST;
+		return -1;
+	}
+	fd_cache_drop(fs, device, inode);
+	return unlinkat(fs->dir_fd, fname, 0);
+}
+
+/*
+  list the objects under a directory of the store, which is closed
+  when done. Only the store root is split between list parts, as the
+  fan-out directories below it spread objects evenly. Objects of both
+  layouts are found while a store is being converted
+ */
+static int store_list_dir(struct hsm_store_context *ctx, int fd, unsigned level,
+			  unsigned part, unsigned num_parts,
+			  hsm_store_list_fn fn, void *private)
+{
+	struct dirent *de;
+	DIR *d;
+	int ret = 0;
+
+	d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		ctx->errmsg = "Unable to open store directory";
+		return -1;
 	}
-	ret = close(h->fd);
-	h->fd = -1;
-	free(h);
+
+	while (ret == 0 && (de = readdir(d)) != NULL) {
+		dev_t device;
+		ino_t inode;
+		struct stat st;
+
+		if (de->d_name[0] == '.' ||
+		    (level == 0 && hsm_store_name_part(de->d_name, num_parts) != part)) {
+			continue;
+		}
+		if (hsm_store_parse_name(de->d_name, &device, &inode)) {
+			if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+			    S_ISREG(st.st_mode)) {
+				fn(private, device, inode, hsm_store_mtime(&st));
+			}
+		} else if (level < HSM_MAX_FANOUT_DEPTH && strlen(de->d_name) == 3 &&
+			   strspn(de->d_name, "0123456789abcdef") == 3) {
+			int sub = openat(dirfd(d), de->d_name, O_RDONLY|O_DIRECTORY);
+			if (sub != -1) {
+				ret = store_list_dir(ctx, sub, level+1, part, num_parts,
+						     fn, private);
+			}
+		}
+	}
+	closedir(d);
+
 	return ret;
 }
+
+/*
+  list part of the objects in the store
+ */
+static int file_list(struct hsm_store_context *ctx, unsigned part, unsigned num_parts,
+		     hsm_store_list_fn fn, void *private)
+{
+	struct file_store *fs = ctx->private;
+	int fd;
+
+	/* a new open of the root, so that each part has its own
+	   directory position */
+	fd = openat(fs->dir_fd, ".", O_RDONLY|O_DIRECTORY);
+	if (fd == -1) {
+		ctx->errmsg = "Unable to open store directory";
+		return -1;
+	}
+	return store_list_dir(ctx, fd, 0, part, num_parts, fn, private);
+}
+
+const struct hsm_store_ops hsm_store_file_ops = {
+	.name		= "file",
+	.init		= file_init,
+	.set_option	= file_set_option,
+	.connect	= file_connect,
+	.shutdown	= file_shutdown,
+	.open		= file_open,
+	.close		= file_close,
+	.remove		= file_remove,
+	.object_time	= file_object_time,
+	.position	= file_position,
+	.list		= file_list,
+	.convert	= file_convert,
+};
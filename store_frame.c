@@ -0,0 +1,906 @@
+/*
+  compressed framing of HSM store objects
+
+  With compression on, an object is stored as a header, then each
+  chunk of the file compressed on its own, then an index giving the
+  stored length of each chunk and a trailer giving the size. A read
+  only decompresses the chunks it touches, so partial recalls stay
+  cheap. Objects are written in one pass from start to end, so any
+  backend can store them as a stream.
+
+  With checksums on, the index also holds a CRC32C of each chunk as
+  written, which is checked whenever the chunk is read back. Objects
+  are then framed even with compression off, using no codec.
+
+  A chunk of zeros, whether written as data or as a hole, takes no
+  space at all. The index then doubles as a map of the holes in the
+  file, so a recall can leave them as holes.
+
+  Objects written with compression and checksums off are stored raw,
+  unless they happen to start like a framed object. Those are framed
+  with no codec, so a raw object can never be mistaken for a framed
+  one.
+ */
+
+#include "hacksm.h"
+#include "store_backend.h"
+#include <zlib.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#define HSM_FRAME_MAGIC "HSMZ"
+
+/* default size of each independently compressed chunk */
+#define HSM_FRAME_CHUNK 0x40000
+#define HSM_FRAME_MAX_CHUNK 0x4000000
+
+/* set in an index entry for a chunk that didn't compress, and is
+   stored as is */
+#define HSM_FRAME_RAW 0x80000000
+
+/* set in an index entry for a chunk of zeros, which isn't stored */
+#define HSM_FRAME_ZERO 0x40000000
+
+/* the stored length in an index entry */
+#define HSM_FRAME_LEN_MASK 0x3fffffff
+
+/* header flag for an index followed by a CRC32C of each chunk */
+#define HSM_FRAME_CRC32C 0x01
+
+struct frame_header {
+	char magic[4];
+	uint8_t codec;
+	uint8_t flags;
+	uint8_t reserved[2];
+	uint32_t chunk_size;
+	/* picked at random when the object is written, so a copy of
+	   it can tell if it has been written again. 0 in objects from
+	   before this was added */
+	uint32_t object_id;
+};
+
+/* at the end of the object, after the chunk index */
+struct frame_trailer {
+	/* size of the file */
+	uint64_t size;
+	/* where the chunk index starts, from the start of the object */
+	uint64_t index_ofs;
+	uint32_t num_chunks;
+	char magic[4];
+};
+
+enum hsm_codec_id {
+	HSM_CODEC_NONE = 0,
+	HSM_CODEC_ZLIB = 1,
+	HSM_CODEC_LZ4  = 2
+};
+
+struct hsm_codec {
+	const char *name;
+	enum hsm_codec_id id;
+	int default_level;
+	/* the most a chunk of n bytes can compress to */
+	size_t (*bound)(size_t n);
+	/* returns the compressed length, or 0 if the chunk should be
+	   stored as is */
+	size_t (*compress)(const uint8_t *in, size_t n, uint8_t *out, size_t outlen,
+			   int level);
+	/* returns 0 if exactly outlen bytes were decompressed */
+	int (*decompress)(const uint8_t *in, size_t n, uint8_t *out, size_t outlen);
+};
+
+struct hsm_store_frame {
+	const struct hsm_codec *codec;
+	int level;
+	uint32_t chunk_size;
+	uint32_t num_chunks;
+	/* size of the file */
+	uint64_t size;
+	uint8_t flags;
+	/* stored length of each chunk. When reading, the CRCs of
+	   the chunks follow in the same array, as they are stored */
+	uint32_t *index;
+	/* CRC of each chunk written */
+	uint32_t *crcs;
+	unsigned index_alloc;
+	/* where each chunk starts in the object, for reads. There is
+	   one more than there are chunks */
+	uint64_t *offsets;
+	/* the chunk being written, or the last chunk decompressed by
+	   a read */
+	uint8_t *buf;
+	uint32_t buf_len;
+	int64_t buf_chunk;
+	/* compressed data */
+	uint8_t *cbuf;
+	size_t cbuf_size;
+};
+
+static size_t none_bound(size_t n)
+{
+	return n;
+}
+
+static size_t none_compress(const uint8_t *in, size_t n, uint8_t *out, size_t outlen,
+			    int level)
+{
+	return 0;
+}
+
+static int none_decompress(const uint8_t *in, size_t n, uint8_t *out, size_t outlen)
+{
+	return -1;
+}
+
+static size_t zlib_bound(size_t n)
+{
+	return compressBound(n);
+}
+
+static size_t zlib_compress(const uint8_t *in, size_t n, uint8_t *out, size_t outlen,
+			    int level)
+{
+	uLongf len = outlen;
+	if (compress2(out, &len, in, n, level) != Z_OK || len >= n) {
+		return 0;
+	}
+	return len;
+}
+
+static int zlib_decompress(const uint8_t *in, size_t n, uint8_t *out, size_t outlen)
+{
+	uLongf len = outlen;
+	if (uncompress(out, &len, in, n) != Z_OK || len != outlen) {
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef HAVE_LZ4
+static size_t lz4_bound(size_t n)
+{
+	return LZ4_compressBound(n);
+}
+
+static size_t lz4_compress(const uint8_t *in, size_t n, uint8_t *out, size_t outlen,
+			   int level)
+{
+	int len = LZ4_compress_fast((const char *)in, (char *)out, n, outlen, level);
+	if (len <= 0 || len >= n) {
+		return 0;
+	}
+	return len;
+}
+
+static int lz4_decompress(const uint8_t *in, size_t n, uint8_t *out, size_t outlen)
+{
+	if (LZ4_decompress_safe((const char *)in, (char *)out, n, outlen) != outlen) {
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+static const struct hsm_codec codecs[] = {
+	{ "none", HSM_CODEC_NONE, 0, none_bound, none_compress, none_decompress },
+	{ "zlib", HSM_CODEC_ZLIB, 6, zlib_bound, zlib_compress, zlib_decompress },
+#ifdef HAVE_LZ4
+	/* for lz4 the level is the acceleration, higher being faster */
+	{ "lz4",  HSM_CODEC_LZ4,  1, lz4_bound,  lz4_compress,  lz4_decompress },
+#endif
+	{ NULL }
+};
+
+static const struct hsm_codec *codec_by_id(unsigned id)
+{
+	unsigned i;
+	for (i=0;codecs[i].name;i++) {
+		if (codecs[i].id == id) {
+			return &codecs[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+  handle the compress=CODEC[:LEVEL], compress_chunk=BYTES and
+  checksum=crc32c|none store options
+ */
+int hsm_frame_set_option(struct hsm_store_context *ctx, const char *name,
+			 const char *value)
+{
+	unsigned i;
+
+	if (strcmp(name, "compress_chunk") == 0) {
+		ctx->chunk_size = strtoul(value, NULL, 0);
+		if (ctx->chunk_size < 0x1000 || ctx->chunk_size > HSM_FRAME_MAX_CHUNK) {
+			ctx->errmsg = "compress_chunk must be from 4k to 64M";
+			errno = EINVAL;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strcmp(name, "checksum") == 0) {
+		if (strcmp(value, "crc32c") == 0) {
+			ctx->checksum = true;
+		} else if (strcmp(value, "none") == 0) {
+			ctx->checksum = false;
+		} else {
+			ctx->errmsg = "Unknown checksum type";
+			errno = EINVAL;
+			return -1;
+		}
+		return 0;
+	}
+
+	for (i=0;codecs[i].name;i++) {
+		size_t len = strlen(codecs[i].name);
+		if (strncmp(value, codecs[i].name, len) != 0 ||
+		    (value[len] != 0 && value[len] != ':')) {
+			continue;
+		}
+		if (codecs[i].id == HSM_CODEC_NONE) {
+			ctx->codec = NULL;
+			return 0;
+		}
+		ctx->codec = &codecs[i];
+		ctx->level = codecs[i].default_level;
+		if (value[len] == ':') {
+			ctx->level = atoi(value+len+1);
+		}
+		return 0;
+	}
+
+	ctx->errmsg = "Unknown compression codec";
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+  make sure the compressed data buffer can hold n bytes
+ */
+static int frame_cbuf(struct hsm_store_frame *f, size_t n)
+{
+	uint8_t *p;
+
+	if (n <= f->cbuf_size) {
+		return 0;
+	}
+	p = realloc(f->cbuf, n);
+	if (p == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	f->cbuf = p;
+	f->cbuf_size = n;
+	return 0;
+}
+
+void hsm_frame_free(struct hsm_store_frame *f)
+{
+	if (f == NULL) {
+		return;
+	}
+	free(f->index);
+	free(f->crcs);
+	free(f->offsets);
+	free(f->buf);
+	free(f->cbuf);
+	free(f);
+}
+
+/*
+  true if data written at the start of an object could be taken for a
+  frame header, in which case it has to be framed
+ */
+bool hsm_frame_needed(const uint8_t *buf, size_t n)
+{
+	if (n > 4) {
+		n = 4;
+	}
+	return memcmp(buf, HSM_FRAME_MAGIC, n) == 0;
+}
+
+/*
+  choose an id for a new object. It only has to differ from the ids
+  of earlier copies of the same object, which may have been written
+  by another process or node, so mix in the time, pid and inode
+ */
+static uint32_t frame_new_id(struct hsm_store_handle *h)
+{
+	static uint32_t counter;
+	struct timespec ts;
+	uint64_t v;
+	uint32_t id;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	v = (ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^ ((uint64_t)getpid() << 32) ^
+		((uint64_t)h->inode * 0x9e3779b97f4a7c15ULL) ^
+		__sync_add_and_fetch(&counter, 1);
+	v ^= v >> 33;
+	v *= 0xff51afd7ed558ccdULL;
+	v ^= v >> 33;
+	id = (uint32_t)v;
+	return id ? id : 1;
+}
+
+/*
+  start writing a framed object
+ */
+int hsm_frame_write_start(struct hsm_store_handle *h)
+{
+	struct hsm_store_context *ctx = h->ctx;
+	struct hsm_store_frame *f;
+	struct frame_header hdr;
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL) {
+		ctx->errmsg = "Unable to allocate store frame";
+		errno = ENOMEM;
+		return -1;
+	}
+	f->codec = ctx->codec ? ctx->codec : codec_by_id(HSM_CODEC_NONE);
+	f->level = ctx->level;
+	f->chunk_size = ctx->chunk_size ? ctx->chunk_size : HSM_FRAME_CHUNK;
+	f->flags = ctx->checksum ? HSM_FRAME_CRC32C : 0;
+	f->buf = malloc(f->chunk_size);
+	if (f->buf == NULL ||
+	    frame_cbuf(f, f->codec->bound(f->chunk_size)) != 0) {
+		hsm_frame_free(f);
+		ctx->errmsg = "Unable to allocate store frame";
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HSM_FRAME_MAGIC, 4);
+	hdr.codec = f->codec->id;
+	hdr.flags = f->flags;
+	hdr.chunk_size = f->chunk_size;
+	hdr.object_id = frame_new_id(h);
+	h->object_id = hdr.object_id;
+	if (hsm_store_raw_write(h, (uint8_t *)&hdr, sizeof(hdr)) != 0) {
+		hsm_frame_free(f);
+		return -1;
+	}
+
+	h->frame = f;
+	return 0;
+}
+
+/*
+  true if a buffer holds nothing but zeros. Comparing the buffer with
+  itself one byte on lets memcmp do the work a word or vector at a
+  time
+ */
+static bool frame_is_zero(const uint8_t *buf, size_t n)
+{
+	return n == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, n - 1) == 0);
+}
+
+/*
+  add a chunk to the index of an object being written
+ */
+static int frame_index_add(struct hsm_store_handle *h, uint32_t entry, uint32_t crc)
+{
+	struct hsm_store_frame *f = h->frame;
+
+	if (f->num_chunks == f->index_alloc) {
+		unsigned n = f->index_alloc ? f->index_alloc * 2 : 64;
+		uint32_t *p = realloc(f->index, n * sizeof(uint32_t));
+		if (p != NULL) {
+			f->index = p;
+			p = realloc(f->crcs, n * sizeof(uint32_t));
+		}
+		if (p == NULL) {
+			h->ctx->errmsg = "Unable to allocate chunk index";
+			errno = ENOMEM;
+			return -1;
+		}
+		f->crcs = p;
+		f->index_alloc = n;
+	}
+
+	f->index[f->num_chunks] = entry;
+	f->crcs[f->num_chunks] = crc;
+	f->num_chunks++;
+	return 0;
+}
+
+/*
+  compress and write out the chunk in the frame buffer. A chunk of
+  zeros is only noted in the index
+ */
+static int frame_flush(struct hsm_store_handle *h)
+{
+	struct hsm_store_frame *f = h->frame;
+	const uint8_t *data;
+	uint32_t entry, crc = 0;
+	size_t len;
+
+	if (f->buf_len == 0) {
+		return 0;
+	}
+
+	if (frame_is_zero(f->buf, f->buf_len)) {
+		if (frame_index_add(h, HSM_FRAME_ZERO, 0) != 0) {
+			return -1;
+		}
+		f->size += f->buf_len;
+		f->buf_len = 0;
+		return 0;
+	}
+
+	if (f->flags & HSM_FRAME_CRC32C) {
+		crc = hsm_crc32c(0, f->buf, f->buf_len);
+	}
+
+	len = f->codec->compress(f->buf, f->buf_len, f->cbuf, f->cbuf_size, f->level);
+	if (len == 0) {
+		data = f->buf;
+		len = f->buf_len;
+		entry = len | HSM_FRAME_RAW;
+	} else {
+		data = f->cbuf;
+		entry = len;
+	}
+
+	if (hsm_store_raw_write(h, data, len) != 0 ||
+	    frame_index_add(h, entry, crc) != 0) {
+		return -1;
+	}
+	f->size += f->buf_len;
+	f->buf_len = 0;
+	return 0;
+}
+
+/*
+  write to a framed object
+ */
+int hsm_frame_write(struct hsm_store_handle *h, const uint8_t *buf, size_t n)
+{
+	struct hsm_store_frame *f = h->frame;
+
+	while (n > 0) {
+		size_t len = f->chunk_size - f->buf_len;
+		if (len > n) {
+			len = n;
+		}
+		memcpy(f->buf + f->buf_len, buf, len);
+		f->buf_len += len;
+		buf += len;
+		n -= len;
+		if (f->buf_len == f->chunk_size && frame_flush(h) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+  add n bytes of zeros to a framed object. Whole chunks of them are
+  just noted in the index
+ */
+int hsm_frame_write_zeros(struct hsm_store_handle *h, uint64_t n)
+{
+	struct hsm_store_frame *f = h->frame;
+
+	while (n > 0) {
+		size_t len;
+
+		if (f->buf_len == 0 && n >= f->chunk_size) {
+			if (frame_index_add(h, HSM_FRAME_ZERO, 0) != 0) {
+				return -1;
+			}
+			f->size += f->chunk_size;
+			n -= f->chunk_size;
+			continue;
+		}
+
+		len = f->chunk_size - f->buf_len;
+		if (len > n) {
+			len = n;
+		}
+		memset(f->buf + f->buf_len, 0, len);
+		f->buf_len += len;
+		n -= len;
+		if (f->buf_len == f->chunk_size && frame_flush(h) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+  finish a framed object, writing out the last chunk, the index and
+  the trailer
+ */
+int hsm_frame_write_finish(struct hsm_store_handle *h)
+{
+	struct hsm_store_frame *f = h->frame;
+	struct frame_trailer tr;
+
+	if (frame_flush(h) != 0) {
+		return -1;
+	}
+
+	memset(&tr, 0, sizeof(tr));
+	tr.size = f->size;
+	tr.index_ofs = h->ofs;
+	tr.num_chunks = f->num_chunks;
+	memcpy(tr.magic, HSM_FRAME_MAGIC, 4);
+
+	if (hsm_store_raw_write(h, (uint8_t *)f->index, f->num_chunks * sizeof(uint32_t)) != 0 ||
+	    ((f->flags & HSM_FRAME_CRC32C) &&
+	     hsm_store_raw_write(h, (uint8_t *)f->crcs, f->num_chunks * sizeof(uint32_t)) != 0) ||
+	    hsm_store_raw_write(h, (uint8_t *)&tr, sizeof(tr)) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  get the id of an object opened for reading from its frame header.
+  Fails if the object isn't framed or has no id
+ */
+int hsm_frame_object_id(struct hsm_store_handle *h, uint32_t *id)
+{
+	struct frame_header hdr;
+
+	if (h->size < sizeof(hdr) ||
+	    hsm_store_raw_pread(h, (uint8_t *)&hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, HSM_FRAME_MAGIC, 4) != 0 ||
+	    hdr.object_id == 0) {
+		return -1;
+	}
+	*id = hdr.object_id;
+	return 0;
+}
+
+/* size of a chunk of the file */
+static uint32_t frame_chunk_len(struct hsm_store_frame *f, uint32_t chunk)
+{
+	if (chunk == f->num_chunks - 1) {
+		return f->size - (uint64_t)chunk * f->chunk_size;
+	}
+	return f->chunk_size;
+}
+
+/*
+  look for a frame header on an object opened for reading, loading
+  its index if it has one. Objects that don't look framed are read
+  raw, which includes any from before framing that start with the
+  frame magic
+ */
+int hsm_frame_read_start(struct hsm_store_handle *h)
+{
+	struct hsm_store_frame *f;
+	struct frame_header hdr;
+	struct frame_trailer tr;
+	uint64_t ofs;
+	size_t entry;
+	unsigned i;
+
+	if (h->size < sizeof(hdr) + sizeof(tr) ||
+	    hsm_store_raw_pread(h, (uint8_t *)&hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, HSM_FRAME_MAGIC, 4) != 0 ||
+	    hsm_store_raw_pread(h, (uint8_t *)&tr, sizeof(tr), h->size - sizeof(tr)) != sizeof(tr) ||
+	    memcmp(tr.magic, HSM_FRAME_MAGIC, 4) != 0 ||
+	    codec_by_id(hdr.codec) == NULL ||
+	    (hdr.flags & ~HSM_FRAME_CRC32C) != 0 ||
+	    hdr.chunk_size == 0 || hdr.chunk_size > HSM_FRAME_MAX_CHUNK ||
+	    tr.num_chunks != (tr.size + hdr.chunk_size - 1) / hdr.chunk_size ||
+	    tr.index_ofs + (uint64_t)tr.num_chunks * sizeof(uint32_t) *
+	    (hdr.flags & HSM_FRAME_CRC32C ? 2 : 1) + sizeof(tr) != h->size) {
+		return 0;
+	}
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL) {
+		goto nomem;
+	}
+	f->codec = codec_by_id(hdr.codec);
+	f->chunk_size = hdr.chunk_size;
+	f->num_chunks = tr.num_chunks;
+	f->size = tr.size;
+	f->flags = hdr.flags;
+	f->buf_chunk = -1;
+	/* the CRCs are read along with the lengths, straight after
+	   them */
+	entry = sizeof(uint32_t) * (f->flags & HSM_FRAME_CRC32C ? 2 : 1);
+	f->index = malloc(f->num_chunks * entry + 1);
+	f->offsets = malloc((f->num_chunks + 1) * sizeof(uint64_t));
+	f->buf = malloc(f->chunk_size);
+	if (f->index == NULL || f->offsets == NULL || f->buf == NULL) {
+		hsm_frame_free(f);
+		goto nomem;
+	}
+
+	if (hsm_store_raw_pread(h, (uint8_t *)f->index, f->num_chunks * entry,
+				tr.index_ofs) != f->num_chunks * entry) {
+		hsm_frame_free(f);
+		h->ctx->errmsg = "Unable to read chunk index";
+		return -1;
+	}
+
+	/* a raw chunk is stored whole and a chunk of zeros not at all,
+	   so anything else can't be trusted to read */
+	ofs = sizeof(hdr);
+	for (i=0;i<f->num_chunks;i++) {
+		uint32_t len = f->index[i] & HSM_FRAME_LEN_MASK;
+		if (((f->index[i] & HSM_FRAME_RAW) && (f->index[i] & HSM_FRAME_ZERO)) ||
+		    ((f->index[i] & HSM_FRAME_RAW) && len != frame_chunk_len(f, i)) ||
+		    ((f->index[i] & HSM_FRAME_ZERO) && len != 0)) {
+			break;
+		}
+		f->offsets[i] = ofs;
+		ofs += len;
+	}
+	f->offsets[i] = ofs;
+	if (i != f->num_chunks || ofs != tr.index_ofs) {
+		hsm_frame_free(f);
+		h->ctx->errmsg = "Corrupt chunk index";
+		errno = EIO;
+		return -1;
+	}
+
+	h->frame = f;
+	h->size = f->size;
+	return 0;
+
+nomem:
+	h->ctx->errmsg = "Unable to allocate store frame";
+	errno = ENOMEM;
+	return -1;
+}
+
+/*
+  decompress one chunk, and check it against its CRC
+ */
+static int frame_decode_chunk(struct hsm_store_handle *h, uint32_t chunk,
+			      const uint8_t *in, uint8_t *out)
+{
+	struct hsm_store_frame *f = h->frame;
+	uint32_t len = frame_chunk_len(f, chunk);
+
+	if (f->index[chunk] & HSM_FRAME_ZERO) {
+		/* there is nothing stored to check */
+		memset(out, 0, len);
+		return 0;
+	}
+
+	if (f->index[chunk] & HSM_FRAME_RAW) {
+		memcpy(out, in, len);
+	} else if (f->codec->decompress(in, f->index[chunk], out, len) != 0) {
+		h->ctx->errmsg = "Unable to decompress store object";
+		errno = EIO;
+		return -1;
+	}
+
+	/* the CRCs follow the lengths in the index */
+	if ((f->flags & HSM_FRAME_CRC32C) &&
+	    hsm_crc32c(0, out, len) != f->index[f->num_chunks + chunk]) {
+		h->ctx->errmsg = "Store object failed its checksum";
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  the chunks a read of n bytes at ofs touches. The read must already
+  be clamped to the file size
+ */
+void hsm_frame_range(struct hsm_store_handle *h, size_t n, off_t ofs,
+		     off_t *cofs, size_t *clen)
+{
+	struct hsm_store_frame *f = h->frame;
+	uint32_t first = ofs / f->chunk_size;
+	uint32_t last = (ofs + n - 1) / f->chunk_size;
+
+	*cofs = f->offsets[first];
+	*clen = f->offsets[last+1] - f->offsets[first];
+}
+
+/*
+  decompress a read of n bytes at ofs from the stored chunks it
+  touches, given in cbuf. Chunks only partly read are decompressed
+  into scratch, or if that is NULL into the frame buffer, where they
+  are kept for the next read
+ */
+static ssize_t frame_decode(struct hsm_store_handle *h, const uint8_t *cbuf,
+			    uint8_t *buf, size_t n, off_t ofs, uint8_t *scratch)
+{
+	struct hsm_store_frame *f = h->frame;
+	uint32_t first = ofs / f->chunk_size;
+	uint32_t chunk = first;
+	size_t done = 0;
+
+	while (done < n) {
+		uint64_t chunk_start = (uint64_t)chunk * f->chunk_size;
+		uint32_t len = frame_chunk_len(f, chunk);
+		uint32_t skip = ofs + done - chunk_start;
+		uint32_t want = len - skip;
+		const uint8_t *in = cbuf + (f->offsets[chunk] - f->offsets[first]);
+
+		if (want > n - done) {
+			want = n - done;
+		}
+
+		if (skip == 0 && want == len) {
+			if (frame_decode_chunk(h, chunk, in, buf + done) != 0) {
+				return -1;
+			}
+		} else if (scratch != NULL) {
+			if (frame_decode_chunk(h, chunk, in, scratch) != 0) {
+				return -1;
+			}
+			memcpy(buf + done, scratch + skip, want);
+		} else {
+			if (f->buf_chunk != chunk) {
+				f->buf_chunk = -1;
+				if (frame_decode_chunk(h, chunk, in, f->buf) != 0) {
+					return -1;
+				}
+				f->buf_chunk = chunk;
+			}
+			memcpy(buf + done, f->buf + skip, want);
+		}
+		done += want;
+		chunk++;
+	}
+	return n;
+}
+
+ssize_t hsm_frame_decode(struct hsm_store_handle *h, const uint8_t *cbuf,
+			 uint8_t *buf, size_t n, off_t ofs)
+{
+	return frame_decode(h, cbuf, buf, n, ofs, NULL);
+}
+
+/*
+  find the first offset at or after ofs that is in a chunk of data,
+  or in a chunk of zeros if 'data' is false, or the size of the file
+  if there is none. ofs must be less than the file size
+ */
+uint64_t hsm_frame_seek(struct hsm_store_handle *h, uint64_t ofs, bool data)
+{
+	struct hsm_store_frame *f = h->frame;
+	uint32_t first = ofs / f->chunk_size;
+	uint32_t chunk;
+
+	for (chunk=first;chunk<f->num_chunks;chunk++) {
+		bool zero = (f->index[chunk] & HSM_FRAME_ZERO) != 0;
+		if (zero != data) {
+			break;
+		}
+	}
+	if (chunk == first) {
+		return ofs;
+	}
+	if (chunk == f->num_chunks) {
+		return f->size;
+	}
+	return (uint64_t)chunk * f->chunk_size;
+}
+
+/*
+  for a mapped read of n bytes at ofs, find the run of whole chunks
+  from the one ofs is in that are stored as is, so can be used in
+  place. Gives where the run is in the object and where ofs is in the
+  run, and returns how many bytes of the read it covers, which is 0 if
+  the first chunk is compressed. The read must already be clamped to
+  the file size
+ */
+size_t hsm_frame_map_range(struct hsm_store_handle *h, size_t n, off_t ofs,
+			   off_t *cofs, size_t *clen, size_t *skip)
+{
+	struct hsm_store_frame *f = h->frame;
+	uint32_t first = ofs / f->chunk_size;
+	uint32_t last = (ofs + n - 1) / f->chunk_size;
+	uint32_t chunk;
+
+	for (chunk=first;chunk<=last;chunk++) {
+		if (!(f->index[chunk] & HSM_FRAME_RAW)) {
+			break;
+		}
+	}
+	if (chunk == first) {
+		return 0;
+	}
+
+	*cofs = f->offsets[first];
+	*clen = f->offsets[chunk] - f->offsets[first];
+	*skip = ofs - (uint64_t)first * f->chunk_size;
+	if (chunk <= last) {
+		n = (uint64_t)chunk * f->chunk_size - ofs;
+	}
+	return n;
+}
+
+/*
+  check the CRCs of the stored chunks found by hsm_frame_map_range(),
+  now mapped at cbuf
+ */
+int hsm_frame_map_check(struct hsm_store_handle *h, const uint8_t *cbuf,
+			off_t ofs, size_t clen)
+{
+	struct hsm_store_frame *f = h->frame;
+	uint32_t chunk = ofs / f->chunk_size;
+	const uint8_t *end = cbuf + clen;
+
+	if (!(f->flags & HSM_FRAME_CRC32C)) {
+		return 0;
+	}
+	for (;cbuf < end;chunk++) {
+		uint32_t len = f->index[chunk] & HSM_FRAME_LEN_MASK;
+		if (hsm_crc32c(0, cbuf, len) != f->index[f->num_chunks + chunk]) {
+			h->ctx->errmsg = "Store object failed its checksum";
+			errno = EIO;
+			return -1;
+		}
+		cbuf += len;
+	}
+	return 0;
+}
+
+/*
+  read n bytes at ofs from a framed object. The read must already be
+  clamped to the file size
+ */
+ssize_t hsm_frame_pread(struct hsm_store_handle *h, uint8_t *buf, size_t n, off_t ofs)
+{
+	struct hsm_store_frame *f = h->frame;
+	uint64_t chunk = ofs / f->chunk_size;
+	size_t clen;
+	off_t cofs;
+
+	/* a read within the chunk we already have */
+	if (f->buf_chunk == chunk &&
+	    ofs + n <= chunk * f->chunk_size + frame_chunk_len(f, chunk)) {
+		memcpy(buf, f->buf + (ofs - chunk * f->chunk_size), n);
+		return n;
+	}
+
+	hsm_frame_range(h, n, ofs, &cofs, &clen);
+	if (frame_cbuf(f, clen) != 0) {
+		h->ctx->errmsg = "Unable to allocate read buffer";
+		return -1;
+	}
+	if (hsm_store_raw_pread(h, f->cbuf, clen, cofs) != clen) {
+		h->ctx->errmsg = "Unable to read store object";
+		return -1;
+	}
+	return hsm_frame_decode(h, f->cbuf, buf, n, ofs);
+}
+
+/*
+  like hsm_frame_pread(), but with buffers of the read's own rather
+  than the frame's, so several threads can read one handle at once
+ */
+ssize_t hsm_frame_pread_shared(struct hsm_store_handle *h, uint8_t *buf, size_t n,
+			       off_t ofs)
+{
+	struct hsm_store_frame *f = h->frame;
+	uint8_t *cbuf, *scratch;
+	ssize_t ret = -1;
+	size_t clen;
+	off_t cofs;
+
+	hsm_frame_range(h, n, ofs, &cofs, &clen);
+	cbuf = malloc(clen);
+	scratch = malloc(f->chunk_size);
+	if (cbuf == NULL || scratch == NULL) {
+		h->ctx->errmsg = "Unable to allocate read buffer";
+		errno = ENOMEM;
+	} else if (hsm_store_raw_pread(h, cbuf, clen, cofs) != clen) {
+		h->ctx->errmsg = "Unable to read store object";
+	} else {
+		ret = frame_decode(h, cbuf, buf, n, ofs, scratch);
+	}
+	free(scratch);
+	free(cbuf);
+	return ret;
+}
@@ -0,0 +1,266 @@
+/*
+  append-only logs of fixed size records, shared by every process
+  using the store
+
+  Records are only appended with the log locked, and each process
+  replays the records appended since it last looked. A log that has
+  grown mostly dead can be rewritten with just its live state, and
+  processes notice the new file and replay it from the start.
+ */
+
+#include "hacksm.h"
+#include "store_backend.h"
+
+#ifdef F_OFD_SETLK
+/* locks held by open file rather than by process, so that one thread
+   closing a file can't drop a lock another holds */
+#define LOG_SETLK F_OFD_SETLK
+#define LOG_SETLKW F_OFD_SETLKW
+#else
+#define LOG_SETLK F_SETLK
+#define LOG_SETLKW F_SETLKW
+#endif
+
+/*
+  lock or unlock a whole file. Also used for the locks backends hold
+  on their own files
+ */
+int hsm_store_lock(int fd, bool wait, short type)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	return fcntl(fd, wait ? LOG_SETLKW : LOG_SETLK, &fl);
+}
+
+/*
+  set up a log. Nothing is opened until it is first used. 'apply' may
+  be NULL for a process that only appends, in which case records are
+  never read
+ */
+void hsm_log_init(struct hsm_store_log *log, const char *name, size_t rec_size,
+		  void (*apply)(void *private, const void *rec),
+		  void (*reset)(void *private), void *private)
+{
+	memset(log, 0, sizeof(*log));
+	log->name = name;
+	log->rec_size = rec_size;
+	log->apply = apply;
+	log->reset = reset;
+	log->private = private;
+	log->fd = -1;
+}
+
+void hsm_log_close(struct hsm_store_log *log)
+{
+	if (log->fd != -1) {
+		close(log->fd);
+		log->fd = -1;
+	}
+	free(log->fname);
+	log->fname = NULL;
+}
+
+/*
+  open the log, if it isn't open or has been replaced by a rewrite
+ */
+static int log_open(struct hsm_store_context *ctx, struct hsm_store_log *log)
+{
+	struct stat st;
+	int fd;
+
+	if (log->fname == NULL &&
+	    asprintf(&log->fname, "%s/%s", ctx->basepath, log->name) == -1) {
+		log->fname = NULL;
+		ctx->errmsg = "Unable to allocate store filename";
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (log->fd != -1 && stat(log->fname, &st) == 0 && st.st_ino == log->ino) {
+		return 0;
+	}
+
+	fd = open(log->fname, O_RDWR|O_CREAT|O_APPEND, 0600);
+	if (fd == -1 || fstat(fd, &st) != 0) {
+		ctx->errmsg = "Unable to open store log";
+		if (fd != -1) close(fd);
+		return -1;
+	}
+
+	if (log->fd != -1) {
+		close(log->fd);
+		if (log->reset) {
+			log->reset(log->private);
+		}
+	}
+	log->fd = fd;
+	log->ino = st.st_ino;
+	log->ofs = 0;
+	return 0;
+}
+
+/*
+  replay any records appended since we last looked
+ */
+int hsm_log_update(struct hsm_store_context *ctx, struct hsm_store_log *log)
+{
+	uint8_t buf[0x2000];
+	struct stat st;
+	ssize_t n;
+
+	if (log_open(ctx, log) != 0) {
+		return -1;
+	}
+
+	if (log->apply == NULL) {
+		if (fstat(log->fd, &st) != 0) {
+			ctx->errmsg = "Unable to read store log";
+			return -1;
+		}
+		log->ofs = st.st_size - st.st_size % log->rec_size;
+		return 0;
+	}
+
+	while ((n = pread(log->fd, buf, sizeof(buf) - sizeof(buf) % log->rec_size,
+			  log->ofs)) > 0) {
+		size_t i, count = n / log->rec_size;
+		for (i=0;i<count;i++) {
+			log->apply(log->private, buf + i * log->rec_size);
+		}
+		/* a partly written record is read again next time */
+		log->ofs += count * log->rec_size;
+		if (count == 0) {
+			break;
+		}
+	}
+	if (n == -1) {
+		ctx->errmsg = "Unable to read store log";
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  lock the log against appends by other processes, and bring it up to
+  date
+ */
+int hsm_log_lock(struct hsm_store_context *ctx, struct hsm_store_log *log)
+{
+	struct stat st;
+
+	while (1) {
+		if (log_open(ctx, log) != 0) {
+			return -1;
+		}
+		if (hsm_store_lock(log->fd, true, F_WRLCK) != 0) {
+			ctx->errmsg = "Unable to lock store log";
+			return -1;
+		}
+		/* the log may have been rewritten while we waited */
+		if (stat(log->fname, &st) == 0 && st.st_ino == log->ino) {
+			break;
+		}
+		hsm_store_lock(log->fd, false, F_UNLCK);
+	}
+
+	/* with the lock held, a partial record can only be left by a
+	   writer that died, and has to go before anything is added
+	   after it */
+	if (fstat(log->fd, &st) == 0 && st.st_size % log->rec_size != 0 &&
+	    ftruncate(log->fd, st.st_size - st.st_size % log->rec_size) != 0) {
+		hsm_store_lock(log->fd, false, F_UNLCK);
+		ctx->errmsg = "Unable to truncate store log";
+		return -1;
+	}
+
+	if (hsm_log_update(ctx, log) != 0) {
+		hsm_store_lock(log->fd, false, F_UNLCK);
+		return -1;
+	}
+	return 0;
+}
+
+void hsm_log_unlock(struct hsm_store_log *log)
+{
+	hsm_store_lock(log->fd, false, F_UNLCK);
+}
+
+/*
+  append records to a locked log, and replay them
+ */
+int hsm_log_write(struct hsm_store_context *ctx, struct hsm_store_log *log,
+		  const void *recs, unsigned count)
+{
+	size_t len = count * log->rec_size;
+
+	if (write(log->fd, recs, len) != len) {
+		ctx->errmsg = "Unable to write store log";
+		return -1;
+	}
+	return hsm_log_update(ctx, log);
+}
+
+/*
+  append records to the log
+ */
+int hsm_log_append(struct hsm_store_context *ctx, struct hsm_store_log *log,
+		   const void *recs, unsigned count)
+{
+	int ret;
+
+	if (hsm_log_lock(ctx, log) != 0) {
+		return -1;
+	}
+	ret = hsm_log_write(ctx, log, recs, count);
+	hsm_log_unlock(log);
+	return ret;
+}
+
+/*
+  replace a locked log with the records written by 'fill', which
+  should describe the current state of the log. The log stays locked,
+  and is replayed from the start the next time it is used
+ */
+int hsm_log_rewrite(struct hsm_store_context *ctx, struct hsm_store_log *log,
+		    int (*fill)(void *private, int fd))
+{
+	char *tmpname = NULL;
+	int fd, ret;
+
+	if (asprintf(&tmpname, "%s.tmp", log->fname) == -1) {
+		ctx->errmsg = "Unable to allocate store filename";
+		return -1;
+	}
+
+	fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1) {
+		ctx->errmsg = "Unable to create store log";
+		free(tmpname);
+		return -1;
+	}
+	ret = fill(log->private, fd);
+	if (ret == 0) {
+		ret = fsync(fd);
+	}
+	if (close(fd) != 0) {
+		ret = -1;
+	}
+	if (ret == 0) {
+		ret = rename(tmpname, log->fname);
+	}
+	if (ret != 0) {
+		ctx->errmsg = "Unable to rewrite store log";
+		unlink(tmpname);
+	}
+	free(tmpname);
+	if (ret != 0) {
+		return -1;
+	}
+
+	/* anyone waiting for the lock on the old log will notice it
+	   was replaced */
+	return 0;
+}
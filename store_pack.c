@@ -0,0 +1,1101 @@
+/*
+  HSM store backend appending objects to large pack files
+
+  Objects are written one after another into pack files, each behind
+  a small header. An index log records where each object is, and
+  every process using the store replays the log to find objects
+  written by others. The packs are the real record: an object only
+  becomes visible once its header is complete and synced, and the
+  index entry for it can be rebuilt from the pack if it is lost.
+
+  Each writer appends to a pack of its own, which it holds a lock on,
+  so packs never need locking for writes. Removed objects leave dead
+  space behind, and packs that are mostly dead are compacted by
+  copying their live objects to a new pack.
+ */
+
+#include "hacksm.h"
+#include "store_backend.h"
+#include <pthread.h>
+#include <dirent.h>
+
+#define HSM_PACK_INDEX "pack.index"
+#define HSM_PACK_MAGIC "HSMP"
+
+/* default size at which a writer moves on to a new pack */
+#define HSM_PACK_SIZE 0x10000000
+
+/* default percentage of a pack that must be dead before it is
+   compacted */
+#define HSM_PACK_COMPACT_PCT 50
+
+/* the index log is rewritten when it is this many times bigger than
+   the live entries in it, and at least this big */
+#define HSM_PACK_INDEX_RATIO 4
+#define HSM_PACK_INDEX_MIN 0x100000
+
+/* size of each copy during compaction */
+#define HSM_PACK_COPY_SIZE 0x100000
+
+/*
+  the header before each object in a pack. The length is all ones
+  until the object is complete
+ */
+struct pack_header {
+	char magic[4];
+	uint32_t reserved;
+	uint64_t device;
+	uint64_t inode;
+	uint64_t length;
+	/* when the object was written, in microseconds since the
+	   epoch */
+	uint64_t time;
+};
+
+enum pack_record_type {
+	PACK_ADD  = 1,	/* an object has been written */
+	PACK_DEL  = 2,	/* an object has been removed */
+	PACK_DROP = 3,	/* a pack has been compacted away */
+	PACK_END  = 4,	/* the end and total space of a pack, written when
+			   the log is rewritten. The end is in offset and
+			   the total in length */
+	PACK_FOUND = 5	/* an object found at the end of a pack by
+			   recovery */
+};
+
+/*
+  a record in the index log. Offsets are of the object data, just
+  after its header
+ */
+struct pack_record {
+	uint32_t type;
+	uint32_t pack;
+	uint64_t device;
+	uint64_t inode;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t time;
+};
+
+struct pack_entry {
+	struct pack_entry *next;
+	struct pack_record rec;
+};
+
+/* space accounting for each pack */
+struct pack_info {
+	uint64_t total;
+	uint64_t live;
+	/* end of the last indexed object */
+	uint64_t end;
+};
+
+struct pack_store {
+	pthread_mutex_t mutex;
+	uint64_t pack_size;
+	unsigned compact_pct;
+
+	struct hsm_store_log index;
+
+	/* index entries, hashed by device and inode */
+	struct pack_entry **hash;
+	unsigned hash_size;
+	unsigned num_entries;
+
+	struct pack_info *packs;
+	unsigned num_packs;
+	/* pack numbers are never reused, so a reader with an old index
+	   can't open the wrong pack */
+	uint32_t next_pack;
+
+	/* the pack we append to. Only one object is written at a
+	   time */
+	pthread_cond_t write_cond;
+	bool writing;
+	int active_fd;
+	uint32_t active_pack;
+	uint64_t active_end;
+};
+
+/* state of a handle open for writing */
+struct pack_write {
+	uint64_t header_ofs;
+	uint64_t device;
+	uint64_t inode;
+	/* the time to record, or zero for now */
+	uint64_t time;
+};
+
+static uint64_t pack_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static unsigned pack_hash(struct pack_store *ps, uint64_t device, uint64_t inode)
+{
+	return (unsigned)((inode * 0x9e3779b97f4a7c15ULL) ^ device) % ps->hash_size;
+}
+
+/*
+  return the name of a pack
+ */
+static char *pack_fname(struct hsm_store_context *ctx, uint32_t pack)
+{
+	char *fname = NULL;
+
+	if (asprintf(&fname, "%s/pack.%08x", ctx->basepath, pack) == -1) {
+		ctx->errmsg = "Unable to allocate store filename";
+		errno = ENOMEM;
+		return NULL;
+	}
+	return fname;
+}
+
+/*
+  find the accounting for a pack, growing the table if needed
+ */
+static struct pack_info *pack_info(struct pack_store *ps, uint32_t pack)
+{
+	if (pack >= ps->num_packs) {
+		unsigned n = pack + 64;
+		struct pack_info *p = realloc(ps->packs, n * sizeof(*p));
+		if (p == NULL) {
+			return NULL;
+		}
+		memset(p + ps->num_packs, 0, (n - ps->num_packs) * sizeof(*p));
+		ps->packs = p;
+		ps->num_packs = n;
+	}
+	return &ps->packs[pack];
+}
+
+static struct pack_entry **pack_find(struct pack_store *ps, uint64_t device, uint64_t inode)
+{
+	struct pack_entry **e;
+
+	for (e=&ps->hash[pack_hash(ps, device, inode)]; *e; e=&(*e)->next) {
+		if ((*e)->rec.device == device && (*e)->rec.inode == inode) {
+			break;
+		}
+	}
+	return e;
+}
+
+/*
+  double the size of the hash table
+ */
+static void pack_rehash(struct pack_store *ps)
+{
+	struct pack_entry **old = ps->hash;
+	unsigned i, old_size = ps->hash_size;
+
+	ps->hash = calloc(old_size * 2, sizeof(struct pack_entry *));
+	if (ps->hash == NULL) {
+		/* just live with longer chains */
+		ps->hash = old;
+		return;
+	}
+	ps->hash_size = old_size * 2;
+
+	for (i=0;i<old_size;i++) {
+		struct pack_entry *e, *next;
+		for (e=old[i]; e; e=next) {
+			unsigned h = pack_hash(ps, e->rec.device, e->rec.inode);
+			next = e->next;
+			e->next = ps->hash[h];
+			ps->hash[h] = e;
+		}
+	}
+	free(old);
+}
+
+/*
+  apply an index record to the in-memory index
+ */
+static void pack_apply(void *private, const void *r)
+{
+	struct pack_store *ps = private;
+	const struct pack_record *rec = r;
+	uint64_t size = rec->length + sizeof(struct pack_header);
+	struct pack_entry **ep, *e;
+	struct pack_info *pi;
+
+	if (rec->pack >= ps->next_pack) {
+		ps->next_pack = rec->pack + 1;
+	}
+
+	switch (rec->type) {
+	case PACK_ADD:
+	case PACK_FOUND:
+		pi = pack_info(ps, rec->pack);
+		if (pi == NULL) {
+			return;
+		}
+		pi->total += size;
+		pi->live += size;
+		if (rec->offset + rec->length > pi->end) {
+			pi->end = rec->offset + rec->length;
+		}
+		ep = pack_find(ps, rec->device, rec->inode);
+		if (rec->type == PACK_FOUND && *ep && (*ep)->rec.time > rec->time) {
+			/* a recovered object older than the indexed copy
+			   was written before it, and is dead space. Only
+			   recovered objects are ordered by time, as the
+			   log order is the real one for the rest */
+			pi->live -= size;
+			return;
+		}
+		if (*ep) {
+			/* a newer copy of the object */
+			e = *ep;
+			pi = pack_info(ps, e->rec.pack);
+			if (pi) {
+				pi->live -= e->rec.length + sizeof(struct pack_header);
+			}
+			e->rec = *rec;
+			e->rec.type = PACK_ADD;
+			return;
+		}
+		e = malloc(sizeof(*e));
+		if (e == NULL) {
+			return;
+		}
+		e->rec = *rec;
+		e->rec.type = PACK_ADD;
+		e->next = NULL;
+		*ep = e;
+		if (++ps->num_entries > ps->hash_size) {
+			pack_rehash(ps);
+		}
+		break;
+
+	case PACK_DEL:
+		ep = pack_find(ps, rec->device, rec->inode);
+		e = *ep;
+		/* only if it is the copy that was removed */
+		if (e == NULL || e->rec.pack != rec->pack || e->rec.offset != rec->offset) {
+			return;
+		}
+		pi = pack_info(ps, e->rec.pack);
+		if (pi) {
+			pi->live -= e->rec.length + sizeof(struct pack_header);
+		}
+		*ep = e->next;
+		free(e);
+		ps->num_entries--;
+		break;
+
+	case PACK_DROP:
+		pi = pack_info(ps, rec->pack);
+		if (pi) {
+			memset(pi, 0, sizeof(*pi));
+		}
+		break;
+
+	case PACK_END:
+		/* this follows the live entries for the pack, so it
+		   puts back the dead space they don't account for */
+		pi = pack_info(ps, rec->pack);
+		if (pi == NULL) {
+			return;
+		}
+		if (rec->offset > pi->end) {
+			pi->end = rec->offset;
+		}
+		if (rec->length > pi->total) {
+			pi->total = rec->length;
+		}
+		break;
+	}
+}
+
+/*
+  throw away the in-memory index, when the log has been rewritten
+ */
+static void pack_index_clear(void *private)
+{
+	struct pack_store *ps = private;
+	unsigned i;
+
+	for (i=0;i<ps->hash_size;i++) {
+		while (ps->hash[i]) {
+			struct pack_entry *e = ps->hash[i];
+			ps->hash[i] = e->next;
+			free(e);
+		}
+	}
+	ps->num_entries = 0;
+	memset(ps->packs, 0, ps->num_packs * sizeof(struct pack_info));
+}
+
+/*
+  write the live entries to a new index log, followed by the end of
+  each pack. Without the end, recovery would take removed objects
+  after the last live one for objects that never made it into the
+  index
+ */
+static int pack_index_fill(void *private, int fd)
+{
+	struct pack_store *ps = private;
+	unsigned i;
+
+	for (i=0;i<ps->hash_size;i++) {
+		struct pack_entry *e;
+		for (e=ps->hash[i]; e; e=e->next) {
+			if (write(fd, &e->rec, sizeof(e->rec)) != sizeof(e->rec)) {
+				return -1;
+			}
+		}
+	}
+	for (i=0;i<ps->num_packs;i++) {
+		struct pack_info *pi = &ps->packs[i];
+		struct pack_record rec;
+
+		if (pi->end == 0 && pi->total == 0) {
+			continue;
+		}
+		memset(&rec, 0, sizeof(rec));
+		rec.type = PACK_END;
+		rec.pack = i;
+		rec.offset = pi->end;
+		rec.length = pi->total;
+		if (write(fd, &rec, sizeof(rec)) != sizeof(rec)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+  rewrite the index log with just the live entries, once it is mostly
+  dead records. Must be called with the store locked
+ */
+static void pack_index_rewrite(struct hsm_store_context *ctx)
+{
+	struct pack_store *ps = ctx->private;
+
+	if (ps->index.ofs < HSM_PACK_INDEX_MIN ||
+	    ps->index.ofs < (off_t)ps->num_entries * sizeof(struct pack_record) * HSM_PACK_INDEX_RATIO) {
+		return;
+	}
+	if (hsm_log_lock(ctx, &ps->index) != 0) {
+		return;
+	}
+	hsm_log_rewrite(ctx, &ps->index, pack_index_fill);
+	hsm_log_unlock(&ps->index);
+}
+
+/*
+  look for objects at the end of a pack that never made it into the
+  index, because the writer died after syncing the object. These are
+  added to the index, and a partly written object is cut off. An
+  object found this way that is older than the indexed copy of the
+  same inode only counts as dead space. Packs locked by a live writer
+  are left alone. Must be called with the store locked
+ */
+static int pack_recover(struct hsm_store_context *ctx, uint32_t pack)
+{
+	struct pack_store *ps = ctx->private;
+	struct pack_header hdr;
+	struct pack_info *pi;
+	struct stat st;
+	uint64_t ofs;
+	char *fname;
+	int fd, ret = 0;
+
+	fname = pack_fname(ctx, pack);
+	if (fname == NULL) {
+		return -1;
+	}
+	fd = open(fname, O_RDWR);
+	free(fname);
+	if (fd == -1) {
+		return 0;
+	}
+	if (hsm_store_lock(fd, false, F_WRLCK) != 0) {
+		/* someone is writing to it */
+		close(fd);
+		return 0;
+	}
+
+	hsm_log_update(ctx, &ps->index);
+	pi = pack_info(ps, pack);
+	if (pi == NULL || fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	ofs = pi->end;
+	while (ofs + sizeof(hdr) <= st.st_size) {
+		struct pack_record rec;
+
+		if (pread(fd, &hdr, sizeof(hdr), ofs) != sizeof(hdr) ||
+		    memcmp(hdr.magic, HSM_PACK_MAGIC, 4) != 0 ||
+		    hdr.length > st.st_size - ofs - sizeof(hdr)) {
+			break;
+		}
+		rec.type = PACK_FOUND;
+		rec.pack = pack;
+		rec.device = hdr.device;
+		rec.inode = hdr.inode;
+		rec.offset = ofs + sizeof(hdr);
+		rec.length = hdr.length;
+		rec.time = hdr.time;
+		if (hsm_log_append(ctx, &ps->index, &rec, 1) != 0) {
+			ret = -1;
+			break;
+		}
+		ofs = rec.offset + rec.length;
+	}
+	if (ret == 0 && ofs < st.st_size) {
+		ret = ftruncate(fd, ofs);
+	}
+
+	/* closing drops the lock */
+	close(fd);
+	return ret;
+}
+
+/*
+  start a new pack for this process to append to. Must be called with
+  the store locked
+ */
+static int pack_new(struct hsm_store_context *ctx)
+{
+	struct pack_store *ps = ctx->private;
+	uint32_t pack = ps->next_pack;
+	char *fname;
+	int fd;
+
+	while (1) {
+		fname = pack_fname(ctx, pack);
+		if (fname == NULL) {
+			return -1;
+		}
+		fd = open(fname, O_RDWR|O_CREAT|O_EXCL, 0600);
+		free(fname);
+		if (fd != -1) {
+			break;
+		}
+		if (errno != EEXIST) {
+			ctx->errmsg = "Unable to create pack";
+			return -1;
+		}
+		pack++;
+	}
+
+	if (hsm_store_lock(fd, false, F_WRLCK) != 0) {
+		ctx->errmsg = "Unable to lock new pack";
+		close(fd);
+		return -1;
+	}
+
+	if (ps->active_fd != -1) {
+		close(ps->active_fd);
+	}
+	ps->active_fd = fd;
+	ps->active_pack = pack;
+	ps->active_end = 0;
+	ps->next_pack = pack + 1;
+	pack_info(ps, pack);
+
+	return 0;
+}
+
+/*
+  set up the backend state
+ */
+static int pack_init(struct hsm_store_context *ctx)
+{
+	struct pack_store *ps;
+
+	ps = calloc(1, sizeof(struct pack_store));
+	if (ps == NULL) {
+		ctx->errmsg = "Unable to allocate pack store";
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ps->hash_size = 1024;
+	ps->hash = calloc(ps->hash_size, sizeof(struct pack_entry *));
+	if (ps->hash == NULL) {
+		free(ps);
+		ctx->errmsg = "Unable to allocate pack store";
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pthread_mutex_init(&ps->mutex, NULL);
+	pthread_cond_init(&ps->write_cond, NULL);
+	ps->pack_size = HSM_PACK_SIZE;
+	ps->compact_pct = HSM_PACK_COMPACT_PCT;
+	ps->active_fd = -1;
+	hsm_log_init(&ps->index, HSM_PACK_INDEX, sizeof(struct pack_record),
+		     pack_apply, pack_index_clear, ps);
+	ctx->private = ps;
+
+	return 0;
+}
+
+/*
+  set a pack store option. The pack store knows these options:
+
+    pack_size=BYTES   size at which writers start a new pack
+    compact=PERCENT   how much of a pack must be dead before it is
+                      compacted
+ */
+static int pack_set_option(struct hsm_store_context *ctx, const char *name,
+			   const char *value)
+{
+	struct pack_store *ps = ctx->private;
+
+	if (strcmp(name, "pack_size") == 0) {
+		ps->pack_size = strtoull(value, NULL, 0);
+		if (ps->pack_size == 0) {
+			ps->pack_size = HSM_PACK_SIZE;
+		}
+		return 0;
+	}
+	if (strcmp(name, "compact") == 0) {
+		ps->compact_pct = strtoul(value, NULL, 0);
+		if (ps->compact_pct == 0 || ps->compact_pct > 100) {
+			ctx->errmsg = "compact must be a percentage";
+			errno = EINVAL;
+			return -1;
+		}
+		return 0;
+	}
+
+	ctx->errmsg = "Unknown store option";
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+  connect to the store, loading the index and recovering any objects
+  left out of it by writers that died
+ */
+static int pack_connect(struct hsm_store_context *ctx)
+{
+	struct pack_store *ps = ctx->private;
+	struct dirent *de;
+	DIR *d;
+	int ret = 0;
+
+	pthread_mutex_lock(&ps->mutex);
+	if (hsm_log_update(ctx, &ps->index) != 0) {
+		pthread_mutex_unlock(&ps->mutex);
+		return -1;
+	}
+
+	d = opendir(ctx->basepath);
+	if (d == NULL) {
+		pthread_mutex_unlock(&ps->mutex);
+		ctx->errmsg = "Unable to open store directory";
+		return -1;
+	}
+	while (ret == 0 && (de = readdir(d)) != NULL) {
+		unsigned pack;
+		char c;
+		if (sscanf(de->d_name, "pack.%8x%c", &pack, &c) == 1) {
+			if (pack >= ps->next_pack) {
+				ps->next_pack = pack + 1;
+			}
+			ret = pack_recover(ctx, pack);
+		}
+	}
+	closedir(d);
+	pthread_mutex_unlock(&ps->mutex);
+
+	if (ret != 0) {
+		ctx->errmsg = "Unable to recover pack";
+	}
+	return ret;
+}
+
+/*
+  shutdown the link to the store
+ */
+static void pack_shutdown(struct hsm_store_context *ctx)
+{
+	struct pack_store *ps = ctx->private;
+
+	pack_index_clear(ps);
+	free(ps->hash);
+	free(ps->packs);
+	hsm_log_close(&ps->index);
+	if (ps->active_fd != -1) {
+		close(ps->active_fd);
+	}
+	pthread_mutex_destroy(&ps->mutex);
+	pthread_cond_destroy(&ps->write_cond);
+	free(ps);
+	ctx->private = NULL;
+}
+
+/*
+  start writing an object at the end of our pack. The object stays
+  invisible until it is finished by pack_write_end()
+ */
+static int pack_write_begin(struct hsm_store_context *ctx, struct hsm_store_handle *h,
+			    dev_t device, ino_t inode, uint64_t time)
+{
+	struct pack_store *ps = ctx->private;
+	struct pack_header hdr;
+	struct pack_write *pw;
+
+	pw = calloc(1, sizeof(*pw));
+	if (pw == NULL) {
+		ctx->errmsg = "Unable to allocate pack write";
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ps->mutex);
+	while (ps->writing) {
+		pthread_cond_wait(&ps->write_cond, &ps->mutex);
+	}
+	if ((ps->active_fd == -1 || ps->active_end >= ps->pack_size) &&
+	    pack_new(ctx) != 0) {
+		pthread_mutex_unlock(&ps->mutex);
+		free(pw);
+		return -1;
+	}
+	ps->writing = true;
+	pthread_mutex_unlock(&ps->mutex);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HSM_PACK_MAGIC, 4);
+	hdr.device = device;
+	hdr.inode = inode;
+	hdr.length = UINT64_MAX;
+
+	pw->header_ofs = ps->active_end;
+	pw->device = device;
+	pw->inode = inode;
+	pw->time = time;
+
+	if (pwrite(ps->active_fd, &hdr, sizeof(hdr), pw->header_ofs) != sizeof(hdr)) {
+		ctx->errmsg = "Unable to write pack header";
+		pthread_mutex_lock(&ps->mutex);
+		ps->writing = false;
+		pthread_cond_signal(&ps->write_cond);
+		pthread_mutex_unlock(&ps->mutex);
+		free(pw);
+		return -1;
+	}
+
+	h->fd = ps->active_fd;
+	h->base = pw->header_ofs + sizeof(hdr);
+	h->size = UINT64_MAX;
+	h->private = pw;
+	return 0;
+}
+
+/*
+  finish writing an object: complete its header, sync it and add it
+  to the index. If 'expect' is given then the object is only kept if
+  the index still has the object at that place, which stops
+  compaction bringing back an object removed while it was copied. A
+  discarded object is cut off the end of the pack
+ */
+static int pack_write_end(struct hsm_store_handle *h, const struct pack_record *expect,
+			  bool discard)
+{
+	struct hsm_store_context *ctx = h->ctx;
+	struct pack_store *ps = ctx->private;
+	struct pack_write *pw = h->private;
+	struct pack_header hdr;
+	struct pack_record rec;
+	int ret = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HSM_PACK_MAGIC, 4);
+	hdr.device = pw->device;
+	hdr.inode = pw->inode;
+	hdr.length = h->ofs;
+	hdr.time = pw->time ? pw->time : pack_now();
+
+	rec.type = PACK_ADD;
+	rec.pack = ps->active_pack;
+	rec.device = pw->device;
+	rec.inode = pw->inode;
+	rec.offset = h->base;
+	rec.length = h->ofs;
+	rec.time = hdr.time;
+
+	if (!discard &&
+	    (pwrite(h->fd, &hdr, sizeof(hdr), pw->header_ofs) != sizeof(hdr) ||
+	     (!ctx->defer_sync && fdatasync(h->fd) != 0))) {
+		ctx->errmsg = "Unable to sync pack";
+		ret = -1;
+	}
+
+	pthread_mutex_lock(&ps->mutex);
+	if (!discard && ret == 0) {
+		ret = hsm_log_lock(ctx, &ps->index);
+	}
+	if (!discard && ret == 0) {
+		if (expect != NULL) {
+			struct pack_entry *e = *pack_find(ps, expect->device, expect->inode);
+			if (e == NULL || e->rec.pack != expect->pack ||
+			    e->rec.offset != expect->offset) {
+				discard = true;
+			}
+		}
+		if (!discard) {
+			ret = hsm_log_write(ctx, &ps->index, &rec, 1);
+		}
+		hsm_log_unlock(&ps->index);
+	}
+	if (discard || ret != 0) {
+		/* if this fails then the header is left incomplete,
+		   and recovery cuts the object off instead */
+		if (ftruncate(ps->active_fd, pw->header_ofs) == 0) {
+			rec.offset = pw->header_ofs;
+			rec.length = 0;
+		}
+	}
+	ps->active_end = rec.offset + rec.length;
+	ps->writing = false;
+	pthread_cond_signal(&ps->write_cond);
+	pthread_mutex_unlock(&ps->mutex);
+
+	free(pw);
+	h->private = NULL;
+	return ret;
+}
+
+/*
+  open an object in the store
+ */
+static int pack_open(struct hsm_store_context *ctx, struct hsm_store_handle *h,
+		     dev_t device, ino_t inode)
+{
+	struct pack_store *ps = ctx->private;
+	struct pack_entry *e;
+	unsigned tries;
+
+	if (!h->readonly) {
+		return pack_write_begin(ctx, h, device, inode, 0);
+	}
+
+	/* the pack may be compacted away between looking it up and
+	   opening it, in which case the index will have moved on */
+	for (tries=0;tries<2;tries++) {
+		char *fname;
+
+		pthread_mutex_lock(&ps->mutex);
+		if (hsm_log_update(ctx, &ps->index) != 0) {
+			pthread_mutex_unlock(&ps->mutex);
+			return -1;
+		}
+		e = *pack_find(ps, device, inode);
+		if (e == NULL) {
+			pthread_mutex_unlock(&ps->mutex);
+			ctx->errmsg = "Object not in store";
+			errno = ENOENT;
+			return -1;
+		}
+		h->base = e->rec.offset;
+		h->size = e->rec.length;
+		fname = pack_fname(ctx, e->rec.pack);
+		pthread_mutex_unlock(&ps->mutex);
+
+		if (fname == NULL) {
+			return -1;
+		}
+		h->fd = open(fname, O_RDONLY);
+		free(fname);
+		if (h->fd != -1) {
+			return 0;
+		}
+		if (errno != ENOENT) {
+			break;
+		}
+	}
+
+	ctx->errmsg = "Unable to open pack";
+	return -1;
+}
+
+/*
+  close an object
+ */
+static int pack_close(struct hsm_store_handle *h)
+{
+	if (!h->readonly) {
+		/* the pack stays open for the next object */
+		return pack_write_end(h, NULL, false);
+	}
+	return close(h->fd);
+}
+
+/*
+  the time of an object is the one recorded in the index by the node
+  that wrote it, which compaction keeps
+ */
+static int pack_object_time(struct hsm_store_context *ctx,
+			    dev_t device, ino_t inode, uint64_t *time)
+{
+	struct pack_store *ps = ctx->private;
+	struct pack_entry *e;
+
+	pthread_mutex_lock(&ps->mutex);
+	if (hsm_log_update(ctx, &ps->index) != 0) {
+		pthread_mutex_unlock(&ps->mutex);
+		return -1;
+	}
+	e = *pack_find(ps, device, inode);
+	if (e == NULL) {
+		pthread_mutex_unlock(&ps->mutex);
+		ctx->errmsg = "Object not in store";
+		errno = ENOENT;
+		return -1;
+	}
+	*time = e->rec.time;
+	pthread_mutex_unlock(&ps->mutex);
+	return 0;
+}
+
+/*
+  remove an object if it still has the given time. This just records
+  the removal in the index, and the space is reclaimed when the pack
+  is compacted
+ */
+static int pack_remove(struct hsm_store_context *ctx,
+		       dev_t device, ino_t inode, uint64_t time)
+{
+	struct pack_store *ps = ctx->private;
+	struct pack_entry *e;
+	struct pack_record rec;
+	int ret;
+
+	pthread_mutex_lock(&ps->mutex);
+	if (hsm_log_update(ctx, &ps->index) != 0) {
+		pthread_mutex_unlock(&ps->mutex);
+		return -1;
+	}
+	e = *pack_find(ps, device, inode);
+	if (e == NULL) {
+		pthread_mutex_unlock(&ps->mutex);
+		errno = ENOENT;
+		return -1;
+	}
+	if (time != UINT64_MAX && e->rec.time != time) {
+		pthread_mutex_unlock(&ps->mutex);
+		ctx->errmsg = "Store object was written again since the removal";
+		errno = EEXIST;
+		return -1;
+	}
+	rec = e->rec;
+	rec.type = PACK_DEL;
+	ret = hsm_log_append(ctx, &ps->index, &rec, 1);
+	pthread_mutex_unlock(&ps->mutex);
+	return ret;
+}
+
+/*
+  position of an object in the store: its pack and where it is in
+  the pack
+ */
+static uint64_t pack_position(struct hsm_store_context *ctx,
+			      dev_t device, ino_t inode)
+{
+	struct pack_store *ps = ctx->private;
+	struct pack_entry *e;
+	uint64_t pos;
+
+	pthread_mutex_lock(&ps->mutex);
+	hsm_log_update(ctx, &ps->index);
+	e = *pack_find(ps, device, inode);
+	if (e == NULL) {
+		pos = ((uint64_t)device << 48) ^ (uint64_t)inode;
+	} else {
+		pos = ((uint64_t)e->rec.pack << 40) | (e->rec.offset & ((1ULL<<40)-1));
+	}
+	pthread_mutex_unlock(&ps->mutex);
+	return pos;
+}
+
+/*
+  list part of the objects in the store, from the index
+ */
+static int pack_list(struct hsm_store_context *ctx, unsigned part, unsigned num_parts,
+		     hsm_store_list_fn fn, void *private)
+{
+	struct pack_store *ps = ctx->private;
+	struct pack_entry *e;
+	unsigned i;
+
+	pthread_mutex_lock(&ps->mutex);
+	if (hsm_log_update(ctx, &ps->index) != 0) {
+		pthread_mutex_unlock(&ps->mutex);
+		return -1;
+	}
+	/* parts are split by object rather than by hash bucket, as
+	   the hash can grow between the calls for each part */
+	for (i=0;i<ps->hash_size;i++) {
+		for (e=ps->hash[i]; e; e=e->next) {
+			if ((e->rec.inode * 0x9e3779b97f4a7c15ULL ^ e->rec.device) % num_parts == part) {
+				fn(private, e->rec.device, e->rec.inode, e->rec.time);
+			}
+		}
+	}
+	pthread_mutex_unlock(&ps->mutex);
+	return 0;
+}
+
+/*
+  copy the live objects of a pack into our own pack, then remove it.
+  The pack is locked while we do this, so only one process compacts
+  it
+ */
+static int pack_compact_one(struct hsm_store_context *ctx, uint32_t pack)
+{
+	struct pack_store *ps = ctx->private;
+	struct pack_record *live = NULL, rec;
+	unsigned i, n = 0;
+	uint8_t *buf;
+	char *fname;
+	int fd, ret = 0;
+
+	fname = pack_fname(ctx, pack);
+	if (fname == NULL) {
+		return -1;
+	}
+	fd = open(fname, O_RDWR);
+	if (fd == -1 || hsm_store_lock(fd, false, F_WRLCK) != 0) {
+		/* gone, or still being written to */
+		if (fd != -1) close(fd);
+		free(fname);
+		return 0;
+	}
+
+	buf = malloc(HSM_PACK_COPY_SIZE);
+
+	pthread_mutex_lock(&ps->mutex);
+	hsm_log_update(ctx, &ps->index);
+	live = calloc(ps->num_entries + 1, sizeof(*live));
+	for (i=0; live && i<ps->hash_size; i++) {
+		struct pack_entry *e;
+		for (e=ps->hash[i]; e; e=e->next) {
+			if (e->rec.pack == pack) {
+				live[n++] = e->rec;
+			}
+		}
+	}
+	pthread_mutex_unlock(&ps->mutex);
+
+	if (buf == NULL || live == NULL) {
+		ctx->errmsg = "No memory for compaction";
+		ret = -1;
+		goto done;
+	}
+
+	for (i=0;i<n && ret == 0;i++) {
+		struct hsm_store_handle h;
+		uint64_t ofs;
+
+		memset(&h, 0, sizeof(h));
+		h.ctx = ctx;
+		if (pack_write_begin(ctx, &h, live[i].device, live[i].inode, live[i].time) != 0) {
+			ret = -1;
+			break;
+		}
+		for (ofs=0; ofs<live[i].length; ) {
+			size_t len = live[i].length - ofs;
+			if (len > HSM_PACK_COPY_SIZE) {
+				len = HSM_PACK_COPY_SIZE;
+			}
+			if (pread(fd, buf, len, live[i].offset + ofs) != len ||
+			    pwrite(h.fd, buf, len, h.base + ofs) != len) {
+				ctx->errmsg = "Unable to copy object during compaction";
+				ret = -1;
+				break;
+			}
+			ofs += len;
+		}
+		h.ofs = ofs;
+		if (pack_write_end(&h, &live[i], ret != 0) != 0) {
+			ret = -1;
+		}
+	}
+
+	if (ret == 0) {
+		memset(&rec, 0, sizeof(rec));
+		rec.type = PACK_DROP;
+		rec.pack = pack;
+		pthread_mutex_lock(&ps->mutex);
+		ret = hsm_log_append(ctx, &ps->index, &rec, 1);
+		pthread_mutex_unlock(&ps->mutex);
+	}
+	if (ret == 0) {
+		unlink(fname);
+	}
+
+done:
+	free(live);
+	free(buf);
+	free(fname);
+	close(fd);
+	return ret;
+}
+
+/*
+  compact the pack with the most dead space, if it is dead enough,
+  and rewrite the index log if it has grown too big. Returns the
+  number of packs compacted
+ */
+static int pack_compact(struct hsm_store_context *ctx)
+{
+	struct pack_store *ps = ctx->private;
+	uint64_t most_dead = 0;
+	uint32_t pack = 0;
+	unsigned i;
+
+	pthread_mutex_lock(&ps->mutex);
+	if (hsm_log_update(ctx, &ps->index) != 0) {
+		pthread_mutex_unlock(&ps->mutex);
+		return -1;
+	}
+	for (i=0;i<ps->num_packs;i++) {
+		struct pack_info *pi = &ps->packs[i];
+		uint64_t dead = pi->total - pi->live;
+		if (pi->total == 0 || (ps->active_fd != -1 && i == ps->active_pack)) {
+			continue;
+		}
+		if (dead * 100 >= pi->total * ps->compact_pct && dead > most_dead) {
+			most_dead = dead;
+			pack = i;
+		}
+	}
+	pthread_mutex_unlock(&ps->mutex);
+
+	if (most_dead != 0 && pack_compact_one(ctx, pack) != 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&ps->mutex);
+	pack_index_rewrite(ctx);
+	pthread_mutex_unlock(&ps->mutex);
+
+	return most_dead != 0 ? 1 : 0;
+}
+
+const struct hsm_store_ops hsm_store_pack_ops = {
+	.name		= "pack",
+	.init		= pack_init,
+	.set_option	= pack_set_option,
+	.connect	= pack_connect,
+	.shutdown	= pack_shutdown,
+	.open		= pack_open,
+	.close		= pack_close,
+	.remove		= pack_remove,
+	.object_time	= pack_object_time,
+	.position	= pack_position,
+	.list		= pack_list,
+	.compact	= pack_compact,
+};
@@ -0,0 +1,513 @@
+/*
+  a queue of store operations done in the background, for callers
+  that want many operations in flight from one thread
+
+  Reads of objects the generic layer transfers itself are handed to
+  the kernel with io_uring when built with liburing, set up with
+  hsm_store_aio_prepare() so framed data is decoded when the read is
+  reaped. Everything else, and everything when io_uring isn't
+  available, is run by a small pool of threads. Operations on the
+  same handle are never run by two threads at once, as a handle's
+  framing and direct I/O buffers are its own, and the threads take
+  each handle's operations in the order they were submitted. The
+  exception is reads of handles that keep no state of their own for
+  a read, such as plain objects read through a file descriptor and
+  stripe objects, which are run in parallel with framed data decoded
+  in buffers of each read's own (see hsm_store_concurrent_reads()).
+
+  When both are busy, finished pool operations are signalled with an
+  eventfd polled from the ring, so a reaper only ever waits on one
+  thing.
+ */
+
+#include "hacksm.h"
+#include "store_backend.h"
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#endif
+
+/* the most threads a queue runs operations on */
+#define HSM_QUEUE_THREADS 8
+
+enum queue_op {
+	QUEUE_READ,
+	QUEUE_WRITE,
+	QUEUE_CLOSE
+};
+
+struct queue_job {
+	struct queue_job *next;
+	enum queue_op op;
+	struct hsm_store_handle *h;
+	uint8_t *buf;
+	size_t n;
+	off_t ofs;
+	void *private;
+	ssize_t result;
+	int err;
+	/* a read given to io_uring */
+	struct hsm_store_aio *aio;
+};
+
+struct hsm_store_queue {
+	struct hsm_store_context *ctx;
+	unsigned depth;
+	/* submitted and not yet reaped */
+	unsigned inflight;
+	pthread_mutex_t mutex;
+	/* jobs waiting for a thread, and jobs finished by one */
+	struct queue_job *jobs, *jobs_tail;
+	struct queue_job *done, *done_tail;
+	/* jobs given to the threads that aren't on the done list */
+	unsigned pool_pending;
+	pthread_cond_t job_cond;
+	pthread_cond_t done_cond;
+	bool stopping;
+	pthread_t threads[HSM_QUEUE_THREADS];
+	unsigned num_threads;
+#ifdef HAVE_LIBURING
+	bool have_ring;
+	struct io_uring ring;
+	/* reads in the ring */
+	unsigned ring_pending;
+	/* written by the threads as they finish jobs, and polled from
+	   the ring while the reaper waits on it */
+	int efd;
+	bool efd_armed;
+#endif
+};
+
+/*
+  the first job a thread can take: one whose handle no other thread
+  is working on, or a read of a handle that can take several at once,
+  and for a close, one with nothing else left on its handle. Must be
+  called with the queue locked
+ */
+static struct queue_job *queue_next_job(struct hsm_store_queue *q)
+{
+	struct queue_job *j, *prev = NULL;
+
+	for (j=q->jobs;j;prev=j,j=j->next) {
+		if (j->h->queue_running != 0 &&
+		    (j->op != QUEUE_READ || !hsm_store_concurrent_reads(j->h))) {
+			continue;
+		}
+		if (j->op == QUEUE_CLOSE && j->h->queued != 1) {
+			continue;
+		}
+		if (prev) {
+			prev->next = j->next;
+		} else {
+			q->jobs = j->next;
+		}
+		if (q->jobs_tail == j) {
+			q->jobs_tail = prev;
+		}
+		j->next = NULL;
+		return j;
+	}
+	return NULL;
+}
+
+/*
+  put a finished job on the done list. Must be called with the queue
+  locked
+ */
+static void queue_finished(struct hsm_store_queue *q, struct queue_job *j)
+{
+	if (q->done_tail) {
+		q->done_tail->next = j;
+	} else {
+		q->done = j;
+	}
+	q->done_tail = j;
+	pthread_cond_signal(&q->done_cond);
+}
+
+static void queue_run(struct queue_job *j)
+{
+	switch (j->op) {
+	case QUEUE_READ:
+		if (hsm_store_concurrent_reads(j->h)) {
+			j->result = hsm_store_pread_shared(j->h, j->buf, j->n, j->ofs);
+		} else {
+			j->result = hsm_store_pread(j->h, j->buf, j->n, j->ofs);
+		}
+		break;
+	case QUEUE_WRITE:
+		j->result = hsm_store_write(j->h, j->buf, j->n);
+		break;
+	case QUEUE_CLOSE:
+		j->result = hsm_store_close(j->h);
+		break;
+	}
+	j->err = j->result == -1 ? errno : 0;
+}
+
+static void *queue_thread(void *private)
+{
+	struct hsm_store_queue *q = private;
+	struct queue_job *j;
+
+	pthread_mutex_lock(&q->mutex);
+	while (true) {
+		struct hsm_store_handle *h;
+
+		j = queue_next_job(q);
+		if (j == NULL) {
+			if (q->stopping) {
+				break;
+			}
+			pthread_cond_wait(&q->job_cond, &q->mutex);
+			continue;
+		}
+
+		h = j->h;
+		h->queue_running++;
+		pthread_mutex_unlock(&q->mutex);
+
+		queue_run(j);
+
+		pthread_mutex_lock(&q->mutex);
+		/* a closed handle is gone */
+		if (j->op != QUEUE_CLOSE) {
+			h->queue_running--;
+			h->queued--;
+		}
+		q->pool_pending--;
+		queue_finished(q, j);
+#ifdef HAVE_LIBURING
+		if (q->have_ring) {
+			eventfd_write(q->efd, 1);
+		}
+#endif
+		/* jobs held back behind this one may be ready now */
+		pthread_cond_broadcast(&q->job_cond);
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return NULL;
+}
+
+/*
+  set up a queue
+ */
+struct hsm_store_queue *hsm_store_queue_init(struct hsm_store_context *ctx,
+					     unsigned depth)
+{
+	struct hsm_store_queue *q;
+	unsigned i;
+
+	q = calloc(1, sizeof(*q));
+	if (q == NULL) {
+		ctx->errmsg = "Unable to allocate store queue";
+		errno = ENOMEM;
+		return NULL;
+	}
+	q->ctx = ctx;
+	q->depth = depth ? depth : 1;
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->job_cond, NULL);
+	pthread_cond_init(&q->done_cond, NULL);
+
+#ifdef HAVE_LIBURING
+	/* one more entry than the depth, for the eventfd poll. Without
+	   io_uring in the kernel, or with it forbidden, the threads do
+	   all the work */
+	q->efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (q->efd != -1 && io_uring_queue_init(q->depth + 1, &q->ring, 0) == 0) {
+		q->have_ring = true;
+	} else if (q->efd != -1) {
+		close(q->efd);
+		q->efd = -1;
+	}
+#endif
+
+	q->num_threads = q->depth < HSM_QUEUE_THREADS ? q->depth : HSM_QUEUE_THREADS;
+	for (i=0;i<q->num_threads;i++) {
+		if (pthread_create(&q->threads[i], NULL, queue_thread, q) != 0) {
+			q->num_threads = i;
+			hsm_store_queue_free(q);
+			ctx->errmsg = "Unable to start store queue thread";
+			return NULL;
+		}
+	}
+
+	return q;
+}
+
+#ifdef HAVE_LIBURING
+/*
+  give a read to the ring, returning -1 if it has to go to the
+  threads instead. A read that can't be done asynchronously is done
+  now
+ */
+static int queue_ring_read(struct hsm_store_queue *q, struct queue_job *j)
+{
+	struct io_uring_sqe *sqe;
+	void *buf;
+	size_t n;
+	off_t ofs;
+	int fd;
+
+	if (!q->have_ring || (q->ctx->ops->pread != NULL && !j->h->cached)) {
+		return -1;
+	}
+
+	j->aio = hsm_store_aio_prepare(j->h, j->buf, j->n, j->ofs);
+	if (j->aio == NULL) {
+		return -1;
+	}
+	if (!hsm_store_aio_describe(j->aio, &fd, &buf, &n, &ofs)) {
+		j->result = hsm_store_aio_complete(j->aio, 0, 0);
+		j->err = j->result == -1 ? errno : 0;
+		pthread_mutex_lock(&q->mutex);
+		queue_finished(q, j);
+		pthread_mutex_unlock(&q->mutex);
+		return 0;
+	}
+
+	sqe = io_uring_get_sqe(&q->ring);
+	if (sqe == NULL) {
+		j->result = hsm_store_aio_complete(j->aio, pread(fd, buf, n, ofs), errno);
+		j->err = j->result == -1 ? errno : 0;
+		pthread_mutex_lock(&q->mutex);
+		queue_finished(q, j);
+		pthread_mutex_unlock(&q->mutex);
+		return 0;
+	}
+	io_uring_prep_read(sqe, fd, buf, n, ofs);
+	io_uring_sqe_set_data(sqe, j);
+	io_uring_submit(&q->ring);
+
+	pthread_mutex_lock(&q->mutex);
+	j->h->queued++;
+	pthread_mutex_unlock(&q->mutex);
+	q->ring_pending++;
+	return 0;
+}
+
+/*
+  collect reads finished in the ring, up to max completions in total
+ */
+static void queue_ring_reap(struct hsm_store_queue *q, struct hsm_store_completion *c,
+			    unsigned max, unsigned *count)
+{
+	struct io_uring_cqe *cqe;
+
+	while (*count < max && io_uring_peek_cqe(&q->ring, &cqe) == 0) {
+		struct queue_job *j = io_uring_cqe_get_data(cqe);
+		int res = cqe->res;
+
+		io_uring_cqe_seen(&q->ring, cqe);
+
+		if (j == NULL) {
+			/* the threads have finished something */
+			eventfd_t v;
+			eventfd_read(q->efd, &v);
+			q->efd_armed = false;
+			continue;
+		}
+
+		q->ring_pending--;
+		j->result = hsm_store_aio_complete(j->aio, res < 0 ? -1 : res,
+						   res < 0 ? -res : 0);
+		j->err = j->result == -1 ? errno : 0;
+
+		pthread_mutex_lock(&q->mutex);
+		j->h->queued--;
+		/* a close may have been waiting for this */
+		pthread_cond_broadcast(&q->job_cond);
+		pthread_mutex_unlock(&q->mutex);
+
+		c[*count].private = j->private;
+		c[*count].result = j->result;
+		c[*count].err = j->err;
+		(*count)++;
+		q->inflight--;
+		free(j);
+	}
+}
+
+/*
+  wait for the ring to have a completion, which includes the threads
+  finishing something if they have anything to do
+ */
+static void queue_ring_wait(struct hsm_store_queue *q)
+{
+	struct io_uring_cqe *cqe;
+	unsigned pool_pending;
+
+	pthread_mutex_lock(&q->mutex);
+	pool_pending = q->pool_pending;
+	pthread_mutex_unlock(&q->mutex);
+
+	if (pool_pending > 0 && !q->efd_armed) {
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&q->ring);
+		if (sqe != NULL) {
+			io_uring_prep_poll_add(sqe, q->efd, POLLIN);
+			io_uring_sqe_set_data(sqe, NULL);
+			io_uring_submit(&q->ring);
+			q->efd_armed = true;
+		}
+	}
+	io_uring_wait_cqe(&q->ring, &cqe);
+}
+#endif
+
+/*
+  add an operation to the queue
+ */
+static int queue_submit(struct hsm_store_queue *q, struct hsm_store_handle *h,
+			enum queue_op op, uint8_t *buf, size_t n, off_t ofs,
+			void *private)
+{
+	struct queue_job *j;
+
+	if (q->inflight == q->depth) {
+		q->ctx->errmsg = "Store queue is full";
+		errno = EAGAIN;
+		return -1;
+	}
+
+	j = calloc(1, sizeof(*j));
+	if (j == NULL) {
+		q->ctx->errmsg = "Unable to allocate store queue entry";
+		errno = ENOMEM;
+		return -1;
+	}
+	j->op = op;
+	j->h = h;
+	j->buf = buf;
+	j->n = n;
+	j->ofs = ofs;
+	j->private = private;
+	q->inflight++;
+
+#ifdef HAVE_LIBURING
+	if (op == QUEUE_READ && queue_ring_read(q, j) == 0) {
+		return 0;
+	}
+#endif
+
+	pthread_mutex_lock(&q->mutex);
+	h->queued++;
+	if (q->jobs_tail) {
+		q->jobs_tail->next = j;
+	} else {
+		q->jobs = j;
+	}
+	q->jobs_tail = j;
+	q->pool_pending++;
+	pthread_cond_signal(&q->job_cond);
+	pthread_mutex_unlock(&q->mutex);
+	return 0;
+}
+
+int hsm_store_submit_read(struct hsm_store_queue *q, struct hsm_store_handle *h,
+			  uint8_t *buf, size_t n, off_t ofs, void *private)
+{
+	return queue_submit(q, h, QUEUE_READ, buf, n, ofs, private);
+}
+
+int hsm_store_submit_write(struct hsm_store_queue *q, struct hsm_store_handle *h,
+			   uint8_t *buf, size_t n, void *private)
+{
+	return queue_submit(q, h, QUEUE_WRITE, buf, n, 0, private);
+}
+
+int hsm_store_submit_close(struct hsm_store_queue *q, struct hsm_store_handle *h,
+			   void *private)
+{
+	return queue_submit(q, h, QUEUE_CLOSE, NULL, 0, 0, private);
+}
+
+/*
+  collect finished operations
+ */
+unsigned hsm_store_reap(struct hsm_store_queue *q, struct hsm_store_completion *c,
+			unsigned max, unsigned min)
+{
+	unsigned count = 0;
+
+	if (min > q->inflight) {
+		min = q->inflight;
+	}
+	if (min > max) {
+		min = max;
+	}
+
+	while (true) {
+		pthread_mutex_lock(&q->mutex);
+		while (q->done && count < max) {
+			struct queue_job *j = q->done;
+			q->done = j->next;
+			if (q->done == NULL) {
+				q->done_tail = NULL;
+			}
+			c[count].private = j->private;
+			c[count].result = j->result;
+			c[count].err = j->err;
+			count++;
+			q->inflight--;
+			free(j);
+		}
+		pthread_mutex_unlock(&q->mutex);
+
+#ifdef HAVE_LIBURING
+		if (q->have_ring) {
+			queue_ring_reap(q, c, max, &count);
+		}
+#endif
+		if (count >= min) {
+			break;
+		}
+
+#ifdef HAVE_LIBURING
+		if (q->ring_pending > 0) {
+			queue_ring_wait(q);
+			continue;
+		}
+#endif
+		pthread_mutex_lock(&q->mutex);
+		while (q->done == NULL) {
+			pthread_cond_wait(&q->done_cond, &q->mutex);
+		}
+		pthread_mutex_unlock(&q->mutex);
+	}
+
+	return count;
+}
+
+/*
+  wait for everything in a queue to finish and free it
+ */
+void hsm_store_queue_free(struct hsm_store_queue *q)
+{
+	struct hsm_store_completion c[16];
+	unsigned i;
+
+	while (q->inflight > 0) {
+		hsm_store_reap(q, c, 16, 1);
+	}
+
+	pthread_mutex_lock(&q->mutex);
+	q->stopping = true;
+	pthread_cond_broadcast(&q->job_cond);
+	pthread_mutex_unlock(&q->mutex);
+	for (i=0;i<q->num_threads;i++) {
+		pthread_join(q->threads[i], NULL);
+	}
+
+#ifdef HAVE_LIBURING
+	if (q->have_ring) {
+		io_uring_queue_exit(&q->ring);
+		close(q->efd);
+	}
+#endif
+	pthread_cond_destroy(&q->job_cond);
+	pthread_cond_destroy(&q->done_cond);
+	pthread_mutex_destroy(&q->mutex);
+	free(q);
+}
@@ -0,0 +1,1557 @@
+/*
+  HSM store backend striping objects over several store roots
+
+  Each object is cut into stripes of stripe_size bytes, and each
+  stripe is kept in its own file on one of the roots, so a large file
+  is read and written with the bandwidth of all the roots, and small
+  files spread over them. The root a stripe goes on is chosen by
+  rendezvous hashing: each root scores the stripe by a hash of the
+  root and the stripe's name, and the highest score wins. Every
+  process agrees on where a stripe is without any shared map, and a
+  new root only takes the stripes it wins, leaving the rest where
+  they are.
+
+  The roots are listed in .stripe in the store root. Stripe 0 of an
+  object starts with a header giving its size and stripe size, so
+  objects keep working if the stripe size option changes.
+ */
+
+#include "hacksm.h"
+#include "store_backend.h"
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+
+/* file in the store root listing the roots */
+#define HSM_STRIPE_FILE ".stripe"
+#define HSM_STRIPE_MAGIC "HSMS"
+
+#define HSM_STRIPE_MAX_ROOTS 32
+
+/* default stripe size for new objects */
+#define HSM_DEFAULT_STRIPE_SIZE 0x400000
+#define HSM_MIN_STRIPE_SIZE 0x10000
+
+/* stripe files are spread over this many directories in each root */
+#define HSM_STRIPE_DIRS 256
+
+/* the most stripe files a reader keeps open */
+#define HSM_STRIPE_MAX_OPEN 32
+
+/* the most stripes read at once by one read */
+#define HSM_STRIPE_MAX_IO 16
+
+/* the most written stripes being synced at once */
+#define HSM_STRIPE_SYNCS 8
+
+/* seconds a rebalance waits before each pass, for anyone that
+   started writing an object just before they saw the new roots.
+   Stripe files written to more recently than this are left for a
+   later pass */
+#define HSM_STRIPE_GRACE 5
+
+/* room for the name of a stripe file relative to its root */
+#define HSM_STRIPE_NAME_MAX 64
+
+/* at the start of stripe 0 of each object */
+struct stripe_header {
+	char magic[4];
+	uint32_t stripe_size;
+	uint64_t size;
+};
+
+struct stripe_root {
+	char *path;
+	/* hash of the path, which the root's scores are made from */
+	uint64_t id;
+	int fd;
+};
+
+/* a list of roots, as indexes into the roots we know */
+struct stripe_set {
+	unsigned count;
+	unsigned roots[HSM_STRIPE_MAX_ROOTS];
+};
+
+struct stripe_store {
+	int dir_fd;
+	/* the roots option, for a new store or a rebalance */
+	const char *roots_option;
+	uint32_t stripe_size;
+	pthread_mutex_t mutex;
+	/* every root listed in .stripe since we connected. Entries
+	   are only added, so they can be used without the mutex */
+	struct stripe_root known[HSM_STRIPE_MAX_ROOTS * 2];
+	unsigned num_known;
+	/* the roots from .stripe. While a rebalance is in progress,
+	   stripes not yet moved are where the old roots put them */
+	struct stripe_set roots;
+	struct stripe_set old_roots;
+	bool converting;
+	ino_t config_ino;
+	struct timespec config_mtime;
+};
+
+struct stripe_handle {
+	/* size of the object, as h->size changes for framed objects */
+	uint64_t size;
+	uint32_t stripe_size;
+	/* stripes in the object. For a write, stripes written so
+	   far */
+	unsigned count;
+	/* for a read, the fd of each stripe, or -1 if it isn't open.
+	   Reads of one handle can run in several threads, so these are
+	   under the mutex, and fds are only closed when no read is
+	   using them */
+	pthread_mutex_t mutex;
+	int *fds;
+	unsigned num_open;
+	unsigned readers;
+	/* the last stripe read ahead */
+	unsigned ahead;
+	/* for a write, stripe 0, which gets its header last, and the
+	   stripe being written */
+	int fd0;
+	int fd;
+	/* for a write, earlier stripes being synced */
+	struct aiocb syncs[HSM_STRIPE_SYNCS];
+	bool sync_busy[HSM_STRIPE_SYNCS];
+	/* stripes in the object being replaced */
+	unsigned old_count;
+};
+
+static uint64_t stripe_mix(uint64_t v)
+{
+	v ^= v >> 33;
+	v *= 0xff51afd7ed558ccdULL;
+	v ^= v >> 33;
+	v *= 0xc4ceb9fe1a85ec53ULL;
+	v ^= v >> 33;
+	return v;
+}
+
+/*
+  the key all placement of an object's stripes is based on
+ */
+static uint64_t stripe_key(dev_t device, ino_t inode)
+{
+	return stripe_mix(stripe_mix((uint64_t)device) ^ (uint64_t)inode);
+}
+
+/*
+  choose the root for a stripe of an object from a set of roots, as
+  the one that gives it the highest score
+ */
+static unsigned stripe_place(struct stripe_store *ss, const struct stripe_set *set,
+			     dev_t device, ino_t inode, unsigned stripe)
+{
+	uint64_t key = stripe_mix(stripe_key(device, inode) + stripe);
+	uint64_t best_score = 0;
+	unsigned i, best = set->roots[0];
+
+	for (i=0;i<set->count;i++) {
+		uint64_t score = stripe_mix(key ^ ss->known[set->roots[i]].id);
+		if (i == 0 || score > best_score) {
+			best_score = score;
+			best = set->roots[i];
+		}
+	}
+	return best;
+}
+
+/*
+  put the name of a stripe file, relative to its root, in fname
+ */
+static void stripe_name(dev_t device, ino_t inode, unsigned stripe,
+			char fname[HSM_STRIPE_NAME_MAX])
+{
+	snprintf(fname, HSM_STRIPE_NAME_MAX, "%02x/0x%llx:0x%llx.%u",
+		 (unsigned)(stripe_key(device, inode) % HSM_STRIPE_DIRS),
+		 (unsigned long long)device, (unsigned long long)inode, stripe);
+}
+
+static bool stripe_set_has(const struct stripe_set *set, unsigned root)
+{
+	unsigned i;
+	for (i=0;i<set->count;i++) {
+		if (set->roots[i] == root) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+  find a root we know by path, opening it if it is new. Returns -1 if
+  it can't be opened. Called with the mutex held
+ */
+static int stripe_root_find(struct stripe_store *ss, const char *path)
+{
+	uint64_t id = 0xcbf29ce484222325ULL;
+	struct stripe_root *r;
+	const char *p;
+	unsigned i;
+
+	for (i=0;i<ss->num_known;i++) {
+		if (strcmp(ss->known[i].path, path) == 0) {
+			return i;
+		}
+	}
+	if (ss->num_known == HSM_STRIPE_MAX_ROOTS * 2) {
+		return -1;
+	}
+
+	/* FNV-1a of the path */
+	for (p=path;*p;p++) {
+		id = (id ^ (uint8_t)*p) * 0x100000001b3ULL;
+	}
+
+	r = &ss->known[ss->num_known];
+	r->fd = open(path, O_RDONLY|O_DIRECTORY);
+	if (r->fd == -1) {
+		return -1;
+	}
+	r->path = strdup(path);
+	if (r->path == NULL) {
+		close(r->fd);
+		return -1;
+	}
+	r->id = id;
+	return ss->num_known++;
+}
+
+/*
+  load .stripe if it has changed since we last looked, returning true
+  if it was (re)loaded
+ */
+static bool stripe_config_load(struct hsm_store_context *ctx)
+{
+	struct stripe_store *ss = ctx->private;
+	struct stripe_set roots, old_roots;
+	bool converting = false;
+	char line[PATH_MAX + 10];
+	struct stat st;
+	FILE *f;
+	int fd;
+
+	fd = openat(ss->dir_fd, HSM_STRIPE_FILE, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+	f = fdopen(fd, "r");
+	if (f == NULL) {
+		close(fd);
+		return false;
+	}
+	if (fstat(fileno(f), &st) != 0) {
+		fclose(f);
+		return false;
+	}
+
+	pthread_mutex_lock(&ss->mutex);
+	if (st.st_ino == ss->config_ino &&
+	    st.st_mtim.tv_sec == ss->config_mtime.tv_sec &&
+	    st.st_mtim.tv_nsec == ss->config_mtime.tv_nsec) {
+		pthread_mutex_unlock(&ss->mutex);
+		fclose(f);
+		return false;
+	}
+
+	roots.count = 0;
+	old_roots.count = 0;
+	while (fgets(line, sizeof(line), f)) {
+		struct stripe_set *set;
+		char *path;
+		int i;
+
+		line[strcspn(line, "\n")] = 0;
+		if (strncmp(line, "root ", 5) == 0) {
+			set = &roots;
+			path = line + 5;
+		} else if (strncmp(line, "old ", 4) == 0) {
+			set = &old_roots;
+			path = line + 4;
+			converting = true;
+		} else {
+			continue;
+		}
+		i = stripe_root_find(ss, path);
+		if (i == -1 || set->count == HSM_STRIPE_MAX_ROOTS) {
+			/* keep what we had rather than lose a root */
+			pthread_mutex_unlock(&ss->mutex);
+			fclose(f);
+			ctx->errmsg = "Unable to open stripe root";
+			return false;
+		}
+		set->roots[set->count++] = i;
+	}
+	fclose(f);
+
+	if (roots.count == 0 || (converting && old_roots.count == 0)) {
+		pthread_mutex_unlock(&ss->mutex);
+		ctx->errmsg = "No roots in stripe file";
+		return false;
+	}
+
+	ss->roots = roots;
+	ss->old_roots = old_roots;
+	ss->converting = converting;
+	ss->config_ino = st.st_ino;
+	ss->config_mtime = st.st_mtim;
+	pthread_mutex_unlock(&ss->mutex);
+
+	return true;
+}
+
+/*
+  write a new .stripe. It is written under a temporary name and
+  renamed, so other users of the store see either the old or the new
+  roots
+ */
+static int stripe_config_save(struct hsm_store_context *ctx,
+			      const struct stripe_set *roots,
+			      const struct stripe_set *old_roots)
+{
+	struct stripe_store *ss = ctx->private;
+	const char *tmpname = HSM_STRIPE_FILE ".tmp";
+	unsigned i;
+	FILE *f;
+	int fd, ret = -1;
+
+	fd = openat(ss->dir_fd, tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	f = fd == -1 ? NULL : fdopen(fd, "w");
+	if (f != NULL) {
+		for (i=0;i<roots->count;i++) {
+			fprintf(f, "root %s\n", ss->known[roots->roots[i]].path);
+		}
+		for (i=0;old_roots && i<old_roots->count;i++) {
+			fprintf(f, "old %s\n", ss->known[old_roots->roots[i]].path);
+		}
+		if (fflush(f) == 0 && fsync(fileno(f)) == 0 &&
+		    fclose(f) == 0 &&
+		    renameat(ss->dir_fd, tmpname, ss->dir_fd, HSM_STRIPE_FILE) == 0) {
+			ret = 0;
+		} else {
+			unlinkat(ss->dir_fd, tmpname, 0);
+		}
+	} else if (fd != -1) {
+		close(fd);
+	}
+	if (ret != 0) {
+		ctx->errmsg = "Unable to write stripe file";
+		return -1;
+	}
+
+	stripe_config_load(ctx);
+	return 0;
+}
+
+/*
+  turn the roots option into a set of roots
+ */
+static int stripe_parse_roots(struct hsm_store_context *ctx, struct stripe_set *set)
+{
+	struct stripe_store *ss = ctx->private;
+	char *list, *path, *save = NULL;
+	int ret = 0;
+
+	list = strdup(ss->roots_option);
+	if (list == NULL) {
+		ctx->errmsg = "Unable to allocate stripe roots";
+		errno = ENOMEM;
+		return -1;
+	}
+
+	set->count = 0;
+	pthread_mutex_lock(&ss->mutex);
+	for (path=strtok_r(list, ":", &save); path && ret == 0;
+	     path=strtok_r(NULL, ":", &save)) {
+		int r = stripe_root_find(ss, path);
+		if (r == -1) {
+			ctx->errmsg = "Unable to open stripe root";
+			ret = -1;
+			break;
+		}
+		if (stripe_set_has(set, r)) {
+			continue;
+		}
+		if (set->count == HSM_STRIPE_MAX_ROOTS) {
+			ctx->errmsg = "Too many stripe roots";
+			errno = EINVAL;
+			ret = -1;
+			break;
+		}
+		set->roots[set->count++] = r;
+	}
+	pthread_mutex_unlock(&ss->mutex);
+	free(list);
+
+	if (ret == 0 && set->count == 0) {
+		ctx->errmsg = "No stripe roots given";
+		errno = EINVAL;
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+  set up the backend state
+ */
+static int stripe_init(struct hsm_store_context *ctx)
+{
+	struct stripe_store *ss;
+
+	ss = calloc(1, sizeof(struct stripe_store));
+	if (ss == NULL) {
+		ctx->errmsg = "Unable to allocate stripe store";
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ss->dir_fd = -1;
+	ss->stripe_size = HSM_DEFAULT_STRIPE_SIZE;
+	pthread_mutex_init(&ss->mutex, NULL);
+	ctx->private = ss;
+
+	return 0;
+}
+
+/*
+  set a stripe store option. The stripe store knows these options:
+
+    roots=DIR:DIR:...    the roots of a new store, or the roots
+                         hsm_store_convert() rebalances a store onto
+    stripe_size=BYTES    stripe size of new objects (default 4MB)
+ */
+static int stripe_set_option(struct hsm_store_context *ctx, const char *name,
+			     const char *value)
+{
+	struct stripe_store *ss = ctx->private;
+
+	if (strcmp(name, "roots") == 0) {
+		ss->roots_option = value;
+		return 0;
+	}
+
+	if (strcmp(name, "stripe_size") == 0) {
+		unsigned long long size = strtoull(value, NULL, 0);
+		if (size < HSM_MIN_STRIPE_SIZE || size > 0x40000000) {
+			ctx->errmsg = "Invalid stripe_size";
+			errno = EINVAL;
+			return -1;
+		}
+		ss->stripe_size = size;
+		return 0;
+	}
+
+	ctx->errmsg = "Unknown store option";
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+  connect to the store. A new store takes its roots from the roots
+  option
+ */
+static int stripe_connect(struct hsm_store_context *ctx)
+{
+	struct stripe_store *ss = ctx->private;
+
+	ss->dir_fd = open(ctx->basepath, O_RDONLY|O_DIRECTORY);
+	if (ss->dir_fd == -1) {
+		ctx->errmsg = "Unable to open store directory";
+		return -1;
+	}
+
+	if (faccessat(ss->dir_fd, HSM_STRIPE_FILE, F_OK, 0) != 0) {
+		struct stripe_set roots;
+		if (ss->roots_option == NULL) {
+			ctx->errmsg = "A stripe store needs -O roots=DIR:DIR...";
+			errno = EINVAL;
+			return -1;
+		}
+		if (stripe_parse_roots(ctx, &roots) != 0 ||
+		    stripe_config_save(ctx, &roots, NULL) != 0) {
+			return -1;
+		}
+	}
+
+	stripe_config_load(ctx);
+	if (ss->roots.count == 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  shutdown the link to the store
+ */
+static void stripe_shutdown(struct hsm_store_context *ctx)
+{
+	struct stripe_store *ss = ctx->private;
+	unsigned i;
+
+	for (i=0;i<ss->num_known;i++) {
+		close(ss->known[i].fd);
+		free(ss->known[i].path);
+	}
+	if (ss->dir_fd != -1) {
+		close(ss->dir_fd);
+	}
+	pthread_mutex_destroy(&ss->mutex);
+	free(ss);
+	ctx->private = NULL;
+}
+
+/*
+  the roots a stripe goes on now and, while a rebalance is in
+  progress, where it went before. Returns true if it may be in the
+  old place
+ */
+static bool stripe_roots(struct hsm_store_context *ctx, dev_t device, ino_t inode,
+			 unsigned stripe, unsigned *root, unsigned *old_root)
+{
+	struct stripe_store *ss = ctx->private;
+	bool converting;
+
+	pthread_mutex_lock(&ss->mutex);
+	*root = stripe_place(ss, &ss->roots, device, inode, stripe);
+	converting = ss->converting;
+	if (converting) {
+		*old_root = stripe_place(ss, &ss->old_roots, device, inode, stripe);
+		converting = (*old_root != *root);
+	}
+	pthread_mutex_unlock(&ss->mutex);
+
+	return converting;
+}
+
+/*
+  find an existing stripe file, returning the root it is on and its
+  stat. A stripe not yet moved by a rebalance is found in its old
+  place. If it can't be found and .stripe has changed then the lookup
+  is tried again with the new roots, so a rebalance by another
+  process is picked up. Fails with ENOENT if there is no such stripe
+ */
+static int stripe_lookup(struct hsm_store_context *ctx, dev_t device, ino_t inode,
+			 unsigned stripe, struct stat *st)
+{
+	struct stripe_store *ss = ctx->private;
+	char fname[HSM_STRIPE_NAME_MAX];
+	unsigned root, old_root;
+	bool converting, retried = false;
+
+	stripe_name(device, inode, stripe, fname);
+again:
+	converting = stripe_roots(ctx, device, inode, stripe, &root, &old_root);
+	if (fstatat(ss->known[root].fd, fname, st, 0) == 0) {
+		return root;
+	}
+	if (errno != ENOENT) {
+		return -1;
+	}
+	if (converting && fstatat(ss->known[old_root].fd, fname, st, 0) == 0) {
+		return old_root;
+	}
+	if (!retried && stripe_config_load(ctx)) {
+		retried = true;
+		goto again;
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+/*
+  open an existing stripe file for reading
+ */
+static int stripe_open_read(struct hsm_store_context *ctx, dev_t device, ino_t inode,
+			    unsigned stripe)
+{
+	struct stripe_store *ss = ctx->private;
+	char fname[HSM_STRIPE_NAME_MAX];
+	struct stat st;
+	int root, fd;
+
+	root = stripe_lookup(ctx, device, inode, stripe, &st);
+	if (root == -1) {
+		return -1;
+	}
+	stripe_name(device, inode, stripe, fname);
+	fd = openat(ss->known[root].fd, fname, O_RDONLY);
+	if (fd == -1 && errno == ENOENT) {
+		/* moved by a rebalance since we looked */
+		root = stripe_lookup(ctx, device, inode, stripe, &st);
+		if (root != -1) {
+			fd = openat(ss->known[root].fd, fname, O_RDONLY);
+		}
+	}
+	return fd;
+}
+
+/*
+  read the header of an object, from its stripe 0
+ */
+static int stripe_read_header(struct hsm_store_context *ctx, int fd,
+			      struct stripe_header *hdr)
+{
+	if (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+	    memcmp(hdr->magic, HSM_STRIPE_MAGIC, 4) != 0 ||
+	    hdr->stripe_size < HSM_MIN_STRIPE_SIZE) {
+		ctx->errmsg = "Corrupt stripe header";
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  the number of stripes an object has
+ */
+static unsigned stripe_count(const struct stripe_header *hdr)
+{
+	if (hdr->size == 0) {
+		return 1;
+	}
+	return (hdr->size + hdr->stripe_size - 1) / hdr->stripe_size;
+}
+
+/*
+  remove the stripes of an object from 'first' to before 'last'
+ */
+static void stripe_unlink(struct hsm_store_context *ctx, dev_t device, ino_t inode,
+			  unsigned first, unsigned last)
+{
+	struct stripe_store *ss = ctx->private;
+	char fname[HSM_STRIPE_NAME_MAX];
+	unsigned i;
+
+	for (i=first;i<last;i++) {
+		unsigned root, old_root;
+		stripe_name(device, inode, i, fname);
+		if (stripe_roots(ctx, device, inode, i, &root, &old_root)) {
+			unlinkat(ss->known[old_root].fd, fname, 0);
+		}
+		unlinkat(ss->known[root].fd, fname, 0);
+	}
+}
+
+/*
+  create the file for the next stripe of an object being written. If
+  a rebalance is in progress then any copy in the old place is
+  removed, so it can't be moved over the new one
+ */
+static int stripe_create(struct hsm_store_handle *h, unsigned stripe)
+{
+	struct hsm_store_context *ctx = h->ctx;
+	struct stripe_store *ss = ctx->private;
+	char fname[HSM_STRIPE_NAME_MAX];
+	unsigned root, old_root;
+	int fd;
+
+	stripe_config_load(ctx);
+	stripe_name(h->device, h->inode, stripe, fname);
+	if (stripe_roots(ctx, h->device, h->inode, stripe, &root, &old_root)) {
+		unlinkat(ss->known[old_root].fd, fname, 0);
+	}
+
+	fd = openat(ss->known[root].fd, fname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1 && errno == ENOENT) {
+		fname[2] = 0;
+		mkdirat(ss->known[root].fd, fname, 0700);
+		fname[2] = '/';
+		fd = openat(ss->known[root].fd, fname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	}
+	if (fd == -1) {
+		ctx->errmsg = "Unable to create stripe file";
+	}
+	return fd;
+}
+
+/*
+  wait for a stripe being synced, and close it
+ */
+static int stripe_sync_wait(struct hsm_store_handle *h, unsigned slot)
+{
+	struct stripe_handle *sh = h->private;
+	struct aiocb *cb = &sh->syncs[slot];
+	const struct aiocb *list[1] = { cb };
+	int ret;
+
+	if (!sh->sync_busy[slot]) {
+		return 0;
+	}
+	while (aio_error(cb) == EINPROGRESS) {
+		aio_suspend(list, 1, NULL);
+	}
+	ret = aio_return(cb);
+	hsm_direct_dontneed(h->ctx, cb->aio_fildes, 0, 0);
+	close(cb->aio_fildes);
+	sh->sync_busy[slot] = false;
+	return ret == 0 ? 0 : -1;
+}
+
+/*
+  finish with a written stripe other than stripe 0. Unless syncs are
+  deferred it is synced in the background while the next stripes are
+  written, which lets each root sync at the same time
+ */
+static int stripe_done(struct hsm_store_handle *h, int fd, unsigned stripe)
+{
+	struct stripe_handle *sh = h->private;
+	unsigned slot = stripe % HSM_STRIPE_SYNCS;
+	struct aiocb *cb = &sh->syncs[slot];
+
+	if (h->ctx->defer_sync) {
+		hsm_direct_dontneed(h->ctx, fd, 0, 0);
+		return close(fd);
+	}
+	if (stripe_sync_wait(h, slot) != 0) {
+		close(fd);
+		return -1;
+	}
+	memset(cb, 0, sizeof(*cb));
+	cb->aio_fildes = fd;
+	if (aio_fsync(O_DSYNC, cb) != 0) {
+		int ret = fdatasync(fd);
+		hsm_direct_dontneed(h->ctx, fd, 0, 0);
+		close(fd);
+		return ret;
+	}
+	sh->sync_busy[slot] = true;
+	return 0;
+}
+
+/*
+  open an object in the store
+ */
+static int stripe_open(struct hsm_store_context *ctx, struct hsm_store_handle *h,
+		       dev_t device, ino_t inode)
+{
+	struct stripe_store *ss = ctx->private;
+	struct stripe_header hdr;
+	struct stripe_handle *sh;
+	int fd;
+
+	sh = calloc(1, sizeof(*sh));
+	if (sh == NULL) {
+		ctx->errmsg = "Unable to allocate store handle";
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (!h->readonly) {
+		/* note how many stripes the object being replaced has,
+		   so any beyond the new object can go */
+		fd = stripe_open_read(ctx, device, inode, 0);
+		if (fd != -1) {
+			if (stripe_read_header(ctx, fd, &hdr) == 0) {
+				sh->old_count = stripe_count(&hdr);
+			}
+			close(fd);
+		}
+		h->private = sh;
+		sh->stripe_size = ss->stripe_size;
+		sh->count = 1;
+		sh->fd0 = sh->fd = stripe_create(h, 0);
+		if (sh->fd0 == -1) {
+			free(sh);
+			h->private = NULL;
+			return -1;
+		}
+		/* stripe 0 only gets its header when the object is
+		   finished, so it is locked to keep a rebalance from
+		   moving it in the meantime */
+		hsm_store_lock(sh->fd0, false, F_WRLCK);
+		h->size = UINT64_MAX;
+		return 0;
+	}
+
+	fd = stripe_open_read(ctx, device, inode, 0);
+	if (fd == -1) {
+		free(sh);
+		ctx->errmsg = "Unable to open store file";
+		return -1;
+	}
+	if (stripe_read_header(ctx, fd, &hdr) != 0) {
+		close(fd);
+		free(sh);
+		return -1;
+	}
+	sh->size = hdr.size;
+	sh->stripe_size = hdr.stripe_size;
+	sh->count = stripe_count(&hdr);
+	sh->fds = malloc(sh->count * sizeof(int));
+	if (sh->fds == NULL) {
+		close(fd);
+		free(sh);
+		ctx->errmsg = "Unable to allocate store handle";
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(sh->fds, 0xff, sh->count * sizeof(int));
+	sh->fds[0] = fd;
+	sh->num_open = 1;
+	pthread_mutex_init(&sh->mutex, NULL);
+
+	h->private = sh;
+	h->size = hdr.size;
+	return 0;
+}
+
+/*
+  where a byte of an object is in its stripe file
+ */
+static off_t stripe_offset(struct stripe_handle *sh, uint64_t ofs)
+{
+	off_t sofs = ofs % sh->stripe_size;
+	if (ofs < sh->stripe_size) {
+		sofs += sizeof(struct stripe_header);
+	}
+	return sofs;
+}
+
+/*
+  write all of a buffer
+ */
+static int stripe_pwrite(int fd, const uint8_t *buf, size_t n, off_t ofs)
+{
+	while (n > 0) {
+		ssize_t nwritten = pwrite(fd, buf, n, ofs);
+		if (nwritten <= 0) {
+			return -1;
+		}
+		buf += nwritten;
+		n -= nwritten;
+		ofs += nwritten;
+	}
+	return 0;
+}
+
+/*
+  append to an object, starting a new stripe file at each stripe
+  boundary
+ */
+static int stripe_write(struct hsm_store_handle *h, const uint8_t *buf, size_t n)
+{
+	struct stripe_handle *sh = h->private;
+
+	while (n > 0) {
+		unsigned stripe = h->ofs / sh->stripe_size;
+		size_t len = sh->stripe_size - h->ofs % sh->stripe_size;
+
+		if (len > n) {
+			len = n;
+		}
+		if (stripe == sh->count) {
+			int fd = stripe_create(h, stripe);
+			if (fd == -1) {
+				return -1;
+			}
+			if (sh->fd != sh->fd0 && stripe_done(h, sh->fd, stripe - 1) != 0) {
+				close(fd);
+				sh->fd = -1;
+				h->ctx->errmsg = "Unable to sync stripe file";
+				return -1;
+			}
+			sh->fd = fd;
+			sh->count++;
+		}
+		if (stripe_pwrite(sh->fd, buf, len, stripe_offset(sh, h->ofs)) != 0) {
+			h->ctx->errmsg = "Unable to write stripe file";
+			return -1;
+		}
+		buf += len;
+		n -= len;
+		h->ofs += len;
+	}
+	return 0;
+}
+
+/*
+  close the stripe files of an object open for reading, other than
+  stripe 0
+ */
+static void stripe_close_fds(struct hsm_store_handle *h)
+{
+	struct stripe_handle *sh = h->private;
+	unsigned i;
+
+	for (i=1;i<sh->count;i++) {
+		if (sh->fds[i] != -1) {
+			hsm_direct_dontneed(h->ctx, sh->fds[i], 0, 0);
+			close(sh->fds[i]);
+			sh->fds[i] = -1;
+		}
+	}
+	sh->num_open = 1;
+}
+
+/*
+  the fd of a stripe of an object open for reading, opening it if
+  needed. Must be called with the handle locked
+ */
+static int stripe_fd(struct hsm_store_handle *h, unsigned stripe)
+{
+	struct stripe_handle *sh = h->private;
+
+	if (sh->fds[stripe] != -1) {
+		return sh->fds[stripe];
+	}
+	sh->fds[stripe] = stripe_open_read(h->ctx, h->device, h->inode, stripe);
+	if (sh->fds[stripe] == -1) {
+		h->ctx->errmsg = "Missing stripe file";
+		return -1;
+	}
+	sh->num_open++;
+	return sh->fds[stripe];
+}
+
+/*
+  read all of a piece of a stripe
+ */
+static int stripe_pread_all(int fd, uint8_t *buf, size_t n, off_t ofs)
+{
+	while (n > 0) {
+		ssize_t nread = pread(fd, buf, n, ofs);
+		if (nread <= 0) {
+			return -1;
+		}
+		buf += nread;
+		n -= nread;
+		ofs += nread;
+	}
+	return 0;
+}
+
+/*
+  start reading the stripe after the one a read ends in, so the next
+  root is already fetching it when reads get there. Must be called
+  with the handle locked
+ */
+static void stripe_readahead(struct hsm_store_handle *h, uint64_t end)
+{
+	struct stripe_handle *sh = h->private;
+	unsigned next = (end - 1) / sh->stripe_size + 1;
+	int fd;
+
+	if (next >= sh->count || next <= sh->ahead) {
+		return;
+	}
+	sh->ahead = next;
+	fd = stripe_fd(h, next);
+	if (fd != -1) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	}
+}
+
+/*
+  set up the reads of the stripes in part of an object, up to
+  HSM_STRIPE_MAX_IO of them, returning how many or -1 on error. The
+  fds stay open until stripe_read_end()
+ */
+static int stripe_read_start(struct hsm_store_handle *h, uint8_t *buf, size_t n,
+			     uint64_t ofs, struct aiocb *cbs, size_t *done)
+{
+	struct stripe_handle *sh = h->private;
+	int count = 0;
+
+	pthread_mutex_lock(&sh->mutex);
+	/* readers of large objects would otherwise end up with every
+	   stripe open */
+	if (sh->readers == 0 && sh->num_open + HSM_STRIPE_MAX_IO > HSM_STRIPE_MAX_OPEN) {
+		stripe_close_fds(h);
+	}
+	while (count < HSM_STRIPE_MAX_IO && *done < n) {
+		uint64_t pos = ofs + *done;
+		size_t len = sh->stripe_size - pos % sh->stripe_size;
+		int fd;
+
+		if (len > n - *done) {
+			len = n - *done;
+		}
+		fd = stripe_fd(h, pos / sh->stripe_size);
+		if (fd == -1) {
+			pthread_mutex_unlock(&sh->mutex);
+			return -1;
+		}
+		memset(&cbs[count], 0, sizeof(cbs[count]));
+		cbs[count].aio_fildes = fd;
+		cbs[count].aio_buf = buf + *done;
+		cbs[count].aio_nbytes = len;
+		cbs[count].aio_offset = stripe_offset(sh, pos);
+		cbs[count].aio_lio_opcode = LIO_READ;
+		count++;
+		*done += len;
+	}
+	stripe_readahead(h, ofs + *done);
+	sh->readers++;
+	pthread_mutex_unlock(&sh->mutex);
+	return count;
+}
+
+static void stripe_read_end(struct hsm_store_handle *h)
+{
+	struct stripe_handle *sh = h->private;
+
+	pthread_mutex_lock(&sh->mutex);
+	sh->readers--;
+	pthread_mutex_unlock(&sh->mutex);
+}
+
+/*
+  read from an object. A read covering several stripes reads them
+  all at once, so each root works on its part in parallel, and the
+  stripe after a read is read ahead. Several threads may read one
+  handle at once
+ */
+static ssize_t stripe_pread(struct hsm_store_handle *h, uint8_t *buf, size_t n, off_t ofs)
+{
+	struct stripe_handle *sh = h->private;
+	struct aiocb cbs[HSM_STRIPE_MAX_IO];
+	struct aiocb *list[HSM_STRIPE_MAX_IO];
+	size_t done = 0;
+	int ret = 0;
+
+	if (ofs >= sh->size) {
+		return 0;
+	}
+	if (n > sh->size - ofs) {
+		n = sh->size - ofs;
+	}
+
+	while (done < n && ret == 0) {
+		int i, count;
+
+		count = stripe_read_start(h, buf, n, ofs, cbs, &done);
+		if (count == -1) {
+			return -1;
+		}
+
+		if (count == 1) {
+			if (stripe_pread_all(cbs[0].aio_fildes, (uint8_t *)cbs[0].aio_buf,
+					     cbs[0].aio_nbytes, cbs[0].aio_offset) != 0) {
+				ret = -1;
+			} else {
+				hsm_direct_dontneed(h->ctx, cbs[0].aio_fildes, cbs[0].aio_offset,
+						    cbs[0].aio_nbytes);
+			}
+			stripe_read_end(h);
+			continue;
+		}
+
+		/* any that fail or come up short, including any that
+		   couldn't be queued, are read again synchronously */
+		for (i=0;i<count;i++) {
+			list[i] = &cbs[i];
+		}
+		lio_listio(LIO_WAIT, list, count, NULL);
+		for (i=0;i<count;i++) {
+			const struct aiocb *wait[1] = { &cbs[i] };
+			while (aio_error(&cbs[i]) == EINPROGRESS) {
+				aio_suspend(wait, 1, NULL);
+			}
+			if (ret == 0 &&
+			    (aio_error(&cbs[i]) != 0 ||
+			     aio_return(&cbs[i]) != cbs[i].aio_nbytes) &&
+			    stripe_pread_all(cbs[i].aio_fildes, (uint8_t *)cbs[i].aio_buf,
+					     cbs[i].aio_nbytes, cbs[i].aio_offset) != 0) {
+				ret = -1;
+			}
+			hsm_direct_dontneed(h->ctx, cbs[i].aio_fildes, cbs[i].aio_offset,
+					    cbs[i].aio_nbytes);
+		}
+		stripe_read_end(h);
+	}
+	if (ret != 0) {
+		h->ctx->errmsg = "Short stripe file";
+		errno = EIO;
+		return -1;
+	}
+	return n;
+}
+
+/*
+  finish writing an object. The header goes on stripe 0 last, so a
+  reader never sees an object whose header is wrong, then every
+  stripe still being synced is waited for
+ */
+static int stripe_write_finish(struct hsm_store_handle *h)
+{
+	struct stripe_handle *sh = h->private;
+	struct stripe_header hdr;
+	int ret = 0;
+	unsigned i;
+
+	if (sh->fd != sh->fd0 && sh->fd != -1 &&
+	    stripe_done(h, sh->fd, sh->count - 1) != 0) {
+		ret = -1;
+	}
+
+	memcpy(hdr.magic, HSM_STRIPE_MAGIC, 4);
+	hdr.stripe_size = sh->stripe_size;
+	hdr.size = h->ofs;
+	if (stripe_pwrite(sh->fd0, (uint8_t *)&hdr, sizeof(hdr), 0) != 0 ||
+	    (!h->ctx->defer_sync && fdatasync(sh->fd0) != 0)) {
+		ret = -1;
+	}
+	hsm_direct_dontneed(h->ctx, sh->fd0, 0, 0);
+	close(sh->fd0);
+
+	for (i=0;i<HSM_STRIPE_SYNCS;i++) {
+		if (stripe_sync_wait(h, i) != 0) {
+			ret = -1;
+		}
+	}
+	if (ret != 0) {
+		h->ctx->errmsg = "Unable to write stripe file";
+		return -1;
+	}
+
+	if (sh->old_count > sh->count) {
+		stripe_unlink(h->ctx, h->device, h->inode, sh->count, sh->old_count);
+	}
+	return 0;
+}
+
+/*
+  close an object
+ */
+static int stripe_close(struct hsm_store_handle *h)
+{
+	struct stripe_handle *sh = h->private;
+	int ret = 0;
+
+	if (!h->readonly) {
+		ret = stripe_write_finish(h);
+	} else {
+		stripe_close_fds(h);
+		hsm_direct_dontneed(h->ctx, sh->fds[0], 0, 0);
+		close(sh->fds[0]);
+		free(sh->fds);
+		pthread_mutex_destroy(&sh->mutex);
+	}
+	free(sh);
+	h->private = NULL;
+	return ret;
+}
+
+/*
+  the time of an object is the modification time of its stripe 0
+ */
+static int stripe_object_time(struct hsm_store_context *ctx,
+			      dev_t device, ino_t inode, uint64_t *time)
+{
+	struct stat st;
+
+	if (stripe_lookup(ctx, device, inode, 0, &st) == -1) {
+		return -1;
+	}
+	*time = hsm_store_mtime(&st);
+	return 0;
+}
+
+/*
+  remove an object if it still has the given time. Stripe 0 goes
+  first, so the object is gone even if the rest can't be removed
+ */
+static int stripe_remove(struct hsm_store_context *ctx,
+			 dev_t device, ino_t inode, uint64_t time)
+{
+	struct stripe_store *ss = ctx->private;
+	char fname[HSM_STRIPE_NAME_MAX];
+	struct stripe_header hdr;
+	unsigned count = 1;
+	struct stat st;
+	int root, fd;
+
+	root = stripe_lookup(ctx, device, inode, 0, &st);
+	if (root == -1) {
+		return -1;
+	}
+	if (time != UINT64_MAX && hsm_store_mtime(&st) != time) {
+		ctx->errmsg = "Store file was written again since the removal";
+		errno = EEXIST;
+		return -1;
+	}
+
+	stripe_name(device, inode, 0, fname);
+	fd = openat(ss->known[root].fd, fname, O_RDONLY);
+	if (fd != -1) {
+		if (stripe_read_header(ctx, fd, &hdr) == 0) {
+			count = stripe_count(&hdr);
+		}
+		close(fd);
+	}
+	if (unlinkat(ss->known[root].fd, fname, 0) != 0) {
+		return -1;
+	}
+	stripe_unlink(ctx, device, inode, 1, count);
+	return 0;
+}
+
+static uint64_t stripe_position(struct hsm_store_context *ctx,
+				dev_t device, ino_t inode)
+{
+	return ((uint64_t)device << 48) ^ (uint64_t)inode;
+}
+
+/*
+  list part of the objects in the store, by their stripe 0 files.
+  The directories of all the roots are split between the parts
+ */
+static int stripe_list(struct hsm_store_context *ctx, unsigned part, unsigned num_parts,
+		       hsm_store_list_fn fn, void *private)
+{
+	struct stripe_store *ss = ctx->private;
+	struct stripe_set all;
+	unsigned i, r;
+
+	stripe_config_load(ctx);
+	pthread_mutex_lock(&ss->mutex);
+	all = ss->roots;
+	for (i=0;ss->converting && i<ss->old_roots.count;i++) {
+		if (!stripe_set_has(&all, ss->old_roots.roots[i]) &&
+		    all.count < HSM_STRIPE_MAX_ROOTS) {
+			all.roots[all.count++] = ss->old_roots.roots[i];
+		}
+	}
+	pthread_mutex_unlock(&ss->mutex);
+
+	for (r=0;r<all.count;r++) {
+		for (i=0;i<HSM_STRIPE_DIRS;i++) {
+			char dname[3];
+			struct dirent *de;
+			DIR *d;
+			int fd;
+
+			if ((r * HSM_STRIPE_DIRS + i) % num_parts != part) {
+				continue;
+			}
+			snprintf(dname, sizeof(dname), "%02x", i);
+			fd = openat(ss->known[all.roots[r]].fd, dname, O_RDONLY|O_DIRECTORY);
+			if (fd == -1) {
+				continue;
+			}
+			d = fdopendir(fd);
+			if (d == NULL) {
+				close(fd);
+				ctx->errmsg = "Unable to open stripe directory";
+				return -1;
+			}
+			while ((de = readdir(d)) != NULL) {
+				size_t len = strlen(de->d_name);
+				dev_t device;
+				ino_t inode;
+				struct stat st;
+
+				if (len < 3 || strcmp(de->d_name + len - 2, ".0") != 0) {
+					continue;
+				}
+				de->d_name[len - 2] = 0;
+				if (!hsm_store_parse_name(de->d_name, &device, &inode)) {
+					continue;
+				}
+				de->d_name[len - 2] = '.';
+				if (fstatat(fd, de->d_name, &st, 0) == 0) {
+					fn(private, device, inode, hsm_store_mtime(&st));
+				}
+			}
+			closedir(d);
+		}
+	}
+	return 0;
+}
+
+/*
+  make objects written with syncs deferred durable, on every root
+ */
+static int stripe_sync(struct hsm_store_context *ctx)
+{
+	struct stripe_store *ss = ctx->private;
+	struct stripe_set roots;
+	unsigned i;
+	int ret = 0;
+
+	pthread_mutex_lock(&ss->mutex);
+	roots = ss->roots;
+	pthread_mutex_unlock(&ss->mutex);
+
+	for (i=0;i<roots.count;i++) {
+		if (syncfs(ss->known[roots.roots[i]].fd) != 0) {
+			ret = -1;
+		}
+	}
+	if (ret != 0) {
+		ctx->errmsg = "Unable to sync store";
+	}
+	return ret;
+}
+
+/*
+  see if a stripe file may still be written to: it was written to
+  within the grace period, or it is stripe 0 of an object still being
+  written
+ */
+static bool stripe_busy(int fd, const struct stat *st, unsigned stripe)
+{
+	time_t now = time(NULL);
+
+	if (st->st_mtime > now - HSM_STRIPE_GRACE) {
+		return true;
+	}
+	return stripe == 0 && hsm_store_lock(fd, false, F_RDLCK) != 0;
+}
+
+/*
+  copy a stripe file from one root to another. The copy is made under
+  a temporary name and linked into place, so it never replaces a
+  stripe written since the rebalance started. If the original was
+  removed while it was being copied the copy is removed too. Returns
+  2 without moving it if the stripe may still be written to, or if
+  it changed while it was being copied
+ */
+static int stripe_move(struct hsm_store_context *ctx, unsigned from, unsigned to,
+		       const char *fname, unsigned stripe)
+{
+	struct stripe_store *ss = ctx->private;
+	int from_fd = ss->known[from].fd, to_fd = ss->known[to].fd;
+	char tmpname[HSM_STRIPE_NAME_MAX + 8], dir[3];
+	struct timespec times[2];
+	struct stat st, st2;
+	uint8_t *buf;
+	int fd, tfd, ret = 0;
+	ssize_t n;
+
+	fd = openat(from_fd, fname, O_RDONLY);
+	if (fd == -1) {
+		/* someone else moved or removed it */
+		return errno == ENOENT ? 1 : -1;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	if (stripe_busy(fd, &st, stripe)) {
+		close(fd);
+		return 2;
+	}
+
+	memcpy(dir, fname, 2);
+	dir[2] = 0;
+	snprintf(tmpname, sizeof(tmpname), "%s/.%s.tmp", dir, fname + 3);
+	tfd = openat(to_fd, tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (tfd == -1 && errno == ENOENT) {
+		mkdirat(to_fd, dir, 0700);
+		tfd = openat(to_fd, tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	}
+	buf = malloc(0x100000);
+	if (tfd == -1 || buf == NULL) {
+		if (tfd != -1) {
+			close(tfd);
+			unlinkat(to_fd, tmpname, 0);
+		}
+		free(buf);
+		close(fd);
+		return -1;
+	}
+
+	while ((n = read(fd, buf, 0x100000)) > 0) {
+		if (write(tfd, buf, n) != n) {
+			ret = -1;
+			break;
+		}
+	}
+	if (n < 0) {
+		ret = -1;
+	}
+	free(buf);
+	if (ret == 0 && (fstat(fd, &st2) != 0 ||
+			 st2.st_size != st.st_size ||
+			 st2.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+			 st2.st_mtim.tv_nsec != st.st_mtim.tv_nsec)) {
+		/* written to while we copied it */
+		ret = 2;
+	}
+	close(fd);
+
+	/* removals of older copies of an object go by its mtime */
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	if (ret == 0 && (futimens(tfd, times) != 0 || fsync(tfd) != 0)) {
+		ret = -1;
+	}
+	if (close(tfd) != 0) {
+		ret = -1;
+	}
+	if (ret == 0 && linkat(to_fd, tmpname, to_fd, fname, 0) != 0) {
+		/* a newer copy is already in place */
+		ret = errno == EEXIST ? 1 : -1;
+	}
+	unlinkat(to_fd, tmpname, 0);
+	if (ret == -1 || ret == 2) {
+		return ret;
+	}
+
+	if (unlinkat(from_fd, fname, 0) != 0 && errno == ENOENT && ret == 0) {
+		unlinkat(to_fd, fname, 0);
+		return 1;
+	}
+	return ret;
+}
+
+/*
+  move the stripes in one root that belong elsewhere. Stripes that
+  may still be written to are counted in busy and left for later
+ */
+static int stripe_convert_root(struct hsm_store_context *ctx, unsigned root,
+			       struct stripe_set *to, int *count, int *busy)
+{
+	struct stripe_store *ss = ctx->private;
+	unsigned i;
+	int ret = 0;
+
+	for (i=0;i<HSM_STRIPE_DIRS && ret == 0;i++) {
+		char dname[3], fname[HSM_STRIPE_NAME_MAX];
+		struct dirent *de;
+		DIR *d;
+		int fd;
+
+		snprintf(dname, sizeof(dname), "%02x", i);
+		fd = openat(ss->known[root].fd, dname, O_RDONLY|O_DIRECTORY);
+		if (fd == -1) {
+			continue;
+		}
+		d = fdopendir(fd);
+		if (d == NULL) {
+			close(fd);
+			ctx->errmsg = "Unable to open stripe directory";
+			return -1;
+		}
+		while (ret == 0 && (de = readdir(d)) != NULL) {
+			unsigned long long device, inode;
+			unsigned stripe, dest;
+			int r;
+
+			if (de->d_name[0] == '.' ||
+			    sscanf(de->d_name, "0x%llx:0x%llx.%u", &device, &inode, &stripe) != 3 ||
+			    strlen(de->d_name) + 4 > HSM_STRIPE_NAME_MAX) {
+				continue;
+			}
+			dest = stripe_place(ss, to, device, inode, stripe);
+			if (dest == root) {
+				continue;
+			}
+			snprintf(fname, sizeof(fname), "%s/%.*s", dname,
+				 HSM_STRIPE_NAME_MAX - 4, de->d_name);
+			r = stripe_move(ctx, root, dest, fname, stripe);
+			if (r == -1) {
+				ctx->errmsg = "Unable to move stripe file";
+				ret = -1;
+			} else if (r == 0) {
+				(*count)++;
+			} else if (r == 2) {
+				(*busy)++;
+			}
+		}
+		closedir(d);
+	}
+
+	return ret;
+}
+
+/*
+  rebalance the store onto the roots given by the roots option, to
+  add or retire roots. This can be done while the store is in use:
+  the new roots are recorded first, and other users look for stripes
+  that are not in place yet where the old roots put them. Only the
+  stripes whose root changes are moved, which for a new root is its
+  share of them. An interrupted rebalance is finished by running it
+  again. Returns the number of stripes moved, or -1 on error
+ */
+static int stripe_convert(struct hsm_store_context *ctx)
+{
+	struct stripe_store *ss = ctx->private;
+	struct stripe_set from, to, all;
+	unsigned i;
+	int count = 0, busy;
+
+	stripe_config_load(ctx);
+	if (ss->roots_option != NULL && stripe_parse_roots(ctx, &to) != 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&ss->mutex);
+	if (ss->converting) {
+		from = ss->old_roots;
+		if (ss->roots_option == NULL) {
+			to = ss->roots;
+		} else if (to.count != ss->roots.count ||
+			   memcmp(to.roots, ss->roots.roots, to.count * sizeof(unsigned)) != 0) {
+			pthread_mutex_unlock(&ss->mutex);
+			ctx->errmsg = "A rebalance onto different roots is in progress";
+			errno = EBUSY;
+			return -1;
+		}
+	} else {
+		from = ss->roots;
+		if (ss->roots_option == NULL ||
+		    (to.count == from.count &&
+		     memcmp(to.roots, from.roots, to.count * sizeof(unsigned)) == 0)) {
+			pthread_mutex_unlock(&ss->mutex);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&ss->mutex);
+
+	if (stripe_config_save(ctx, &to, &from) != 0) {
+		return -1;
+	}
+
+	/* stripes can be on any root, old or new */
+	all = from;
+	for (i=0;i<to.count;i++) {
+		if (!stripe_set_has(&all, to.roots[i]) && all.count < HSM_STRIPE_MAX_ROOTS) {
+			all.roots[all.count++] = to.roots[i];
+		}
+	}
+
+	/* stripes can be written where the old roots put them by
+	   someone that hadn't yet seen the new ones, so nothing is
+	   moved until they have had time to see them, and stripes
+	   still being written are moved by a later pass once the
+	   object is finished */
+	do {
+		sleep(HSM_STRIPE_GRACE);
+		busy = 0;
+		for (i=0;i<all.count;i++) {
+			if (stripe_convert_root(ctx, all.roots[i], &to, &count, &busy) != 0) {
+				return -1;
+			}
+		}
+	} while (busy != 0);
+
+	if (stripe_config_save(ctx, &to, NULL) != 0) {
+		return -1;
+	}
+
+	return count;
+}
+
+const struct hsm_store_ops hsm_store_stripe_ops = {
+	.name		= "stripe",
+	.init		= stripe_init,
+	.set_option	= stripe_set_option,
+	.connect	= stripe_connect,
+	.shutdown	= stripe_shutdown,
+	.open		= stripe_open,
+	.close		= stripe_close,
+	.remove		= stripe_remove,
+	.object_time	= stripe_object_time,
+	.position	= stripe_position,
+	.list		= stripe_list,
+	.convert	= stripe_convert,
+	.sync		= stripe_sync,
+	.write		= stripe_write,
+	.pread		= stripe_pread,
+	.concurrent_pread = true,
+};